@@ -0,0 +1,327 @@
+/*
+ * benchmark.c - Microbenchmarks of the server's hot paths.
+ *
+ * Linked against server.c (compiled with its main() renamed), so the code
+ * timed is exactly what the server runs:
+ *   xor_cipher          buffers of 64 B to 64 MB
+ *   parse               the path helpers every request goes through
+ *   get_latest_version  one directory of 10 to 1M entries
+ *   list_files          a storage tree of 10 to 1M entries
+ * Every case reports ns/op, bytes/s (where bytes are involved) and heap
+ * allocations per op. With --json the results are also written one JSON
+ * object per line, always in the same order, so that the files of two
+ * builds can be diffed line by line.
+ *
+ * The storage cases run in a scratch directory below --dir (default /tmp)
+ * that is removed again afterwards.
+ *
+ * Usage: benchmark [--json file] [--dir path] [--max-bytes n]
+ *                  [--max-entries n] [--min-time seconds]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include "cipher.h"
+
+// From server.c
+int valid_path(const char *path);
+void split_path(const char *path, char *filename, size_t name_cap, char *ext, size_t ext_cap);
+int parse_stored_name(const char *stored, char *logical, size_t cap);
+int parse_path_version(char *path);
+int get_latest_version(const char *filename, const char *ext);
+void list_files(int client_sock, const char *filter);
+
+#define ROOT_DIR "server_storage"   // as in server.c, relative to the working directory
+#define BENCH_DIR "bench"
+#define NAMES_PER_DIR 16            // distinct files the versions are spread over
+
+// === Allocation Counting === //
+
+/*
+ * The allocator entry points are replaced by thin wrappers around glibc's
+ * own, so allocations made inside libc (opendir, fopen, ...) count too.
+ */
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *p, size_t size);
+extern void __libc_free(void *p);
+
+static _Atomic unsigned long allocations;
+
+void *malloc(size_t size) {
+    atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+    atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size) {
+    atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+    return __libc_realloc(p, size);
+}
+
+void free(void *p) {
+    __libc_free(p);
+}
+
+// === Timing === //
+
+struct bench_options {
+    const char *json;
+    const char *dir;
+    long max_bytes;
+    long max_entries;
+    double min_time;
+};
+
+static struct bench_options opts = { NULL, "/tmp", 64L * 1024 * 1024, 1000000, 0.25 };
+static FILE *json_out;
+static volatile long sink;  // keeps results of the timed calls alive
+
+typedef void (*bench_fn)(void *ctx);
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * run_case - Times fn, raising the iteration count until a run lasts at
+ * least opts.min_time, and reports that run. bytes is what one call
+ * processes (0 when a byte rate makes no sense).
+ */
+
+static void run_case(const char *group, const char *name, long param, long bytes, bench_fn fn, void *ctx) {
+    long iterations = 1;
+    double elapsed;
+    unsigned long allocs;
+    for (;;) {
+        unsigned long a0 = atomic_load(&allocations);
+        double t0 = now_seconds();
+        for (long i = 0; i < iterations; i++) fn(ctx);
+        elapsed = now_seconds() - t0;
+        allocs = atomic_load(&allocations) - a0;
+        if (elapsed >= opts.min_time || iterations >= (1L << 40)) break;
+        // Aim a little past min_time instead of creeping up on it
+        double scale = elapsed > 0 ? opts.min_time * 1.2 / elapsed : 100;
+        iterations = scale > 100 ? iterations * 100 : (long)(iterations * scale) + 1;
+    }
+
+    double ns_per_op = elapsed * 1e9 / iterations;
+    double allocs_per_op = (double)allocs / iterations;
+    double rate = bytes ? bytes * (double)iterations / elapsed : 0;
+    char mbps[32] = "-";
+    if (bytes) snprintf(mbps, sizeof(mbps), "%.1f", rate / 1e6);
+    printf("%-20s %-20s %10ld %14.1f %12s %12.2f %12ld\n", group, name, param, ns_per_op, mbps, allocs_per_op,
+           iterations);
+    if (json_out) {
+        fprintf(json_out, "{\"group\":\"%s\",\"name\":\"%s\",\"param\":%ld,\"ns_per_op\":%.1f,", group, name, param,
+                ns_per_op);
+        if (bytes) fprintf(json_out, "\"bytes_per_sec\":%.0f,", rate);
+        else fprintf(json_out, "\"bytes_per_sec\":null,");
+        fprintf(json_out, "\"allocs_per_op\":%.2f,\"iterations\":%ld}\n", allocs_per_op, iterations);
+    }
+}
+
+// === xor_cipher === //
+
+struct xor_ctx {
+    char *buf;
+    long size;
+};
+
+static void bench_xor(void *arg) {
+    struct xor_ctx *ctx = arg;
+    xor_cipher(ctx->buf, ctx->size, "secretkey", 0);
+}
+
+static void xor_cases(void) {
+    char *buf = malloc(opts.max_bytes);
+    if (!buf) {
+        perror("benchmark buffer");
+        return;
+    }
+    memset(buf, 0x5a, opts.max_bytes);
+    for (long size = 64; size <= opts.max_bytes; size *= 4) {
+        struct xor_ctx ctx = { buf, size };
+        run_case("xor_cipher", "xor_cipher", size, size, bench_xor, &ctx);
+    }
+    free(buf);
+}
+
+// === Parsing === //
+
+static const char *sample_path = "projects/2025/reports/quarterly_summary.txt";
+
+static void bench_valid_path(void *arg) {
+    sink += valid_path(sample_path);
+}
+
+static void bench_split_path(void *arg) {
+    char filename[1024], ext[32];
+    split_path(sample_path, filename, sizeof(filename), ext, sizeof(ext));
+    sink += ext[1];
+}
+
+static void bench_parse_path_version(void *arg) {
+    char path[1024] = "projects/2025/reports/quarterly_summary.txt:42";
+    sink += parse_path_version(path);
+}
+
+static void bench_parse_stored_name(void *arg) {
+    char logical[1024];
+    sink += parse_stored_name("quarterly_summary_v42.txt", logical, sizeof(logical));
+}
+
+static void parse_cases(void) {
+    long len = strlen(sample_path);
+    run_case("parse", "valid_path", 1, len, bench_valid_path, NULL);
+    run_case("parse", "split_path", 1, len, bench_split_path, NULL);
+    run_case("parse", "parse_path_version", 1, len + 3, bench_parse_path_version, NULL);
+    run_case("parse", "parse_stored_name", 1, 25, bench_parse_stored_name, NULL);
+}
+
+// === Storage: get_latest_version and list_files === //
+
+/*
+ * Entry i of the scratch directory is "f<i % 16>_v<i / 16 + 1>.dat", so
+ * every file has many versions, as in a long-lived store.
+ */
+
+static void entry_path(char *out, size_t cap, long i) {
+    snprintf(out, cap, "%s/%s/f%ld_v%ld.dat", ROOT_DIR, BENCH_DIR, i % NAMES_PER_DIR, i / NAMES_PER_DIR + 1);
+}
+
+static long listing_bytes = sizeof("__END__\n") - 1;  // what one list_files call sends
+
+static int create_entries(long from, long to) {
+    char path[256];
+    for (long i = from; i < to; i++) {
+        entry_path(path, sizeof(path), i);
+        listing_bytes += strlen(path) - strlen(ROOT_DIR "/") + 1;
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            perror(path);
+            return -1;
+        }
+        close(fd);
+    }
+    return 0;
+}
+
+static void remove_entries(long count) {
+    char path[256];
+    for (long i = 0; i < count; i++) {
+        entry_path(path, sizeof(path), i);
+        unlink(path);
+    }
+    rmdir(ROOT_DIR "/" BENCH_DIR);
+    rmdir(ROOT_DIR);
+}
+
+static void bench_latest_version(void *arg) {
+    sink += get_latest_version(BENCH_DIR "/f0", ".dat");
+}
+
+// Reads and discards what list_files sends
+static void *drain(void *arg) {
+    int sock = (int)(long)arg;
+    char buf[65536];
+    while (read(sock, buf, sizeof(buf)) > 0) {}
+    return NULL;
+}
+
+static void bench_list_files(void *arg) {
+    list_files((int)(long)arg, NULL);
+}
+
+static void storage_cases(void) {
+    char scratch[1024];
+    snprintf(scratch, sizeof(scratch), "%s/fsbench.XXXXXX", opts.dir);
+    char cwd[4096];
+    if (!getcwd(cwd, sizeof(cwd)) || !mkdtemp(scratch) || chdir(scratch) != 0) {
+        perror("benchmark scratch directory");
+        return;
+    }
+    mkdir(ROOT_DIR, 0755);
+    mkdir(ROOT_DIR "/" BENCH_DIR, 0755);
+
+    int socks[2];
+    pthread_t drainer;
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, socks) != 0 ||
+        pthread_create(&drainer, NULL, drain, (void *)(long)socks[1]) != 0) {
+        perror("benchmark socket");
+        return;
+    }
+
+    long created = 0;
+    for (long entries = 10; entries <= opts.max_entries; entries *= 10) {
+        if (create_entries(created, entries) < 0) break;
+        created = entries;
+        run_case("get_latest_version", "get_latest_version", entries, 0, bench_latest_version, NULL);
+        run_case("list_files", "list_files", entries, listing_bytes, bench_list_files, (void *)(long)socks[0]);
+    }
+
+    close(socks[0]);
+    pthread_join(drainer, NULL);
+    close(socks[1]);
+    remove_entries(created);
+    if (chdir(cwd) != 0) perror(cwd);
+    rmdir(scratch);
+}
+
+// === Main === //
+
+int main(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (!value) {
+            fprintf(stderr, "Missing value for %s\n", argv[i]);
+            return 1;
+        } else if (strcmp(argv[i], "--json") == 0) {
+            opts.json = value;
+        } else if (strcmp(argv[i], "--dir") == 0) {
+            opts.dir = value;
+        } else if (strcmp(argv[i], "--max-bytes") == 0) {
+            opts.max_bytes = atol(value);
+        } else if (strcmp(argv[i], "--max-entries") == 0) {
+            opts.max_entries = atol(value);
+        } else if (strcmp(argv[i], "--min-time") == 0) {
+            opts.min_time = atof(value);
+        } else {
+            fprintf(stderr, "Unknown option %s\n", argv[i]);
+            return 1;
+        }
+        i++;
+    }
+    if (opts.max_bytes < 64) opts.max_bytes = 64;
+    if (opts.json && !(json_out = fopen(opts.json, "w"))) {
+        perror(opts.json);
+        return 1;
+    }
+
+    printf("%-20s %-20s %10s %14s %12s %12s %12s\n", "group", "case", "param", "ns/op", "MB/s", "allocs/op",
+           "iterations");
+    xor_cases();
+    parse_cases();
+    storage_cases();
+
+    if (json_out && fclose(json_out) != 0) {
+        perror(opts.json);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,244 @@
+/*
+ * bufpool.c - Pooled I/O buffers and per-request arenas.
+ *
+ * Free buffers are kept on a stack threaded through their first bytes.
+ * Buffers are never freed: the pool only grows, up to its cap, and then
+ * recycles what it has.
+ *
+ * Arenas keep their first block across resets, so a connection that only
+ * serves ordinary requests allocates nothing after its first one. Blocks
+ * added for unusually large requests are freed again on reset.
+ */
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "bufpool.h"
+
+#define DEFAULT_BUFFER_SIZE (64 * 1024)
+#define DEFAULT_MAX_BYTES (64L * 1024 * 1024)
+#define ARENA_BLOCK (16 * 1024)
+#define ARENA_ALIGN 16
+
+// === Buffer Pool === //
+
+struct free_buffer {
+    struct free_buffer *next;
+};
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_returned = PTHREAD_COND_INITIALIZER;
+static struct free_buffer *free_list;
+static size_t buffer_size = DEFAULT_BUFFER_SIZE;
+static size_t max_buffers = DEFAULT_MAX_BYTES / DEFAULT_BUFFER_SIZE;
+static size_t nbuffers, in_use, peak_in_use;
+static size_t set_waiters;  // bufpool_get_many calls waiting for room
+static unsigned long gets, waits;
+
+/*
+ * bufpool_configure - Sets the buffer size and the cap on the memory all
+ * buffers together may take (at least one buffer). Call before the first
+ * bufpool_get.
+ */
+
+void bufpool_configure(size_t size, size_t max_bytes) {
+    if (size >= sizeof(struct free_buffer)) buffer_size = size;
+    max_buffers = max_bytes / buffer_size;
+    if (max_buffers == 0) max_buffers = 1;
+}
+
+size_t bufpool_buffer_size(void) {
+    return buffer_size;
+}
+
+// Takes one buffer off the free list or allocates it; pool_lock held
+static void *take_buffer(void) {
+    void *buf = free_list;
+    if (buf) {
+        free_list = free_list->next;
+    } else if ((buf = malloc(buffer_size))) {
+        nbuffers++;
+    }
+    if (buf && ++in_use > peak_in_use) peak_in_use = in_use;
+    return buf;
+}
+
+// Puts one buffer back on the free list; pool_lock held
+static void return_buffer(void *buf) {
+    struct free_buffer *fb = buf;
+    fb->next = free_list;
+    free_list = fb;
+    in_use--;
+}
+
+/*
+ * bufpool_get - Returns a buffer of bufpool_buffer_size() bytes, waiting
+ * while the pool is at its cap and every buffer is out. Returns NULL only
+ * if the pool is empty and memory for a new buffer cannot be had.
+ */
+
+void *bufpool_get(void) {
+    pthread_mutex_lock(&pool_lock);
+    gets++;
+    while (!free_list && nbuffers >= max_buffers) {
+        waits++;
+        pthread_cond_wait(&pool_returned, &pool_lock);
+    }
+    void *buf = take_buffer();
+    pthread_mutex_unlock(&pool_lock);
+    return buf;
+}
+
+void bufpool_put(void *buf) {
+    if (!buf) return;
+    pthread_mutex_lock(&pool_lock);
+    return_buffer(buf);
+    // A waiting set may need this buffer together with others
+    if (set_waiters) pthread_cond_broadcast(&pool_returned);
+    else pthread_cond_signal(&pool_returned);
+    pthread_mutex_unlock(&pool_lock);
+}
+
+/*
+ * bufpool_get_many - Fills bufs with n buffers taken together: waits until
+ * the cap leaves room for the whole set rather than holding part of it.
+ * Returns -1, having taken nothing, if the set is larger than the cap or
+ * memory for new buffers cannot be had.
+ */
+
+int bufpool_get_many(void **bufs, size_t n) {
+    pthread_mutex_lock(&pool_lock);
+    gets += n;
+    if (n > max_buffers) {
+        pthread_mutex_unlock(&pool_lock);
+        return -1;
+    }
+    if (max_buffers - in_use < n) {
+        waits++;
+        set_waiters++;
+        while (max_buffers - in_use < n) pthread_cond_wait(&pool_returned, &pool_lock);
+        set_waiters--;
+    }
+    size_t got = 0;
+    while (got < n && (bufs[got] = take_buffer())) got++;
+    if (got < n) {
+        while (got > 0) {
+            return_buffer(bufs[--got]);
+            bufs[got] = NULL;
+        }
+        pthread_cond_broadcast(&pool_returned);
+    }
+    pthread_mutex_unlock(&pool_lock);
+    return got == n ? 0 : -1;
+}
+
+void bufpool_put_many(void **bufs, size_t n) {
+    pthread_mutex_lock(&pool_lock);
+    for (size_t i = 0; i < n; i++) {
+        if (bufs[i]) return_buffer(bufs[i]);
+    }
+    pthread_cond_broadcast(&pool_returned);
+    pthread_mutex_unlock(&pool_lock);
+}
+
+// === Arenas === //
+
+struct arena_block {
+    struct arena_block *next;
+    size_t size;
+    size_t used;
+    _Alignas(ARENA_ALIGN) char data[];
+};
+
+struct arena {
+    struct arena_block *head;    // block being filled; the first block is last
+    size_t used;                 // bytes handed out since the last reset
+};
+
+static _Atomic size_t arenas, arena_bytes, arena_peak, arena_reserved;
+
+static struct arena_block *new_block(size_t size) {
+    struct arena_block *b = malloc(sizeof(*b) + size);
+    if (b) {
+        b->next = NULL;
+        b->size = size;
+        b->used = 0;
+        atomic_fetch_add(&arena_reserved, size);
+    }
+    return b;
+}
+
+struct arena *arena_create(void) {
+    struct arena *a = malloc(sizeof(*a));
+    if (!a) return NULL;
+    if (!(a->head = new_block(ARENA_BLOCK))) {
+        free(a);
+        return NULL;
+    }
+    a->used = 0;
+    atomic_fetch_add(&arenas, 1);
+    return a;
+}
+
+/*
+ * arena_alloc - Returns size bytes (16-byte aligned) that stay valid until
+ * the next arena_reset. Returns NULL if a new block cannot be allocated.
+ */
+
+void *arena_alloc(struct arena *a, size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    struct arena_block *b = a->head;
+    if (b->size - b->used < size) {
+        if (!(b = new_block(size > ARENA_BLOCK ? size : ARENA_BLOCK))) return NULL;
+        b->next = a->head;
+        a->head = b;
+    }
+    void *p = b->data + b->used;
+    b->used += size;
+    a->used += size;
+
+    size_t now = atomic_fetch_add(&arena_bytes, size) + size;
+    size_t peak = atomic_load(&arena_peak);
+    while (now > peak && !atomic_compare_exchange_weak(&arena_peak, &peak, now)) {}
+    return p;
+}
+
+// Releases everything allocated since the last reset, keeping the first block
+void arena_reset(struct arena *a) {
+    while (a->head->next) {
+        struct arena_block *b = a->head;
+        a->head = b->next;
+        atomic_fetch_sub(&arena_reserved, b->size);
+        free(b);
+    }
+    a->head->used = 0;
+    atomic_fetch_sub(&arena_bytes, a->used);
+    a->used = 0;
+}
+
+void arena_destroy(struct arena *a) {
+    if (!a) return;
+    arena_reset(a);
+    atomic_fetch_sub(&arena_reserved, a->head->size);
+    atomic_fetch_sub(&arenas, 1);
+    free(a->head);
+    free(a);
+}
+
+// === Statistics === //
+
+void pool_stats(struct pool_stats *st) {
+    pthread_mutex_lock(&pool_lock);
+    st->buffer_size = buffer_size;
+    st->buffers = nbuffers;
+    st->max_buffers = max_buffers;
+    st->in_use = in_use;
+    st->peak_in_use = peak_in_use;
+    st->gets = gets;
+    st->waits = waits;
+    pthread_mutex_unlock(&pool_lock);
+    st->arenas = atomic_load(&arenas);
+    st->arena_bytes = atomic_load(&arena_bytes);
+    st->arena_peak = atomic_load(&arena_peak);
+    st->arena_reserved = atomic_load(&arena_reserved);
+}
@@ -0,0 +1,51 @@
+/*
+ * bufpool.h - Pooled I/O buffers and per-request arenas.
+ *
+ * Transfers borrow a fixed-size buffer from one global pool instead of
+ * allocating their own. The pool grows on demand up to a configured cap;
+ * once every buffer is out, callers wait for one to be returned, so the
+ * memory spent on transfers stays bounded however many clients connect.
+ * A thread must hold at most one pool buffer, or one set of them taken
+ * together with bufpool_get_many, at a time.
+ *
+ * An arena hands out short-lived allocations (parsed paths, names) by
+ * bumping a pointer, and gives them all back in one step when the request
+ * that made them ends.
+ */
+
+#ifndef BUFPOOL_H
+#define BUFPOOL_H
+
+#include <stddef.h>
+
+void bufpool_configure(size_t buffer_size, size_t max_bytes);
+size_t bufpool_buffer_size(void);
+void *bufpool_get(void);
+void bufpool_put(void *buf);
+int bufpool_get_many(void **bufs, size_t n);
+void bufpool_put_many(void **bufs, size_t n);
+
+struct arena;
+
+struct arena *arena_create(void);
+void *arena_alloc(struct arena *a, size_t size);
+void arena_reset(struct arena *a);
+void arena_destroy(struct arena *a);
+
+struct pool_stats {
+    size_t buffer_size;
+    size_t buffers;          // allocated so far
+    size_t max_buffers;
+    size_t in_use;
+    size_t peak_in_use;
+    unsigned long gets;
+    unsigned long waits;     // gets that had to wait for a free buffer
+    size_t arenas;           // live arenas
+    size_t arena_bytes;      // currently handed out by all arenas
+    size_t arena_peak;
+    size_t arena_reserved;   // block memory held by all arenas
+};
+
+void pool_stats(struct pool_stats *st);
+
+#endif
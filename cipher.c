@@ -0,0 +1,389 @@
+/*
+ * cipher.c - Repeating-key XOR and ChaCha20 (RFC 8439).
+ *
+ * ChaCha20 produces keystream in 64-byte blocks. Besides the portable
+ * one-block-at-a-time version there are SSE2 (4 blocks), AVX2 (8 blocks)
+ * and AVX-512 (16 blocks) versions that run the blocks side by side, one
+ * block per vector lane; the widest one the CPU supports is picked at
+ * startup.
+ * The 32-bit block counter limits one nonce to 256 GiB of data.
+ */
+
+#include <string.h>
+#include "cipher.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+// === XOR Encryption/Decryption Function === //
+
+/*
+ * xor_cipher - Encrypts/Decrypts data using XOR cipher with a given key.
+ * offset is the position of data[0] within the whole file.
+ */
+
+void xor_cipher(char *data, long size, const char *key, long offset) {
+    size_t key_len = strlen(key);
+    for (long i = 0; i < size; ++i) {
+        data[i] ^= key[(offset + i) % key_len];
+    }
+}
+
+// === ChaCha20 === //
+
+#define ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+#define QUARTER_ROUND(a, b, c, d)                        \
+    do {                                                 \
+        a += b; d ^= a; d = ROTL32(d, 16);               \
+        c += d; b ^= c; b = ROTL32(b, 12);               \
+        a += b; d ^= a; d = ROTL32(d, 8);                \
+        c += d; b ^= c; b = ROTL32(b, 7);                \
+    } while (0)
+
+static size_t (*chacha20_blocks)(uint32_t state[16], uint8_t *data, size_t len);
+static const char *chacha20_name = "scalar";
+
+static uint32_t load32_le(const uint8_t *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/*
+ * chacha20_block - Computes one 64-byte keystream block for state.
+ */
+
+static void chacha20_block(const uint32_t state[16], uint8_t out[64]) {
+    uint32_t x[16];
+    memcpy(x, state, sizeof(x));
+    for (int i = 0; i < 10; i++) {
+        QUARTER_ROUND(x[0], x[4], x[8], x[12]);
+        QUARTER_ROUND(x[1], x[5], x[9], x[13]);
+        QUARTER_ROUND(x[2], x[6], x[10], x[14]);
+        QUARTER_ROUND(x[3], x[7], x[11], x[15]);
+        QUARTER_ROUND(x[0], x[5], x[10], x[15]);
+        QUARTER_ROUND(x[1], x[6], x[11], x[12]);
+        QUARTER_ROUND(x[2], x[7], x[8], x[13]);
+        QUARTER_ROUND(x[3], x[4], x[9], x[14]);
+    }
+    for (int i = 0; i < 16; i++) {
+        uint32_t v = x[i] + state[i];
+        out[4 * i] = v;
+        out[4 * i + 1] = v >> 8;
+        out[4 * i + 2] = v >> 16;
+        out[4 * i + 3] = v >> 24;
+    }
+}
+
+/*
+ * The *_blocks functions XOR whole blocks of keystream into data, advance
+ * the counter in state[12], and return how many bytes they handled.
+ */
+
+static size_t chacha20_blocks_scalar(uint32_t state[16], uint8_t *data, size_t len) {
+    uint8_t block[64];
+    size_t done = 0;
+    while (len - done >= 64) {
+        chacha20_block(state, block);
+        for (int i = 0; i < 64; i++) data[done + i] ^= block[i];
+        state[12]++;
+        done += 64;
+    }
+    return done;
+}
+
+#ifdef HAVE_X86_SIMD
+
+#define ROTL_SSE2(v, n) _mm_or_si128(_mm_slli_epi32(v, n), _mm_srli_epi32(v, 32 - (n)))
+
+#define QUARTER_ROUND_SSE2(a, b, c, d)                                              \
+    do {                                                                            \
+        a = _mm_add_epi32(a, b); d = _mm_xor_si128(d, a); d = ROTL_SSE2(d, 16);     \
+        c = _mm_add_epi32(c, d); b = _mm_xor_si128(b, c); b = ROTL_SSE2(b, 12);     \
+        a = _mm_add_epi32(a, b); d = _mm_xor_si128(d, a); d = ROTL_SSE2(d, 8);      \
+        c = _mm_add_epi32(c, d); b = _mm_xor_si128(b, c); b = ROTL_SSE2(b, 7);      \
+    } while (0)
+
+/*
+ * transpose4_sse2 - Turns "word i of blocks 0..3" vectors into
+ * "words 0..3 of block i" vectors.
+ */
+
+static inline void transpose4_sse2(__m128i *a, __m128i *b, __m128i *c, __m128i *d) {
+    __m128i t0 = _mm_unpacklo_epi32(*a, *b), t1 = _mm_unpacklo_epi32(*c, *d);
+    __m128i t2 = _mm_unpackhi_epi32(*a, *b), t3 = _mm_unpackhi_epi32(*c, *d);
+    *a = _mm_unpacklo_epi64(t0, t1);
+    *b = _mm_unpackhi_epi64(t0, t1);
+    *c = _mm_unpacklo_epi64(t2, t3);
+    *d = _mm_unpackhi_epi64(t2, t3);
+}
+
+static size_t chacha20_blocks_sse2(uint32_t state[16], uint8_t *data, size_t len) {
+    size_t done = 0;
+    while (len - done >= 256) {
+        __m128i in[16], x[16];
+        for (int i = 0; i < 16; i++) in[i] = _mm_set1_epi32(state[i]);
+        in[12] = _mm_add_epi32(in[12], _mm_set_epi32(3, 2, 1, 0));
+        memcpy(x, in, sizeof(x));
+
+        for (int i = 0; i < 10; i++) {
+            QUARTER_ROUND_SSE2(x[0], x[4], x[8], x[12]);
+            QUARTER_ROUND_SSE2(x[1], x[5], x[9], x[13]);
+            QUARTER_ROUND_SSE2(x[2], x[6], x[10], x[14]);
+            QUARTER_ROUND_SSE2(x[3], x[7], x[11], x[15]);
+            QUARTER_ROUND_SSE2(x[0], x[5], x[10], x[15]);
+            QUARTER_ROUND_SSE2(x[1], x[6], x[11], x[12]);
+            QUARTER_ROUND_SSE2(x[2], x[7], x[8], x[13]);
+            QUARTER_ROUND_SSE2(x[3], x[4], x[9], x[14]);
+        }
+        for (int i = 0; i < 16; i++) x[i] = _mm_add_epi32(x[i], in[i]);
+
+        for (int k = 0; k < 4; k++) {
+            transpose4_sse2(&x[4 * k], &x[4 * k + 1], &x[4 * k + 2], &x[4 * k + 3]);
+            for (int blk = 0; blk < 4; blk++) {
+                __m128i *p = (__m128i *)(data + done + 64 * blk + 16 * k);
+                _mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), x[4 * k + blk]));
+            }
+        }
+        state[12] += 4;
+        done += 256;
+    }
+    return done + chacha20_blocks_scalar(state, data + done, len - done);
+}
+
+#define ROTL_AVX2(v, n) _mm256_or_si256(_mm256_slli_epi32(v, n), _mm256_srli_epi32(v, 32 - (n)))
+
+__attribute__((target("avx2")))
+static size_t chacha20_blocks_avx2(uint32_t state[16], uint8_t *data, size_t len) {
+    const __m256i rot16 = _mm256_setr_epi8(2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13,
+                                           2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13);
+    const __m256i rot8 = _mm256_setr_epi8(3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14,
+                                          3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14);
+    size_t done = 0;
+    while (len - done >= 512) {
+        __m256i in[16], x[16];
+        for (int i = 0; i < 16; i++) in[i] = _mm256_set1_epi32(state[i]);
+        // Lanes 0-3 (low half) hold blocks 0-3, lanes 4-7 blocks 4-7
+        in[12] = _mm256_add_epi32(in[12], _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+        memcpy(x, in, sizeof(x));
+
+#define QUARTER_ROUND_AVX2(a, b, c, d)                                                              \
+        do {                                                                                        \
+            a = _mm256_add_epi32(a, b); d = _mm256_xor_si256(d, a); d = _mm256_shuffle_epi8(d, rot16); \
+            c = _mm256_add_epi32(c, d); b = _mm256_xor_si256(b, c); b = ROTL_AVX2(b, 12);           \
+            a = _mm256_add_epi32(a, b); d = _mm256_xor_si256(d, a); d = _mm256_shuffle_epi8(d, rot8);  \
+            c = _mm256_add_epi32(c, d); b = _mm256_xor_si256(b, c); b = ROTL_AVX2(b, 7);            \
+        } while (0)
+
+        for (int i = 0; i < 10; i++) {
+            QUARTER_ROUND_AVX2(x[0], x[4], x[8], x[12]);
+            QUARTER_ROUND_AVX2(x[1], x[5], x[9], x[13]);
+            QUARTER_ROUND_AVX2(x[2], x[6], x[10], x[14]);
+            QUARTER_ROUND_AVX2(x[3], x[7], x[11], x[15]);
+            QUARTER_ROUND_AVX2(x[0], x[5], x[10], x[15]);
+            QUARTER_ROUND_AVX2(x[1], x[6], x[11], x[12]);
+            QUARTER_ROUND_AVX2(x[2], x[7], x[8], x[13]);
+            QUARTER_ROUND_AVX2(x[3], x[4], x[9], x[14]);
+        }
+#undef QUARTER_ROUND_AVX2
+        for (int i = 0; i < 16; i++) x[i] = _mm256_add_epi32(x[i], in[i]);
+
+        // Transpose within each 128-bit half: afterwards x[4k + b] holds
+        // words 4k..4k+3 of block b (low half) and of block b + 4 (high half)
+        for (int k = 0; k < 4; k++) {
+            __m256i a = x[4 * k], b = x[4 * k + 1], c = x[4 * k + 2], d = x[4 * k + 3];
+            __m256i t0 = _mm256_unpacklo_epi32(a, b), t1 = _mm256_unpacklo_epi32(c, d);
+            __m256i t2 = _mm256_unpackhi_epi32(a, b), t3 = _mm256_unpackhi_epi32(c, d);
+            x[4 * k] = _mm256_unpacklo_epi64(t0, t1);
+            x[4 * k + 1] = _mm256_unpackhi_epi64(t0, t1);
+            x[4 * k + 2] = _mm256_unpacklo_epi64(t2, t3);
+            x[4 * k + 3] = _mm256_unpackhi_epi64(t2, t3);
+        }
+        for (int blk = 0; blk < 4; blk++) {
+            uint8_t *lo = data + done + 64 * blk, *hi = lo + 256;
+            __m256i w01 = _mm256_permute2x128_si256(x[blk], x[4 + blk], 0x20);
+            __m256i w23 = _mm256_permute2x128_si256(x[8 + blk], x[12 + blk], 0x20);
+            __m256i w45 = _mm256_permute2x128_si256(x[blk], x[4 + blk], 0x31);
+            __m256i w67 = _mm256_permute2x128_si256(x[8 + blk], x[12 + blk], 0x31);
+            _mm256_storeu_si256((__m256i *)lo, _mm256_xor_si256(_mm256_loadu_si256((__m256i *)lo), w01));
+            _mm256_storeu_si256((__m256i *)(lo + 32), _mm256_xor_si256(_mm256_loadu_si256((__m256i *)(lo + 32)), w23));
+            _mm256_storeu_si256((__m256i *)hi, _mm256_xor_si256(_mm256_loadu_si256((__m256i *)hi), w45));
+            _mm256_storeu_si256((__m256i *)(hi + 32), _mm256_xor_si256(_mm256_loadu_si256((__m256i *)(hi + 32)), w67));
+        }
+        state[12] += 8;
+        done += 512;
+    }
+    return done + chacha20_blocks_sse2(state, data + done, len - done);
+}
+
+#define QUARTER_ROUND_AVX512(a, b, c, d)                                                               \
+    do {                                                                                               \
+        a = _mm512_add_epi32(a, b); d = _mm512_xor_si512(d, a); d = _mm512_rol_epi32(d, 16);          \
+        c = _mm512_add_epi32(c, d); b = _mm512_xor_si512(b, c); b = _mm512_rol_epi32(b, 12);          \
+        a = _mm512_add_epi32(a, b); d = _mm512_xor_si512(d, a); d = _mm512_rol_epi32(d, 8);           \
+        c = _mm512_add_epi32(c, d); b = _mm512_xor_si512(b, c); b = _mm512_rol_epi32(b, 7);           \
+    } while (0)
+
+__attribute__((target("avx512f")))
+static size_t chacha20_blocks_avx512(uint32_t state[16], uint8_t *data, size_t len) {
+    size_t done = 0;
+    while (len - done >= 1024) {
+        __m512i in[16], x[16];
+        for (int i = 0; i < 16; i++) in[i] = _mm512_set1_epi32(state[i]);
+        in[12] = _mm512_add_epi32(in[12], _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+        for (int i = 0; i < 16; i++) x[i] = in[i];
+
+        for (int i = 0; i < 10; i++) {
+            QUARTER_ROUND_AVX512(x[0], x[4], x[8], x[12]);
+            QUARTER_ROUND_AVX512(x[1], x[5], x[9], x[13]);
+            QUARTER_ROUND_AVX512(x[2], x[6], x[10], x[14]);
+            QUARTER_ROUND_AVX512(x[3], x[7], x[11], x[15]);
+            QUARTER_ROUND_AVX512(x[0], x[5], x[10], x[15]);
+            QUARTER_ROUND_AVX512(x[1], x[6], x[11], x[12]);
+            QUARTER_ROUND_AVX512(x[2], x[7], x[8], x[13]);
+            QUARTER_ROUND_AVX512(x[3], x[4], x[9], x[14]);
+        }
+        for (int i = 0; i < 16; i++) x[i] = _mm512_add_epi32(x[i], in[i]);
+
+        // Transpose within each 128-bit lane: afterwards lane l of x[4k + b]
+        // holds words 4k..4k+3 of block b + 4l
+        for (int k = 0; k < 4; k++) {
+            __m512i a = x[4 * k], b = x[4 * k + 1], c = x[4 * k + 2], d = x[4 * k + 3];
+            __m512i t0 = _mm512_unpacklo_epi32(a, b), t1 = _mm512_unpacklo_epi32(c, d);
+            __m512i t2 = _mm512_unpackhi_epi32(a, b), t3 = _mm512_unpackhi_epi32(c, d);
+            x[4 * k] = _mm512_unpacklo_epi64(t0, t1);
+            x[4 * k + 1] = _mm512_unpackhi_epi64(t0, t1);
+            x[4 * k + 2] = _mm512_unpacklo_epi64(t2, t3);
+            x[4 * k + 3] = _mm512_unpackhi_epi64(t2, t3);
+        }
+        for (int b = 0; b < 4; b++) {
+            __m512i t0 = _mm512_shuffle_i32x4(x[b], x[4 + b], 0x44);
+            __m512i t1 = _mm512_shuffle_i32x4(x[8 + b], x[12 + b], 0x44);
+            __m512i t2 = _mm512_shuffle_i32x4(x[b], x[4 + b], 0xee);
+            __m512i t3 = _mm512_shuffle_i32x4(x[8 + b], x[12 + b], 0xee);
+            __m512i blocks[4] = {
+                _mm512_shuffle_i32x4(t0, t1, 0x88), _mm512_shuffle_i32x4(t0, t1, 0xdd),
+                _mm512_shuffle_i32x4(t2, t3, 0x88), _mm512_shuffle_i32x4(t2, t3, 0xdd),
+            };
+            for (int l = 0; l < 4; l++) {
+                uint8_t *p = data + done + 64 * (b + 4 * l);
+                _mm512_storeu_si512(p, _mm512_xor_si512(_mm512_loadu_si512(p), blocks[l]));
+            }
+        }
+        state[12] += 16;
+        done += 1024;
+    }
+    return done + chacha20_blocks_avx2(state, data + done, len - done);
+}
+
+#endif
+
+/*
+ * chacha20_use_impl - Switches ChaCha20 to the named implementation (see
+ * chacha20_impl_name). Returns -1 if it is unknown or the CPU lacks it.
+ * Not thread-safe: meant for startup and for tests.
+ */
+
+int chacha20_use_impl(const char *name) {
+    size_t (*blocks)(uint32_t state[16], uint8_t *data, size_t len) = NULL;
+    const char *found = NULL;
+    if (strcmp(name, "scalar") == 0) {
+        blocks = chacha20_blocks_scalar;
+        found = "scalar";
+    }
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (strcmp(name, "sse2") == 0) {
+        blocks = chacha20_blocks_sse2;
+        found = "sse2";
+    } else if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2")) {
+        blocks = chacha20_blocks_avx2;
+        found = "avx2";
+    } else if (strcmp(name, "avx512") == 0 && __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx2")) {
+        blocks = chacha20_blocks_avx512;
+        found = "avx512";
+    }
+#endif
+    if (!blocks) return -1;
+    chacha20_blocks = blocks;
+    chacha20_name = found;
+    return 0;
+}
+
+// The widest implementation the CPU supports
+__attribute__((constructor))
+static void chacha20_init(void) {
+    if (chacha20_use_impl("avx512") < 0 && chacha20_use_impl("avx2") < 0 && chacha20_use_impl("sse2") < 0) {
+        chacha20_use_impl("scalar");
+    }
+}
+
+const char *chacha20_impl_name(void) {
+    return chacha20_name;
+}
+
+/*
+ * chacha20_xor - Encrypts/decrypts len bytes that start offset bytes into
+ * the stream identified by key and nonce.
+ */
+
+void chacha20_xor(const uint8_t key[CHACHA20_KEY_SIZE], const uint8_t nonce[CHACHA20_NONCE_SIZE],
+                  uint64_t offset, void *data, size_t len) {
+    uint8_t *p = data;
+    uint32_t state[16] = { 0x61707865, 0x3320646e, 0x79622d32, 0x6b206574 };
+    for (int i = 0; i < 8; i++) state[4 + i] = load32_le(key + 4 * i);
+    state[12] = (uint32_t)(offset / 64);
+    for (int i = 0; i < 3; i++) state[13 + i] = load32_le(nonce + 4 * i);
+
+    // A start in the middle of a block uses the tail of that block
+    size_t skip = offset % 64;
+    if (skip > 0 && len > 0) {
+        uint8_t block[64];
+        chacha20_block(state, block);
+        size_t n = 64 - skip < len ? 64 - skip : len;
+        for (size_t i = 0; i < n; i++) p[i] ^= block[skip + i];
+        state[12]++;
+        p += n;
+        len -= n;
+    }
+
+    size_t done = chacha20_blocks(state, p, len);
+    if (done < len) {
+        uint8_t block[64];
+        chacha20_block(state, block);
+        for (size_t i = 0; done + i < len; i++) p[done + i] ^= block[i];
+    }
+}
+
+// === Hex Helpers === //
+
+static int hex_nibble(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+/*
+ * hex_decode - Parses exactly len bytes of hex. Returns -1 on bad input.
+ */
+
+int hex_decode(const char *hex, uint8_t *out, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        int hi = hex_nibble(hex[2 * i]);
+        int lo = hi < 0 ? -1 : hex_nibble(hex[2 * i + 1]);
+        if (lo < 0) return -1;
+        out[i] = hi << 4 | lo;
+    }
+    return hex[2 * len] == '\0' ? 0 : -1;
+}
+
+void hex_encode(const uint8_t *in, size_t len, char *out) {
+    static const char digits[] = "0123456789abcdef";
+    for (size_t i = 0; i < len; i++) {
+        out[2 * i] = digits[in[i] >> 4];
+        out[2 * i + 1] = digits[in[i] & 15];
+    }
+    out[2 * len] = '\0';
+}
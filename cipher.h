@@ -0,0 +1,37 @@
+/*
+ * cipher.h - Payload ciphers shared by client and server.
+ *
+ * Two modes exist:
+ *  - the original repeating-key XOR ("xor"), kept so existing stored
+ *    versions stay readable, and
+ *  - ChaCha20 (RFC 8439) with a 256-bit key and a random 96-bit nonce
+ *    per stored version ("chacha20").
+ *
+ * Both take the byte offset of data[0] within the file, so a file can be
+ * processed in chunks, in parallel, or starting from any position.
+ */
+
+#ifndef CIPHER_H
+#define CIPHER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CHACHA20_KEY_SIZE 32
+#define CHACHA20_NONCE_SIZE 12
+
+enum cipher_mode { CIPHER_XOR, CIPHER_CHACHA20 };
+
+void xor_cipher(char *data, long size, const char *key, long offset);
+
+void chacha20_xor(const uint8_t key[CHACHA20_KEY_SIZE], const uint8_t nonce[CHACHA20_NONCE_SIZE],
+                  uint64_t offset, void *data, size_t len);
+
+// Name of the ChaCha20 implementation in use ("avx512", "avx2", "sse2" or "scalar")
+const char *chacha20_impl_name(void);
+int chacha20_use_impl(const char *name);
+
+int hex_decode(const char *hex, uint8_t *out, size_t len);
+void hex_encode(const uint8_t *in, size_t len, char *out);
+
+#endif
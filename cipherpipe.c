@@ -0,0 +1,299 @@
+/*
+ * cipherpipe.c - Pipelined, multi-threaded cipher stage for large transfers.
+ *
+ * Slot i of the ring carries chunks i, i + nslots, i + 2 * nslots, ...
+ * Its tag is the sequence number of the chunk times four plus the stage
+ * the chunk has reached: FREE (ready to be filled with that chunk),
+ * FILLED (waiting for a worker) or DONE (waiting for the consumer).
+ * Releasing chunk s makes its slot FREE for chunk s + nslots. A stage
+ * waits for an exact tag, so a worker that claimed chunk s never touches
+ * the previous occupant of the slot.
+ *
+ * Workers claim sequence numbers with one atomic add. A chunk of length 0
+ * marks the end of the stream; workers that claim past it wait until the
+ * pipe is stopped.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "cipherpipe.h"
+
+#define SPINS 2000  // checks before a waiting stage goes to sleep
+
+enum { SLOT_FREE, SLOT_FILLED, SLOT_DONE };
+
+#define TAG(seq, stage) ((seq) * 4 + (stage))
+
+struct slot {
+    atomic_long tag;
+    size_t len;
+    long offset;
+    int failed;
+    char *data;
+};
+
+struct cpipe {
+    size_t chunk;
+    long nslots;
+    struct slot *slots;
+    void **buffers;      // slot memory, in slot order
+    const struct cpipe_alloc *alloc;
+    cpipe_fn work;
+    void *ctx;
+
+    long fill_seq;       // producer only
+    long offset;         // producer only: stream offset of the next chunk
+    long take_seq;       // consumer only
+    atomic_long claim;   // next chunk a worker takes
+
+    atomic_int stopping;
+    atomic_int failed;
+    atomic_int sleepers;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+
+    pthread_t workers[CPIPE_MAX_WORKERS];
+    int nworkers;
+    pthread_t reader, writer;
+    int has_reader, has_writer;
+    int read_fd;
+    long read_size;
+    cpipe_fn sink;
+    void *sink_ctx;
+};
+
+// === Waiting and Waking === //
+
+static void wake_all(struct cpipe *p) {
+    pthread_mutex_lock(&p->lock);
+    pthread_cond_broadcast(&p->changed);
+    pthread_mutex_unlock(&p->lock);
+}
+
+static void publish(struct cpipe *p, atomic_long *tag, long value) {
+    atomic_store(tag, value);
+    if (atomic_load(&p->sleepers)) wake_all(p);
+}
+
+static void stop(struct cpipe *p, int failed) {
+    if (failed) atomic_store(&p->failed, 1);
+    atomic_store(&p->stopping, 1);
+    wake_all(p);
+}
+
+// Waits until *tag is want; returns 0 if the pipe was stopped first
+static int wait_for(struct cpipe *p, atomic_long *tag, long want) {
+    for (int i = 0; i < SPINS; i++) {
+        if (atomic_load_explicit(tag, memory_order_acquire) == want) return 1;
+        if (atomic_load_explicit(&p->stopping, memory_order_relaxed)) return 0;
+    }
+    pthread_mutex_lock(&p->lock);
+    atomic_fetch_add(&p->sleepers, 1);
+    while (atomic_load(tag) != want && !atomic_load(&p->stopping)) pthread_cond_wait(&p->changed, &p->lock);
+    atomic_fetch_sub(&p->sleepers, 1);
+    pthread_mutex_unlock(&p->lock);
+    return atomic_load(tag) == want;
+}
+
+// === Stages === //
+
+static void *worker_main(void *arg) {
+    struct cpipe *p = arg;
+    for (;;) {
+        long seq = atomic_fetch_add(&p->claim, 1);
+        struct slot *s = &p->slots[seq % p->nslots];
+        if (!wait_for(p, &s->tag, TAG(seq, SLOT_FILLED))) return NULL;
+        s->failed = s->len > 0 && p->work && p->work(p->ctx, s->data, s->len, s->offset) < 0;
+        publish(p, &s->tag, TAG(seq, SLOT_DONE));
+    }
+}
+
+static void *reader_main(void *arg) {
+    struct cpipe *p = arg;
+    long left = p->read_size;
+    while (left > 0) {
+        char *buf = cpipe_fill(p);
+        if (!buf) return NULL;
+        // Whole chunks, so that chunk boundaries stay where the caller expects them
+        size_t want = left < (long)p->chunk ? (size_t)left : p->chunk, got = 0;
+        while (got < want) {
+            ssize_t n = read(p->read_fd, buf + got, want - got);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            got += n;
+        }
+        if (got < want) {
+            stop(p, 1);
+            return NULL;
+        }
+        cpipe_submit(p, got);
+        left -= got;
+    }
+    if (cpipe_fill(p)) cpipe_submit(p, 0);
+    return NULL;
+}
+
+static void *writer_main(void *arg) {
+    struct cpipe *p = arg;
+    char *data;
+    size_t len;
+    while ((data = cpipe_take(p, &len))) {
+        long offset = p->slots[p->take_seq % p->nslots].offset;
+        int status = p->sink(p->sink_ctx, data, len, offset);
+        cpipe_release(p);
+        if (status < 0) {
+            stop(p, 1);
+            break;
+        }
+    }
+    return NULL;
+}
+
+// === Public API === //
+
+int cpipe_workers(int n) {
+    if (n <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        n = cpus > 0 ? (int)cpus : 1;
+    }
+    return n > CPIPE_MAX_WORKERS ? CPIPE_MAX_WORKERS : n;
+}
+
+/*
+ * cpipe_start - Starts workers threads that apply work to every chunk of
+ * up to chunk bytes; the first chunk sits at offset in the stream. The
+ * ring holds two chunks per worker plus one each for the two ends, taken
+ * from alloc as one set. Returns NULL on failure.
+ */
+
+struct cpipe *cpipe_start(int workers, size_t chunk, long offset, cpipe_fn work, void *ctx,
+                          const struct cpipe_alloc *alloc) {
+    struct cpipe *p = calloc(1, sizeof(*p));
+    if (!p) return NULL;
+    workers = cpipe_workers(workers);
+    p->chunk = chunk;
+    p->nslots = 2L * workers + 2;
+    p->offset = offset;
+    p->work = work;
+    p->ctx = ctx;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->changed, NULL);
+    if (!(p->slots = calloc(p->nslots, sizeof(*p->slots)))) goto fail;
+    if (!(p->buffers = calloc(p->nslots, sizeof(*p->buffers)))) goto fail;
+    if (alloc) {
+        if (alloc->get(p->buffers, p->nslots) < 0) goto fail;
+        p->alloc = alloc;
+    }
+    for (long i = 0; i < p->nslots; i++) {
+        atomic_init(&p->slots[i].tag, TAG(i, SLOT_FREE));
+        if (!alloc && !(p->buffers[i] = malloc(chunk))) goto fail;
+        p->slots[i].data = p->buffers[i];
+    }
+    for (; p->nworkers < workers; p->nworkers++) {
+        if (pthread_create(&p->workers[p->nworkers], NULL, worker_main, p) != 0) break;
+    }
+    if (p->nworkers > 0) return p;
+
+fail:
+    cpipe_finish(p, 1);
+    return NULL;
+}
+
+// Starts a thread producing size bytes read from fd
+int cpipe_start_reader(struct cpipe *p, int fd, long size) {
+    p->read_fd = fd;
+    p->read_size = size;
+    p->has_reader = pthread_create(&p->reader, NULL, reader_main, p) == 0;
+    return p->has_reader ? 0 : -1;
+}
+
+// Starts a thread handing every finished chunk, in order, to sink
+int cpipe_start_writer(struct cpipe *p, cpipe_fn sink, void *ctx) {
+    p->sink = sink;
+    p->sink_ctx = ctx;
+    p->has_writer = pthread_create(&p->writer, NULL, writer_main, p) == 0;
+    return p->has_writer ? 0 : -1;
+}
+
+/*
+ * cpipe_fill - Returns the slot for the next chunk (chunk bytes), waiting
+ * while the ring is full, or NULL once the pipe has stopped.
+ */
+
+char *cpipe_fill(struct cpipe *p) {
+    struct slot *s = &p->slots[p->fill_seq % p->nslots];
+    return wait_for(p, &s->tag, TAG(p->fill_seq, SLOT_FREE)) ? s->data : NULL;
+}
+
+// Hands the slot returned by cpipe_fill, holding len bytes, to the workers
+void cpipe_submit(struct cpipe *p, size_t len) {
+    struct slot *s = &p->slots[p->fill_seq % p->nslots];
+    s->len = len;
+    s->offset = p->offset;
+    p->offset += len;
+    publish(p, &s->tag, TAG(p->fill_seq, SLOT_FILLED));
+    p->fill_seq++;
+}
+
+/*
+ * cpipe_take - Waits for the next chunk in stream order. Returns NULL at
+ * the end of the stream, or if the pipe stopped (see cpipe_failed); a
+ * chunk whose work failed stops the pipe.
+ */
+
+char *cpipe_take(struct cpipe *p, size_t *len) {
+    struct slot *s = &p->slots[p->take_seq % p->nslots];
+    if (!wait_for(p, &s->tag, TAG(p->take_seq, SLOT_DONE))) return NULL;
+    if (s->failed) {
+        stop(p, 1);
+        return NULL;
+    }
+    *len = s->len;
+    return s->len > 0 ? s->data : NULL;
+}
+
+// Gives the chunk returned by cpipe_take back to the producer
+void cpipe_release(struct cpipe *p) {
+    struct slot *s = &p->slots[p->take_seq % p->nslots];
+    publish(p, &s->tag, TAG(p->take_seq + p->nslots, SLOT_FREE));
+    p->take_seq++;
+}
+
+int cpipe_failed(struct cpipe *p) {
+    return atomic_load(&p->failed);
+}
+
+/*
+ * cpipe_finish - Ends the stream when the caller is the producer, waits
+ * for a writer thread to hand on everything (unless abort is set), then
+ * stops and joins every thread and frees the pipe. Returns -1 if any
+ * stage failed.
+ */
+
+int cpipe_finish(struct cpipe *p, int abort) {
+    if (!abort && !p->has_reader && p->nworkers > 0 && cpipe_fill(p)) cpipe_submit(p, 0);
+    if (!abort && p->has_writer) {
+        pthread_join(p->writer, NULL);
+        p->has_writer = 0;
+    }
+    stop(p, 0);
+    if (p->has_reader) pthread_join(p->reader, NULL);
+    if (p->has_writer) pthread_join(p->writer, NULL);
+    for (int i = 0; i < p->nworkers; i++) pthread_join(p->workers[i], NULL);
+
+    int status = atomic_load(&p->failed) ? -1 : 0;
+    if (p->alloc) {
+        p->alloc->put(p->buffers, p->nslots);
+    } else {
+        for (long i = 0; p->buffers && i < p->nslots; i++) free(p->buffers[i]);
+    }
+    free(p->buffers);
+    free(p->slots);
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->changed);
+    free(p);
+    return status;
+}
@@ -0,0 +1,58 @@
+/*
+ * cipherpipe.h - Pipelined, multi-threaded cipher stage for large transfers.
+ *
+ * A pipe carries one byte stream in fixed-size chunks through a ring of
+ * slots: a producer fills slots in stream order, a pool of workers
+ * transforms them in parallel, and a consumer takes them back in the
+ * original order. Every chunk knows its offset in the stream, so ciphers
+ * keyed by position (see cipher.h) work on any chunk independently.
+ *
+ * Slots pass from stage to stage through atomic sequence tags, so no
+ * stage takes a lock while there is work for it; a stage that runs dry
+ * (or finds the ring full) spins briefly, then sleeps until woken.
+ *
+ * The producer and consumer are either the caller's own thread or a
+ * built-in reader (from a file descriptor) or writer (into a callback)
+ * thread. Any stage failing stops the whole pipe.
+ */
+
+#ifndef CIPHERPIPE_H
+#define CIPHERPIPE_H
+
+#include <stddef.h>
+
+#define CPIPE_MAX_WORKERS 16
+
+// Transforms (work) or consumes (sink) one chunk; returns -1 to stop the pipe
+typedef int (*cpipe_fn)(void *ctx, char *data, size_t len, long offset);
+
+// Where slot memory comes from: get fills n buffers of chunk bytes (all or
+// none, returning -1 on failure) and put gives them back
+struct cpipe_alloc {
+    int (*get)(void **bufs, size_t n);
+    void (*put)(void **bufs, size_t n);
+};
+
+struct cpipe;
+
+// alloc may be NULL, in which case slots are malloc'd
+struct cpipe *cpipe_start(int workers, size_t chunk, long offset, cpipe_fn work, void *ctx,
+                          const struct cpipe_alloc *alloc);
+int cpipe_start_reader(struct cpipe *p, int fd, long size);
+int cpipe_start_writer(struct cpipe *p, cpipe_fn sink, void *ctx);
+
+// Producer side: cpipe_submit(p, 0) ends the stream
+char *cpipe_fill(struct cpipe *p);
+void cpipe_submit(struct cpipe *p, size_t len);
+
+// Consumer side
+char *cpipe_take(struct cpipe *p, size_t *len);
+void cpipe_release(struct cpipe *p);
+
+int cpipe_failed(struct cpipe *p);
+int cpipe_finish(struct cpipe *p, int abort);
+
+// Workers to use for a setting of n (0 = one per CPU, at most CPIPE_MAX_WORKERS)
+int cpipe_workers(int n);
+
+#endif
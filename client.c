@@ -6,215 +6,964 @@
  *
  * This client program connects to a server to perform file operations such as WRITE, GET, RM, and LS.
  * It supports versioning, encryption/decryption, and handles communication over TCP sockets.
+ * Every command goes through libfsclient (fsclient.c). SYNC mirrors a
+ * whole directory tree over a pool of persistent connections,
+ * MGET restores many files from a single streamed archive, WATCH
+ * follows new and deleted versions as the server pushes them,
+ * "RM -r" deletes many versions in one request, and SNAPSHOT records
+ * the whole store at a point in time for GET, LS and MGET to read back.
+ * Every transfer carries a CRC32C checksum that the receiving side verifies.
+ * Payloads are encrypted with ChaCha20 when client.conf selects it; the
+ * server only ever sees ciphertext for those versions.
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/socket.h>
-#include <arpa/inet.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+#include <stdint.h>
+#include "crc32c.h"
+#include "cipher.h"
+#include "fsclient.h"
+#include "cipherpipe.h"
 
 #define BUFFER_SIZE 4096
-#define ENCRYPTION_KEY "secretkey"  // ====  Encryption key for XOR cipher ==== // 
+#define PORT 2024                   // overridable with the FS_PORT environment variable
+#define ENCRYPTION_KEY "secretkey"  // ====  Encryption key for XOR cipher (legacy mode) ==== //
+#define CLIENT_CONFIG_FILE "client.conf"  // overridable with FS_CLIENT_CONFIG
+
+#define SYNC_DEFAULT_JOBS 4          // parallel connections used by SYNC
+
+// === Client Configuration === //
+
+struct client_config {
+    enum cipher_mode cipher;
+    int has_key;
+    uint8_t key[CHACHA20_KEY_SIZE];
+    char cache_dir[1024];  // "" = no GET cache
+    long cache_size;
+    int cipher_threads;    // 0 = one per CPU
+};
+
+struct client_config config;
+
+static int read_key_file(const char *path, uint8_t *key) {
+    char hex[2 * CHACHA20_KEY_SIZE + 2];
+    FILE *fp = fopen(path, "r");
+    if (!fp) return -1;
+    int ok = fscanf(fp, "%65s", hex) == 1 && hex_decode(hex, key, CHACHA20_KEY_SIZE) == 0;
+    fclose(fp);
+    return ok ? 0 : -1;
+}
 
-// === XOR Encryption/Decryption Function === // 
+/*
+ * load_config - Reads "key = value" lines from the client config file, if
+ * there is one. Lines starting with '#' are comments.
+ *
+ *   cipher     "xor" (default) or "chacha20" for new uploads
+ *   key        256-bit ChaCha20 key as 64 hex digits
+ *   key_file   file holding the key in the same form
+ *   cache_dir  where GET keeps the files it fetched ("none" for no
+ *              cache; default $XDG_CACHE_HOME/fsclient or ~/.cache/fsclient)
+ *   cache_size bytes the cache may hold, with a k/m/g suffix (256m)
+ *   cipher_threads
+ *              threads encrypting or decrypting a single WRITE or GET of
+ *              4 MiB or more (default one per CPU; 1 = none)
+ *
+ * The key is also needed to read back ChaCha20 versions, whatever cipher
+ * new uploads use. Returns -1 if the settings are unusable.
+ */
 
-void xor_cipher(char *data, long size, const char *key) {
-    size_t key_len = strlen(key);
-    for (long i = 0; i < size; ++i) {
-        data[i] ^= key[i % key_len];
+int load_config(void) {
+    const char *path = getenv("FS_CLIENT_CONFIG") ? getenv("FS_CLIENT_CONFIG") : CLIENT_CONFIG_FILE;
+    const char *xdg = getenv("XDG_CACHE_HOME"), *home = getenv("HOME");
+    if (xdg && xdg[0]) snprintf(config.cache_dir, sizeof(config.cache_dir), "%s/fsclient", xdg);
+    else if (home && home[0]) snprintf(config.cache_dir, sizeof(config.cache_dir), "%s/.cache/fsclient", home);
+    FILE *fp = fopen(path, "r");
+    if (fp) {
+        char line[512], key[128], value[256];
+        while (fgets(line, sizeof(line), fp)) {
+            if (line[0] == '#' || sscanf(line, " %127[^= \t] = %255s", key, value) != 2) continue;
+            if (strcmp(key, "cipher") == 0) {
+                if (strcmp(value, "chacha20") == 0) config.cipher = CIPHER_CHACHA20;
+                else if (strcmp(value, "xor") == 0) config.cipher = CIPHER_XOR;
+                else printf("%s: unknown cipher '%s' ignored\n", path, value);
+            } else if (strcmp(key, "key") == 0 || strcmp(key, "key_file") == 0) {
+                int rc = key[3] == '\0' ? hex_decode(value, config.key, CHACHA20_KEY_SIZE)
+                                        : read_key_file(value, config.key);
+                if (rc < 0) {
+                    printf("%s: %s must be 64 hex digits\n", path, key);
+                    fclose(fp);
+                    return -1;
+                }
+                config.has_key = 1;
+            } else if (strcmp(key, "cache_dir") == 0) {
+                snprintf(config.cache_dir, sizeof(config.cache_dir), "%s", strcmp(value, "none") == 0 ? "" : value);
+            } else if (strcmp(key, "cipher_threads") == 0) {
+                config.cipher_threads = atoi(value);
+            } else if (strcmp(key, "cache_size") == 0) {
+                char *end;
+                double size = strtod(value, &end);
+                if (*end == 'k' || *end == 'K') size *= 1024;
+                else if (*end == 'm' || *end == 'M') size *= 1024 * 1024;
+                else if (*end == 'g' || *end == 'G') size *= 1024 * 1024 * 1024;
+                config.cache_size = (long)size;
+            } else {
+                printf("%s: unknown setting '%s' ignored\n", path, key);
+            }
+        }
+        fclose(fp);
     }
+    if (config.cipher == CIPHER_CHACHA20 && !config.has_key) {
+        printf("%s: cipher chacha20 needs a key or key_file\n", path);
+        return -1;
+    }
+    return 0;
 }
 
-int main(int argc, char *argv[]) {
-    if (argc < 2) {
+/*
+ * encrypt_chunk - Applies the cipher of one stored version to the chunk at
+ * offset. Versions with a nonce use ChaCha20, older ones the XOR key.
+ */
 
-        // Display usage instructions if insufficient arguments are provided
-        printf("Usage:\n");
-        printf("  %s WRITE local_file_path remote_file_path\n", argv[0]);
-        printf("  %s GET remote_file_path[:version] local_file_path\n", argv[0]);
-        printf("  %s RM remote_file_path\n", argv[0]);
-        printf("  %s LS [remote_path]\n", argv[0]);
-        return 1;
+static void encrypt_chunk(const uint8_t *nonce, char *data, size_t len, long offset) {
+    if (nonce) {
+        chacha20_xor(config.key, nonce, offset, data, len);
+    } else {
+        xor_cipher(data, len, ENCRYPTION_KEY, offset);
     }
+}
 
-    int sock;
-    struct sockaddr_in server_addr;
-    char buffer[BUFFER_SIZE];
+// === Client Setup === //
+
+/*
+ * open_client - Opens a libfsclient handle on the server (FS_PORT) with up
+ * to conns connections, set up from client.conf. cache selects whether
+ * GETs go through the local cache.
+ */
 
-    // === Establish Connection to Server === // 
+static struct fsc_client *open_client(int conns, int cache) {
+    const char *port_env = getenv("FS_PORT");
+    struct fsc_options opts = { "127.0.0.1", port_env ? atoi(port_env) : PORT, conns,
+                                config.cipher, config.has_key ? config.key : NULL,
+                                cache && config.cache_dir[0] ? config.cache_dir : NULL, config.cache_size,
+                                config.cipher_threads > 0 ? config.cipher_threads : cpipe_workers(0) };
+    struct fsc_client *cl = fsc_open(&opts);
+    if (!cl) perror("Client setup failed");
+    return cl;
+}
 
-    sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock < 0) {
-        perror("Socket creation failed");
-        return 1;
+/*
+ * make_parent_dirs - Creates the missing parent directories of a local path.
+ */
+
+void make_parent_dirs(const char *path) {
+    char temp[2048];
+    snprintf(temp, sizeof(temp), "%s", path);
+    for (char *p = temp + 1; *p; p++) {
+        if (*p == '/') {
+            *p = '\0';
+            mkdir(temp, 0755);
+            *p = '/';
+        }
     }
+}
 
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(2024);
-    server_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+// === MGET: Restore Many Files from One Stream === //
+
+struct mget_state {
+    int restored, failed;
+    long bytes;
+    int status;
+};
+
+static void mget_entry(struct fsc_client *cl, struct fsc_result *res, void *arg) {
+    struct mget_state *m = arg;
+    if (res->more && res->status == FSC_OK) {
+        m->restored++;
+        m->bytes += res->size;
+    } else if (res->more) {
+        printf("Skipped %s: %s\n", res->path, res->message);
+        m->failed++;
+    } else if (res->status == FSC_ERR_SERVER) {
+        printf("Server response: %s\n", res->message);
+        m->status = 1;
+    } else if (res->status != FSC_OK) {
+        printf("MGET failed: %s\n", res->message);
+        m->status = 1;
+    }
+}
 
-    if (connect(sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        perror("Connection failed");
-        close(sock);
-        return 1;
+/*
+ * mget - Restores every remote file matching pattern into local_dir with
+ * a single MGET, extracting each entry as it streams in (see fsc_mget).
+ * when is "v<version>", "t<unix time>", "s<snapshot>" or NULL for the
+ * latest versions.
+ */
+
+int mget(const char *pattern, const char *local_dir, const char *when) {
+    struct fsc_client *cl = open_client(1, 0);
+    if (!cl) return 1;
+    struct mget_state m = { 0, 0, 0, 0 };
+    if (fsc_mget(cl, pattern, when, local_dir, mget_entry, &m) < 0) {
+        printf("Invalid pattern or argument.\n");
+        m.status = 1;
     }
+    fsc_run(cl);
+    fsc_close(cl);
 
-    // === WRITE Command: Upload File with Encryption === //
+    printf("Restored %d files (%ld bytes) into '%s'", m.restored, m.bytes, local_dir);
+    if (m.failed) printf(", %d failed", m.failed);
+    printf("\n");
+    return m.status == 0 && m.failed == 0 ? 0 : 1;
+}
 
-    if (strcmp(argv[1], "WRITE") == 0 && argc == 4) {
-        char *local_path = argv[2];
-        char *remote_path = argv[3];
+// === WATCH: Follow Changes as They Happen === //
 
-        FILE *fp = fopen(local_path, "rb");
-        if (!fp) {
-            perror("Failed to open local file");
-            close(sock);
-            return 1;
+struct watch_state {
+    unsigned long long cursor;
+    int refused;
+};
+
+static void watch_event(struct fsc_client *cl, struct fsc_result *res, void *arg) {
+    struct watch_state *w = arg;
+    unsigned long long seq;
+    if (!res->more) {
+        if (res->status == FSC_ERR_SERVER) {
+            printf("Server response: %s\n", res->message);
+            w->refused = 1;
         }
+        return;
+    }
+    const char *line = res->lines[0];
+    if (sscanf(line, "WATCHING %llu", &seq) == 1) {
+        if (!w->cursor) w->cursor = seq;
+    } else if (sscanf(line, "EVENT %llu", &seq) == 1 || sscanf(line, "RESYNC %llu", &seq) == 1) {
+        printf("%s\n", line);
+        fflush(stdout);
+        w->cursor = seq;
+    } else if (sscanf(line, "PING %llu", &seq) == 1) {
+        w->cursor = seq;
+    } else {
+        printf("Server response: %s\n", line);
+        w->refused = 1;
+    }
+}
 
-        fseek(fp, 0, SEEK_END);
-        long filesize = ftell(fp);
-        fseek(fp, 0, SEEK_SET);
+/*
+ * watch - Prints the server's change events for prefix as they arrive,
+ * one "EVENT <seq> NEW|DELETE <path> <version> [size]" line each, until
+ * interrupted. A dropped connection is re-established and resumed after
+ * the last event seen; "RESYNC <seq>" is printed when events were missed
+ * in between. from resumes an earlier run (0 starts with new events).
+ */
 
-        if (filesize <= 0) {
-            printf("Empty or invalid file.\n");
-            fclose(fp);
-            close(sock);
-            return 1;
+int watch(const char *prefix, unsigned long long from) {
+    struct fsc_client *cl = open_client(1, 0);
+    if (!cl) return 1;
+    struct watch_state w = { from, 0 };
+    while (!w.refused) {
+        if (fsc_watch(cl, prefix, w.cursor, watch_event, &w) < 0) {
+            printf("Invalid prefix.\n");
+            break;
         }
-
-        char *filedata = malloc(filesize);
-        if (!filedata) {
-            perror("Memory allocation failed");
-            fclose(fp);
-            close(sock);
-            return 1;
+        while (!w.refused && fsc_pending(cl) > 0) {
+            if (fsc_process(cl, -1) < 0) break;
         }
+        if (w.refused) break;
+        fprintf(stderr, "Connection lost, resuming after event %llu...\n", w.cursor);
+        sleep(1);
+    }
+    fsc_close(cl);
+    return 1;
+}
 
-        fread(filedata, 1, filesize, fp);
-        fclose(fp);
+// === RM -r: Delete Many Versions at Once === //
+
+struct rm_bulk_state {
+    long matched, deleted, failed;
+    int status;
+};
+
+static void rm_bulk_progress(struct fsc_client *cl, struct fsc_result *res, void *arg) {
+    struct rm_bulk_state *r = arg;
+    long held = 0, done;
+    if (!res->more) {
+        if (res->status == FSC_ERR_SERVER) printf("Server response: %s\n", res->message);
+        else if (res->status != FSC_OK) printf("RM failed: %s\n", res->message);
+        if (res->status != FSC_OK) r->status = 1;
+        return;
+    }
+    const char *line = res->lines[0];
+    if (sscanf(line, "MATCHED %ld %ld", &r->matched, &held) >= 1) {
+        if (held) printf("Keeping %ld versions held by snapshots.\n", held);
+        printf("Deleting %ld versions...\n", r->matched);
+    } else if (sscanf(line, "PROGRESS %ld", &done) == 1) {
+        printf("  %ld of %ld\n", done, r->matched);
+    } else if (sscanf(line, "DELETED %ld %ld", &r->deleted, &r->failed) != 2) {
+        printf("Server response: %s\n", line);
+        r->status = 1;
+    }
+}
+
+/*
+ * rm_bulk - Deletes every version matching spec ("pattern[:versions]",
+ * see the server's RM -r) except the newest keep of each path, printing
+ * the server's progress as it goes.
+ */
+
+int rm_bulk(const char *spec, int keep) {
+    struct fsc_client *cl = open_client(1, 0);
+    if (!cl) return 1;
+    struct rm_bulk_state r = { 0, -1, 0, 0 };
+    if (fsc_rm_bulk(cl, spec, keep, rm_bulk_progress, &r) < 0) {
+        printf("Invalid pattern or argument.\n");
+        r.status = 1;
+    }
+    fsc_run(cl);
+    fsc_close(cl);
+
+    if (r.deleted < 0) return 1;
+    printf("Deleted %ld versions", r.deleted);
+    if (r.failed) printf(", %ld failed", r.failed);
+    printf("\n");
+    return r.status == 0 && r.failed == 0 && r.deleted + r.failed == r.matched ? 0 : 1;
+}
 
-        xor_cipher(filedata, filesize, ENCRYPTION_KEY); // == Encrypt data === // 
+// === SNAPSHOT: Point-in-Time Views === //
+
+enum snapshot_action { SNAP_TAKE, SNAP_LIST, SNAP_DROP };
+
+// Prints why a SNAPSHOT request failed, if it did; returns 1 then
+static int snapshot_failed(struct fsc_result *res, int *status) {
+    if (res->status == FSC_OK) return 0;
+    if (res->status == FSC_ERR_SERVER) printf("Server response: %s\n", res->message);
+    else printf("SNAPSHOT failed: %s\n", res->message);
+    *status = 1;
+    return 1;
+}
 
-        char header[1024];
-        snprintf(header, sizeof(header), "WRITE %s %ld\n", remote_path, filesize);
-        send(sock, header, strlen(header), 0);
+static void snapshot_taken(struct fsc_client *cl, struct fsc_result *res, void *arg) {
+    if (!snapshot_failed(res, arg)) printf("Snapshot %lu taken (%zu paths)\n", res->snapshot, res->size);
+}
 
-        send(sock, filedata, filesize, 0);
-        printf("Encrypted file '%s' sent to server as '%s'\n", local_path, remote_path);
-        free(filedata);
+static void snapshot_listed(struct fsc_client *cl, struct fsc_result *res, void *arg) {
+    if (snapshot_failed(res, arg)) return;
+    for (size_t i = 0; i < res->nlines; i++) {
+        unsigned long id;
+        long created;
+        size_t paths;
+        if (sscanf(res->lines[i], "%lu %ld %zu", &id, &created, &paths) != 3) continue;
+        time_t when = created;
+        char stamp[32];
+        strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", localtime(&when));
+        printf("%lu  %s  %zu paths\n", id, stamp, paths);
     }
+}
 
-    // === GET Command: Download File with Optional Version and Decryption === // 
+static void snapshot_dropped(struct fsc_client *cl, struct fsc_result *res, void *arg) {
+    if (!snapshot_failed(res, arg)) printf("Snapshot dropped.\n");
+}
 
-    else if (strcmp(argv[1], "GET") == 0 && argc == 4) {
-        char *remote_arg = argv[2];
-        char *local_path = argv[3];
+/*
+ * snapshot - Takes a snapshot, lists them, or drops snapshot id, and
+ * prints the outcome.
+ */
 
-        char remote_path[1024];
-        int version = -1;
+int snapshot(enum snapshot_action action, unsigned long id) {
+    struct fsc_client *cl = open_client(1, 0);
+    if (!cl) return 1;
+    int status = 0, rc;
+    if (action == SNAP_TAKE) rc = fsc_snapshot(cl, snapshot_taken, &status);
+    else if (action == SNAP_LIST) rc = fsc_snapshot_list(cl, snapshot_listed, &status);
+    else rc = fsc_snapshot_drop(cl, id, snapshot_dropped, &status);
+    if (rc < 0) {
+        printf("No such snapshot.\n");
+        status = 1;
+    }
+    fsc_run(cl);
+    fsc_close(cl);
+    return status;
+}
 
-        char *colon = strchr(remote_arg, ':');
-        if (colon) {
-            *colon = '\0';
-            strcpy(remote_path, remote_arg);
-            version = atoi(colon + 1);
-        } else {
-            strcpy(remote_path, remote_arg);
+// === SYNC: Mirror a Directory Tree === //
+
+/*
+ * A sync_file describes one relative path on either side. Jobs are built
+ * by diffing the local walk against the server's "LS -l" listing, then
+ * run as libfsclient WRITEs and GETs, as many at a time as the pool has
+ * connections.
+ */
+
+struct sync_file {
+    char *rel;
+    long size;
+    time_t mtime;
+    int version;
+    int has_crc;
+    uint32_t crc;
+    int has_nonce;
+    uint8_t nonce[CHACHA20_NONCE_SIZE];
+};
+
+struct file_list {
+    struct sync_file *items;
+    size_t count, cap;
+};
+
+struct sync_job {
+    char *rel;
+    int upload;
+    long size;
+    time_t mtime;
+    int version;
+};
+
+struct sync_state {
+    const char *local_dir;
+    const char *remote_dir;
+    struct sync_job *jobs;
+    size_t njobs;
+    size_t next;
+    int running, max_running;
+    int starting;
+    int uploaded, downloaded, failed;
+};
+
+// A transfer in flight, and the local file it reads or fills
+struct sync_transfer {
+    struct sync_state *s;
+    struct sync_job *job;
+    int fd;
+    char local_path[2048];
+};
+
+static int file_list_add(struct file_list *list, const char *rel, long size, time_t mtime, int version) {
+    if (list->count == list->cap) {
+        size_t cap = list->cap ? list->cap * 2 : 256;
+        struct sync_file *grown = realloc(list->items, cap * sizeof(*grown));
+        if (!grown) return -1;
+        list->items = grown;
+        list->cap = cap;
+    }
+    struct sync_file *f = &list->items[list->count];
+    if (!(f->rel = strdup(rel))) return -1;
+    f->size = size;
+    f->mtime = mtime;
+    f->version = version;
+    f->has_crc = 0;
+    list->count++;
+    return 0;
+}
+
+static void file_list_free(struct file_list *list) {
+    for (size_t i = 0; i < list->count; i++) free(list->items[i].rel);
+    free(list->items);
+}
+
+static int compare_files(const void *a, const void *b) {
+    return strcmp(((const struct sync_file *)a)->rel, ((const struct sync_file *)b)->rel);
+}
+
+/*
+ * walk_local - Collects every regular file below root/rel. Names the
+ * line-based protocol cannot carry (whitespace) are skipped.
+ */
+
+static void walk_local(const char *root, const char *rel, struct file_list *list) {
+    char dirpath[2048];
+    snprintf(dirpath, sizeof(dirpath), "%s%s%s", root, rel[0] ? "/" : "", rel);
+    DIR *dir = opendir(dirpath);
+    if (!dir) return;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        char child[1024], full[2048];
+        snprintf(child, sizeof(child), "%s%s%s", rel, rel[0] ? "/" : "", entry->d_name);
+        snprintf(full, sizeof(full), "%s/%s", root, child);
+        if (strpbrk(entry->d_name, " \t\r\n")) {
+            printf("Skipping '%s': whitespace in file names is not supported\n", full);
+            continue;
         }
+        struct stat st;
+        if (lstat(full, &st) != 0) continue;
+        if (S_ISDIR(st.st_mode)) {
+            walk_local(root, child, list);
+        } else if (S_ISREG(st.st_mode) && st.st_size > 0) {
+            file_list_add(list, child, st.st_size, st.st_mtime, 0);
+        }
+    }
+    closedir(dir);
+}
 
-        char header[1024];
-        if (version > 0) {
-            snprintf(header, sizeof(header), "GET %s:%d\n", remote_path, version);
-        } else {
-            snprintf(header, sizeof(header), "GET %s\n", remote_path);
+struct remote_list {
+    struct file_list *list;
+    size_t prefix_len;
+    int status;
+};
+
+static void remote_listed(struct fsc_client *cl, struct fsc_result *res, void *arg) {
+    struct remote_list *r = arg;
+    r->status = res->status == FSC_OK ? 0 : -1;
+    for (size_t i = 0; i < res->nlines; i++) {
+        char path[1024], crc[16], nonce[32] = "-";
+        int version;
+        long size, mtime;
+        if (sscanf(res->lines[i], "%1023s %d %ld %ld %15s %31s", path, &version, &size, &mtime, crc, nonce) >= 5 &&
+            strlen(path) > r->prefix_len && file_list_add(r->list, path + r->prefix_len, size, mtime, version) == 0) {
+            struct sync_file *f = &r->list->items[r->list->count - 1];
+            f->has_crc = sscanf(crc, "%x", &f->crc) == 1;
+            f->has_nonce = hex_decode(nonce, f->nonce, CHACHA20_NONCE_SIZE) == 0;
         }
+    }
+}
 
-        send(sock, header, strlen(header), 0);
+/*
+ * list_remote - Fetches the latest version of every file under
+ * remote_dir with "LS -l", keyed by path relative to remote_dir.
+ */
 
-        long filesize;
-        memset(buffer, 0, sizeof(buffer));
-        recv(sock, buffer, sizeof(buffer), 0);
+static int list_remote(struct fsc_client *cl, const char *remote_dir, struct file_list *list) {
+    char filter[1100];
+    snprintf(filter, sizeof(filter), "%s/", remote_dir);
+    struct remote_list r = { list, strlen(filter), -1 };
+    if (fsc_ls(cl, 1, filter, remote_listed, &r) < 0) return -1;
+    fsc_run(cl);
+    return r.status;
+}
 
-        if (sscanf(buffer, "SIZE %ld", &filesize) != 1 || filesize <= 0) {
-            printf("Invalid file or file not found on server.\n");
-            close(sock);
-            return 1;
-        }
+static int compare_jobs(const void *a, const void *b) {
+    const struct sync_job *x = a, *y = b;
+    // Largest first, so the long transfers overlap the many short ones
+    return (x->size < y->size) - (x->size > y->size);
+}
+
+static int add_job(struct sync_state *s, size_t *cap, const struct sync_file *f, int upload) {
+    if (s->njobs == *cap) {
+        *cap = *cap ? *cap * 2 : 256;
+        struct sync_job *grown = realloc(s->jobs, *cap * sizeof(*grown));
+        if (!grown) return -1;
+        s->jobs = grown;
+    }
+    struct sync_job *j = &s->jobs[s->njobs++];
+    j->rel = f->rel;
+    j->upload = upload;
+    j->size = f->size;
+    j->mtime = f->mtime;
+    j->version = f->version;
+    return 0;
+}
+
+/*
+ * stored_crc - Computes the checksum the server would store for a local
+ * file, i.e. the CRC32C of its encrypted bytes. nonce is that of the stored
+ * version being compared against (NULL for XOR). Returns -1 on error.
+ */
+
+int stored_crc(const char *local_path, const uint8_t *nonce, uint32_t *crc) {
+    char buffer[BUFFER_SIZE];
+    FILE *fp = fopen(local_path, "rb");
+    if (!fp) return -1;
+    long offset = 0;
+    size_t n;
+    *crc = 0;
+    while ((n = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+        encrypt_chunk(nonce, buffer, n, offset);
+        *crc = crc32c_update(*crc, buffer, n);
+        offset += n;
+    }
+    int failed = ferror(fp);
+    fclose(fp);
+    return failed ? -1 : 0;
+}
+
+/*
+ * same_content - For files of equal size whose mtimes differ, checks the
+ * local file against the server's checksum before transferring anything.
+ */
 
-        send(sock, "READY\n", 6, 0);
+static int same_content(const struct sync_state *s, const struct sync_file *l, const struct sync_file *r) {
+    char local_path[2048];
+    uint32_t crc;
+    if (!r->has_crc || l->size != r->size || (r->has_nonce && !config.has_key)) return 0;
+    snprintf(local_path, sizeof(local_path), "%s/%s", s->local_dir, l->rel);
+    return stored_crc(local_path, r->has_nonce ? r->nonce : NULL, &crc) == 0 && crc == r->crc;
+}
 
-        char *filedata = malloc(filesize);
-        if (!filedata) {
-            perror("Memory allocation failed");
-            close(sock);
-            return 1;
+/*
+ * plan_sync - Diffs the local and remote listings. Equal size and mtime,
+ * or equal size and checksum, means unchanged; otherwise the newer side
+ * wins (local on a tie).
+ */
+
+static int plan_sync(struct sync_state *s, struct file_list *local, struct file_list *remote, int *unchanged) {
+    size_t cap = 0, i = 0, j = 0;
+    qsort(local->items, local->count, sizeof(*local->items), compare_files);
+    qsort(remote->items, remote->count, sizeof(*remote->items), compare_files);
+    *unchanged = 0;
+
+    while (i < local->count || j < remote->count) {
+        int cmp = i == local->count ? 1 : j == remote->count ? -1 : strcmp(local->items[i].rel, remote->items[j].rel);
+        int rc = 0;
+        if (cmp < 0) {
+            rc = add_job(s, &cap, &local->items[i++], 1);
+        } else if (cmp > 0) {
+            rc = add_job(s, &cap, &remote->items[j++], 0);
+        } else {
+            struct sync_file *l = &local->items[i++], *r = &remote->items[j++];
+            if ((l->size == r->size && l->mtime == r->mtime) || same_content(s, l, r)) {
+                (*unchanged)++;
+            } else if (r->mtime > l->mtime) {
+                rc = add_job(s, &cap, r, 0);
+            } else {
+                rc = add_job(s, &cap, l, 1);
+            }
         }
+        if (rc < 0) return -1;
+    }
+    qsort(s->jobs, s->njobs, sizeof(*s->jobs), compare_jobs);
+    return 0;
+}
 
-        long bytes_received = 0;
-        while (bytes_received < filesize) {
-            ssize_t chunk = recv(sock, filedata + bytes_received, filesize - bytes_received, 0);
-            if (chunk <= 0) break;
-            bytes_received += chunk;
+static void start_transfers(struct fsc_client *cl, struct sync_state *s);
+
+/*
+ * transfer_done - Finishes one transfer: a download is renamed into place
+ * and stamped with the remote mtime once it arrived intact. Starts the
+ * next job in its place.
+ */
+
+static void transfer_done(struct fsc_client *cl, struct fsc_result *res, void *arg) {
+    struct sync_transfer *t = arg;
+    struct sync_state *s = t->s;
+    struct sync_job *j = t->job;
+    int ok = close(t->fd) == 0 && res->status == FSC_OK;
+    if (j->upload) {
+        if (res->status != FSC_OK) printf("Failed to send '%s': %s\n", t->local_path, res->message);
+    } else {
+        char temp_path[2100];
+        snprintf(temp_path, sizeof(temp_path), "%s.part", t->local_path);
+        if (res->status != FSC_OK) printf("Failed to fetch '%s/%s': %s\n", s->remote_dir, j->rel, res->message);
+        if (ok && rename(temp_path, t->local_path) == 0) {
+            struct timeval times[2] = { { j->mtime, 0 }, { j->mtime, 0 } };
+            utimes(t->local_path, times);
+        } else {
+            remove(temp_path);
+            ok = 0;
         }
+    }
+    if (ok && j->upload) s->uploaded++;
+    else if (ok) s->downloaded++;
+    else s->failed++;
+    free(t);
+    s->running--;
+    start_transfers(cl, s);
+}
 
-        FILE *fp = fopen(local_path, "wb");
-        if (!fp) {
-            perror("Failed to create local file");
-            free(filedata);
-            close(sock);
-            return 1;
+/*
+ * start_transfers - Submits jobs until max_running transfers are under
+ * way. Callbacks of transfers that fail right away come back in here and
+ * leave the starting to the outer call.
+ */
+
+static void start_transfers(struct fsc_client *cl, struct sync_state *s) {
+    if (s->starting) return;
+    s->starting = 1;
+    while (s->running < s->max_running && s->next < s->njobs) {
+        struct sync_job *j = &s->jobs[s->next++];
+        struct sync_transfer *t = malloc(sizeof(*t));
+        if (!t) {
+            s->failed++;
+            continue;
         }
+        char remote_path[2048], temp_path[2100];
+        t->s = s;
+        t->job = j;
+        snprintf(t->local_path, sizeof(t->local_path), "%s/%s", s->local_dir, j->rel);
+        snprintf(remote_path, sizeof(remote_path), "%s/%s", s->remote_dir, j->rel);
+        snprintf(temp_path, sizeof(temp_path), "%s.part", t->local_path);
+        if (j->upload) {
+            t->fd = open(t->local_path, O_RDONLY);
+        } else {
+            make_parent_dirs(t->local_path);
+            t->fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        }
+        if (t->fd < 0) {
+            perror(j->upload ? t->local_path : temp_path);
+            free(t);
+            s->failed++;
+            continue;
+        }
+        s->running++;
+        int rc = j->upload ? fsc_write_fd(cl, remote_path, t->fd, j->size, j->mtime, transfer_done, t)
+                           : fsc_get_fd(cl, remote_path, j->version, t->fd, transfer_done, t);
+        if (rc < 0) {
+            printf("Failed to %s '%s': %s\n", j->upload ? "send" : "fetch", t->local_path, strerror(errno));
+            close(t->fd);
+            if (!j->upload) remove(temp_path);
+            free(t);
+            s->running--;
+            s->failed++;
+        }
+    }
+    s->starting = 0;
+}
 
-        fwrite(filedata, 1, filesize, fp);
-        fclose(fp);
-        free(filedata);
+/*
+ * sync_dirs - Two-way sync of local_dir with remote_dir using up to jobs
+ * parallel persistent connections. Returns 0 if every transfer succeeded.
+ */
+
+int sync_dirs(const char *local_dir, const char *remote_arg, int jobs) {
+    char remote_dir[1024];
+    snprintf(remote_dir, sizeof(remote_dir), "%s", remote_arg);
+    size_t len = strlen(remote_dir);
+    while (len > 1 && remote_dir[len - 1] == '/') remote_dir[--len] = '\0';
 
-        printf("Decrypted file saved as '%s'\n", local_path);
+    struct stat st;
+    if (stat(local_dir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        printf("Local directory '%s' does not exist.\n", local_dir);
+        return 1;
     }
 
-    // === RM Command: Delete File on Server === // 
+    if (jobs < 1) jobs = 1;
+    struct fsc_client *cl = open_client(jobs, 0);
+    if (!cl) return 1;
+    struct file_list local = { NULL, 0, 0 }, remote = { NULL, 0, 0 };
+    walk_local(local_dir, "", &local);
+    if (list_remote(cl, remote_dir, &remote) < 0) {
+        printf("Failed to list '%s' on server.\n", remote_dir);
+        fsc_close(cl);
+        file_list_free(&local);
+        file_list_free(&remote);
+        return 1;
+    }
 
-    else if (strcmp(argv[1], "RM") == 0 && argc == 3) {
-        char *remote_path = argv[2];
+    struct sync_state s = { local_dir, remote_dir, NULL, 0, 0, 0, jobs, 0, 0, 0, 0 };
+    int unchanged = 0;
+    if (plan_sync(&s, &local, &remote, &unchanged) < 0) {
+        perror("Memory allocation failed");
+        fsc_close(cl);
+        file_list_free(&local);
+        file_list_free(&remote);
+        return 1;
+    }
+
+    start_transfers(cl, &s);
+    fsc_run(cl);
+    fsc_close(cl);
+
+    printf("Sync complete: %d uploaded, %d downloaded, %d unchanged, %d failed\n",
+           s.uploaded, s.downloaded, unchanged, s.failed);
+    free(s.jobs);
+    file_list_free(&local);
+    file_list_free(&remote);
+    return s.failed > 0;
+}
+
+// === Single Command Callbacks === //
+
+struct command {
+    const char *local;
+    const char *remote;
+    int status;
+    int cached;
+};
+
+static void write_done(struct fsc_client *cl, struct fsc_result *res, void *arg) {
+    struct command *cmd = arg;
+    if (res->status == FSC_OK) {
+        printf("Encrypted file '%s' sent to server as '%s'\n", cmd->local, cmd->remote);
+    } else {
+        printf("Failed to send '%s' to server: %s\n", cmd->local, res->message);
+        cmd->status = 1;
+    }
+}
+
+static void get_done(struct fsc_client *cl, struct fsc_result *res, void *arg) {
+    struct command *cmd = arg;
+    if (res->status == FSC_ERR_NOT_FOUND) {
+        printf("Invalid file or file not found on server.\n");
+    } else if (res->status != FSC_OK) {
+        printf("Failed to fetch '%s': %s\n", cmd->remote, res->message);
+    }
+    if (res->status != FSC_OK) cmd->status = 1;
+    cmd->cached = res->cached;
+}
+
+static void rm_done(struct fsc_client *cl, struct fsc_result *res, void *arg) {
+    struct command *cmd = arg;
+    printf("Server response: %s\n", res->status == FSC_OK ? "File deleted." : res->message);
+    if (res->status != FSC_OK) cmd->status = 1;
+}
+
+static void ls_done(struct fsc_client *cl, struct fsc_result *res, void *arg) {
+    struct command *cmd = arg;
+    if (res->status != FSC_OK) {
+        printf("Listing failed: %s\n", res->message);
+        cmd->status = 1;
+        return;
+    }
+    for (size_t i = 0; i < res->nlines; i++) printf("%s\n", res->lines[i]);
+    printf("__END__\n");
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+
+        // Display usage instructions if insufficient arguments are provided
+        printf("Usage:\n");
+        printf("  %s WRITE local_file_path remote_file_path\n", argv[0]);
+        printf("  %s GET remote_file_path[:version|@snapshot] local_file_path\n", argv[0]);
+        printf("  %s RM remote_file_path\n", argv[0]);
+        printf("  %s RM -r remote_prefix_or_glob[:from-to] [keep_latest]\n", argv[0]);
+        printf("  %s LS [-l] [remote_path] [@snapshot]\n", argv[0]);
+        printf("  %s SYNC local_dir remote_dir [connections]\n", argv[0]);
+        printf("  %s MGET remote_prefix_or_glob local_dir [v<version>|t<unix_time>|s<snapshot>]\n", argv[0]);
+        printf("  %s SNAPSHOT [-l | -d snapshot]\n", argv[0]);
+        printf("  %s WATCH [remote_prefix] [from_event]\n", argv[0]);
+        return 1;
+    }
+
+    if (load_config() < 0) return 1;
+
+    // === SYNC Command: Mirror a Directory Tree === //
 
-        char header[1024];
-        snprintf(header, sizeof(header), "RM %s\n", remote_path);
-        send(sock, header, strlen(header), 0);
+    if (strcmp(argv[1], "SYNC") == 0 && (argc == 4 || argc == 5)) {
+        int jobs = argc == 5 ? atoi(argv[4]) : SYNC_DEFAULT_JOBS;
+        return sync_dirs(argv[2], argv[3], jobs);
+    }
+
+    // === MGET Command: Restore Many Files in One Stream === //
+
+    if (strcmp(argv[1], "MGET") == 0 && (argc == 4 || argc == 5)) {
+        return mget(argv[2], argv[3], argc == 5 ? argv[4] : NULL);
+    }
+
+    // === RM -r Command: Delete Many Versions in One Request === //
+
+    if (strcmp(argv[1], "RM") == 0 && (argc == 4 || argc == 5) && strcmp(argv[2], "-r") == 0) {
+        return rm_bulk(argv[3], argc == 5 ? atoi(argv[4]) : 0);
+    }
 
-        memset(buffer, 0, sizeof(buffer));
-        recv(sock, buffer, sizeof(buffer), 0);
-        printf("Server response: %s\n", buffer);
+    // === SNAPSHOT Command: Record or Manage Point-in-Time Views === //
+
+    if (strcmp(argv[1], "SNAPSHOT") == 0 && argc <= 4) {
+        if (argc == 2) return snapshot(SNAP_TAKE, 0);
+        if (argc == 3 && strcmp(argv[2], "-l") == 0) return snapshot(SNAP_LIST, 0);
+        if (argc == 4 && strcmp(argv[2], "-d") == 0) return snapshot(SNAP_DROP, strtoul(argv[3], NULL, 10));
+    }
+
+    // === WATCH Command: Follow Changes Instead of Polling LS === //
+
+    if (strcmp(argv[1], "WATCH") == 0 && argc <= 4) {
+        return watch(argc >= 3 ? argv[2] : "", argc == 4 ? strtoull(argv[3], NULL, 10) : 0);
     }
 
-    // === LS Command: List Files on Server === // 
+    // === Single Commands: Run Through libfsclient === //
 
-    else if (strcmp(argv[1], "LS") == 0) {
-        char header[1024];
-        if (argc == 3)
-            snprintf(header, sizeof(header), "LS %s\n", argv[2]);
-        else
-            snprintf(header, sizeof(header), "LS\n");
+    struct fsc_client *cl = open_client(1, 1);
+    if (!cl) return 1;
+    struct command cmd = { NULL, NULL, 0, 0 };
 
-        send(sock, header, strlen(header), 0);
+    // === WRITE Command: Upload File with Encryption === //
+
+    if (strcmp(argv[1], "WRITE") == 0 && argc == 4) {
+        cmd.local = argv[2];
+        cmd.remote = argv[3];
 
-        while (1) {
-            ssize_t len = recv(sock, buffer, sizeof(buffer) - 1, 0);
-            if (len <= 0) break;
-            buffer[len] = '\0';
-            printf("%s", buffer);
-            if (strstr(buffer, "__END__\n")) break;
+        struct stat st;
+        int fd = open(cmd.local, O_RDONLY);
+        if (fd < 0 || fstat(fd, &st) != 0 || st.st_size <= 0) {
+            printf("Empty or invalid file.\n");
+            cmd.status = 1;
+        } else if (fsc_write_fd(cl, cmd.remote, fd, st.st_size, 0, write_done, &cmd) < 0) {
+            printf("Failed to send '%s' to server.\n", cmd.local);
+            cmd.status = 1;
         }
+        fsc_run(cl);
+        if (fd >= 0) close(fd);
+    }
+
+    // === GET Command: Download File with Optional Version and Decryption === //
+
+    else if (strcmp(argv[1], "GET") == 0 && argc == 4) {
+        char *remote_arg = argv[2];
+        cmd.local = argv[3];
+        cmd.remote = remote_arg;
+
+        int version = -1;
+        unsigned long snapshot = 0;
+        char *colon = strchr(remote_arg, ':');
+        char *at = strrchr(remote_arg, '@');
+        if (colon) {
+            *colon = '\0';
+            version = atoi(colon + 1);
+        } else if (at && at[1] && strspn(at + 1, "0123456789") == strlen(at + 1)) {
+            *at = '\0';
+            snapshot = strtoul(at + 1, NULL, 10);
+        }
+
+        // Written next to the target and renamed once the checksum matched
+        char temp_path[2200];
+        snprintf(temp_path, sizeof(temp_path), "%s.part", cmd.local);
+        int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            perror("Failed to create local file");
+            cmd.status = 1;
+        } else if ((snapshot ? fsc_get_snapshot(cl, remote_arg, snapshot, fd, get_done, &cmd)
+                             : fsc_get_fd(cl, remote_arg, version, fd, get_done, &cmd)) < 0) {
+            printf("Invalid file or file not found on server.\n");
+            cmd.status = 1;
+        }
+        fsc_run(cl);
+        if (fd >= 0) {
+            if (close(fd) != 0) cmd.status = 1;
+            if (cmd.status == 0 && rename(temp_path, cmd.local) == 0) {
+                printf("Decrypted file saved as '%s'%s\n", cmd.local, cmd.cached ? " (unchanged, from cache)" : "");
+            } else {
+                remove(temp_path);
+                cmd.status = 1;
+            }
+        }
+    }
+
+    // === RM Command: Delete File on Server === //
+
+    else if (strcmp(argv[1], "RM") == 0 && argc == 3) {
+        if (fsc_rm(cl, argv[2], rm_done, &cmd) < 0) {
+            printf("Server response: Delete failed.\n");
+            cmd.status = 1;
+        }
+        fsc_run(cl);
+    }
+
+    // === LS Command: List Files on Server === //
+
+    else if (strcmp(argv[1], "LS") == 0 && argc <= 5) {
+        unsigned long snapshot = 0;
+        int nargs = argc;
+        if (nargs >= 3 && argv[nargs - 1][0] == '@') snapshot = strtoul(argv[--nargs] + 1, NULL, 10);
+        int detailed = nargs >= 3 && strcmp(argv[2], "-l") == 0;
+        const char *filter = nargs == 4 ? argv[3] : (nargs == 3 && !detailed ? argv[2] : NULL);
+        if (nargs > 4 || fsc_ls_snapshot(cl, detailed, filter, snapshot, ls_done, &cmd) < 0) {
+            printf("Invalid command or argument count.\n");
+            cmd.status = 1;
+        }
+        fsc_run(cl);
     }
 
     else {
         printf("Invalid command or argument count.\n");
+        cmd.status = 1;
     }
 
-    close(sock);
-    return 0;
+    fsc_close(cl);
+    return cmd.status;
 }
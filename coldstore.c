@@ -0,0 +1,687 @@
+/*
+ * coldstore.c - Append-only, deflate-compressed archives for cold versions.
+ *
+ * An archive is a sequence of records: a fixed header, the filename and
+ * extension, then the version's deflate stream. A record is written with
+ * a zeroed magic, synced, and only then stamped complete, so a crash
+ * mid-write leaves an incomplete record at the very end of the newest
+ * archive, which the next start cuts off.
+ *
+ * Deletions go to a separate tombstone log rather than to the archives,
+ * so a long-running compression never holds up an RM. Each tombstone
+ * names the archive and offset of the record it deletes; archive ids are
+ * never reused, so old tombstones cannot hit new records. Sealed archives
+ * whose records are all deleted are unlinked, and the log is rewritten
+ * without their tombstones.
+ *
+ * Nothing but the archives and the log is persisted: the index is rebuilt
+ * at startup by scanning them. Records are framed and indexed like the
+ * pack's (recordlog.c).
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <zlib.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "coldstore.h"
+#include "recordlog.h"
+#include "crc32c.h"
+
+#define COLD_RECORD 0x444c4f43u     // "COLD"
+#define COLD_TOMBSTONE 0x424d4f54u  // "TOMB"
+#define COLD_IO_CHUNK (64 * 1024)
+#define TOMBSTONE_LOG "tombstones.log"
+
+// Starts like every struct rlog_record
+struct cold_header {
+    uint32_t magic;        // COLD_RECORD once the record is complete, 0 before
+    uint32_t header_crc;   // CRC32C of the header (this field zeroed) and the names
+    uint16_t name_len;
+    uint16_t ext_len;
+    int32_t version;
+    int64_t mtime;
+    uint64_t size;         // uncompressed
+    uint64_t packed_size;  // length of the deflate stream after the names
+};
+
+struct cold_tombstone {
+    uint32_t magic;
+    uint32_t archive;
+    uint64_t off;
+    uint32_t crc;          // CRC32C of the fields above
+    uint32_t pad;
+};
+
+struct archive {
+    uint32_t id;
+    int fd;
+    uint64_t size;
+    size_t live;           // records not deleted
+};
+
+struct cold_entry {
+    int version;
+    uint32_t archive;
+    uint64_t off;
+    long size;
+    long packed_size;
+    time_t mtime;
+    unsigned reads;
+};
+
+static pthread_rwlock_t cold_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t store_lock = PTHREAD_MUTEX_INITIALIZER;  // one cold_store at a time
+static int enabled;        // set once cold_open has loaded everything
+static char cold_dir[1024];
+static long max_archive_size;
+static int compression_level;
+static struct archive *archives;
+static size_t narchives, archives_cap;
+static struct rlog_index cold_index = { sizeof(struct cold_entry), { NULL } };  // by filename + extension
+static int tomb_fd = -1;
+static int frozen;  // set while another process owns the archives
+
+// === Records === //
+
+static uint64_t body_len(const void *h) {
+    return ((const struct cold_header *)h)->packed_size;
+}
+
+// Incomplete records still have a zeroed magic, so only COLD_RECORD reads back
+static const struct rlog_format cold_format = { sizeof(struct cold_header), { COLD_RECORD, 0 }, body_len };
+
+static size_t record_len(const struct cold_header *h) {
+    return rlog_record_len(&cold_format, h);
+}
+
+static uint32_t header_crc(const struct cold_header *h, const char *filename, const char *ext) {
+    return rlog_header_crc(&cold_format, h, filename, ext);
+}
+
+static uint32_t tombstone_crc(const struct cold_tombstone *t) {
+    return crc32c_update(0, t, offsetof(struct cold_tombstone, crc));
+}
+
+static void archive_path(char *out, size_t cap, uint32_t id) {
+    snprintf(out, cap, "%s/archive_%06u.cold", cold_dir, id);
+}
+
+static struct archive *find_archive(uint32_t id) {
+    for (size_t i = 0; i < narchives; i++) {
+        if (archives[i].id == id) return &archives[i];
+    }
+    return NULL;
+}
+
+// === Index === //
+
+static struct rlog_name *find_file(const char *filename, const char *ext, int create) {
+    return rlog_name(&cold_index, filename, ext, create);
+}
+
+static struct cold_entry *find_entry(struct rlog_name *f, int version) {
+    return rlog_find(&cold_index, f, version);
+}
+
+/*
+ * rewrite_tombstones - Rewrites the tombstone log without the tombstones
+ * of archives that are gone, so the log shrinks as archives do. The new
+ * log is synced under a temporary name and renamed over the old one; if
+ * anything fails the old log, still correct, stays in use.
+ */
+
+static void rewrite_tombstones(void) {
+    char path[1100], temp[1120];
+    snprintf(path, sizeof(path), "%s/%s", cold_dir, TOMBSTONE_LOG);
+    snprintf(temp, sizeof(temp), "%s.tmp", path);
+    int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return;
+    struct cold_tombstone t;
+    uint64_t off = 0;
+    int ok = 1;
+    while (ok && pread(tomb_fd, &t, sizeof(t), off) == (ssize_t)sizeof(t)) {
+        off += sizeof(t);
+        if (t.magic != COLD_TOMBSTONE || t.crc != tombstone_crc(&t) || !find_archive(t.archive)) continue;
+        ok = write(fd, &t, sizeof(t)) == (ssize_t)sizeof(t);
+    }
+    ok = ok && fdatasync(fd) == 0;
+    close(fd);
+    int log_fd = ok && rename(temp, path) == 0 ? open(path, O_RDWR | O_APPEND | O_CLOEXEC) : -1;
+    if (log_fd < 0) {
+        if (!ok) unlink(temp);
+        perror("cold tombstone log rewrite");
+        return;
+    }
+    close(tomb_fd);
+    tomb_fd = log_fd;
+}
+
+/*
+ * release_record - Counts one record of an archive as deleted, and
+ * unlinks the archive once nothing in it is live, unless appends still go
+ * there, and drops the archive's tombstones from the log. Open readers
+ * hold their own descriptor and are unaffected. While cold_open is still
+ * scanning, archives are only counted.
+ */
+
+static void release_record(uint32_t id) {
+    struct archive *a = find_archive(id);
+    if (!a || --a->live > 0 || !enabled || a == &archives[narchives - 1]) return;
+    char path[1100];
+    archive_path(path, sizeof(path), id);
+    unlink(path);
+    close(a->fd);
+    memmove(a, a + 1, (&archives[narchives] - (a + 1)) * sizeof(*a));
+    narchives--;
+    rewrite_tombstones();
+}
+
+static void drop_entry(struct rlog_name *f, struct cold_entry *e) {
+    uint32_t id = e->archive;
+    rlog_drop(&cold_index, f, e);
+    release_record(id);
+}
+
+/*
+ * index_record - Points the index at the record at archive:off. A version
+ * already indexed elsewhere (archived twice around a crash) is replaced.
+ */
+
+static int index_record(const struct cold_header *h, const char *filename, const char *ext,
+                        uint32_t archive, uint64_t off) {
+    struct rlog_name *f = find_file(filename, ext, 1);
+    if (!f) return -1;
+    struct cold_entry *e = find_entry(f, h->version);
+    if (e) {
+        release_record(e->archive);
+    } else if (!(e = rlog_add(&cold_index, f))) {
+        return -1;
+    }
+    e->version = h->version;
+    e->archive = archive;
+    e->off = off;
+    e->size = h->size;
+    e->packed_size = h->packed_size;
+    e->mtime = h->mtime;
+    e->reads = 0;
+    struct archive *a = find_archive(archive);
+    if (a) a->live++;
+    return 0;
+}
+
+// Where a tombstone's record was
+struct cold_location {
+    uint32_t archive;
+    uint64_t off;
+};
+
+static int compare_locations(const void *a, const void *b) {
+    const struct cold_location *x = a, *y = b;
+    if (x->archive != y->archive) return (x->archive > y->archive) - (x->archive < y->archive);
+    return (x->off > y->off) - (x->off < y->off);
+}
+
+/*
+ * apply_tombstones - Drops every indexed entry at one of the count
+ * locations, in one pass over the index.
+ */
+
+static void apply_tombstones(struct cold_location *locs, size_t count) {
+    if (count == 0) return;
+    qsort(locs, count, sizeof(*locs), compare_locations);
+    for (int b = 0; b < RLOG_BUCKETS; b++) {
+        for (struct rlog_name *f = cold_index.buckets[b]; f; f = f->next) {
+            // Backwards, as dropping moves the last entry into the gap
+            for (size_t i = f->count; i-- > 0;) {
+                struct cold_entry *e = rlog_entry(&cold_index, f, i);
+                struct cold_location key = { e->archive, e->off };
+                if (bsearch(&key, locs, count, sizeof(*locs), compare_locations)) drop_entry(f, e);
+            }
+        }
+    }
+}
+
+// === Archives === //
+
+static struct archive *add_archive(uint32_t id, int fd, uint64_t size) {
+    if (narchives == archives_cap) {
+        size_t cap = archives_cap ? archives_cap * 2 : 16;
+        struct archive *grown = realloc(archives, cap * sizeof(*grown));
+        if (!grown) return NULL;
+        archives = grown;
+        archives_cap = cap;
+    }
+    struct archive *a = &archives[narchives++];
+    a->id = id;
+    a->fd = fd;
+    a->size = size;
+    a->live = 0;
+    return a;
+}
+
+/*
+ * active_archive - Returns the archive new records go to, starting a new
+ * one once the current one has reached max_archive_size. Called with the
+ * write lock held.
+ */
+
+static struct archive *active_archive(void) {
+    if (narchives > 0 && archives[narchives - 1].size < (uint64_t)max_archive_size) {
+        return &archives[narchives - 1];
+    }
+    uint32_t id = narchives > 0 ? archives[narchives - 1].id + 1 : 1;
+    char path[1100];
+    archive_path(path, sizeof(path), id);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return NULL;
+    struct archive *a = add_archive(id, fd, 0);
+    if (!a) close(fd);
+    return a;
+}
+
+/*
+ * scan_archive - Replays one archive into the index. An incomplete record
+ * at the end of the newest archive is cut off; anywhere else the rest of
+ * the archive is skipped with a warning.
+ */
+
+static void replay_record(void *ctx, const void *header, const char *filename, const char *ext, uint64_t off) {
+    index_record(header, filename, ext, ((const struct archive *)ctx)->id, off);
+}
+
+static void scan_archive(struct archive *a, int newest) {
+    uint64_t off;
+    if (rlog_scan(&cold_format, a->fd, a->size, &off, replay_record, a) < 0) {
+        printf("Cold archive %u: bad record at offset %lu%s\n", a->id, (unsigned long)off,
+               newest ? ", truncated" : ", rest skipped");
+        if (newest) {
+            if (ftruncate(a->fd, off) != 0) perror("cold truncate");
+            a->size = off;
+        }
+    }
+}
+
+/*
+ * replay_tombstones - Applies the tombstone log. The locations are
+ * gathered first and matched against the index in one pass; should
+ * memory run short, in several.
+ */
+
+static void replay_tombstones(void) {
+    struct cold_location *locs = NULL;
+    size_t count = 0, cap = 0;
+    struct cold_tombstone t;
+    while (read(tomb_fd, &t, sizeof(t)) == (ssize_t)sizeof(t)) {
+        if (t.magic != COLD_TOMBSTONE || t.crc != tombstone_crc(&t)) continue;
+        if (count == cap) {
+            size_t grown_cap = cap ? cap * 2 : 1024;
+            struct cold_location *grown = realloc(locs, grown_cap * sizeof(*grown));
+            if (grown) {
+                locs = grown;
+                cap = grown_cap;
+            } else if (cap > 0) {
+                apply_tombstones(locs, count);
+                count = 0;
+            } else {
+                struct cold_location one = { t.archive, t.off };
+                apply_tombstones(&one, 1);
+                continue;
+            }
+        }
+        locs[count].archive = t.archive;
+        locs[count].off = t.off;
+        count++;
+    }
+    apply_tombstones(locs, count);
+    free(locs);
+}
+
+/*
+ * cold_open - Loads every archive under dir (created if missing) and
+ * rebuilds the index. New archives are started at archive_max bytes;
+ * level is the deflate level for new records.
+ */
+
+int cold_open(const char *dir, long archive_max, int level) {
+    snprintf(cold_dir, sizeof(cold_dir), "%s", dir);
+    max_archive_size = archive_max;
+    compression_level = level;
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) return -1;
+
+    uint32_t *ids;
+    size_t count;
+    if (rlog_list_ids(dir, "archive_%u.cold", &ids, &count) < 0) return -1;
+
+    for (size_t i = 0; i < count; i++) {
+        char path[1100];
+        struct stat st;
+        archive_path(path, sizeof(path), ids[i]);
+        int fd = open(path, O_RDWR | O_CLOEXEC);
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            if (fd >= 0) close(fd);
+            continue;
+        }
+        struct archive *a = add_archive(ids[i], fd, st.st_size);
+        if (!a) {
+            close(fd);
+            break;
+        }
+        scan_archive(a, i == count - 1);
+    }
+    free(ids);
+
+    char path[1100];
+    snprintf(path, sizeof(path), "%s/%s", dir, TOMBSTONE_LOG);
+    tomb_fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (tomb_fd < 0) return -1;
+    replay_tombstones();
+    enabled = 1;
+
+    // Sealed archives that only held deleted records
+    for (size_t i = 0; i + 1 < narchives;) {
+        if (archives[i].live == 0) {
+            archives[i].live = 1;
+            release_record(archives[i].id);
+        } else {
+            i++;
+        }
+    }
+    return 0;
+}
+
+int cold_enabled(void) {
+    return enabled;
+}
+
+/*
+ * cold_freeze - Stops (on) or resumes every write to the archives and the
+ * tombstone log; cold_store and cold_remove fail meanwhile. Returns once
+ * a cold_store in progress is done. Reads keep working.
+ */
+
+void cold_freeze(int on) {
+    pthread_mutex_lock(&store_lock);
+    pthread_rwlock_wrlock(&cold_lock);
+    frozen = on;
+    pthread_rwlock_unlock(&cold_lock);
+    pthread_mutex_unlock(&store_lock);
+}
+
+// === Writing === //
+
+/*
+ * deflate_to - Compresses src into fd from off on. Returns the number of
+ * bytes written and the uncompressed size in *size, or -1 on error.
+ */
+
+static long deflate_to(FILE *src, int fd, uint64_t off, uint64_t *size) {
+    unsigned char *in = malloc(COLD_IO_CHUNK), *out = malloc(COLD_IO_CHUNK);
+    z_stream z = { 0 };
+    long written = -1;
+    if (!in || !out || deflateInit(&z, compression_level) != Z_OK) goto out;
+
+    uint64_t pos = off;
+    int flush;
+    *size = 0;
+    do {
+        size_t n = fread(in, 1, COLD_IO_CHUNK, src);
+        if (ferror(src)) goto done;
+        *size += n;
+        flush = feof(src) ? Z_FINISH : Z_NO_FLUSH;
+        z.next_in = in;
+        z.avail_in = n;
+        do {
+            z.next_out = out;
+            z.avail_out = COLD_IO_CHUNK;
+            deflate(&z, flush);
+            size_t have = COLD_IO_CHUNK - z.avail_out;
+            if (pwrite(fd, out, have, pos) != (ssize_t)have) goto done;
+            pos += have;
+        } while (z.avail_out == 0);
+    } while (flush != Z_FINISH);
+    written = pos - off;
+done:
+    deflateEnd(&z);
+out:
+    free(in);
+    free(out);
+    return written;
+}
+
+/*
+ * cold_store - Compresses a version read from src into the active archive
+ * and indexes it. The record is on disk (synced) before this returns, so
+ * the caller may delete its fast-tier copy afterwards.
+ */
+
+int cold_store(const char *filename, const char *ext, int version, time_t mtime, FILE *src) {
+    if (!enabled) return -1;
+    pthread_mutex_lock(&store_lock);
+    pthread_rwlock_wrlock(&cold_lock);
+    struct archive *a = frozen ? NULL : active_archive();
+    // Only cold_store appends, and store_lock keeps it to one at a time,
+    // so the archive's end stays put without holding cold_lock
+    uint32_t id = a ? a->id : 0;
+    int fd = a ? dup(a->fd) : -1;
+    uint64_t off = a ? a->size : 0;
+    pthread_rwlock_unlock(&cold_lock);
+    if (fd < 0) {
+        pthread_mutex_unlock(&store_lock);
+        return -1;
+    }
+
+    struct cold_header h = { 0 };
+    h.name_len = strlen(filename);
+    h.ext_len = strlen(ext);
+    h.version = version;
+    h.mtime = mtime;
+    struct iovec iov[3] = { { &h, sizeof(h) }, { (void *)filename, h.name_len }, { (void *)ext, h.ext_len } };
+    size_t names = sizeof(h) + h.name_len + h.ext_len;
+    int status = -1;
+    long packed = -1;
+    if (pwritev(fd, iov, 3, off) == (ssize_t)names) {
+        packed = deflate_to(src, fd, off + names, &h.size);
+    }
+    if (packed >= 0 && fdatasync(fd) == 0) {
+        h.magic = COLD_RECORD;
+        h.packed_size = packed;
+        h.header_crc = header_crc(&h, filename, ext);
+        status = pwrite(fd, &h, sizeof(h), off) == (ssize_t)sizeof(h) && fdatasync(fd) == 0 ? 0 : -1;
+    }
+
+    pthread_rwlock_wrlock(&cold_lock);
+    if (status == 0 && (a = find_archive(id))) {
+        a->size = off + record_len(&h);
+        status = index_record(&h, filename, ext, id, off);
+    } else if (ftruncate(fd, off) != 0) {
+        perror("cold truncate");
+    }
+    pthread_rwlock_unlock(&cold_lock);
+    close(fd);
+    pthread_mutex_unlock(&store_lock);
+    return status;
+}
+
+/*
+ * cold_remove - Deletes an archived version by logging a tombstone.
+ * Returns -1 if the version is not archived.
+ */
+
+int cold_remove(const char *filename, const char *ext, int version) {
+    pthread_rwlock_wrlock(&cold_lock);
+    struct rlog_name *f = find_file(filename, ext, 0);
+    struct cold_entry *e = find_entry(f, version);
+    int status = -1;
+    if (e && !frozen) {
+        struct cold_tombstone t = { COLD_TOMBSTONE, e->archive, e->off, 0, 0 };
+        t.crc = tombstone_crc(&t);
+        if (write(tomb_fd, &t, sizeof(t)) == (ssize_t)sizeof(t)) {
+            drop_entry(f, e);
+            status = 0;
+        }
+    }
+    pthread_rwlock_unlock(&cold_lock);
+    return status;
+}
+
+// === Reading === //
+
+struct cold_reader {
+    int fd;
+    uint64_t start;     // first byte of the deflate stream
+    uint64_t packed;
+    uint64_t consumed;
+    int done;
+    z_stream z;
+    unsigned char in[COLD_IO_CHUNK];
+};
+
+static ssize_t reader_read(void *cookie, char *buf, size_t len) {
+    struct cold_reader *r = cookie;
+    r->z.next_out = (Bytef *)buf;
+    r->z.avail_out = len;
+    while (r->z.avail_out > 0 && !r->done) {
+        if (r->z.avail_in == 0) {
+            uint64_t left = r->packed - r->consumed;
+            if (left == 0) break;
+            ssize_t got = pread(r->fd, r->in, left < sizeof(r->in) ? left : sizeof(r->in), r->start + r->consumed);
+            if (got <= 0) return -1;
+            r->consumed += got;
+            r->z.next_in = r->in;
+            r->z.avail_in = got;
+        }
+        int rc = inflate(&r->z, Z_NO_FLUSH);
+        if (rc == Z_STREAM_END) r->done = 1;
+        else if (rc != Z_OK && rc != Z_BUF_ERROR) return -1;
+    }
+    return len - r->z.avail_out;
+}
+
+static int reader_close(void *cookie) {
+    struct cold_reader *r = cookie;
+    inflateEnd(&r->z);
+    close(r->fd);
+    free(r);
+    return 0;
+}
+
+/*
+ * cold_fopen - Opens an archived version for reading; the stream yields
+ * the original bytes. Sets *size to the uncompressed size and counts the
+ * read. Returns NULL if the version is not archived.
+ */
+
+FILE *cold_fopen(const char *filename, const char *ext, int version, long *size) {
+    struct cold_reader *r = calloc(1, sizeof(*r));
+    if (!r) return NULL;
+    r->fd = -1;
+    pthread_rwlock_rdlock(&cold_lock);
+    struct cold_entry *e = find_entry(find_file(filename, ext, 0), version);
+    struct archive *a = e ? find_archive(e->archive) : NULL;
+    if (a && (r->fd = dup(a->fd)) >= 0) {
+        r->start = e->off + sizeof(struct cold_header) + strlen(filename) + strlen(ext);
+        r->packed = e->packed_size;
+        *size = e->size;
+        __atomic_fetch_add(&e->reads, 1, __ATOMIC_RELAXED);
+    }
+    pthread_rwlock_unlock(&cold_lock);
+
+    cookie_io_functions_t io = { reader_read, NULL, NULL, reader_close };
+    FILE *fp = NULL;
+    if (r->fd >= 0 && inflateInit(&r->z) == Z_OK) {
+        if (!(fp = fopencookie(r, "r", io))) inflateEnd(&r->z);
+    }
+    if (!fp) {
+        if (r->fd >= 0) close(r->fd);
+        free(r);
+    }
+    return fp;
+}
+
+int cold_latest_version(const char *filename, const char *ext) {
+    int latest = 0;
+    pthread_rwlock_rdlock(&cold_lock);
+    struct rlog_name *f = find_file(filename, ext, 0);
+    for (size_t i = 0; f && i < f->count; i++) {
+        const struct cold_entry *e = rlog_entry(&cold_index, f, i);
+        if (e->version > latest) latest = e->version;
+    }
+    pthread_rwlock_unlock(&cold_lock);
+    return latest;
+}
+
+// === Listing === //
+
+/*
+ * cold_list - Returns a snapshot of every archived version, with its read
+ * count, for listings and for the tiering policy.
+ */
+
+struct cold_item *cold_list(size_t *count) {
+    struct cold_item *items = NULL;
+    size_t n = 0, cap = 0;
+    pthread_rwlock_rdlock(&cold_lock);
+    for (int b = 0; enabled && b < RLOG_BUCKETS; b++) {
+        for (struct rlog_name *f = cold_index.buckets[b]; f; f = f->next) {
+            for (size_t i = 0; i < f->count; i++) {
+                if (n == cap) {
+                    cap = cap ? cap * 2 : 256;
+                    struct cold_item *grown = realloc(items, cap * sizeof(*grown));
+                    if (!grown) goto out;
+                    items = grown;
+                }
+                struct cold_item *it = &items[n];
+                const struct cold_entry *e = rlog_entry(&cold_index, f, i);
+                size_t len = strlen(f->filename) + strlen(f->ext) + 16;
+                it->logical = malloc(len);
+                it->stored = malloc(len);
+                if (!it->logical || !it->stored) {
+                    free(it->logical);
+                    free(it->stored);
+                    goto out;
+                }
+                snprintf(it->logical, len, "%s%s", f->filename, f->ext);
+                snprintf(it->stored, len, "%s_v%d%s", f->filename, e->version, f->ext);
+                it->version = e->version;
+                it->size = e->size;
+                it->packed_size = e->packed_size;
+                it->mtime = e->mtime;
+                it->reads = __atomic_load_n(&e->reads, __ATOMIC_RELAXED);
+                n++;
+            }
+        }
+    }
+out:
+    pthread_rwlock_unlock(&cold_lock);
+    *count = n;
+    return items;
+}
+
+void cold_free_list(struct cold_item *items, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        free(items[i].logical);
+        free(items[i].stored);
+    }
+    free(items);
+}
+
+// Starts a new read-counting window
+void cold_reset_reads(void) {
+    pthread_rwlock_rdlock(&cold_lock);
+    for (int b = 0; b < RLOG_BUCKETS; b++) {
+        for (struct rlog_name *f = cold_index.buckets[b]; f; f = f->next) {
+            for (size_t i = 0; i < f->count; i++) {
+                struct cold_entry *e = rlog_entry(&cold_index, f, i);
+                __atomic_store_n(&e->reads, 0, __ATOMIC_RELAXED);
+            }
+        }
+    }
+    pthread_rwlock_unlock(&cold_lock);
+}
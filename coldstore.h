@@ -0,0 +1,49 @@
+/*
+ * coldstore.h - Compressed archive tier for cold versions.
+ *
+ * Versions that are rarely read are moved off the fast storage directory
+ * into large append-only archive files on a second (cheaper, slower)
+ * path, each version deflate-compressed. An in-memory index maps every
+ * archived version to its archive and offset.
+ *
+ * Archived versions are read back through an ordinary FILE *, which
+ * inflates as it goes, so callers stream them exactly like the files of
+ * the fast tier. Reads are counted, so the caller can spot versions that
+ * became hot again and bring them back.
+ *
+ * Versions are named like their file-backed counterparts, by filename
+ * (without extension), extension and version number.
+ */
+
+#ifndef COLDSTORE_H
+#define COLDSTORE_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <time.h>
+
+// One archived version, as returned by cold_list()
+struct cold_item {
+    char *logical;     // "docs/a.txt"
+    char *stored;      // "docs/a_v3.txt"
+    int version;
+    long size;         // uncompressed
+    long packed_size;  // compressed, as it sits in the archive
+    time_t mtime;
+    unsigned reads;    // cold_fopen calls since the last cold_reset_reads
+};
+
+int cold_open(const char *dir, long archive_max, int level);
+int cold_enabled(void);
+void cold_freeze(int on);
+
+int cold_store(const char *filename, const char *ext, int version, time_t mtime, FILE *src);
+FILE *cold_fopen(const char *filename, const char *ext, int version, long *size);
+int cold_remove(const char *filename, const char *ext, int version);
+int cold_latest_version(const char *filename, const char *ext);
+
+struct cold_item *cold_list(size_t *count);
+void cold_free_list(struct cold_item *items, size_t count);
+void cold_reset_reads(void);
+
+#endif
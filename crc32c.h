@@ -0,0 +1,17 @@
+/*
+ * crc32c.h - CRC32C (Castagnoli) checksums shared by client and server.
+ *
+ * crc32c_update() takes the checksum of the bytes seen so far (0 to
+ * start) and returns the checksum including data, so a stream can be
+ * checksummed chunk by chunk as it is sent or received.
+ */
+
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+uint32_t crc32c_update(uint32_t crc, const void *data, size_t len);
+
+#endif
@@ -0,0 +1,1513 @@
+/*
+ * fsclient.c - libfsclient, an asynchronous client for the file server.
+ *
+ * The server handles one command at a time per connection, so an
+ * operation owns its connection from the request line to the last reply
+ * byte; concurrency comes from the pool. Queued operations go to the
+ * first idle connection, and new connections are opened (non-blocking)
+ * up to max_conns. All sockets share one epoll instance.
+ *
+ * A connection has an output buffer, refilled chunk by chunk while a
+ * WRITE payload is streaming, and an input buffer parsed according to
+ * the phase of the current operation. Replies ending in "__END__" are
+ * either collected (LS, SNAPSHOT) or handed over line by line (RM -r,
+ * WATCH); MGET's entries are written out one after the other, each
+ * through a temporary file renamed into place once its checksum matched.
+ *
+ * Transfers of FSC_PIPE_MIN bytes or more, given cipher_threads, run their
+ * cipher on a pipe of worker threads (see cipherpipe.c): a WRITE from a
+ * file descriptor has the pipe's reader thread read and its workers
+ * encrypt ahead of the connection, and a ChaCha20 GET hands received
+ * chunks to the workers and a writer thread that stores them in order.
+ * Either way the event loop only copies bytes and folds in the checksum.
+ *
+ * The GET cache lives below cache_dir, one directory per remote path
+ * (named after two hashes of it, and holding the path itself to rule out
+ * collisions) with one plaintext file per version, "<version>.<crc>"
+ * after the version's stored checksum. Hits refresh the file's mtime; the
+ * oldest entries go once the cache outgrows cache_max.
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <netdb.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/random.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "fsclient.h"
+#include "crc32c.h"
+#include "cipherpipe.h"
+
+#define FSC_DEFAULT_HOST "127.0.0.1"
+#define FSC_DEFAULT_PORT 2024
+#define FSC_DEFAULT_CONNS 4
+#define FSC_CHUNK (64 * 1024)      // WRITE payload is read and encrypted this much at a time
+#define FSC_INBUF (64 * 1024)
+#define FSC_PATH_MAX 1023          // the server reads paths with %1023s
+#define LEGACY_XOR_KEY "secretkey" // must match the server's ENCRYPTION_KEY
+#define FSC_CACHE_MAX (256L * 1024 * 1024)
+#define FSC_CACHE_OFFER 8          // cached versions a GET offers, newest first
+#define FSC_PIPE_MIN (4L * 1024 * 1024)  // smallest transfer given to the cipher workers
+#define FSC_PIPE_CHUNK (256 * 1024)
+
+enum fsc_op_type { FSC_WRITE, FSC_GET, FSC_RM, FSC_LS, FSC_MGET, FSC_RM_BULK, FSC_WATCH, FSC_SNAPSHOT };
+
+/*
+ * Input phases: REPLY waits for a single line (WRITE/RM result, GET's
+ * SIZE line), LIST takes lines up to "__END__", BODY consumes the payload
+ * of a GET or an MGET entry and TRAILER waits for its "CRC <hex>" line.
+ */
+
+enum fsc_phase { PH_IDLE, PH_REPLY, PH_LIST, PH_BODY, PH_TRAILER };
+
+struct fsc_op {
+    enum fsc_op_type type;
+    char *request;
+    fsc_callback cb;
+    void *arg;
+    struct fsc_op *next;
+
+    // WRITE source (data, or fd when data is NULL) / GET sink (fd, or memory)
+    char *data;
+    int fd;
+    long size;
+    long done;
+    uint32_t crc;
+    int trailer_sent;
+    int has_nonce;
+    uint8_t nonce[CHACHA20_NONCE_SIZE];
+    const uint8_t *key;
+
+    // Cipher workers of a large transfer; a GET fills one chunk at a time
+    struct cpipe *pipe;
+    char *pipe_chunk;
+    size_t pipe_len;
+
+    // GET cache: the remote path, and the entry being filled
+    char *remote;
+    int cache_fd;
+    char *cache_temp;
+    char *cache_final;
+
+    // MGET: target directory, length of the path prefix not recreated
+    // there, and the entry being received (remote path, local file, mtime)
+    char *dir;
+    size_t strip;
+    char *entry;
+    char *local;
+    time_t mtime;
+
+    struct fsc_result res;
+    int replied;
+    int resent;            // already sent again after a connection closed on it
+    int reported;          // a progress callback ran
+    char message[256];
+    size_t lines_cap;
+};
+
+struct fsc_conn {
+    int sock;
+    uint32_t gen;          // bumped per socket so stale epoll events are ignored
+    int connecting;
+    int served;            // an operation completed on this socket
+    uint32_t events;
+    enum fsc_phase phase;
+    struct fsc_op *op;
+    char *out;
+    size_t out_off, out_len, out_cap;
+    size_t in_off, in_len;
+    char in[FSC_INBUF];
+};
+
+struct fsc_client {
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    int epfd;
+    int max_conns;
+    struct fsc_conn *conns;
+    enum cipher_mode cipher;
+    int has_key;
+    uint8_t key[CHACHA20_KEY_SIZE];
+    int cipher_threads;
+    char *cache_dir;
+    long cache_max;
+    struct fsc_op *queue_head, *queue_tail;
+    int pending;
+    int closing;
+};
+
+static void dispatch(struct fsc_client *cl);
+static void cache_finish(struct fsc_client *cl, struct fsc_op *op, int ok);
+static void mget_close(struct fsc_op *op);
+
+// === Operations === //
+
+static void free_op(struct fsc_op *op) {
+    if (op->pipe) cpipe_finish(op->pipe, 1);
+    for (size_t i = 0; i < op->res.nlines; i++) free(op->res.lines[i]);
+    free(op->res.lines);
+    free(op->res.data);
+    free(op->data);
+    free(op->request);
+    free(op->remote);
+    free(op->cache_temp);
+    free(op->cache_final);
+    free(op->dir);
+    free(op->entry);
+    free(op->local);
+    free(op);
+}
+
+/*
+ * finish_op - Delivers the result of an operation that has left the queue
+ * and its connection, then frees it.
+ */
+
+static void finish_op(struct fsc_client *cl, struct fsc_op *op, int status) {
+    if (op->res.status == FSC_OK) op->res.status = status;
+    if (op->pipe) {
+        // Only a complete GET still has chunks to store
+        int abort = op->res.status != FSC_OK || op->type != FSC_GET;
+        if (cpipe_finish(op->pipe, abort) < 0 && op->res.status == FSC_OK) op->res.status = FSC_ERR_IO;
+        op->pipe = NULL;
+    }
+    if (op->cache_fd >= 0) cache_finish(cl, op, op->res.status == FSC_OK);
+    if (op->type == FSC_MGET && op->fd >= 0) {
+        // Cut short in the middle of an entry
+        op->res.status = op->res.status == FSC_OK ? FSC_ERR_IO : op->res.status;
+        mget_close(op);
+    }
+    if (op->res.status != FSC_OK && op->type == FSC_GET) {
+        // Never hand out a partial or unverified file
+        free(op->res.data);
+        op->res.data = NULL;
+        op->res.size = 0;
+    }
+    op->res.message = op->message[0] ? op->message : fsc_strerror(op->res.status);
+    cl->pending--;
+    op->cb(cl, &op->res, op->arg);
+    free_op(op);
+}
+
+static int valid_remote_path(const char *path) {
+    size_t len = strlen(path);
+    if (len == 0 || len > FSC_PATH_MAX) return 0;
+    for (size_t i = 0; i < len; i++) {
+        if (path[i] == ' ' || path[i] == '\t' || path[i] == '\n' || path[i] == '\r') return 0;
+    }
+    return 1;
+}
+
+static struct fsc_op *new_op(struct fsc_client *cl, enum fsc_op_type type, fsc_callback cb, void *arg) {
+    if (cl->closing) {
+        errno = ECANCELED;
+        return NULL;
+    }
+    struct fsc_op *op = calloc(1, sizeof(*op));
+    if (!op) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    op->type = type;
+    op->cb = cb;
+    op->arg = arg;
+    op->fd = -1;
+    op->cache_fd = -1;
+    return op;
+}
+
+static int submit(struct fsc_client *cl, struct fsc_op *op, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+
+static int submit(struct fsc_client *cl, struct fsc_op *op, const char *fmt, ...) {
+    char line[FSC_PATH_MAX + 512];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    op->request = strdup(line);
+    if (!op->request) {
+        free_op(op);
+        errno = ENOMEM;
+        return -1;
+    }
+    if (cl->queue_tail) cl->queue_tail->next = op;
+    else cl->queue_head = op;
+    cl->queue_tail = op;
+    cl->pending++;
+    dispatch(cl);
+    return 0;
+}
+
+// === Local Cache === //
+
+static void make_dirs(const char *dir, mode_t mode) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s", dir);
+    for (char *p = path + 1; *p; p++) {
+        if (*p == '/') {
+            *p = '\0';
+            mkdir(path, mode);
+            *p = '/';
+        }
+    }
+    mkdir(path, mode);
+}
+
+/*
+ * cache_path_dir - Returns the (malloc'd) cache directory of a remote
+ * path, or NULL if there is none yet and create is not set, or if another
+ * path already owns it.
+ */
+
+static char *cache_path_dir(struct fsc_client *cl, const char *remote, int create) {
+    uint32_t fnv = 2166136261u;
+    for (const char *p = remote; *p; p++) fnv = (fnv ^ (uint8_t)*p) * 16777619u;
+    size_t cap = strlen(cl->cache_dir) + 32;
+    char *dir = malloc(cap), owner[FSC_PATH_MAX + 2], file[PATH_MAX];
+    if (!dir) return NULL;
+    snprintf(dir, cap, "%s/%08x%08x", cl->cache_dir, crc32c_update(0, remote, strlen(remote)), fnv);
+    snprintf(file, sizeof(file), "%s/path", dir);
+
+    FILE *fp = fopen(file, "r");
+    if (!fp && create) {
+        make_dirs(dir, 0700);
+        if ((fp = fopen(file, "w"))) {
+            fputs(remote, fp);
+            if (fclose(fp) != 0) unlink(file);
+        }
+        fp = fopen(file, "r");
+    }
+    int owned = fp && fgets(owner, sizeof(owner), fp) && strcmp(owner, remote) == 0;
+    if (fp) fclose(fp);
+    if (owned) return dir;
+    free(dir);
+    return NULL;
+}
+
+// Parses a cache entry name, "<version>.<crc>"
+static int cache_entry(const char *name, int *version, uint32_t *crc) {
+    int used = 0;
+    return sscanf(name, "%d.%8x%n", version, crc, &used) == 2 && name[used] == '\0' && *version > 0;
+}
+
+/*
+ * cache_offer - Formats " CACHED=<version>:<crc>,..." for the cached
+ * versions of remote (only version, if it is > 0), newest first, or an
+ * empty string.
+ */
+
+static void cache_offer(struct fsc_client *cl, const char *remote, int version, char *out, size_t cap) {
+    int versions[FSC_CACHE_OFFER];
+    uint32_t crcs[FSC_CACHE_OFFER];
+    int count = 0;
+    out[0] = '\0';
+    char *dir = cache_path_dir(cl, remote, 0);
+    DIR *d = dir ? opendir(dir) : NULL;
+    struct dirent *entry;
+    while (d && (entry = readdir(d)) != NULL) {
+        int v;
+        uint32_t crc;
+        if (!cache_entry(entry->d_name, &v, &crc) || (version > 0 && v != version)) continue;
+        // Keep the newest FSC_CACHE_OFFER, sorted
+        int i = count < FSC_CACHE_OFFER ? count++ : FSC_CACHE_OFFER;
+        for (; i > 0 && versions[i - 1] < v; i--) {
+            if (i < FSC_CACHE_OFFER) {
+                versions[i] = versions[i - 1];
+                crcs[i] = crcs[i - 1];
+            }
+        }
+        if (i < FSC_CACHE_OFFER) {
+            versions[i] = v;
+            crcs[i] = crc;
+        }
+    }
+    if (d) closedir(d);
+    free(dir);
+
+    size_t len = 0;
+    for (int i = 0; i < count && len < cap; i++) {
+        len += snprintf(out + len, cap - len, "%s%d:%08x", i ? "," : " CACHED=", versions[i], crcs[i]);
+    }
+    if (len >= cap) out[0] = '\0';
+}
+
+/*
+ * cache_serve - Delivers the cached copy of version to a GET the server
+ * answered with "not modified". Returns -1 if the entry is gone.
+ */
+
+static int cache_serve(struct fsc_client *cl, struct fsc_op *op, int version, uint32_t crc) {
+    char *dir = cache_path_dir(cl, op->remote, 0);
+    char file[PATH_MAX];
+    snprintf(file, sizeof(file), "%s/%d.%08x", dir ? dir : "", version, crc);
+    free(dir);
+    int fd = open(file, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || (op->fd < 0 && !(op->res.data = malloc(st.st_size ? st.st_size : 1)))) {
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    char buf[FSC_CHUNK];
+    long done = 0;
+    while (done < st.st_size && op->res.status == FSC_OK) {
+        ssize_t n = read(fd, op->fd < 0 ? op->res.data + done : buf, op->fd < 0 ? st.st_size - done : sizeof(buf));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        for (ssize_t off = 0; op->fd >= 0 && off < n;) {
+            ssize_t w = write(op->fd, buf + off, n - off);
+            if (w < 0 && errno == EINTR) continue;
+            if (w < 0) {
+                op->res.status = FSC_ERR_IO;
+                snprintf(op->message, sizeof(op->message), "local write failed: %s", strerror(errno));
+                break;
+            }
+            off += w;
+        }
+        done += n;
+    }
+    futimens(fd, NULL);  // recently used
+    close(fd);
+    if (done < st.st_size && op->res.status == FSC_OK) {
+        free(op->res.data);
+        op->res.data = NULL;
+        return -1;
+    }
+    op->res.size = done;
+    op->res.version = version;
+    op->res.cached = 1;
+    return 0;
+}
+
+// Starts a cache entry for the GET body about to arrive
+static void cache_begin(struct fsc_client *cl, struct fsc_op *op, int version, uint32_t crc) {
+    char *dir = cache_path_dir(cl, op->remote, 1);
+    if (!dir) return;
+    size_t cap = strlen(dir) + 32;
+    op->cache_temp = malloc(cap);
+    op->cache_final = malloc(cap);
+    if (op->cache_temp && op->cache_final) {
+        snprintf(op->cache_temp, cap, "%s/.fetchXXXXXX", dir);
+        snprintf(op->cache_final, cap, "%s/%d.%08x", dir, version, crc);
+        op->cache_fd = mkstemp(op->cache_temp);
+    }
+    free(dir);
+}
+
+static void cache_write(struct fsc_op *op, const char *data, size_t len) {
+    while (op->cache_fd >= 0 && len > 0) {
+        ssize_t n = write(op->cache_fd, data, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            // Not worth failing the GET over
+            close(op->cache_fd);
+            op->cache_fd = -1;
+            unlink(op->cache_temp);
+            return;
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+struct cache_file {
+    char *path;
+    time_t used;
+    long size;
+};
+
+static int compare_used(const void *a, const void *b) {
+    const struct cache_file *x = a, *y = b;
+    return (x->used > y->used) - (x->used < y->used);
+}
+
+// Drops the least recently used entries until the cache fits cache_max
+static void cache_trim(struct fsc_client *cl) {
+    struct cache_file *files = NULL;
+    size_t count = 0, cap = 0;
+    long total = 0;
+    DIR *top = opendir(cl->cache_dir);
+    struct dirent *sub, *entry;
+    while (top && (sub = readdir(top)) != NULL) {
+        char dir[PATH_MAX];
+        if (sub->d_name[0] == '.') continue;
+        snprintf(dir, sizeof(dir), "%s/%s", cl->cache_dir, sub->d_name);
+        DIR *d = opendir(dir);
+        while (d && (entry = readdir(d)) != NULL) {
+            int version;
+            uint32_t crc;
+            struct stat st;
+            char path[PATH_MAX + 256];
+            if (!cache_entry(entry->d_name, &version, &crc)) continue;
+            snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+            if (stat(path, &st) != 0) continue;
+            if (count == cap) {
+                cap = cap ? cap * 2 : 64;
+                struct cache_file *grown = realloc(files, cap * sizeof(*grown));
+                if (!grown) break;
+                files = grown;
+            }
+            if (!(files[count].path = strdup(path))) break;
+            files[count].used = st.st_mtime;
+            files[count].size = st.st_size;
+            total += st.st_size;
+            count++;
+        }
+        if (d) closedir(d);
+    }
+    if (top) closedir(top);
+
+    if (total > cl->cache_max) qsort(files, count, sizeof(*files), compare_used);
+    for (size_t i = 0; i < count; i++) {
+        if (total > cl->cache_max && unlink(files[i].path) == 0) total -= files[i].size;
+        free(files[i].path);
+    }
+    free(files);
+}
+
+// Publishes (ok) or discards the entry a GET was filling
+static void cache_finish(struct fsc_client *cl, struct fsc_op *op, int ok) {
+    int failed = close(op->cache_fd) != 0;
+    op->cache_fd = -1;
+    if (ok && op->done == op->size && !failed && rename(op->cache_temp, op->cache_final) == 0) {
+        cache_trim(cl);
+    } else {
+        unlink(op->cache_temp);
+    }
+}
+
+// === Connections === //
+
+static uint64_t event_tag(const struct fsc_client *cl, const struct fsc_conn *c) {
+    return (uint64_t)c->gen << 32 | (uint32_t)(c - cl->conns);
+}
+
+static void set_events(struct fsc_client *cl, struct fsc_conn *c) {
+    const struct fsc_op *op = c->op;
+    uint32_t want = EPOLLIN;
+    if (c->connecting || c->out_off < c->out_len || (op && op->type == FSC_WRITE && !op->trailer_sent)) {
+        want |= EPOLLOUT;
+    }
+    if (want != c->events) {
+        struct epoll_event ev = { .events = want, .data.u64 = event_tag(cl, c) };
+        epoll_ctl(cl->epfd, EPOLL_CTL_MOD, c->sock, &ev);
+        c->events = want;
+    }
+}
+
+static int out_reserve(struct fsc_conn *c, size_t extra) {
+    if (c->out_off == c->out_len) c->out_off = c->out_len = 0;
+    if (c->out_len + extra <= c->out_cap) return 0;
+    size_t cap = c->out_cap ? c->out_cap : 4096;
+    while (cap < c->out_len + extra) cap *= 2;
+    char *grown = realloc(c->out, cap);
+    if (!grown) return -1;
+    c->out = grown;
+    c->out_cap = cap;
+    return 0;
+}
+
+static int out_append(struct fsc_conn *c, const char *data, size_t len) {
+    if (out_reserve(c, len) < 0) return -1;
+    memcpy(c->out + c->out_len, data, len);
+    c->out_len += len;
+    return 0;
+}
+
+/*
+ * drop_conn - Closes a connection, failing the operation it was running.
+ * A server may close a kept-alive connection just as a request goes out
+ * on it (when it hands over to a new server, say), never starting on it;
+ * a request with no payload and no reply yet is queued again once.
+ */
+
+static void drop_conn(struct fsc_client *cl, struct fsc_conn *c, int status) {
+    struct fsc_op *op = c->op;
+    int resend = op && status == FSC_ERR_IO && c->served && !op->resent && op->type != FSC_WRITE &&
+                 (c->phase == PH_REPLY || c->phase == PH_LIST) && c->in_len == 0 && op->res.nlines == 0 &&
+                 !op->reported;
+    close(c->sock);
+    c->sock = -1;
+    c->op = NULL;
+    c->phase = PH_IDLE;
+    c->out_off = c->out_len = 0;
+    c->in_off = c->in_len = 0;
+    if (resend) {
+        op->resent = 1;
+        op->next = cl->queue_head;
+        cl->queue_head = op;
+        if (!cl->queue_tail) cl->queue_tail = op;
+    } else if (op) {
+        finish_op(cl, op, status);
+    }
+}
+
+static int open_conn(struct fsc_client *cl, struct fsc_conn *c) {
+    int sock = socket(cl->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sock < 0) return -1;
+    int one = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(sock, (struct sockaddr *)&cl->addr, cl->addrlen) < 0 && errno != EINPROGRESS) {
+        close(sock);
+        return -1;
+    }
+    c->gen++;
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT, .data.u64 = event_tag(cl, c) };
+    if (epoll_ctl(cl->epfd, EPOLL_CTL_ADD, sock, &ev) < 0) {
+        close(sock);
+        return -1;
+    }
+    c->sock = sock;
+    c->connecting = 1;
+    c->served = 0;
+    c->events = ev.events;
+    c->phase = PH_IDLE;
+    c->out_off = c->out_len = 0;
+    c->in_off = c->in_len = 0;
+    return 0;
+}
+
+static void complete(struct fsc_client *cl, struct fsc_conn *c, int status) {
+    struct fsc_op *op = c->op;
+    c->op = NULL;
+    c->served = 1;
+    c->phase = PH_IDLE;
+    finish_op(cl, op, status);
+}
+
+static void start_op(struct fsc_client *cl, struct fsc_conn *c, struct fsc_op *op) {
+    c->op = op;
+    c->phase = op->type == FSC_WRITE || op->type == FSC_GET || op->type == FSC_RM ? PH_REPLY : PH_LIST;
+    if (out_append(c, op->request, strlen(op->request)) < 0) {
+        complete(cl, c, FSC_ERR_NOMEM);
+        return;
+    }
+    set_events(cl, c);
+}
+
+/*
+ * dispatch - Hands queued operations to idle connections, opening new
+ * ones while the pool has room.
+ */
+
+static void dispatch(struct fsc_client *cl) {
+    while (cl->queue_head) {
+        struct fsc_conn *idle = NULL, *spare = NULL;
+        for (int i = 0; i < cl->max_conns && !idle; i++) {
+            struct fsc_conn *c = &cl->conns[i];
+            if (c->sock >= 0 && !c->op) idle = c;
+            else if (c->sock < 0 && !spare) spare = c;
+        }
+        if (!idle && !spare) return;
+
+        struct fsc_op *op = cl->queue_head;
+        cl->queue_head = op->next;
+        if (!cl->queue_head) cl->queue_tail = NULL;
+        op->next = NULL;
+
+        if (!idle) {
+            if (open_conn(cl, spare) < 0) {
+                snprintf(op->message, sizeof(op->message), "connect: %s", strerror(errno));
+                finish_op(cl, op, FSC_ERR_IO);
+                continue;
+            }
+            idle = spare;
+        }
+        start_op(cl, idle, op);
+    }
+}
+
+// === Cipher Workers === //
+
+// Applies the version's cipher to one chunk, on a worker thread
+static int cipher_chunk(void *arg, char *data, size_t len, long offset) {
+    struct fsc_op *op = arg;
+    if (op->has_nonce) chacha20_xor(op->key, op->nonce, offset, data, len);
+    else xor_cipher(data, len, LEGACY_XOR_KEY, offset);
+    return 0;
+}
+
+// Stores one decrypted GET chunk, in order, on the pipe's writer thread
+static int store_chunk(void *arg, char *data, size_t len, long offset) {
+    struct fsc_op *op = arg;
+    cache_write(op, data, len);
+    if (op->fd < 0) {
+        memcpy(op->res.data + offset, data, len);
+        return 0;
+    }
+    for (size_t off = 0; off < len;) {
+        ssize_t n = write(op->fd, data + off, len - off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            snprintf(op->message, sizeof(op->message), "local write failed: %s", strerror(errno));
+            return -1;
+        }
+        off += n;
+    }
+    return 0;
+}
+
+/*
+ * start_pipe - Puts a transfer of FSC_PIPE_MIN bytes or more on cipher
+ * workers, if the client has them. Without a pipe (or when one cannot be
+ * started) the cipher runs inline.
+ */
+
+static void start_pipe(struct fsc_client *cl, struct fsc_op *op) {
+    if (cl->cipher_threads < 2 || op->size < FSC_PIPE_MIN) return;
+    op->key = cl->key;
+    op->pipe = cpipe_start(cl->cipher_threads, FSC_PIPE_CHUNK, 0, cipher_chunk, op, NULL);
+    if (!op->pipe) return;
+    int rc = op->type == FSC_WRITE ? cpipe_start_reader(op->pipe, op->fd, op->size)
+                                   : cpipe_start_writer(op->pipe, store_chunk, op);
+    if (rc < 0) {
+        cpipe_finish(op->pipe, 1);
+        op->pipe = NULL;
+    }
+}
+
+// === Output === //
+
+/*
+ * refill - Queues the next piece of a WRITE: an encrypted payload chunk,
+ * or the CRC trailer once the payload is out. Returns 1 if something was
+ * queued, 0 if there is nothing left and -1 on error.
+ */
+
+static int refill(struct fsc_client *cl, struct fsc_conn *c) {
+    struct fsc_op *op = c->op;
+    if (!op || op->type != FSC_WRITE || op->trailer_sent) return 0;
+
+    if (op->done == 0 && !op->data && !op->pipe) start_pipe(cl, op);
+    if (op->pipe && op->done < op->size) {
+        size_t n;
+        char *chunk = cpipe_take(op->pipe, &n);
+        if (!chunk || out_append(c, chunk, n) < 0) {
+            snprintf(op->message, sizeof(op->message), "local read failed");
+            return -1;
+        }
+        cpipe_release(op->pipe);
+        op->crc = crc32c_update(op->crc, c->out + c->out_len - n, n);
+        op->done += n;
+        if (op->done == op->size) {
+            cpipe_finish(op->pipe, 0);
+            op->pipe = NULL;
+        }
+        return 1;
+    }
+    if (op->done < op->size) {
+        size_t want = op->size - op->done < FSC_CHUNK ? (size_t)(op->size - op->done) : FSC_CHUNK;
+        if (out_reserve(c, want) < 0) return -1;
+        char *chunk = c->out + c->out_len;
+        ssize_t n;
+        if (op->data) {
+            memcpy(chunk, op->data + op->done, want);
+            n = want;
+        } else {
+            do {
+                n = read(op->fd, chunk, want);
+            } while (n < 0 && errno == EINTR);
+        }
+        if (n <= 0) {
+            // The server expects exactly size bytes; the stream is lost
+            snprintf(op->message, sizeof(op->message), "local read failed");
+            return -1;
+        }
+        if (op->has_nonce) {
+            chacha20_xor(cl->key, op->nonce, op->done, chunk, n);
+        } else {
+            xor_cipher(chunk, n, LEGACY_XOR_KEY, op->done);
+        }
+        op->crc = crc32c_update(op->crc, chunk, n);
+        op->done += n;
+        c->out_len += n;
+        return 1;
+    }
+
+    char trailer[32];
+    int len = snprintf(trailer, sizeof(trailer), "CRC %08x\n", op->crc);
+    if (out_append(c, trailer, len) < 0) return -1;
+    op->trailer_sent = 1;
+    return 1;
+}
+
+static void on_writable(struct fsc_client *cl, struct fsc_conn *c) {
+    if (c->connecting) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(c->sock, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err) {
+            if (c->op) snprintf(c->op->message, sizeof(c->op->message), "connect: %s", strerror(err));
+            drop_conn(cl, c, FSC_ERR_IO);
+            return;
+        }
+        c->connecting = 0;
+    }
+
+    for (;;) {
+        if (c->out_off == c->out_len) {
+            int more = refill(cl, c);
+            if (more < 0) {
+                drop_conn(cl, c, FSC_ERR_IO);
+                return;
+            }
+            if (more == 0) break;
+        }
+        ssize_t n = send(c->sock, c->out + c->out_off, c->out_len - c->out_off, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (n < 0) {
+            drop_conn(cl, c, FSC_ERR_IO);
+            return;
+        }
+        c->out_off += n;
+    }
+
+    // A WRITE finishes once its reply is in and the whole payload is out;
+    // the server answers early errors only after skipping the payload.
+    struct fsc_op *op = c->op;
+    if (op && op->type == FSC_WRITE && op->replied && op->trailer_sent && c->out_off == c->out_len) {
+        complete(cl, c, op->res.status);
+    }
+    if (c->sock >= 0) set_events(cl, c);
+}
+
+// === Input === //
+
+static int push_line(struct fsc_op *op, const char *line) {
+    if (op->res.nlines == op->lines_cap) {
+        size_t cap = op->lines_cap ? op->lines_cap * 2 : 64;
+        char **grown = realloc(op->res.lines, cap * sizeof(*grown));
+        if (!grown) return -1;
+        op->res.lines = grown;
+        op->lines_cap = cap;
+    }
+    char *copy = strdup(line);
+    if (!copy) return -1;
+    op->res.lines[op->res.nlines++] = copy;
+    return 0;
+}
+
+static void server_error(struct fsc_op *op, const char *line) {
+    op->res.status = FSC_ERR_SERVER;
+    snprintf(op->message, sizeof(op->message), "%s", line);
+}
+
+/*
+ * get_size - Handles GET's "SIZE <n> [NONCE=<hex>] [VERSION=<v>]
+ * [CRC=<crc>]" line and acknowledges it, or serves a "NOT_MODIFIED <v>
+ * <crc>" reply from the cache. A version we cannot decrypt is still
+ * received (and dropped) so the connection stays in step with the server.
+ */
+
+static int get_size(struct fsc_client *cl, struct fsc_conn *c, const char *line) {
+    struct fsc_op *op = c->op;
+    long size;
+    int used = 0, version;
+    unsigned int crc;
+    if (sscanf(line, "NOT_MODIFIED %d %x", &version, &crc) == 2) {
+        if (cache_serve(cl, op, version, crc) == 0) {
+            complete(cl, c, op->res.status);
+        } else {
+            // The entry went away meanwhile: ask again, offering nothing
+            char *offer = strstr(op->request, " CACHED=");
+            if (offer) strcpy(offer, "\n");
+            start_op(cl, c, op);
+        }
+        return 0;
+    }
+    if (sscanf(line, "SIZE %ld%n", &size, &used) != 1 || size <= 0) {
+        complete(cl, c, FSC_ERR_NOT_FOUND);
+        return 0;
+    }
+    int has_crc = 0;
+    for (const char *p = line + used; *p; p += strcspn(p, " ")) {
+        char hex[32];
+        p += strspn(p, " ");
+        if (sscanf(p, "NONCE=%31s", hex) == 1) {
+            if (hex_decode(hex, op->nonce, CHACHA20_NONCE_SIZE) < 0 || !cl->has_key) {
+                op->res.status = FSC_ERR_KEY;
+            } else {
+                op->has_nonce = 1;
+            }
+        } else if (sscanf(p, "VERSION=%d", &op->res.version) != 1 && sscanf(p, "CRC=%x", &crc) == 1) {
+            has_crc = 1;
+        }
+    }
+    if (op->remote && has_crc && op->res.version > 0 && op->res.status == FSC_OK) {
+        cache_begin(cl, op, op->res.version, crc);
+    }
+    op->size = size;
+    if (op->fd < 0 && op->res.status == FSC_OK) {
+        op->res.data = malloc(size);
+        if (!op->res.data) op->res.status = FSC_ERR_NOMEM;
+    }
+    // Legacy XOR versions arrive decrypted; there is nothing to spread out
+    if (op->has_nonce && op->res.status == FSC_OK) start_pipe(cl, op);
+    c->phase = PH_BODY;
+    if (out_append(c, "READY\n", 6) < 0) return -1;
+    set_events(cl, c);
+    return 0;
+}
+
+/*
+ * report - Runs a progress callback (more set) for an operation that goes
+ * on, then clears what it reported.
+ */
+
+static void report(struct fsc_client *cl, struct fsc_op *op) {
+    op->res.more = 1;
+    op->res.message = op->message[0] ? op->message : fsc_strerror(op->res.status);
+    op->reported = 1;
+    op->cb(cl, &op->res, op->arg);
+    op->res = (struct fsc_result){ 0 };
+    op->message[0] = '\0';
+}
+
+static void report_line(struct fsc_client *cl, struct fsc_op *op, const char *line) {
+    char *lines[1] = { (char *)line };
+    op->res.lines = lines;
+    op->res.nlines = 1;
+    report(cl, op);
+}
+
+// === MGET Entries === //
+
+/*
+ * safe_relative - Rejects entry paths that would land outside the target
+ * directory (absolute, or with "." or ".." components).
+ */
+
+static int safe_relative(const char *path) {
+    if (path[0] == '\0' || path[0] == '/') return 0;
+    for (const char *p = path; *p;) {
+        size_t len = strcspn(p, "/");
+        if (len == 0 || (len == 1 && p[0] == '.') || (len == 2 && p[0] == '.' && p[1] == '.')) return 0;
+        p += len;
+        if (*p == '/') p++;
+    }
+    return 1;
+}
+
+// Opens "<local>.part" for the entry announced last, or sets its status
+static void mget_open(struct fsc_op *op) {
+    const char *rel = strlen(op->entry) > op->strip ? op->entry + op->strip : op->entry;
+    char temp[PATH_MAX];
+    if (!safe_relative(rel)) {
+        op->res.status = FSC_ERR_IO;
+        snprintf(op->message, sizeof(op->message), "refusing to extract outside '%s'", op->dir);
+        return;
+    }
+    if (snprintf(temp, sizeof(temp), "%s/%s.part", op->dir, rel) >= (int)sizeof(temp)) {
+        op->res.status = FSC_ERR_IO;
+        snprintf(op->message, sizeof(op->message), "local path too long");
+        return;
+    }
+    if (!(op->local = strndup(temp, strlen(temp) - 5))) {
+        op->res.status = FSC_ERR_NOMEM;
+        return;
+    }
+    *strrchr(temp, '/') = '\0';
+    make_dirs(temp, 0755);
+    snprintf(temp, sizeof(temp), "%s.part", op->local);
+    op->fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (op->fd < 0) {
+        op->res.status = FSC_ERR_IO;
+        snprintf(op->message, sizeof(op->message), "%s: %s", op->local, strerror(errno));
+    }
+}
+
+// Renames the entry's file into place if it arrived intact, or removes it
+static void mget_close(struct fsc_op *op) {
+    char temp[PATH_MAX];
+    snprintf(temp, sizeof(temp), "%s.part", op->local);
+    if (close(op->fd) != 0 && op->res.status == FSC_OK) {
+        op->res.status = FSC_ERR_IO;
+        snprintf(op->message, sizeof(op->message), "%s: %s", op->local, strerror(errno));
+    }
+    op->fd = -1;
+    if (op->res.status == FSC_OK && rename(temp, op->local) == 0) {
+        struct timespec times[2] = { { op->mtime, 0 }, { op->mtime, 0 } };
+        utimensat(AT_FDCWD, op->local, times, 0);
+    } else {
+        if (op->res.status == FSC_OK) {
+            op->res.status = FSC_ERR_IO;
+            snprintf(op->message, sizeof(op->message), "%s: %s", op->local, strerror(errno));
+        }
+        unlink(temp);
+    }
+}
+
+/*
+ * mget_line - Handles an MGET line between entries: "FILE <path> <version>
+ * <size> <mtime> <nonce|->" starts one, "SKIP <path> <reason>" reports one
+ * the server could not send. An entry that cannot be stored is still
+ * received (and dropped) so the stream stays in step.
+ */
+
+static int mget_line(struct fsc_client *cl, struct fsc_conn *c, const char *line) {
+    struct fsc_op *op = c->op;
+    char path[FSC_PATH_MAX + 1], reason[64], nonce[32];
+    long size, mtime;
+    int version;
+    if (sscanf(line, "SKIP %1023s %63s", path, reason) == 2) {
+        server_error(op, reason);
+        op->res.path = path;
+        report(cl, op);
+        return 0;
+    }
+    if (sscanf(line, "FILE %1023s %d %ld %ld %31s", path, &version, &size, &mtime, nonce) != 5 || size < 0) {
+        return -1;
+    }
+    free(op->entry);
+    free(op->local);
+    op->local = NULL;
+    if (!(op->entry = strdup(path))) op->res.status = FSC_ERR_NOMEM;
+    op->res.version = version;
+    op->size = size;
+    op->done = 0;
+    op->crc = 0;
+    op->mtime = mtime;
+    op->has_nonce = 0;
+    if (strcmp(nonce, "-") != 0) {
+        if (hex_decode(nonce, op->nonce, CHACHA20_NONCE_SIZE) < 0) return -1;
+        if (!cl->has_key) op->res.status = FSC_ERR_KEY;
+        op->has_nonce = 1;
+    }
+    if (op->res.status == FSC_OK) mget_open(op);
+    c->phase = size > 0 ? PH_BODY : PH_TRAILER;
+    return 0;
+}
+
+// Handles an entry's "CRC <hex>", or the "ERR <reason>" sent in its place
+static int mget_trailer(struct fsc_client *cl, struct fsc_conn *c, const char *line) {
+    struct fsc_op *op = c->op;
+    unsigned int expected;
+    if (strncmp(line, "ERR ", 4) == 0) {
+        if (op->res.status == FSC_OK) server_error(op, line + 4);
+    } else if (sscanf(line, "CRC %x", &expected) != 1) {
+        return -1;
+    } else if (op->res.status == FSC_OK && expected != op->crc) {
+        op->res.status = FSC_ERR_CHECKSUM;
+    }
+    if (op->fd >= 0) mget_close(op);
+    op->res.path = op->entry;
+    op->res.size = op->size;
+    report(cl, op);
+    c->phase = PH_LIST;
+    return 0;
+}
+
+static int handle_line(struct fsc_client *cl, struct fsc_conn *c, const char *line) {
+    struct fsc_op *op = c->op;
+    if (!op) return -1;  // nothing was asked
+
+    if (c->phase == PH_LIST) {
+        unsigned long id;
+        size_t paths;
+        if (strcmp(line, "__END__") == 0) {
+            complete(cl, c, FSC_OK);
+        } else if (strncmp(line, "ERR ", 4) == 0 && op->res.status == FSC_OK) {
+            server_error(op, line);
+            // A refused WATCH sends no "__END__"
+            if (op->type == FSC_WATCH) complete(cl, c, op->res.status);
+        } else if (op->type == FSC_MGET) {
+            return mget_line(cl, c, line);
+        } else if ((op->type == FSC_RM_BULK || op->type == FSC_WATCH) && op->res.status == FSC_OK) {
+            report_line(cl, op, line);
+        } else if (op->type == FSC_SNAPSHOT && sscanf(line, "SNAPSHOT %lu %zu", &id, &paths) == 2) {
+            op->res.snapshot = id;
+            op->res.size = paths;
+        } else if (op->type == FSC_SNAPSHOT && strcmp(line, "OK") == 0) {
+            // A snapshot was dropped
+        } else if (op->res.status == FSC_OK && push_line(op, line) < 0) {
+            op->res.status = FSC_ERR_NOMEM;
+        }
+        return 0;
+    }
+
+    if (c->phase == PH_TRAILER && op->type == FSC_MGET) return mget_trailer(cl, c, line);
+    if (c->phase == PH_TRAILER) {
+        unsigned int expected;
+        if (sscanf(line, "CRC %x", &expected) != 1) return -1;
+        complete(cl, c, expected == op->crc ? FSC_OK : FSC_ERR_CHECKSUM);
+        return 0;
+    }
+
+    if (c->phase != PH_REPLY) return -1;
+    switch (op->type) {
+    case FSC_WRITE:
+        if (sscanf(line, "OK %d", &op->res.version) != 1) server_error(op, line);
+        op->replied = 1;
+        if (op->trailer_sent && c->out_off == c->out_len) complete(cl, c, op->res.status);
+        return 0;
+    case FSC_RM:
+        if (strcmp(line, "File deleted.") != 0) server_error(op, line);
+        complete(cl, c, op->res.status);
+        return 0;
+    case FSC_GET:
+        return get_size(cl, c, line);
+    default:
+        return -1;
+    }
+}
+
+/*
+ * take_body - Consumes GET payload bytes from the input buffer. The
+ * checksum covers the bytes as sent; ChaCha20 versions are decrypted here,
+ * or collected into chunks for the cipher workers (legacy XOR versions
+ * arrive already decrypted).
+ */
+
+static void take_body(struct fsc_client *cl, struct fsc_conn *c) {
+    struct fsc_op *op = c->op;
+    size_t avail = c->in_len - c->in_off;
+    size_t take = (size_t)(op->size - op->done) < avail ? (size_t)(op->size - op->done) : avail;
+    char *chunk = c->in + c->in_off;
+
+    // A pipe chunk takes no more than its free space; the rest is left for
+    // the next call, so it must not be checksummed yet
+    if (op->pipe && take > FSC_PIPE_CHUNK - op->pipe_len) take = FSC_PIPE_CHUNK - op->pipe_len;
+    op->crc = crc32c_update(op->crc, chunk, take);
+    if (op->pipe) {
+        if (op->pipe_len == 0 && !(op->pipe_chunk = cpipe_fill(op->pipe))) {
+            // The writer failed; keep reading so the connection stays in step
+            op->res.status = FSC_ERR_IO;
+            cpipe_finish(op->pipe, 1);
+            op->pipe = NULL;
+        } else {
+            memcpy(op->pipe_chunk + op->pipe_len, chunk, take);
+            op->pipe_len += take;
+            if (op->pipe_len == FSC_PIPE_CHUNK || op->done + (long)take == op->size) {
+                cpipe_submit(op->pipe, op->pipe_len);
+                op->pipe_len = 0;
+            }
+        }
+    } else if (op->res.status == FSC_OK) {
+        if (op->has_nonce) chacha20_xor(cl->key, op->nonce, op->done, chunk, take);
+        cache_write(op, chunk, take);
+        if (op->fd < 0) {
+            memcpy(op->res.data + op->done, chunk, take);
+        } else {
+            for (size_t off = 0; off < take;) {
+                ssize_t n = write(op->fd, chunk + off, take - off);
+                if (n < 0 && errno == EINTR) continue;
+                if (n < 0) {
+                    op->res.status = FSC_ERR_IO;
+                    snprintf(op->message, sizeof(op->message), "local write failed: %s", strerror(errno));
+                    break;
+                }
+                off += n;
+            }
+        }
+    }
+    op->done += take;
+    op->res.size = op->done;
+    c->in_off += take;
+    if (op->done == op->size) c->phase = PH_TRAILER;
+}
+
+static int parse_input(struct fsc_client *cl, struct fsc_conn *c) {
+    while (c->sock >= 0 && c->in_off < c->in_len) {
+        if (c->phase == PH_BODY) {
+            take_body(cl, c);
+            continue;
+        }
+        char *start = c->in + c->in_off;
+        char *nl = memchr(start, '\n', c->in_len - c->in_off);
+        if (!nl) break;
+        *nl = '\0';
+        c->in_off += nl - start + 1;
+        if (handle_line(cl, c, start) < 0) return -1;
+    }
+    return 0;
+}
+
+static void on_readable(struct fsc_client *cl, struct fsc_conn *c) {
+    if (c->connecting) return;  // errors while connecting surface as EPOLLOUT
+    for (;;) {
+        if (c->in_off > 0) {
+            memmove(c->in, c->in + c->in_off, c->in_len - c->in_off);
+            c->in_len -= c->in_off;
+            c->in_off = 0;
+        }
+        if (c->in_len == sizeof(c->in)) {
+            // A single reply line longer than the buffer: not our protocol
+            drop_conn(cl, c, FSC_ERR_IO);
+            return;
+        }
+        ssize_t n = recv(c->sock, c->in + c->in_len, sizeof(c->in) - c->in_len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+        if (n <= 0) {
+            // The server went away (an idle connection just leaves the pool)
+            drop_conn(cl, c, FSC_ERR_IO);
+            return;
+        }
+        c->in_len += n;
+        if (parse_input(cl, c) < 0) {
+            drop_conn(cl, c, FSC_ERR_IO);
+            return;
+        }
+        if (c->sock < 0) return;
+    }
+}
+
+// === Public API === //
+
+struct fsc_client *fsc_open(const struct fsc_options *opts) {
+    struct fsc_options defaults = { 0 };
+    if (!opts) opts = &defaults;
+
+    struct fsc_client *cl = calloc(1, sizeof(*cl));
+    if (!cl) return NULL;
+    cl->max_conns = opts->max_conns > 0 ? opts->max_conns : FSC_DEFAULT_CONNS;
+    cl->cipher = opts->cipher;
+    if (opts->key) {
+        memcpy(cl->key, opts->key, CHACHA20_KEY_SIZE);
+        cl->has_key = 1;
+    }
+    cl->cipher_threads = opts->cipher_threads > 1 ? cpipe_workers(opts->cipher_threads) : 0;
+    if (cl->cipher == CIPHER_CHACHA20 && !cl->has_key) {
+        free(cl);
+        errno = EINVAL;
+        return NULL;
+    }
+    char port[16];
+    snprintf(port, sizeof(port), "%d", opts->port > 0 ? opts->port : FSC_DEFAULT_PORT);
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM }, *ai;
+    if (getaddrinfo(opts->host ? opts->host : FSC_DEFAULT_HOST, port, &hints, &ai) != 0) {
+        free(cl);
+        errno = EHOSTUNREACH;
+        return NULL;
+    }
+    memcpy(&cl->addr, ai->ai_addr, ai->ai_addrlen);
+    cl->addrlen = ai->ai_addrlen;
+    freeaddrinfo(ai);
+
+    cl->cache_max = opts->cache_max > 0 ? opts->cache_max : FSC_CACHE_MAX;
+    cl->cache_dir = opts->cache_dir ? strdup(opts->cache_dir) : NULL;
+    cl->conns = calloc(cl->max_conns, sizeof(*cl->conns));
+    cl->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (!cl->conns || cl->epfd < 0 || (opts->cache_dir && !cl->cache_dir)) {
+        if (cl->epfd >= 0) close(cl->epfd);
+        free(cl->cache_dir);
+        free(cl->conns);
+        free(cl);
+        return NULL;
+    }
+    for (int i = 0; i < cl->max_conns; i++) cl->conns[i].sock = -1;
+    return cl;
+}
+
+/*
+ * fsc_close - Closes every connection. Operations still queued or in
+ * flight get their callback with FSC_ERR_CANCELLED.
+ */
+
+void fsc_close(struct fsc_client *cl) {
+    if (!cl) return;
+    cl->closing = 1;
+    for (int i = 0; i < cl->max_conns; i++) {
+        struct fsc_conn *c = &cl->conns[i];
+        if (c->sock >= 0) drop_conn(cl, c, FSC_ERR_CANCELLED);
+        free(c->out);
+    }
+    while (cl->queue_head) {
+        struct fsc_op *op = cl->queue_head;
+        cl->queue_head = op->next;
+        finish_op(cl, op, FSC_ERR_CANCELLED);
+    }
+    close(cl->epfd);
+    free(cl->conns);
+    free(cl->cache_dir);
+    free(cl);
+}
+
+static int prepare_write(struct fsc_client *cl, struct fsc_op *op, size_t size) {
+    op->size = size;
+    if (cl->cipher == CIPHER_CHACHA20) {
+        if (getrandom(op->nonce, sizeof(op->nonce), 0) != (ssize_t)sizeof(op->nonce)) return -1;
+        op->has_nonce = 1;
+    }
+    return 0;
+}
+
+static int submit_write(struct fsc_client *cl, struct fsc_op *op, const char *remote_path, time_t mtime) {
+    char nonce_opt[2 * CHACHA20_NONCE_SIZE + 8] = "";
+    if (op->has_nonce) {
+        strcpy(nonce_opt, " NONCE=");
+        hex_encode(op->nonce, CHACHA20_NONCE_SIZE, nonce_opt + 7);
+    }
+    return submit(cl, op, "WRITE %s %ld %ld CRC32C%s\n", remote_path, op->size, (long)mtime, nonce_opt);
+}
+
+int fsc_write(struct fsc_client *cl, const char *remote_path, const void *data, size_t size,
+              time_t mtime, fsc_callback cb, void *arg) {
+    if (!valid_remote_path(remote_path)) {
+        errno = EINVAL;
+        return -1;
+    }
+    struct fsc_op *op = new_op(cl, FSC_WRITE, cb, arg);
+    if (!op) return -1;
+    // Copied so the caller may reuse its buffer right away
+    op->data = malloc(size ? size : 1);
+    if (!op->data || prepare_write(cl, op, size) < 0) {
+        free_op(op);
+        errno = ENOMEM;
+        return -1;
+    }
+    memcpy(op->data, data, size);
+    return submit_write(cl, op, remote_path, mtime);
+}
+
+/*
+ * fsc_write_fd - Like fsc_write, but streams size bytes from fd (read
+ * sequentially as the connection drains). fd must stay open until the
+ * callback runs.
+ */
+
+int fsc_write_fd(struct fsc_client *cl, const char *remote_path, int fd, size_t size,
+                 time_t mtime, fsc_callback cb, void *arg) {
+    if (!valid_remote_path(remote_path) || fd < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    struct fsc_op *op = new_op(cl, FSC_WRITE, cb, arg);
+    if (!op) return -1;
+    op->fd = fd;
+    if (prepare_write(cl, op, size) < 0) {
+        free_op(op);
+        return -1;
+    }
+    return submit_write(cl, op, remote_path, mtime);
+}
+
+static int submit_get(struct fsc_client *cl, const char *remote_path, int version, unsigned long snapshot,
+                      int fd, fsc_callback cb, void *arg) {
+    if (!valid_remote_path(remote_path) || strchr(remote_path, ':')) {
+        errno = EINVAL;
+        return -1;
+    }
+    struct fsc_op *op = new_op(cl, FSC_GET, cb, arg);
+    if (!op) return -1;
+    op->fd = fd;
+    char offer[FSC_CACHE_OFFER * 20 + 16] = "";
+    if (cl->cache_dir) {
+        if (!(op->remote = strdup(remote_path))) {
+            free_op(op);
+            errno = ENOMEM;
+            return -1;
+        }
+        cache_offer(cl, remote_path, version, offer, sizeof(offer));
+    }
+    if (version > 0) return submit(cl, op, "GET %s:%d CRC32C%s\n", remote_path, version, offer);
+    if (snapshot > 0) return submit(cl, op, "GET %s CRC32C SNAP=%lu%s\n", remote_path, snapshot, offer);
+    return submit(cl, op, "GET %s CRC32C%s\n", remote_path, offer);
+}
+
+// version <= 0 fetches the latest version
+int fsc_get(struct fsc_client *cl, const char *remote_path, int version, fsc_callback cb, void *arg) {
+    return submit_get(cl, remote_path, version, 0, -1, cb, arg);
+}
+
+/*
+ * fsc_get_fd - Writes the decrypted file to fd as it arrives. On failure
+ * fd may hold a partial file; callers typically write to a temporary
+ * file and rename it on success.
+ */
+
+int fsc_get_fd(struct fsc_client *cl, const char *remote_path, int version, int fd,
+               fsc_callback cb, void *arg) {
+    if (fd < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    return submit_get(cl, remote_path, version, 0, fd, cb, arg);
+}
+
+/*
+ * fsc_get_snapshot - Fetches the version remote_path had in a snapshot
+ * taken on the server, into fd like fsc_get_fd, or into memory like
+ * fsc_get when fd is -1.
+ */
+
+int fsc_get_snapshot(struct fsc_client *cl, const char *remote_path, unsigned long snapshot, int fd,
+                     fsc_callback cb, void *arg) {
+    if (snapshot == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    return submit_get(cl, remote_path, 0, snapshot, fd, cb, arg);
+}
+
+// stored_path names one stored version, e.g. "docs/a_v2.txt"
+int fsc_rm(struct fsc_client *cl, const char *stored_path, fsc_callback cb, void *arg) {
+    if (!valid_remote_path(stored_path)) {
+        errno = EINVAL;
+        return -1;
+    }
+    struct fsc_op *op = new_op(cl, FSC_RM, cb, arg);
+    if (!op) return -1;
+    return submit(cl, op, "RM %s\n", stored_path);
+}
+
+int fsc_ls(struct fsc_client *cl, int detailed, const char *filter, fsc_callback cb, void *arg) {
+    return fsc_ls_snapshot(cl, detailed, filter, 0, cb, arg);
+}
+
+// fsc_ls for the versions recorded in a snapshot (0 = the current ones)
+int fsc_ls_snapshot(struct fsc_client *cl, int detailed, const char *filter, unsigned long snapshot,
+                    fsc_callback cb, void *arg) {
+    if (filter && *filter && !valid_remote_path(filter)) {
+        errno = EINVAL;
+        return -1;
+    }
+    struct fsc_op *op = new_op(cl, FSC_LS, cb, arg);
+    if (!op) return -1;
+    const char *f = filter ? filter : "";
+    char snap[32] = "";
+    if (snapshot > 0) snprintf(snap, sizeof(snap), " SNAP=%lu", snapshot);
+    return submit(cl, op, "LS%s%s%s%s\n", detailed ? " -l" : "", *f ? " " : "", f, snap);
+}
+
+/*
+ * fsc_mget - Restores every remote file matching pattern (a path prefix,
+ * or a glob) into local_dir, at their latest versions or as of when
+ * ("v<version>", "t<unix time>" or "s<snapshot>"; NULL for the latest).
+ * Files keep their path below the directory part of the pattern, so both
+ * "docs/" and "docs/a*" restore docs/a.txt as local_dir/a.txt, and are
+ * stamped with their stored mtime.
+ */
+
+int fsc_mget(struct fsc_client *cl, const char *pattern, const char *when, const char *local_dir,
+             fsc_callback cb, void *arg) {
+    if (!valid_remote_path(pattern) || (when && !valid_remote_path(when)) || !local_dir || !*local_dir) {
+        errno = EINVAL;
+        return -1;
+    }
+    struct fsc_op *op = new_op(cl, FSC_MGET, cb, arg);
+    if (!op) return -1;
+    if (!(op->dir = strdup(local_dir))) {
+        free_op(op);
+        errno = ENOMEM;
+        return -1;
+    }
+    size_t literal = strcspn(pattern, "*?[");
+    for (size_t i = 0; i < literal; i++) {
+        if (pattern[i] == '/') op->strip = i + 1;
+    }
+    return submit(cl, op, "MGET %s%s%s\n", pattern, when ? " " : "", when ? when : "");
+}
+
+/*
+ * fsc_rm_bulk - Deletes every version matching spec ("pattern[:versions]",
+ * see the server's RM -r) except the newest keep of each path. The
+ * server's "MATCHED", "PROGRESS" and "DELETED" lines are reported as they
+ * come.
+ */
+
+int fsc_rm_bulk(struct fsc_client *cl, const char *spec, int keep, fsc_callback cb, void *arg) {
+    if (!valid_remote_path(spec) || keep < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    struct fsc_op *op = new_op(cl, FSC_RM_BULK, cb, arg);
+    if (!op) return -1;
+    if (keep > 0) return submit(cl, op, "RM -r %s KEEP=%d\n", spec, keep);
+    return submit(cl, op, "RM -r %s\n", spec);
+}
+
+/*
+ * fsc_watch - Follows the versions written and deleted below prefix ("" for
+ * all), reporting the server's "WATCHING", "EVENT", "RESYNC" and "PING"
+ * lines. from resumes after an earlier event (0 starts with new ones).
+ */
+
+int fsc_watch(struct fsc_client *cl, const char *prefix, unsigned long long from, fsc_callback cb, void *arg) {
+    if (*prefix && !valid_remote_path(prefix)) {
+        errno = EINVAL;
+        return -1;
+    }
+    struct fsc_op *op = new_op(cl, FSC_WATCH, cb, arg);
+    if (!op) return -1;
+    if (from) return submit(cl, op, "WATCH %s FROM=%llu\n", prefix, from);
+    return submit(cl, op, "WATCH %s\n", prefix);
+}
+
+// Records the versions every path has right now as a new snapshot
+int fsc_snapshot(struct fsc_client *cl, fsc_callback cb, void *arg) {
+    struct fsc_op *op = new_op(cl, FSC_SNAPSHOT, cb, arg);
+    if (!op) return -1;
+    return submit(cl, op, "SNAPSHOT\n");
+}
+
+int fsc_snapshot_list(struct fsc_client *cl, fsc_callback cb, void *arg) {
+    struct fsc_op *op = new_op(cl, FSC_SNAPSHOT, cb, arg);
+    if (!op) return -1;
+    return submit(cl, op, "SNAPSHOT -l\n");
+}
+
+int fsc_snapshot_drop(struct fsc_client *cl, unsigned long snapshot, fsc_callback cb, void *arg) {
+    if (snapshot == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    struct fsc_op *op = new_op(cl, FSC_SNAPSHOT, cb, arg);
+    if (!op) return -1;
+    return submit(cl, op, "SNAPSHOT -d %lu\n", snapshot);
+}
+
+int fsc_fd(const struct fsc_client *cl) {
+    return cl->epfd;
+}
+
+int fsc_pending(const struct fsc_client *cl) {
+    return cl->pending;
+}
+
+int fsc_process(struct fsc_client *cl, int timeout_ms) {
+    struct epoll_event events[64];
+    int n = epoll_wait(cl->epfd, events, 64, timeout_ms);
+    if (n < 0) return errno == EINTR ? cl->pending : -1;
+
+    for (int i = 0; i < n; i++) {
+        struct fsc_conn *c = &cl->conns[(uint32_t)events[i].data.u64];
+        uint32_t gen = events[i].data.u64 >> 32;
+        if (c->sock >= 0 && c->gen == gen && (events[i].events & (EPOLLOUT | EPOLLERR))) on_writable(cl, c);
+        if (c->sock >= 0 && c->gen == gen && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) on_readable(cl, c);
+    }
+    dispatch(cl);
+    return cl->pending;
+}
+
+int fsc_run(struct fsc_client *cl) {
+    while (cl->pending > 0) {
+        if (fsc_process(cl, -1) < 0) return -1;
+    }
+    return 0;
+}
+
+const char *fsc_strerror(int status) {
+    switch (status) {
+    case FSC_OK: return "success";
+    case FSC_ERR_IO: return "connection or I/O error";
+    case FSC_ERR_SERVER: return "request refused by server";
+    case FSC_ERR_NOT_FOUND: return "file not found";
+    case FSC_ERR_CHECKSUM: return "checksum mismatch";
+    case FSC_ERR_KEY: return "file is ChaCha20-encrypted and no key is configured";
+    case FSC_ERR_NOMEM: return "out of memory";
+    case FSC_ERR_CANCELLED: return "cancelled";
+    default: return "unknown error";
+    }
+}
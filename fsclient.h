@@ -0,0 +1,146 @@
+/*
+ * fsclient.h - libfsclient, an asynchronous client for the file server.
+ *
+ * Operations are submitted with a callback and return immediately. They
+ * are multiplexed over a pool of persistent, non-blocking connections
+ * and progress whenever the application calls fsc_process(), so the
+ * library fits into an existing event loop: wait for fsc_fd() to become
+ * readable, then call fsc_process(cl, 0). Programs without a loop of
+ * their own can simply call fsc_run().
+ *
+ * A client handle is not thread-safe; use it from one thread (callbacks
+ * run on that thread, inside fsc_process). Callbacks may submit further
+ * operations.
+ *
+ * Payloads are encrypted and checksummed exactly as the command-line
+ * client does, so files written through either one can be read by both.
+ *
+ * Besides single files, the library runs the server's streamed commands:
+ * MGET restores many files into a local directory, "RM -r" deletes many
+ * versions, WATCH follows changes, and SNAPSHOT records or manages
+ * point-in-time views. A WATCH keeps its connection for as long as it
+ * runs, until the connection drops or the client is closed.
+ *
+ * With a cache directory configured, every GET result is kept there,
+ * keyed by path, version and stored checksum. GETs offer the cached
+ * versions to the server, and when the one asked for is still current
+ * the server only says so and the file comes from the cache: a repeat
+ * fetch costs one small round trip.
+ */
+
+#ifndef FSCLIENT_H
+#define FSCLIENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include "cipher.h"
+
+enum fsc_status {
+    FSC_OK = 0,
+    FSC_ERR_IO = -1,         // connection failed or dropped, or local I/O failed
+    FSC_ERR_SERVER = -2,     // the server refused the request (see message)
+    FSC_ERR_NOT_FOUND = -3,  // GET of a path or version that does not exist
+    FSC_ERR_CHECKSUM = -4,   // payload did not match its CRC32C trailer
+    FSC_ERR_KEY = -5,        // ChaCha20 version but no key configured
+    FSC_ERR_NOMEM = -6,
+    FSC_ERR_CANCELLED = -7,  // client closed before the operation ran
+};
+
+struct fsc_options {
+    const char *host;        // default "127.0.0.1"
+    int port;                // default 2024
+    int max_conns;           // connection pool size, default 4
+    enum cipher_mode cipher; // cipher for uploads (default legacy XOR)
+    const uint8_t *key;      // ChaCha20 key, CHACHA20_KEY_SIZE bytes, or NULL
+    const char *cache_dir;   // local GET cache, created on demand; NULL = none
+    long cache_max;          // bytes the cache may hold, default 256 MiB
+    int cipher_threads;      // cipher workers for transfers of 4 MiB and more,
+                             // default 0 (the cipher runs on the caller's thread)
+};
+
+/*
+ * fsc_result - Outcome of one operation, valid only during the callback.
+ *
+ *   WRITE  version is the stored version number
+ *   GET    data/size hold the decrypted file (memory GETs only); the
+ *          callback may keep the buffer by setting data to NULL, after
+ *          which it must free() it. version is the version fetched and
+ *          cached is set when it came from the local cache
+ *   LS     lines/nlines hold the listing without the "__END__" marker
+ *   SNAPSHOT  snapshot is the id of the new snapshot and size the number
+ *          of paths it records; a listing has "<id> <created> <paths>"
+ *          per snapshot in lines/nlines
+ *   any    message holds the server's reply on FSC_ERR_SERVER
+ *
+ * MGET, RM -r and WATCH also report along the way, in callbacks with more
+ * set; the operation goes on after them and still ends in one callback
+ * with more clear. An MGET reports every entry once it is stored or has
+ * failed: path is the remote path, version and size are those of the
+ * entry, and status and message are the entry's alone. RM -r and WATCH
+ * report each reply line as it arrives, in lines[0] (nlines is 1).
+ */
+
+struct fsc_result {
+    int status;
+    const char *message;
+    int version;
+    char *data;
+    size_t size;
+    char **lines;
+    size_t nlines;
+    int cached;
+    unsigned long snapshot;
+    const char *path;
+    int more;
+};
+
+struct fsc_client;
+
+typedef void (*fsc_callback)(struct fsc_client *cl, struct fsc_result *res, void *arg);
+
+struct fsc_client *fsc_open(const struct fsc_options *opts);
+void fsc_close(struct fsc_client *cl);
+
+/*
+ * Submission functions return 0 once the operation is queued, or -1 with
+ * errno set (EINVAL for a bad path, ENOMEM, ECANCELED while closing).
+ * A queued operation always ends in exactly one callback.
+ */
+
+int fsc_write(struct fsc_client *cl, const char *remote_path, const void *data, size_t size,
+              time_t mtime, fsc_callback cb, void *arg);
+int fsc_write_fd(struct fsc_client *cl, const char *remote_path, int fd, size_t size,
+                 time_t mtime, fsc_callback cb, void *arg);
+int fsc_get(struct fsc_client *cl, const char *remote_path, int version, fsc_callback cb, void *arg);
+int fsc_get_fd(struct fsc_client *cl, const char *remote_path, int version, int fd,
+               fsc_callback cb, void *arg);
+int fsc_get_snapshot(struct fsc_client *cl, const char *remote_path, unsigned long snapshot, int fd,
+                     fsc_callback cb, void *arg);
+int fsc_rm(struct fsc_client *cl, const char *stored_path, fsc_callback cb, void *arg);
+int fsc_ls(struct fsc_client *cl, int detailed, const char *filter, fsc_callback cb, void *arg);
+int fsc_ls_snapshot(struct fsc_client *cl, int detailed, const char *filter, unsigned long snapshot,
+                    fsc_callback cb, void *arg);
+int fsc_mget(struct fsc_client *cl, const char *pattern, const char *when, const char *local_dir,
+             fsc_callback cb, void *arg);
+int fsc_rm_bulk(struct fsc_client *cl, const char *spec, int keep, fsc_callback cb, void *arg);
+int fsc_watch(struct fsc_client *cl, const char *prefix, unsigned long long from, fsc_callback cb, void *arg);
+int fsc_snapshot(struct fsc_client *cl, fsc_callback cb, void *arg);
+int fsc_snapshot_list(struct fsc_client *cl, fsc_callback cb, void *arg);
+int fsc_snapshot_drop(struct fsc_client *cl, unsigned long snapshot, fsc_callback cb, void *arg);
+
+// Pollable descriptor; readable whenever fsc_process has work to do
+int fsc_fd(const struct fsc_client *cl);
+
+// Runs ready I/O and callbacks, waiting up to timeout_ms (-1 = forever).
+// Returns the number of operations still outstanding, or -1 on error.
+int fsc_process(struct fsc_client *cl, int timeout_ms);
+
+int fsc_pending(const struct fsc_client *cl);
+
+// Processes until every outstanding operation has completed
+int fsc_run(struct fsc_client *cl);
+
+const char *fsc_strerror(int status);
+
+#endif
@@ -0,0 +1,556 @@
+/*
+ * packstore.c - Append-only segment files for small versions.
+ *
+ * A segment is a sequence of records: a fixed header, the filename and
+ * extension, then the payload. Tombstones are header-only records that
+ * name the exact segment and offset of the record they delete, so a
+ * record that was copied elsewhere by the compactor (or written again
+ * under a reused version number) is never hit by an old tombstone.
+ *
+ * Nothing but the segments is persisted: the index is rebuilt at startup
+ * by scanning them in order. Records are only appended to the newest
+ * segment; once it reaches segment_max a new one is started.
+ *
+ * The compactor copies the live records of a sealed segment to the
+ * active one, one record per lock hold, then syncs the copies and only
+ * then unlinks the old segment.
+ * Tombstones are carried over for as long as the segment holding their
+ * target still exists.
+ *
+ * Reading and checking records and the index itself are shared with the
+ * cold tier (recordlog.c).
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "packstore.h"
+#include "recordlog.h"
+
+#define PACK_RECORD 0x4b504652u     // "RFPK"
+#define PACK_TOMBSTONE 0x4b505452u  // "RTPK"
+#define PACK_HAS_NONCE 1u
+#ifndef COMPACT_INTERVAL
+#define COMPACT_INTERVAL 10         // seconds between compactor passes
+#endif
+
+// Starts like every struct rlog_record
+struct pack_header {
+    uint32_t magic;
+    uint32_t header_crc;   // CRC32C of the header (this field zeroed) and the names
+    uint16_t name_len;
+    uint16_t ext_len;
+    int32_t version;
+    uint32_t flags;
+    uint32_t crc;          // CRC32C of the payload
+    uint64_t size;
+    int64_t mtime;
+    uint8_t nonce[CHACHA20_NONCE_SIZE];
+    uint32_t target_seg;   // tombstones: the deleted record's location
+    uint64_t target_off;
+};
+
+struct segment {
+    uint32_t id;
+    int fd;
+    uint64_t size;
+    uint64_t dead;         // bytes of deleted or superseded records
+};
+
+struct pack_entry {
+    int version;
+    uint32_t seg;
+    uint64_t off;
+    struct pack_info info;
+};
+
+static pthread_rwlock_t pack_lock = PTHREAD_RWLOCK_INITIALIZER;
+static char pack_dir[1024];
+static long max_segment_size;
+static struct segment *segs;
+static size_t nsegs, segs_cap;
+static struct rlog_index pack_index = { sizeof(struct pack_entry), { NULL } };  // by filename + extension
+static double compact_ratio;
+static int frozen;  // set while another process owns the segments
+
+// === Records === //
+
+static uint64_t body_len(const void *h) {
+    return ((const struct pack_header *)h)->size;
+}
+
+static const struct rlog_format pack_format = { sizeof(struct pack_header), { PACK_RECORD, PACK_TOMBSTONE }, body_len };
+
+static size_t record_len(const struct pack_header *h) {
+    return rlog_record_len(&pack_format, h);
+}
+
+static uint32_t header_crc(const struct pack_header *h, const char *filename, const char *ext) {
+    return rlog_header_crc(&pack_format, h, filename, ext);
+}
+
+static void segment_path(char *out, size_t cap, uint32_t id) {
+    snprintf(out, cap, "%s/segment_%06u.pack", pack_dir, id);
+}
+
+static struct segment *find_segment(uint32_t id) {
+    for (size_t i = 0; i < nsegs; i++) {
+        if (segs[i].id == id) return &segs[i];
+    }
+    return NULL;
+}
+
+// === Index === //
+
+static struct rlog_name *find_file(const char *filename, const char *ext, int create) {
+    return rlog_name(&pack_index, filename, ext, create);
+}
+
+static struct pack_entry *find_entry(struct rlog_name *f, int version) {
+    return rlog_find(&pack_index, f, version);
+}
+
+/*
+ * index_record - Points the index at the record at seg:off. A version
+ * indexed elsewhere (a copy left behind by an interrupted compaction) is
+ * superseded and its bytes count as dead.
+ */
+
+static int index_record(const struct pack_header *h, const char *filename, const char *ext,
+                        uint32_t seg, uint64_t off) {
+    struct rlog_name *f = find_file(filename, ext, 1);
+    if (!f) return -1;
+    struct pack_entry *e = find_entry(f, h->version);
+    if (e) {
+        struct segment *old = find_segment(e->seg);
+        if (old) old->dead += sizeof(*h) + h->name_len + h->ext_len + e->info.size;
+    } else if (!(e = rlog_add(&pack_index, f))) {
+        return -1;
+    }
+    e->version = h->version;
+    e->seg = seg;
+    e->off = off;
+    e->info.size = h->size;
+    e->info.mtime = h->mtime;
+    e->info.crc = h->crc;
+    e->info.has_nonce = (h->flags & PACK_HAS_NONCE) != 0;
+    memcpy(e->info.nonce, h->nonce, CHACHA20_NONCE_SIZE);
+    return 0;
+}
+
+static void apply_tombstone(const struct pack_header *h, const char *filename, const char *ext) {
+    struct rlog_name *f = find_file(filename, ext, 0);
+    struct pack_entry *e = find_entry(f, h->version);
+    if (e && e->seg == h->target_seg && e->off == h->target_off) {
+        struct segment *seg = find_segment(e->seg);
+        if (seg) seg->dead += sizeof(*h) + h->name_len + h->ext_len + e->info.size;
+        rlog_drop(&pack_index, f, e);
+    }
+}
+
+// === Segments === //
+
+static struct segment *add_segment(uint32_t id, int fd, uint64_t size) {
+    if (nsegs == segs_cap) {
+        size_t cap = segs_cap ? segs_cap * 2 : 16;
+        struct segment *grown = realloc(segs, cap * sizeof(*grown));
+        if (!grown) return NULL;
+        segs = grown;
+        segs_cap = cap;
+    }
+    struct segment *s = &segs[nsegs++];
+    s->id = id;
+    s->fd = fd;
+    s->size = size;
+    s->dead = 0;
+    return s;
+}
+
+/*
+ * active_segment - Returns the segment appends go to, starting a new one
+ * when the current one cannot take len more bytes. Called with the write
+ * lock held.
+ */
+
+static struct segment *active_segment(size_t len) {
+    if (nsegs > 0 && (segs[nsegs - 1].size == 0 || segs[nsegs - 1].size + len <= (uint64_t)max_segment_size)) {
+        return &segs[nsegs - 1];
+    }
+    uint32_t id = nsegs > 0 ? segs[nsegs - 1].id + 1 : 1;
+    char path[1100];
+    mkdir(pack_dir, 0755);
+    segment_path(path, sizeof(path), id);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return NULL;
+    struct segment *s = add_segment(id, fd, 0);
+    if (!s) close(fd);
+    return s;
+}
+
+static int write_at(struct segment *s, const struct iovec *iov, int iovcnt, size_t len, uint64_t *off) {
+    ssize_t n = pwritev(s->fd, iov, iovcnt, s->size);
+    if (n != (ssize_t)len) {
+        // Leave no half record behind for the next append to follow
+        if (ftruncate(s->fd, s->size) != 0) perror("pack truncate");
+        return -1;
+    }
+    *off = s->size;
+    s->size += len;
+    return 0;
+}
+
+static int compare_ids(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * scan_segment - Replays one segment into the index. A torn record at the
+ * end of the newest segment (a crash mid-append) is cut off; anywhere
+ * else the rest of the segment is skipped with a warning.
+ */
+
+static void replay_record(void *ctx, const void *header, const char *filename, const char *ext, uint64_t off) {
+    const struct pack_header *h = header;
+    const struct segment *s = ctx;
+    if (h->magic == PACK_RECORD) index_record(h, filename, ext, s->id, off);
+    else apply_tombstone(h, filename, ext);
+}
+
+static void scan_segment(struct segment *s, int newest) {
+    uint64_t off;
+    if (rlog_scan(&pack_format, s->fd, s->size, &off, replay_record, s) < 0) {
+        printf("Pack segment %u: bad record at offset %lu%s\n", s->id, (unsigned long)off,
+               newest ? ", truncated" : ", rest skipped");
+        if (newest) {
+            if (ftruncate(s->fd, off) != 0) perror("pack truncate");
+            s->size = off;
+        } else {
+            s->dead += s->size - off;
+        }
+    }
+}
+
+/*
+ * pack_open - Loads every segment under dir and rebuilds the index.
+ * New segments are started once the current one reaches segment_max.
+ */
+
+int pack_open(const char *dir, long segment_max) {
+    snprintf(pack_dir, sizeof(pack_dir), "%s", dir);
+    max_segment_size = segment_max;
+
+    uint32_t *ids;
+    size_t count;
+    if (rlog_list_ids(dir, "segment_%u.pack", &ids, &count) < 0) return errno == ENOENT ? 0 : -1;
+
+    // Segments are replayed oldest first: tombstones always follow the
+    // record they delete
+    for (size_t i = 0; i < count; i++) {
+        char path[1100];
+        struct stat st;
+        segment_path(path, sizeof(path), ids[i]);
+        int fd = open(path, O_RDWR | O_CLOEXEC);
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            if (fd >= 0) close(fd);
+            continue;
+        }
+        struct segment *s = add_segment(ids[i], fd, st.st_size);
+        if (!s) {
+            close(fd);
+            break;
+        }
+        scan_segment(s, i == count - 1);
+    }
+    free(ids);
+    return 0;
+}
+
+// === Operations === //
+
+/*
+ * pack_append - Stores one version. The whole record goes out in a
+ * single pwritev at the end of the active segment.
+ */
+
+int pack_append(const char *filename, const char *ext, int version, const void *data,
+                const struct pack_info *info) {
+    struct pack_header h = { 0 };
+    h.magic = PACK_RECORD;
+    h.name_len = strlen(filename);
+    h.ext_len = strlen(ext);
+    h.version = version;
+    h.flags = info->has_nonce ? PACK_HAS_NONCE : 0;
+    h.crc = info->crc;
+    h.size = info->size;
+    h.mtime = info->mtime;
+    if (info->has_nonce) memcpy(h.nonce, info->nonce, CHACHA20_NONCE_SIZE);
+    h.header_crc = header_crc(&h, filename, ext);
+
+    struct iovec iov[4] = {
+        { &h, sizeof(h) },
+        { (void *)filename, h.name_len },
+        { (void *)ext, h.ext_len },
+        { (void *)data, info->size },
+    };
+    size_t len = record_len(&h);
+    uint64_t off;
+    pthread_rwlock_wrlock(&pack_lock);
+    struct segment *s = frozen ? NULL : active_segment(len);
+    int status = s ? write_at(s, iov, 4, len, &off) : -1;
+    if (status == 0) status = index_record(&h, filename, ext, s->id, off);
+    pthread_rwlock_unlock(&pack_lock);
+    return status;
+}
+
+/*
+ * pack_read - Reads a packed version into buf (with one pread) and fills
+ * in info. Returns -1 if the version is not packed or does not fit in cap.
+ */
+
+int pack_read(const char *filename, const char *ext, int version, void *buf, size_t cap, struct pack_info *info) {
+    int status = -1;
+    pthread_rwlock_rdlock(&pack_lock);
+    struct pack_entry *e = find_entry(find_file(filename, ext, 0), version);
+    struct segment *s = e ? find_segment(e->seg) : NULL;
+    if (s && (size_t)e->info.size <= cap) {
+        uint64_t at = e->off + sizeof(struct pack_header) + strlen(filename) + strlen(ext);
+        if (pread(s->fd, buf, e->info.size, at) == e->info.size) {
+            *info = e->info;
+            status = 0;
+        }
+    }
+    pthread_rwlock_unlock(&pack_lock);
+    return status;
+}
+
+/*
+ * pack_remove - Deletes a packed version by appending a tombstone.
+ * Returns -1 if the version is not packed.
+ */
+
+int pack_remove(const char *filename, const char *ext, int version) {
+    pthread_rwlock_wrlock(&pack_lock);
+    struct rlog_name *f = find_file(filename, ext, 0);
+    struct pack_entry *e = find_entry(f, version);
+    if (!e || frozen) {
+        pthread_rwlock_unlock(&pack_lock);
+        return -1;
+    }
+
+    struct pack_header h = { 0 };
+    h.magic = PACK_TOMBSTONE;
+    h.name_len = strlen(filename);
+    h.ext_len = strlen(ext);
+    h.version = version;
+    h.target_seg = e->seg;
+    h.target_off = e->off;
+    h.header_crc = header_crc(&h, filename, ext);
+    struct iovec iov[3] = { { &h, sizeof(h) }, { (void *)filename, h.name_len }, { (void *)ext, h.ext_len } };
+    size_t len = record_len(&h);
+    uint64_t off;
+    struct segment *s = active_segment(len);
+    int status = s ? write_at(s, iov, 3, len, &off) : -1;
+    if (status == 0) apply_tombstone(&h, filename, ext);
+    pthread_rwlock_unlock(&pack_lock);
+    return status;
+}
+
+int pack_latest_version(const char *filename, const char *ext) {
+    int latest = 0;
+    pthread_rwlock_rdlock(&pack_lock);
+    struct rlog_name *f = find_file(filename, ext, 0);
+    for (size_t i = 0; f && i < f->count; i++) {
+        const struct pack_entry *e = rlog_entry(&pack_index, f, i);
+        if (e->version > latest) latest = e->version;
+    }
+    pthread_rwlock_unlock(&pack_lock);
+    return latest;
+}
+
+/*
+ * pack_list - Returns a snapshot of every packed version, so callers can
+ * send it to a client without holding up appends.
+ */
+
+struct pack_item *pack_list(size_t *count) {
+    struct pack_item *items = NULL;
+    size_t n = 0, cap = 0;
+    pthread_rwlock_rdlock(&pack_lock);
+    for (int b = 0; b < RLOG_BUCKETS; b++) {
+        for (struct rlog_name *f = pack_index.buckets[b]; f; f = f->next) {
+            for (size_t i = 0; i < f->count; i++) {
+                if (n == cap) {
+                    cap = cap ? cap * 2 : 256;
+                    struct pack_item *grown = realloc(items, cap * sizeof(*grown));
+                    if (!grown) goto out;
+                    items = grown;
+                }
+                struct pack_item *it = &items[n];
+                const struct pack_entry *e = rlog_entry(&pack_index, f, i);
+                size_t len = strlen(f->filename) + strlen(f->ext) + 16;
+                it->logical = malloc(len);
+                it->stored = malloc(len);
+                if (!it->logical || !it->stored) {
+                    free(it->logical);
+                    free(it->stored);
+                    goto out;
+                }
+                snprintf(it->logical, len, "%s%s", f->filename, f->ext);
+                snprintf(it->stored, len, "%s_v%d%s", f->filename, e->version, f->ext);
+                it->version = e->version;
+                it->info = e->info;
+                n++;
+            }
+        }
+    }
+out:
+    pthread_rwlock_unlock(&pack_lock);
+    *count = n;
+    return items;
+}
+
+void pack_free_list(struct pack_item *items, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        free(items[i].logical);
+        free(items[i].stored);
+    }
+    free(items);
+}
+
+// === Compaction === //
+
+/*
+ * carry_record - Copies one record of a segment being compacted to the
+ * active segment if it is still needed, returning the bytes copied and
+ * lowering *first_to to the segment it went to. Called with the write
+ * lock held.
+ */
+
+static size_t carry_record(struct segment *from, uint64_t off, const struct pack_header *h,
+                         const char *filename, const char *ext, uint32_t *first_to) {
+    struct pack_entry *e = NULL;
+    if (h->magic == PACK_RECORD) {
+        e = find_entry(find_file(filename, ext, 0), h->version);
+        if (!e || e->seg != from->id || e->off != off) return 0;  // deleted or superseded
+    } else if (h->target_seg == from->id || !find_segment(h->target_seg)) {
+        return 0;  // its target is gone, or goes away with this segment
+    }
+
+    size_t len = record_len(h), copied = 0;
+    char *copy = malloc(len);
+    if (!copy) return 0;
+    uint64_t new_off;
+    struct iovec iov = { copy, len };
+    // from is not used past this read: starting a new segment may move segs
+    if (pread(from->fd, copy, len, off) == (ssize_t)len) {
+        struct segment *to = active_segment(len);
+        if (to && write_at(to, &iov, 1, len, &new_off) == 0) {
+            copied = len;
+            if (to->id < *first_to) *first_to = to->id;
+            if (e) {
+                e->seg = to->id;
+                e->off = new_off;
+            }
+        }
+    }
+    free(copy);
+    return copied;
+}
+
+// fdatasyncs every segment from id first on, which holds all that was carried
+static int sync_segments_from(uint32_t first) {
+    int status = 0;
+    pthread_rwlock_rdlock(&pack_lock);
+    for (size_t i = 0; i < nsegs && status == 0; i++) {
+        if (segs[i].id >= first) status = fdatasync(segs[i].fd);
+    }
+    pthread_rwlock_unlock(&pack_lock);
+    return status;
+}
+
+static void compact_segment(uint32_t id) {
+    struct pack_header h;
+    char *filename = malloc(UINT16_MAX + 1), *ext = malloc(UINT16_MAX + 1);
+    uint64_t off = 0, moved = 0;
+    uint32_t first_to = UINT32_MAX;
+    if (!filename || !ext) goto out;
+
+    for (;;) {
+        pthread_rwlock_wrlock(&pack_lock);
+        struct segment *s = frozen ? NULL : find_segment(id);
+        int rc = s ? rlog_read_header(&pack_format, s->fd, off, s->size, &h, filename, ext) : -1;
+        if (rc == 1) moved += carry_record(s, off, &h, filename, ext, &first_to);
+        pthread_rwlock_unlock(&pack_lock);
+        if (rc < 0) goto out;  // unreadable: keep the segment rather than lose records
+        if (rc == 0) break;
+        off += record_len(&h);
+    }
+    // The copies must be on disk before the originals go
+    if (first_to != UINT32_MAX && sync_segments_from(first_to) < 0) {
+        perror("pack compaction sync");
+        goto out;
+    }
+
+    pthread_rwlock_wrlock(&pack_lock);
+    struct segment *s = frozen ? NULL : find_segment(id);
+    if (s) {
+        char path[1100];
+        segment_path(path, sizeof(path), id);
+        unlink(path);
+        close(s->fd);
+        *s = segs[--nsegs];
+        qsort(segs, nsegs, sizeof(*segs), compare_ids);  // id is the first member
+    }
+    pthread_rwlock_unlock(&pack_lock);
+    printf("Compacted pack segment %u (%lu bytes kept)\n", id, (unsigned long)moved);
+out:
+    free(filename);
+    free(ext);
+}
+
+static void *compactor(void *arg) {
+    for (;;) {
+        sleep(COMPACT_INTERVAL);
+        uint32_t victim = 0;
+        pthread_rwlock_rdlock(&pack_lock);
+        // Never the active (last) segment
+        for (size_t i = 0; i + 1 < nsegs && !victim; i++) {
+            if (segs[i].size == 0 || segs[i].dead >= compact_ratio * segs[i].size) victim = segs[i].id;
+        }
+        pthread_rwlock_unlock(&pack_lock);
+        if (victim) compact_segment(victim);
+    }
+    return NULL;
+}
+
+/*
+ * pack_start_compactor - Starts the background thread that rewrites
+ * sealed segments once at least dead_ratio of their bytes are dead.
+ */
+
+void pack_start_compactor(double dead_ratio) {
+    compact_ratio = dead_ratio > 0 ? dead_ratio : 0.5;
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, compactor, NULL) == 0) pthread_detach(tid);
+}
+
+/*
+ * pack_freeze - Stops (on) or resumes every write to the segment files:
+ * appends and removals fail and compaction leaves its segment alone.
+ * Returns once writes in progress are done, so another process can take
+ * the directory over. Reads keep working.
+ */
+
+void pack_freeze(int on) {
+    pthread_rwlock_wrlock(&pack_lock);
+    frozen = on;
+    pthread_rwlock_unlock(&pack_lock);
+}
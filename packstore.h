@@ -0,0 +1,53 @@
+/*
+ * packstore.h - Packed storage for small versions.
+ *
+ * Small versions are appended to large append-only segment files instead
+ * of getting a file (plus a metadata file) each. An in-memory index maps
+ * every packed version to its segment and offset, so a GET is a single
+ * pread. Deleting appends a tombstone; a background compactor rewrites
+ * segments whose space is mostly dead.
+ *
+ * Versions are named like their file-backed counterparts, by filename
+ * (without extension), extension and version number, so callers can
+ * check the pack and the file tree side by side.
+ */
+
+#ifndef PACKSTORE_H
+#define PACKSTORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include "cipher.h"
+
+struct pack_info {
+    long size;
+    time_t mtime;
+    uint32_t crc;                        // CRC32C of the stored bytes
+    int has_nonce;                       // set for ChaCha20 uploads
+    uint8_t nonce[CHACHA20_NONCE_SIZE];
+};
+
+// One packed version, as returned by pack_list()
+struct pack_item {
+    char *logical;   // "docs/a.txt"
+    char *stored;    // "docs/a_v3.txt"
+    int version;
+    struct pack_info info;
+};
+
+int pack_open(const char *dir, long segment_max);
+void pack_start_compactor(double dead_ratio);
+void pack_freeze(int on);
+
+int pack_append(const char *filename, const char *ext, int version, const void *data,
+                const struct pack_info *info);
+int pack_read(const char *filename, const char *ext, int version, void *buf, size_t cap,
+              struct pack_info *info);
+int pack_remove(const char *filename, const char *ext, int version);
+int pack_latest_version(const char *filename, const char *ext);
+
+struct pack_item *pack_list(size_t *count);
+void pack_free_list(struct pack_item *items, size_t count);
+
+#endif
@@ -0,0 +1,220 @@
+/*
+ * ratelimit.c - Per-client token buckets and fair bandwidth sharing.
+ *
+ * Buckets run in "debt" mode: taking more than is available leaves a
+ * negative balance, and the caller sleeps until it is paid back. All
+ * sleeping happens outside of the locks, so a throttled bulk transfer
+ * never holds up a small GET or LS from another client.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include "ratelimit.h"
+
+#define CLIENT_BUCKETS 256
+#define CLIENT_SWEEP_AT 4096    // sweep idle entries beyond this many clients
+#define CLIENT_IDLE_SECS 60.0
+#define MIN_BYTE_BURST (64 * 1024)
+
+struct token_bucket {
+    double rate;
+    double burst;
+    double tokens;
+    double last;
+};
+
+struct client_limits {
+    uint32_t ip;
+    int refs;
+    double last_used;
+    pthread_mutex_t lock;
+    struct token_bucket bytes;
+    struct token_bucket ops[OP_COUNT];
+    struct client_limits *next;
+};
+
+static struct rate_config config;
+static int enabled;
+
+static pthread_mutex_t clients_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct client_limits *clients[CLIENT_BUCKETS];
+static size_t nclients;
+static int active_bulk;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void sleep_seconds(double secs) {
+    struct timespec ts;
+    ts.tv_sec = (time_t)secs;
+    ts.tv_nsec = (long)((secs - ts.tv_sec) * 1e9);
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR) {
+    }
+}
+
+static void bucket_init(struct token_bucket *b, double rate, double burst) {
+    b->rate = rate;
+    b->burst = burst;
+    b->tokens = burst;
+    b->last = now_seconds();
+}
+
+/*
+ * bucket_take - Refills the bucket, takes amount, and returns how long the
+ * caller must wait before the debt is paid back.
+ */
+
+static double bucket_take(struct token_bucket *b, double amount, double now) {
+    if (b->rate <= 0) return 0;
+    b->tokens += (now - b->last) * b->rate;
+    if (b->tokens > b->burst) b->tokens = b->burst;
+    b->last = now;
+    b->tokens -= amount;
+    return b->tokens < 0 ? -b->tokens / b->rate : 0;
+}
+
+static double byte_burst(double rate) {
+    return rate / 10 > MIN_BYTE_BURST ? rate / 10 : MIN_BYTE_BURST;
+}
+
+void ratelimit_configure(const struct rate_config *cfg) {
+    config = *cfg;
+    enabled = cfg->client_bytes > 0 || cfg->total_bytes > 0;
+    for (int i = 0; i < OP_COUNT; i++) {
+        if (cfg->ops[i] > 0) enabled = 1;
+    }
+}
+
+/*
+ * sweep_idle - Drops clients nobody references that have been idle for a
+ * while. Called with clients_lock held.
+ */
+
+static void sweep_idle(double now) {
+    for (int i = 0; i < CLIENT_BUCKETS; i++) {
+        struct client_limits **link = &clients[i];
+        while (*link) {
+            struct client_limits *cl = *link;
+            if (cl->refs == 0 && now - cl->last_used > CLIENT_IDLE_SECS) {
+                *link = cl->next;
+                pthread_mutex_destroy(&cl->lock);
+                free(cl);
+                nclients--;
+            } else {
+                link = &cl->next;
+            }
+        }
+    }
+}
+
+/*
+ * ratelimit_client - Returns the (shared) limits of a client IP, or NULL
+ * when rate limiting is disabled. Release with ratelimit_release().
+ */
+
+struct client_limits *ratelimit_client(uint32_t ip) {
+    if (!enabled) return NULL;
+    double now = now_seconds();
+    pthread_mutex_lock(&clients_lock);
+    struct client_limits *cl = clients[ip % CLIENT_BUCKETS];
+    while (cl && cl->ip != ip) cl = cl->next;
+    if (!cl) {
+        if (nclients >= CLIENT_SWEEP_AT) sweep_idle(now);
+        cl = calloc(1, sizeof(*cl));
+        if (!cl) {
+            pthread_mutex_unlock(&clients_lock);
+            return NULL;
+        }
+        cl->ip = ip;
+        pthread_mutex_init(&cl->lock, NULL);
+        bucket_init(&cl->bytes, config.client_bytes, byte_burst(config.client_bytes));
+        for (int i = 0; i < OP_COUNT; i++) {
+            bucket_init(&cl->ops[i], config.ops[i], config.ops[i] > 1 ? config.ops[i] : 1);
+        }
+        cl->next = clients[ip % CLIENT_BUCKETS];
+        clients[ip % CLIENT_BUCKETS] = cl;
+        nclients++;
+    }
+    cl->refs++;
+    cl->last_used = now;
+    pthread_mutex_unlock(&clients_lock);
+    return cl;
+}
+
+void ratelimit_release(struct client_limits *cl) {
+    if (!cl) return;
+    pthread_mutex_lock(&clients_lock);
+    cl->refs--;
+    cl->last_used = now_seconds();
+    pthread_mutex_unlock(&clients_lock);
+}
+
+/*
+ * ratelimit_request - Waits until the client may issue another op.
+ */
+
+void ratelimit_request(struct client_limits *cl, enum rate_op op) {
+    if (!cl) return;
+    pthread_mutex_lock(&cl->lock);
+    double wait = bucket_take(&cl->ops[op], 1, now_seconds());
+    pthread_mutex_unlock(&cl->lock);
+    if (wait > 0) sleep_seconds(wait);
+}
+
+// === Transfers === //
+
+void transfer_begin(struct transfer *t, struct client_limits *cl, long size) {
+    t->client = cl;
+    t->bulk = enabled && size > config.small_transfer;
+    t->tokens = 0;
+    t->last = now_seconds();
+    if (t->bulk) {
+        pthread_mutex_lock(&clients_lock);
+        active_bulk++;
+        pthread_mutex_unlock(&clients_lock);
+    }
+}
+
+/*
+ * transfer_account - Charges bytes to the client's budget and to this
+ * transfer's fair share of the total, sleeping off whichever is behind.
+ */
+
+void transfer_account(struct transfer *t, size_t bytes) {
+    if (!t->bulk) return;
+    double now = now_seconds(), wait = 0;
+
+    if (t->client && config.client_bytes > 0) {
+        pthread_mutex_lock(&t->client->lock);
+        wait = bucket_take(&t->client->bytes, bytes, now);
+        pthread_mutex_unlock(&t->client->lock);
+    }
+
+    if (config.total_bytes > 0) {
+        pthread_mutex_lock(&clients_lock);
+        int active = active_bulk > 0 ? active_bulk : 1;
+        pthread_mutex_unlock(&clients_lock);
+        struct token_bucket share = { config.total_bytes / active, 0, t->tokens, t->last };
+        share.burst = byte_burst(share.rate);
+        double share_wait = bucket_take(&share, bytes, now);
+        t->tokens = share.tokens;
+        t->last = share.last;
+        if (share_wait > wait) wait = share_wait;
+    }
+
+    if (wait > 0) sleep_seconds(wait);
+}
+
+void transfer_end(struct transfer *t) {
+    if (!t->bulk) return;
+    pthread_mutex_lock(&clients_lock);
+    active_bulk--;
+    pthread_mutex_unlock(&clients_lock);
+    t->bulk = 0;
+}
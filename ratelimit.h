@@ -0,0 +1,49 @@
+/*
+ * ratelimit.h - Token-bucket limits per client IP and per command, plus
+ * fair sharing of the server's transfer bandwidth between bulk transfers.
+ *
+ * Limits shape rather than reject: a request or chunk that is over budget
+ * waits until the bucket allows it. A zero rate means unlimited, and with
+ * every rate at zero all calls return immediately.
+ */
+
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum rate_op { OP_WRITE, OP_GET, OP_RM, OP_LS, OP_OTHER, OP_COUNT };
+
+struct rate_config {
+    double client_bytes;   // bytes/s per client IP
+    double total_bytes;    // bytes/s split fairly across active bulk transfers
+    double ops[OP_COUNT];  // requests/s per client IP for each command
+    long small_transfer;   // transfers up to this size are never slowed down
+};
+
+struct client_limits;
+
+/*
+ * transfer - One WRITE or GET payload being moved. Bulk transfers get an
+ * equal share of total_bytes, recomputed as transfers come and go.
+ */
+
+struct transfer {
+    struct client_limits *client;
+    int bulk;
+    double tokens;
+    double last;
+};
+
+void ratelimit_configure(const struct rate_config *cfg);
+
+struct client_limits *ratelimit_client(uint32_t ip);
+void ratelimit_release(struct client_limits *cl);
+void ratelimit_request(struct client_limits *cl, enum rate_op op);
+
+void transfer_begin(struct transfer *t, struct client_limits *cl, long size);
+void transfer_account(struct transfer *t, size_t bytes);
+void transfer_end(struct transfer *t);
+
+#endif
@@ -0,0 +1,165 @@
+/*
+ * recordlog.c - Shared plumbing of the append-only stores.
+ *
+ * Nothing here locks or keeps state of its own: every store guards its
+ * index and files with its own lock, and calls in with it held.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include "recordlog.h"
+#include "crc32c.h"
+
+// === Records === //
+
+size_t rlog_record_len(const struct rlog_format *fmt, const void *header) {
+    const struct rlog_record *r = header;
+    return fmt->header_size + r->name_len + r->ext_len + fmt->body_len(header);
+}
+
+uint32_t rlog_header_crc(const struct rlog_format *fmt, const void *header, const char *filename, const char *ext) {
+    static const uint32_t zero = 0;
+    const struct rlog_record *r = header;
+    size_t skip = offsetof(struct rlog_record, header_crc) + sizeof(r->header_crc);
+    uint32_t crc = crc32c_update(0, header, offsetof(struct rlog_record, header_crc));
+    crc = crc32c_update(crc, &zero, sizeof(zero));
+    crc = crc32c_update(crc, (const char *)header + skip, fmt->header_size - skip);
+    crc = crc32c_update(crc, filename, r->name_len);
+    return crc32c_update(crc, ext, r->ext_len);
+}
+
+/*
+ * rlog_read_header - Reads and checks the header and names at off.
+ * Returns 1 on success, 0 at the end of the file and -1 for a torn,
+ * incomplete or corrupt record. filename and ext need UINT16_MAX + 1
+ * bytes each.
+ */
+
+int rlog_read_header(const struct rlog_format *fmt, int fd, uint64_t off, uint64_t file_size, void *header,
+                     char *filename, char *ext) {
+    const struct rlog_record *r = header;
+    if (off == file_size) return 0;
+    if (pread(fd, header, fmt->header_size, off) != (ssize_t)fmt->header_size) return -1;
+    if (r->magic == 0 || (r->magic != fmt->magics[0] && r->magic != fmt->magics[1])) return -1;
+    if (off + rlog_record_len(fmt, header) > file_size) return -1;
+    if (pread(fd, filename, r->name_len, off + fmt->header_size) != r->name_len ||
+        pread(fd, ext, r->ext_len, off + fmt->header_size + r->name_len) != r->ext_len) {
+        return -1;
+    }
+    filename[r->name_len] = '\0';
+    ext[r->ext_len] = '\0';
+    return rlog_header_crc(fmt, header, filename, ext) == r->header_crc ? 1 : -1;
+}
+
+/*
+ * rlog_scan - Hands every record of a file to fn, oldest first. Returns 0
+ * if the walk reached the end of the file, or -1 if it stopped at a bad
+ * record; either way *end is where it stopped. Headers may be at most
+ * RLOG_MAX_HEADER bytes.
+ */
+
+int rlog_scan(const struct rlog_format *fmt, int fd, uint64_t file_size, uint64_t *end, rlog_record_fn fn,
+              void *ctx) {
+    _Alignas(8) char header[RLOG_MAX_HEADER];
+    char filename[UINT16_MAX + 1], ext[UINT16_MAX + 1];
+    uint64_t off = 0;
+    int rc;
+    while ((rc = rlog_read_header(fmt, fd, off, file_size, header, filename, ext)) == 1) {
+        fn(ctx, header, filename, ext, off);
+        off += rlog_record_len(fmt, header);
+    }
+    *end = off;
+    return rc;
+}
+
+static int compare_ids(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * rlog_list_ids - Collects the ids of the files in dir whose names match
+ * name_format (e.g. "segment_%u.pack"), sorted. Returns -1 if dir cannot
+ * be read; free *ids with free().
+ */
+
+int rlog_list_ids(const char *dir, const char *name_format, uint32_t **ids, size_t *count) {
+    *ids = NULL;
+    *count = 0;
+    DIR *d = opendir(dir);
+    if (!d) return -1;
+    size_t cap = 0;
+    struct dirent *entry;
+    unsigned id;
+    while ((entry = readdir(d)) != NULL) {
+        if (sscanf(entry->d_name, name_format, &id) != 1) continue;
+        if (*count == cap) {
+            cap = cap ? cap * 2 : 16;
+            uint32_t *grown = realloc(*ids, cap * sizeof(*grown));
+            if (!grown) break;
+            *ids = grown;
+        }
+        (*ids)[(*count)++] = id;
+    }
+    closedir(d);
+    if (*count > 0) qsort(*ids, *count, sizeof(**ids), compare_ids);
+    return 0;
+}
+
+// === Index === //
+
+static unsigned bucket_of(const char *filename, const char *ext) {
+    uint32_t crc = crc32c_update(0, filename, strlen(filename));
+    return crc32c_update(crc, ext, strlen(ext)) % RLOG_BUCKETS;
+}
+
+struct rlog_name *rlog_name(struct rlog_index *ix, const char *filename, const char *ext, int create) {
+    unsigned b = bucket_of(filename, ext);
+    for (struct rlog_name *n = ix->buckets[b]; n; n = n->next) {
+        if (strcmp(n->filename, filename) == 0 && strcmp(n->ext, ext) == 0) return n;
+    }
+    if (!create) return NULL;
+    struct rlog_name *n = calloc(1, sizeof(*n));
+    if (!n || !(n->filename = strdup(filename)) || !(n->ext = strdup(ext))) {
+        if (n) free(n->filename);
+        free(n);
+        return NULL;
+    }
+    n->next = ix->buckets[b];
+    ix->buckets[b] = n;
+    return n;
+}
+
+void *rlog_entry(const struct rlog_index *ix, const struct rlog_name *n, size_t i) {
+    return (char *)n->versions + i * ix->entry_size;
+}
+
+// The entry of that version under n (which may be NULL), or NULL
+void *rlog_find(const struct rlog_index *ix, struct rlog_name *n, int version) {
+    for (size_t i = 0; n && i < n->count; i++) {
+        int *entry = rlog_entry(ix, n, i);
+        if (*entry == version) return entry;
+    }
+    return NULL;
+}
+
+// Appends an entry for the caller to fill in; NULL if out of memory
+void *rlog_add(const struct rlog_index *ix, struct rlog_name *n) {
+    if (n->count == n->cap) {
+        size_t cap = n->cap ? n->cap * 2 : 4;
+        void *grown = realloc(n->versions, cap * ix->entry_size);
+        if (!grown) return NULL;
+        n->versions = grown;
+        n->cap = cap;
+    }
+    return rlog_entry(ix, n, n->count++);
+}
+
+// Removes an entry, moving the last one into its place
+void rlog_drop(const struct rlog_index *ix, struct rlog_name *n, void *entry) {
+    void *last = rlog_entry(ix, n, --n->count);
+    if (entry != last) memcpy(entry, last, ix->entry_size);
+}
@@ -0,0 +1,72 @@
+/*
+ * recordlog.h - Shared plumbing of the append-only stores.
+ *
+ * The pack (packstore.c) and the cold tier (coldstore.c) both keep
+ * versions as records in numbered, append-only files: a fixed header,
+ * the filename and extension, then a body. Their headers differ past a
+ * common prefix (struct rlog_record), which is enough to check a record,
+ * find the next one and replay a whole file. Both also index what they
+ * hold by filename and extension, with one array of versions per name.
+ *
+ * A store describes its header with a struct rlog_format; everything
+ * here works from that.
+ */
+
+#ifndef RECORDLOG_H
+#define RECORDLOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define RLOG_BUCKETS 4096
+#define RLOG_MAX_HEADER 128
+
+// Leading fields of every record header; the rest is up to the store
+struct rlog_record {
+    uint32_t magic;
+    uint32_t header_crc;   // CRC32C of the header (this field zeroed) and the names
+    uint16_t name_len;
+    uint16_t ext_len;
+};
+
+struct rlog_format {
+    size_t header_size;
+    uint32_t magics[2];                       // record kinds the store writes; 0 = unused
+    uint64_t (*body_len)(const void *header); // bytes after the names
+};
+
+size_t rlog_record_len(const struct rlog_format *fmt, const void *header);
+uint32_t rlog_header_crc(const struct rlog_format *fmt, const void *header, const char *filename, const char *ext);
+int rlog_read_header(const struct rlog_format *fmt, int fd, uint64_t off, uint64_t file_size, void *header,
+                     char *filename, char *ext);
+
+// Called for every intact record of a file, in order
+typedef void (*rlog_record_fn)(void *ctx, const void *header, const char *filename, const char *ext,
+                               uint64_t off);
+
+int rlog_scan(const struct rlog_format *fmt, int fd, uint64_t file_size, uint64_t *end, rlog_record_fn fn,
+              void *ctx);
+int rlog_list_ids(const char *dir, const char *name_format, uint32_t **ids, size_t *count);
+
+// All indexed versions of one filename + extension. versions holds count
+// entries of the index's entry size, each starting with an int version.
+struct rlog_name {
+    char *filename;
+    char *ext;
+    void *versions;
+    size_t count, cap;
+    struct rlog_name *next;
+};
+
+struct rlog_index {
+    size_t entry_size;
+    struct rlog_name *buckets[RLOG_BUCKETS];
+};
+
+struct rlog_name *rlog_name(struct rlog_index *ix, const char *filename, const char *ext, int create);
+void *rlog_find(const struct rlog_index *ix, struct rlog_name *n, int version);
+void *rlog_add(const struct rlog_index *ix, struct rlog_name *n);
+void rlog_drop(const struct rlog_index *ix, struct rlog_name *n, void *entry);
+void *rlog_entry(const struct rlog_index *ix, const struct rlog_name *n, size_t i);
+
+#endif
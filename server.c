@@ -1,20 +1,61 @@
 /*
  * server.c - Practicum 2 Project
- * 
+ *
  * Shorena K. Anzhilov
  * CS5600 - Northeastern University
  * Spring 2025
- * 
+ *
  * This server program handles multiple client connections concurrently.
  * It supports the following functionalities:
  * WRITE: Receive and store encrypted files with versioning.
  * GET: Send decrypted files to clients, supporting version retrieval.
- * RM: Remove specified files from the server storage.
+ *     Versions uploaded with ChaCha20 are stored and returned as the
+ *     client's ciphertext, together with their nonce; only the client
+ *     holds the key.
+ * MGET: Stream every file matching a prefix or glob, optionally as of a
+ *     version or a point in time, back to back in one framed stream.
+ * RM: Remove specified files from the server storage. "RM -r" removes
+ *     every version matching a prefix or glob, a version range and a
+ *     number of newest versions to keep, in one request.
+ * SNAPSHOT: Record the latest version of every path, without copying any
+ *     data, for GET, LS and MGET to read from later. Versions a snapshot
+ *     holds cannot be deleted until it is dropped.
  * LS: List files in the server storage, with optional filtering.
- * SIGINT Handling: Gracefully shuts down the server upon receiving Ctrl+C.
+ *     "LS -l" lists the latest version, size, mtime and CRC32C of every path.
+ * Integrity: every version is stored with whole-file and per-chunk CRC32C
+ *     checksums that are verified on upload and again on every GET.
+ * Rate limits: optional per-client and per-command token buckets and a
+ *     fair-shared bandwidth budget, configured in server.conf.
+ * Listeners: optionally several SO_REUSEPORT accept threads, each pinned to
+ *     a CPU together with the connections it accepts.
+ * Packing: optionally, small versions are appended to shared segment files
+ *     (see packstore.c) instead of getting a file each.
+ * Tracing: optionally, per-request phase timings are kept in per-thread
+ *     ring buffers and dumped as Chrome trace JSON on SIGUSR1 or TRACE.
+ * Memory: transfers borrow 64k buffers from a globally capped pool and
+ *     request-scoped strings come from a per-connection arena (see
+ *     bufpool.c); STATS reports their usage.
+ * WATCH: Subscribe to a path prefix and get new and deleted versions
+ *     pushed as they happen, resumable by sequence number.
+ * Tiering: optionally, old or long-unread versions move to compressed
+ *     archives on a second path (see coldstore.c) and come back when they
+ *     are read again; clients see no difference.
+ * Cipher workers: optionally, a large legacy XOR GET is read, checked and
+ *     decrypted by a pipeline of threads while it is sent (see cipherpipe.c).
+ * io_uring: optionally, large file transfers batch their socket and file
+ *     I/O through a per-connection io_uring (see uring.c).
+ * Restart: SIGINT or SIGTERM stops accepting and lets the transfers in
+ *     flight finish before exiting. A new server started in the same
+ *     directory takes the listening sockets over from the running one, which
+ *     then drains the same way, so clients never see a refused connection.
+ *
+ * A connection may carry any number of commands back to back, so clients
+ * such as SYNC can keep a few persistent connections open instead of
+ * connecting once per file.
  *
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -22,32 +63,254 @@
 #include <signal.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sched.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <pthread.h>
 #include <dirent.h>
-#include <sys/stat.h>
+#include <fnmatch.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include "crc32c.h"
+#include "cipher.h"
+#include "ratelimit.h"
+#include "packstore.h"
+#include "trace.h"
+#include "bufpool.h"
+#include "coldstore.h"
+#include "watch.h"
+#include "uring.h"
+#include "cipherpipe.h"
+#include "snapshot.h"
 
-#define PORT 2024
+#define PORT 2024            // overridable with the FS_PORT environment variable
 #define BUFFER_SIZE 4096
 #define ROOT_DIR "server_storage"
-#define ENCRYPTION_KEY "secretkey"
+#define META_DIR "server_meta"   // per-version checksums, mirroring ROOT_DIR
+#define CRC_CHUNK (64 * 1024)    // granularity of the stored chunk checksums
+#define PACK_DIR "server_packs"   // segment files of the packed storage mode
+#define SNAP_DIR "server_snapshots"  // saved SNAPSHOT path lists
+#define CONFIG_FILE "server.conf" // overridable with the FS_CONFIG environment variable
+#define MAX_LISTENERS 64
+#define WATCH_PING 30              // seconds of silence before a WATCH heartbeat
+#define READ_GUARD 3600           // seconds a read keeps a version off the cold tier
+#define URING_MIN_SIZE (4 * CRC_CHUNK)  // smaller transfers keep to plain system calls
+#define PIPE_MIN_SIZE (4L * 1024 * 1024)  // smallest GET decrypted by cipher workers
+#define RM_MAX_THREADS 64
+#define ENCRYPTION_KEY "secretkey"  // legacy XOR mode only
+
+int listen_socks[MAX_LISTENERS];
+int nlisteners;
+pthread_mutex_t file_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Shared while a version is deleted, held alone while a snapshot is taken
+static pthread_rwlock_t snapshot_lock = PTHREAD_RWLOCK_INITIALIZER;
+// Bumped whenever a version file is removed or a cold version is brought
+// back, either of which a listing running meanwhile can miss (take_snapshot)
+static atomic_ulong listing_epoch;
+
+// Takes file_mutex, recording the wait as a lock_wait span
+static void lock_files(void) {
+    uint64_t t = trace_now();
+    pthread_mutex_lock(&file_mutex);
+    trace_span(TRACE_LOCK_WAIT, t);
+}
+
+// ===  Helper Functions === //
+
+/*
+ * send_all - Sends the whole buffer, retrying on short writes.
+ * Returns 0 on success, -1 if the connection failed.
+ */
+
+int send_all(int sock, const void *data, size_t len) {
+    const char *p = data;
+    while (len > 0) {
+        ssize_t n = send(sock, p, len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int send_str(int sock, const char *msg) {
+    return send_all(sock, msg, strlen(msg));
+}
+
+// === Connection Buffering === //
+
+/*
+ * conn - Buffered reader over a client socket. Commands are read line by
+ * line and payloads through the same buffer, so bytes belonging to the
+ * next pipelined command are never lost.
+ */
+
+struct conn {
+    int sock;
+    struct client_limits *limits;
+    uint64_t accepted;   // trace_now() when accept() returned
+    struct arena *arena; // per-request allocations, reset after every command
+    const char *upload;  // file of the WRITE in progress, under file_mutex
+    struct uring *ring;  // set up by the first large transfer, see conn_ring
+    struct conn *prev;   // open connections, under conns_lock
+    struct conn *next;
+    size_t off;
+    size_t len;
+    char buf[BUFFER_SIZE];
+};
+
+static ssize_t conn_fill(struct conn *c) {
+    ssize_t n;
+    do {
+        n = recv(c->sock, c->buf, sizeof(c->buf), 0);
+    } while (n < 0 && errno == EINTR);
+    c->off = 0;
+    c->len = n > 0 ? n : 0;
+    return n;
+}
+
+/*
+ * conn_read_line - Reads one command line, without the trailing newline.
+ * Returns 1 on success, 0 on a clean end of stream and -1 on error or an
+ * overlong line.
+ */
+
+int conn_read_line(struct conn *c, char *line, size_t cap) {
+    size_t n = 0;
+    for (;;) {
+        if (c->off == c->len) {
+            ssize_t got = conn_fill(c);
+            if (got <= 0) return (got == 0 && n == 0) ? 0 : -1;
+        }
+        char *start = c->buf + c->off;
+        char *nl = memchr(start, '\n', c->len - c->off);
+        size_t take = nl ? (size_t)(nl - start) : c->len - c->off;
+        if (n + take >= cap) return -1;
+        memcpy(line + n, start, take);
+        n += take;
+        c->off += take;
+        if (nl) {
+            c->off++;
+            if (n > 0 && line[n - 1] == '\r') n--;
+            line[n] = '\0';
+            return 1;
+        }
+    }
+}
 
-int server_sock; 
-pthread_mutex_t file_mutex = PTHREAD_MUTEX_INITIALIZER; 
+/*
+ * conn_read - Reads up to len payload bytes, draining buffered data first.
+ * Returns the number of bytes read, 0 on end of stream, -1 on error.
+ */
+
+ssize_t conn_read(struct conn *c, void *dst, size_t len) {
+    if (c->off < c->len) {
+        size_t avail = c->len - c->off;
+        if (len > avail) len = avail;
+        memcpy(dst, c->buf + c->off, len);
+        c->off += len;
+        return len;
+    }
+    ssize_t n;
+    do {
+        n = recv(c->sock, dst, len, 0);
+    } while (n < 0 && errno == EINTR);
+    return n;
+}
+
+/*
+ * conn_skip_payload - Discards len payload bytes (e.g. the body of a
+ * rejected WRITE) and, if one was announced, the CRC trailer after them.
+ */
+
+int conn_skip_payload(struct conn *c, long len, int trailer) {
+    char scratch[BUFFER_SIZE];
+    while (len > 0) {
+        ssize_t n = conn_read(c, scratch, len < (long)sizeof(scratch) ? (size_t)len : sizeof(scratch));
+        if (n <= 0) return -1;
+        len -= n;
+    }
+    if (trailer && conn_read_line(c, scratch, sizeof(scratch)) <= 0) return -1;
+    return 0;
+}
+
+// === Storage Paths === //
+
+/*
+ * valid_path - Rejects remote paths that would escape ROOT_DIR.
+ */
+
+int valid_path(const char *path) {
+    if (path[0] == '\0' || path[0] == '/') return 0;
+    const char *p = path;
+    while (*p) {
+        const char *end = strchr(p, '/');
+        size_t len = end ? (size_t)(end - p) : strlen(p);
+        if (len == 0 || (len == 2 && p[0] == '.' && p[1] == '.') || (len == 1 && p[0] == '.')) return 0;
+        p += len;
+        if (*p == '/') p++;
+    }
+    return 1;
+}
+
+/*
+ * split_path - Splits a remote path into name and extension
+ * ("docs/a.txt" -> "docs/a" + ".txt"). Only a dot in the last path
+ * component starts an extension, and overlong extensions stay in the name.
+ */
+
+void split_path(const char *path, char *filename, size_t name_cap, char *ext, size_t ext_cap) {
+    const char *slash = strrchr(path, '/');
+    const char *dot = strrchr(slash ? slash : path, '.');
+    if (dot && dot != path && dot[-1] != '/' && strlen(dot) < ext_cap) {
+        snprintf(filename, name_cap, "%.*s", (int)(dot - path), path);
+        snprintf(ext, ext_cap, "%s", dot);
+    } else {
+        snprintf(filename, name_cap, "%s", path);
+        ext[0] = '\0';
+    }
+}
 
-// ===  Helper Functions === // 
+/*
+ * parse_version_suffix - Returns N if name[0..len) ends in "_v<N>", else 0.
+ * *stem_len receives the length of the part before "_v".
+ */
+
+static int parse_version_suffix(const char *name, size_t len, size_t *stem_len) {
+    size_t i = len;
+    while (i > 0 && name[i - 1] >= '0' && name[i - 1] <= '9') i--;
+    if (i == len || i < 3 || name[i - 1] != 'v' || name[i - 2] != '_') return 0;
+    *stem_len = i - 2;
+    return atoi(name + i);
+}
 
 /*
- * xor_cipher - Encrypts/Decrypts data using XOR cipher with a given key.
+ * parse_stored_name - Maps a stored file name ("a_v3.txt") back to its
+ * logical name ("a.txt") and returns the version, or 0 if it is not a
+ * versioned file.
  */
 
-void xor_cipher(char *data, long size, const char *key) {
-    size_t key_len = strlen(key);
-    for (long i = 0; i < size; ++i) {
-        data[i] ^= key[i % key_len];
+int parse_stored_name(const char *stored, char *logical, size_t cap) {
+    size_t len = strlen(stored), stem;
+    const char *dot = strrchr(stored, '.');
+    int version;
+    if (dot && (version = parse_version_suffix(stored, dot - stored, &stem)) > 0) {
+        snprintf(logical, cap, "%.*s%s", (int)stem, stored, dot);
+        return version;
     }
+    if ((version = parse_version_suffix(stored, len, &stem)) > 0) {
+        snprintf(logical, cap, "%.*s", (int)stem, stored);
+        return version;
+    }
+    return 0;
 }
 
 /*
@@ -55,9 +318,9 @@ void xor_cipher(char *data, long size, const char *key) {
  */
 
 void make_parent_dirs(const char *path) {
-    char temp[1024];
-    strcpy(temp, path);
-    for (char *p = temp + strlen(ROOT_DIR) + 1; *p; p++) {
+    char temp[2304];
+    snprintf(temp, sizeof(temp), "%s", path);
+    for (char *p = temp + 1; *p; p++) {
         if (*p == '/') {
             *p = '\0';
             mkdir(temp, 0755);
@@ -68,274 +331,2663 @@ void make_parent_dirs(const char *path) {
 
 /*
  * get_latest_version - Retrieves the latest version number of a file.
+ * Only "<name>_v<N><ext>" entries in the file's own directory count,
+ * plus any packed versions.
  */
 
-int get_latest_version(const char *basepath) {
+int get_latest_version(const char *filename, const char *ext) {
+    uint64_t t = trace_now();
+    char dirpath[2048];
+    const char *slash = strrchr(filename, '/');
+    const char *base = slash ? slash + 1 : filename;
+    if (slash) {
+        snprintf(dirpath, sizeof(dirpath), "%s/%.*s", ROOT_DIR, (int)(slash - filename), filename);
+    } else {
+        snprintf(dirpath, sizeof(dirpath), "%s", ROOT_DIR);
+    }
+
     int max_version = 0;
-    DIR *dir = opendir(ROOT_DIR);
-    if (!dir) return 0;
+    DIR *dir = opendir(dirpath);
+    size_t base_len = strlen(base), ext_len = strlen(ext);
     struct dirent *entry;
-    while ((entry = readdir(dir)) != NULL) {
-        if (strstr(entry->d_name, basepath) && strstr(entry->d_name, "_v")) {
-            int ver = 0;
-            sscanf(entry->d_name, "%*[^_]_v%d", &ver);
-            if (ver > max_version) max_version = ver;
+    while (dir && (entry = readdir(dir)) != NULL) {
+        size_t len = strlen(entry->d_name), stem;
+        if (len <= base_len + ext_len || strncmp(entry->d_name, base, base_len) != 0) continue;
+        if (strcmp(entry->d_name + len - ext_len, ext) != 0) continue;
+        int ver = parse_version_suffix(entry->d_name, len - ext_len, &stem);
+        if (ver > max_version && stem == base_len) max_version = ver;
+    }
+    if (dir) closedir(dir);
+    int packed = pack_latest_version(filename, ext);
+    if (packed > max_version) max_version = packed;
+    int cold = cold_latest_version(filename, ext);
+    trace_span(TRACE_VERSION_LOOKUP, t);
+    return cold > max_version ? cold : max_version;
+}
+
+/*
+ * parse_stored_path - Splits a stored path ("docs/a_v3.txt") into the
+ * filename and extension it was written under ("docs/a", ".txt") and
+ * returns the version, or 0 if it is not a versioned path.
+ */
+
+int parse_stored_path(const char *stored, char *filename, size_t name_cap, char *ext, size_t ext_cap) {
+    char logical[1024];
+    const char *slash = strrchr(stored, '/');
+    size_t dir_len = slash ? (size_t)(slash - stored) + 1 : 0;
+    if (dir_len >= sizeof(logical)) return 0;
+    int version = parse_stored_name(stored + dir_len, logical + dir_len, sizeof(logical) - dir_len);
+    if (version == 0) return 0;
+    memcpy(logical, stored, dir_len);
+    split_path(logical, filename, name_cap, ext, ext_cap);
+    return version;
+}
+
+/*
+ * open_version - Opens the file-backed version at final ("ROOT_DIR/..."),
+ * or its archived copy if it has moved to the cold tier, and sets *size.
+ * Reading a file refreshes its atime (at most every READ_GUARD seconds,
+ * whatever the mount options), which is what the tiering policy goes by.
+ */
+
+static FILE *open_version(const char *final, long *size) {
+    char filename[1024], ext[32];
+    struct stat st;
+    lock_files();
+    FILE *fp = fopen(final, "rb");
+    if (fp && fstat(fileno(fp), &st) == 0) {
+        *size = st.st_size;
+        time_t now = time(NULL);
+        if (st.st_atime < now - READ_GUARD) {
+            struct timespec times[2] = { { now, 0 }, { 0, UTIME_OMIT } };
+            futimens(fileno(fp), times);
         }
+    } else if (fp) {
+        fclose(fp);
+        fp = NULL;
+    } else {
+        int version = parse_stored_path(final + strlen(ROOT_DIR) + 1, filename, sizeof(filename), ext, sizeof(ext));
+        if (version > 0) fp = cold_fopen(filename, ext, version, size);
     }
-    closedir(dir);
-    return max_version;
+    pthread_mutex_unlock(&file_mutex);
+    return fp;
 }
 
+// === Version Metadata === //
+
 /*
- * list_files - Sends a list of files in the server storage to the client.
- * If a filter is provided, only matching files are listed.
+ * version_meta - Integrity data kept for each stored version: the CRC32C
+ * of the whole file and of every CRC_CHUNK-sized chunk, so GET can catch
+ * corruption on disk before the damaged chunk is sent.
  */
 
-void list_files(int client_sock, const char *filter) {
-    DIR *dir = opendir(ROOT_DIR);
+struct version_meta {
+    uint32_t crc;
+    size_t nchunks;
+    uint32_t *chunks;
+    int has_nonce;                       // set for ChaCha20 uploads
+    uint8_t nonce[CHACHA20_NONCE_SIZE];
+};
+
+/*
+ * meta_path - Maps ROOT_DIR/<rel> to META_DIR/<rel>.meta.
+ */
+
+void meta_path(char *out, size_t cap, const char *final) {
+    snprintf(out, cap, "%s/%s.meta", META_DIR, final + strlen(ROOT_DIR) + 1);
+}
+
+int save_meta(const char *final, const struct version_meta *m) {
+    char path[2200];
+    meta_path(path, sizeof(path), final);
+    make_parent_dirs(path);
+    FILE *fp = fopen(path, "w");
+    if (!fp) return -1;
+    fprintf(fp, "crc32c %08x\nchunk %d\n", m->crc, CRC_CHUNK);
+    if (m->has_nonce) {
+        char hex[2 * CHACHA20_NONCE_SIZE + 1];
+        hex_encode(m->nonce, CHACHA20_NONCE_SIZE, hex);
+        fprintf(fp, "nonce %s\n", hex);
+    }
+    for (size_t i = 0; i < m->nchunks; i++) fprintf(fp, "%08x\n", m->chunks[i]);
+    return fclose(fp) == 0 ? 0 : -1;
+}
+
+/*
+ * load_meta - Reads the checksums (and nonce, if any) of a stored
+ * version. Chunk checksums are only loaded when with_chunks is set.
+ * Returns -1 for versions that have no (or unreadable) metadata.
+ */
+
+int load_meta(const char *final, struct version_meta *m, int with_chunks) {
+    char path[2200];
+    char hex[2 * CHACHA20_NONCE_SIZE + 1];
+    int chunk_size = 0;
+    meta_path(path, sizeof(path), final);
+    m->nchunks = 0;
+    m->chunks = NULL;
+    m->has_nonce = 0;
+    FILE *fp = fopen(path, "r");
+    if (!fp) return -1;
+    if (fscanf(fp, "crc32c %x chunk %d", &m->crc, &chunk_size) != 2 || chunk_size != CRC_CHUNK) {
+        fclose(fp);
+        return -1;
+    }
+    if (fscanf(fp, " nonce %24s", hex) == 1) {
+        m->has_nonce = hex_decode(hex, m->nonce, CHACHA20_NONCE_SIZE) == 0;
+    }
+    if (with_chunks) {
+        size_t cap = 0;
+        unsigned int crc;
+        while (fscanf(fp, "%x", &crc) == 1) {
+            if (m->nchunks == cap) {
+                cap = cap ? cap * 2 : 64;
+                uint32_t *grown = realloc(m->chunks, cap * sizeof(*grown));
+                if (!grown) break;
+                m->chunks = grown;
+            }
+            m->chunks[m->nchunks++] = crc;
+        }
+    }
+    fclose(fp);
+    return 0;
+}
+
+void remove_meta(const char *final) {
+    char path[2200];
+    meta_path(path, sizeof(path), final);
+    remove(path);
+}
+
+/*
+ * walk_storage - Calls fn for every regular file below ROOT_DIR/reldir,
+ * passing its path relative to ROOT_DIR.
+ */
+
+typedef void (*walk_fn)(const char *relpath, const struct stat *st, void *ctx);
+
+void walk_storage(const char *reldir, walk_fn fn, void *ctx) {
+    char dirpath[2048];
+    snprintf(dirpath, sizeof(dirpath), "%s%s%s", ROOT_DIR, reldir[0] ? "/" : "", reldir);
+    DIR *dir = opendir(dirpath);
+    if (!dir) return;
     struct dirent *entry;
-    char line[1024];
     while ((entry = readdir(dir)) != NULL) {
-        if (entry->d_type == DT_REG) {
-            if (!filter || strstr(entry->d_name, filter)) {
-                snprintf(line, sizeof(line), "%s\n", entry->d_name);
-                send(client_sock, line, strlen(line), 0);
-            }
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        char rel[1024], full[2048];
+        snprintf(rel, sizeof(rel), "%s%s%s", reldir, reldir[0] ? "/" : "", entry->d_name);
+        snprintf(full, sizeof(full), "%s/%s", ROOT_DIR, rel);
+        struct stat st;
+        if (lstat(full, &st) != 0) continue;
+        if (S_ISDIR(st.st_mode)) {
+            walk_storage(rel, fn, ctx);
+        } else if (S_ISREG(st.st_mode)) {
+            fn(rel, &st, ctx);
         }
     }
-    send(client_sock, "__END__\n", 8, 0);
     closedir(dir);
 }
 
+// === Listing === //
+
+struct plain_ctx {
+    int sock;
+    const char *filter;
+};
+
+static void list_plain(const char *relpath, const struct stat *st, void *arg) {
+    struct plain_ctx *ctx = arg;
+    char line[1100];
+    if (!ctx->filter || strstr(relpath, ctx->filter)) {
+        snprintf(line, sizeof(line), "%s\n", relpath);
+        send_str(ctx->sock, line);
+    }
+}
+
 /*
- * handle_sigint - Signal handler for SIGINT (Ctrl+C).
- * Closes the server socket and exits gracefully.
+ * list_files - Sends a list of files in the server storage to the client.
+ * If a filter is provided, only matching files are listed.
  */
 
-void handle_sigint(int sig) {
-    printf("\nCaught SIGINT, closing server socket...\n");
-    close(server_sock);
-    exit(0);
+void list_files(int client_sock, const char *filter) {
+    struct plain_ctx ctx = { client_sock, filter };
+    walk_storage("", list_plain, &ctx);
+    size_t npacked;
+    struct pack_item *packed = pack_list(&npacked);
+    for (size_t i = 0; i < npacked; i++) list_plain(packed[i].stored, NULL, &ctx);
+    pack_free_list(packed, npacked);
+    size_t ncold;
+    struct cold_item *cold = cold_list(&ncold);
+    for (size_t i = 0; i < ncold; i++) list_plain(cold[i].stored, NULL, &ctx);
+    cold_free_list(cold, ncold);
+    send_str(client_sock, "__END__\n");
+}
+
+// list_files for the versions recorded in snapshot snap
+void list_snapshot_files(int client_sock, const char *filter, unsigned long snap) {
+    size_t count;
+    struct snap_entry *entries = snap_entries(snap, &count);
+    char line[1100], filename[1024], ext[32];
+    for (size_t i = 0; i < count; i++) {
+        split_path(entries[i].path, filename, sizeof(filename), ext, sizeof(ext));
+        snprintf(line, sizeof(line), "%s_v%d%s\n", filename, entries[i].version, ext);
+        if (!filter || strstr(line, filter)) send_str(client_sock, line);
+    }
+    snap_free_entries(entries, count);
+    send_str(client_sock, "__END__\n");
+}
+
+struct version_entry {
+    char *path;
+    char *stored;
+    int version;
+    long size;
+    time_t mtime;
+    time_t atime;                    // file-backed versions only
+    const struct pack_info *packed;  // checksum and nonce of packed versions
+    int cold;                        // archived in the cold tier
+};
+
+struct detail_ctx {
+    const char *prefix;
+    struct version_entry *entries;
+    size_t count, cap;
+};
+
+static struct version_entry *add_version(struct detail_ctx *ctx, const char *logical, const char *relpath,
+                                         int version) {
+    if (ctx->prefix && strncmp(logical, ctx->prefix, strlen(ctx->prefix)) != 0) return NULL;
+
+    if (ctx->count == ctx->cap) {
+        size_t cap = ctx->cap ? ctx->cap * 2 : 256;
+        struct version_entry *grown = realloc(ctx->entries, cap * sizeof(*grown));
+        if (!grown) return NULL;
+        ctx->entries = grown;
+        ctx->cap = cap;
+    }
+    struct version_entry *e = &ctx->entries[ctx->count];
+    if (!(e->path = strdup(logical))) return NULL;
+    if (!(e->stored = strdup(relpath))) {
+        free(e->path);
+        return NULL;
+    }
+    e->version = version;
+    e->atime = 0;
+    e->packed = NULL;
+    e->cold = 0;
+    ctx->count++;
+    return e;
+}
+
+static void collect_version(const char *relpath, const struct stat *st, void *arg) {
+    char logical[1024];
+    const char *slash = strrchr(relpath, '/');
+    size_t dir_len = slash ? (size_t)(slash - relpath) + 1 : 0;
+    int version = parse_stored_name(relpath + dir_len, logical + dir_len, sizeof(logical) - dir_len);
+    if (version == 0) return;
+    memcpy(logical, relpath, dir_len);
+    struct version_entry *e = add_version(arg, logical, relpath, version);
+    if (e) {
+        e->size = st->st_size;
+        e->mtime = st->st_mtime;
+        e->atime = st->st_atime;
+    }
 }
 
-// ===  Client Handler Thread === // 
+static int compare_versions(const void *a, const void *b) {
+    const struct version_entry *x = a, *y = b;
+    int c = strcmp(x->path, y->path);
+    if (c != 0) return c;
+    if (x->version != y->version) return y->version - x->version;
+    return x->cold - y->cold;
+}
 
 /*
- * handle_client - Handles client requests in a separate thread.
+ * collect_versions - Gathers every version, file-backed, packed or cold,
+ * whose path starts with ctx->prefix, sorted by path and then newest
+ * first. Packed entries point into *packed, which is freed by
+ * free_versions. A version caught mid-move between tiers is listed once.
  */
 
-void *handle_client(void *arg) {
-    int client_sock = *(int *)arg;
-    free(arg);
-    
-    char buffer[BUFFER_SIZE];
-    memset(buffer, 0, sizeof(buffer));
-    ssize_t received = recv(client_sock, buffer, sizeof(buffer), 0);
-    if (received <= 0) {
-        close(client_sock);
-        pthread_exit(NULL);
-    }
-    
-    // === WRITE Operation === //
-
-    if (strncmp(buffer, "WRITE", 5) == 0) {
-        char filepath[1024];
-        long filesize;
-        sscanf(buffer, "WRITE %s %ld", filepath, &filesize);
-
-        // Split the remote path into name and extension
-        char *dot = strrchr(filepath, '.');
-        char filename[512];
-        char ext[32] = "";
-        if (dot) {
-            strncpy(filename, filepath, dot - filepath);
-            filename[dot - filepath] = '\0';
-            strcpy(ext, dot);
+static void collect_versions(struct detail_ctx *ctx, struct pack_item **packed, size_t *npacked) {
+    walk_storage("", collect_version, ctx);
+    *packed = pack_list(npacked);
+    for (size_t i = 0; i < *npacked; i++) {
+        struct pack_item *item = &(*packed)[i];
+        struct version_entry *e = add_version(ctx, item->logical, item->stored, item->version);
+        if (e) {
+            e->size = item->info.size;
+            e->mtime = item->info.mtime;
+            e->packed = &item->info;
+        }
+    }
+    size_t ncold;
+    struct cold_item *cold = cold_list(&ncold);
+    for (size_t i = 0; i < ncold; i++) {
+        struct version_entry *e = add_version(ctx, cold[i].logical, cold[i].stored, cold[i].version);
+        if (e) {
+            e->size = cold[i].size;
+            e->mtime = cold[i].mtime;
+            e->cold = 1;
+        }
+    }
+    cold_free_list(cold, ncold);
+    qsort(ctx->entries, ctx->count, sizeof(*ctx->entries), compare_versions);
+
+    // The file-backed copy sorts first and wins
+    size_t kept = 0;
+    for (size_t i = 0; i < ctx->count; i++) {
+        struct version_entry *e = &ctx->entries[i];
+        if (kept > 0 && e->version == ctx->entries[kept - 1].version &&
+            strcmp(e->path, ctx->entries[kept - 1].path) == 0) {
+            free(e->path);
+            free(e->stored);
         } else {
-            strcpy(filename, filepath);
+            ctx->entries[kept++] = *e;
         }
+    }
+    ctx->count = kept;
+}
 
-        pthread_mutex_lock(&file_mutex);
-        int version = get_latest_version(filename) + 1;
+static void free_versions(struct detail_ctx *ctx, struct pack_item *packed, size_t npacked) {
+    for (size_t i = 0; i < ctx->count; i++) {
+        free(ctx->entries[i].path);
+        free(ctx->entries[i].stored);
+    }
+    free(ctx->entries);
+    pack_free_list(packed, npacked);
+}
+
+/*
+ * list_latest - Sends "path version size mtime crc32c nonce" for the
+ * latest version of every path starting with prefix, or for the version
+ * it had in snapshot snap (if not 0). crc32c is "-" for versions that
+ * predate checksums and nonce is "-" unless the version was uploaded with
+ * ChaCha20. This is what SYNC diffs against.
+ */
 
-        // Build the full path to the new versioned file
-        char final[2048];
-        snprintf(final, sizeof(final), "%s/%s_v%d%s", ROOT_DIR, filename, version, ext);
-        make_parent_dirs(final);
+void list_latest(int client_sock, const char *prefix, unsigned long snap) {
+    struct detail_ctx ctx = { prefix, NULL, 0, 0 };
+    struct pack_item *packed;
+    size_t npacked;
+    collect_versions(&ctx, &packed, &npacked);
 
-        // === Permission Check === //
-        if (access(final, F_OK) == 0) {
-            if (access(final, W_OK) != 0) {
-                send(client_sock, "Permission denied.\n", 19, 0);
-                pthread_mutex_unlock(&file_mutex);
-                close(client_sock);
-                pthread_exit(NULL);
+    char line[1200], final[2048], crc[16], nonce[2 * CHACHA20_NONCE_SIZE + 1];
+    for (size_t i = 0; i < ctx.count; i++) {
+        struct version_entry *e = &ctx.entries[i];
+        int first = i == 0 || strcmp(e->path, ctx.entries[i - 1].path) != 0;
+        if (snap ? e->version == snap_version(snap, e->path) : first) {
+            struct version_meta meta;
+            snprintf(final, sizeof(final), "%s/%s", ROOT_DIR, e->stored);
+            strcpy(crc, "-");
+            strcpy(nonce, "-");
+            if (e->packed) {
+                snprintf(crc, sizeof(crc), "%08x", e->packed->crc);
+                if (e->packed->has_nonce) hex_encode(e->packed->nonce, CHACHA20_NONCE_SIZE, nonce);
+            } else if (load_meta(final, &meta, 0) == 0) {
+                snprintf(crc, sizeof(crc), "%08x", meta.crc);
+                if (meta.has_nonce) hex_encode(meta.nonce, CHACHA20_NONCE_SIZE, nonce);
             }
+            snprintf(line, sizeof(line), "%s %d %ld %ld %s %s\n", e->path, e->version, e->size, (long)e->mtime, crc, nonce);
+            send_str(client_sock, line);
         }
+    }
+    free_versions(&ctx, packed, npacked);
+    send_str(client_sock, "__END__\n");
+}
 
-        FILE *fp = fopen(final, "wb");
-        pthread_mutex_unlock(&file_mutex);
-        if (!fp) {
-            close(client_sock);
-            pthread_exit(NULL);
+// === Configuration === //
+
+struct server_config {
+    int listeners;        // accept threads, each with its own SO_REUSEPORT socket
+    int pin_cpus;         // pin listener i (and its connections) to CPU i
+    int tcp_nodelay;
+    int sndbuf;           // SO_SNDBUF/SO_RCVBUF for client sockets, 0 = kernel default
+    int rcvbuf;
+    struct rate_config rate;
+    long pack_threshold;  // versions up to this size are packed, 0 = off
+    long pack_segment;    // segment file size
+    double pack_compact;  // dead fraction at which a segment is rewritten
+    int trace;            // record per-request phase timings
+    int trace_events;     // ring buffer slots per thread
+    long buffer_pool;     // cap on the memory of all pooled I/O buffers
+    char cold_dir[1024];  // archive directory of the cold tier, "" = off
+    int cold_keep;        // newest versions of a path that stay hot, 0 = no limit
+    int cold_after_days;  // unread this long moves a version, 0 = never
+    int cold_promote;     // reads within one pass that bring a version back
+    int cold_interval;    // seconds between tiering passes
+    long cold_archive;    // archive file size
+    int cold_level;       // deflate level
+    int watch_history;    // change events kept for resuming WATCH subscribers
+    char upgrade_socket[256];  // where a new server asks for the listeners, "none" = off
+    int drain_timeout;    // seconds a stopping server waits for transfers in flight
+    atomic_int io_uring;  // batch large transfers through io_uring; cleared if unsupported
+    int cipher_threads;   // workers decrypting one large legacy XOR GET, 0 = inline
+    int rm_threads;       // workers unlinking the versions of one bulk RM
+};
+
+struct server_config config = {
+    .listeners = 1,
+    .pin_cpus = 0,
+    .tcp_nodelay = 1,
+    .sndbuf = 0,
+    .rcvbuf = 0,
+    .rate = { 0, 0, { 0 }, 64 * 1024 },
+    .pack_threshold = 0,
+    .pack_segment = 64L * 1024 * 1024,
+    .pack_compact = 0.5,
+    .trace = 0,
+    .trace_events = 2048,
+    .buffer_pool = 64L * 1024 * 1024,
+    .cold_dir = "",
+    .cold_keep = 0,
+    .cold_after_days = 0,
+    .cold_promote = 2,
+    .cold_interval = 300,
+    .cold_archive = 1024L * 1024 * 1024,
+    .cold_level = 6,
+    .watch_history = 4096,
+    .upgrade_socket = "server_upgrade.sock",
+    .drain_timeout = 60,
+    .io_uring = 0,
+    .cipher_threads = 0,
+    .rm_threads = 4,
+};
+
+/*
+ * parse_amount - Parses a number with an optional k/m/g suffix (powers of
+ * 1024), e.g. "10m" for 10 MiB/s.
+ */
+
+double parse_amount(const char *text) {
+    char *end;
+    double value = strtod(text, &end);
+    switch (*end) {
+        case 'k': case 'K': return value * 1024;
+        case 'm': case 'M': return value * 1024 * 1024;
+        case 'g': case 'G': return value * 1024 * 1024 * 1024;
+        default: return value;
+    }
+}
+
+/*
+ * load_config - Reads "key = value" lines from the config file, if there is
+ * one. Lines starting with '#' are comments. Every limit defaults to 0,
+ * which means unlimited.
+ *
+ *   rate_client_bytes   bytes/s per client IP
+ *   rate_total_bytes    bytes/s shared fairly by all bulk transfers
+ *   rate_write_ops      WRITE requests/s per client IP (likewise
+ *   rate_get_ops        for GET, RM and LS)
+ *   rate_small_transfer transfers up to this size are never slowed down
+ *   listeners           number of SO_REUSEPORT accept threads (default 1)
+ *   pin_cpus            1 to pin each listener and its connections to a CPU
+ *   tcp_nodelay         0 to leave Nagle's algorithm on (default 1)
+ *   socket_sndbuf       send/receive buffer sizes for client sockets
+ *   socket_rcvbuf
+ *   pack_threshold      pack versions up to this size (at most 64k) into
+ *                       segment files; 0 (default) stores every version
+ *                       as its own file
+ *   pack_segment_size   size at which a new segment is started (64m)
+ *   pack_compact_ratio  rewrite a segment once this fraction is dead (0.5)
+ *   trace               1 to record per-request phase timings
+ *   trace_events        events kept per connection thread (2048)
+ *   buffer_pool         memory for 64k transfer buffers shared by all
+ *                       connections (64m); transfers wait beyond that
+ *   cold_dir            directory of the cold tier's archives; unset
+ *                       (default) keeps every version on the fast tier
+ *   cold_keep_versions  move all but the newest N versions of a path
+ *   cold_after_days     move versions not read for this many days
+ *   cold_promote_reads  bring a cold version back after this many reads
+ *                       within one pass (2; 0 = never)
+ *   cold_interval       seconds between tiering passes (300)
+ *   cold_archive_size   size at which a new archive is started (1g)
+ *   cold_compression    deflate level 1-9 (6)
+ *   watch_history       change events kept for WATCH subscribers that
+ *                       resume after a disconnect (4096)
+ *   upgrade_socket      UNIX socket through which a newly started server
+ *                       takes the listening sockets over
+ *                       (server_upgrade.sock; none = off)
+ *   drain_timeout       seconds a stopping server lets transfers in flight
+ *                       run before discarding them (60)
+ *   io_uring            1 to run file transfers of 256k and more through
+ *                       io_uring; kernels without it keep to plain calls
+ *   cipher_threads      threads checking and decrypting a single legacy
+ *                       XOR GET of 4m or more (0 = on the connection's
+ *                       own thread)
+ *   rm_threads          threads deleting the versions of one "RM -r" (4)
+ */
+
+void load_config(void) {
+    const char *path = getenv("FS_CONFIG") ? getenv("FS_CONFIG") : CONFIG_FILE;
+    FILE *fp = fopen(path, "r");
+    if (fp) {
+        char line[512], key[128], value[256];
+        while (fgets(line, sizeof(line), fp)) {
+            if (line[0] == '#' || sscanf(line, " %127[^= \t] = %255s", key, value) != 2) continue;
+            if (strcmp(key, "rate_client_bytes") == 0) config.rate.client_bytes = parse_amount(value);
+            else if (strcmp(key, "rate_total_bytes") == 0) config.rate.total_bytes = parse_amount(value);
+            else if (strcmp(key, "rate_write_ops") == 0) config.rate.ops[OP_WRITE] = parse_amount(value);
+            else if (strcmp(key, "rate_get_ops") == 0) config.rate.ops[OP_GET] = parse_amount(value);
+            else if (strcmp(key, "rate_rm_ops") == 0) config.rate.ops[OP_RM] = parse_amount(value);
+            else if (strcmp(key, "rate_ls_ops") == 0) config.rate.ops[OP_LS] = parse_amount(value);
+            else if (strcmp(key, "rate_small_transfer") == 0) config.rate.small_transfer = (long)parse_amount(value);
+            else if (strcmp(key, "listeners") == 0) config.listeners = atoi(value);
+            else if (strcmp(key, "pin_cpus") == 0) config.pin_cpus = atoi(value);
+            else if (strcmp(key, "tcp_nodelay") == 0) config.tcp_nodelay = atoi(value);
+            else if (strcmp(key, "socket_sndbuf") == 0) config.sndbuf = (int)parse_amount(value);
+            else if (strcmp(key, "socket_rcvbuf") == 0) config.rcvbuf = (int)parse_amount(value);
+            else if (strcmp(key, "pack_threshold") == 0) config.pack_threshold = (long)parse_amount(value);
+            else if (strcmp(key, "pack_segment_size") == 0) config.pack_segment = (long)parse_amount(value);
+            else if (strcmp(key, "pack_compact_ratio") == 0) config.pack_compact = atof(value);
+            else if (strcmp(key, "trace") == 0) config.trace = atoi(value);
+            else if (strcmp(key, "trace_events") == 0) config.trace_events = (int)parse_amount(value);
+            else if (strcmp(key, "buffer_pool") == 0) config.buffer_pool = (long)parse_amount(value);
+            else if (strcmp(key, "cold_dir") == 0) snprintf(config.cold_dir, sizeof(config.cold_dir), "%s", value);
+            else if (strcmp(key, "cold_keep_versions") == 0) config.cold_keep = atoi(value);
+            else if (strcmp(key, "cold_after_days") == 0) config.cold_after_days = atoi(value);
+            else if (strcmp(key, "cold_promote_reads") == 0) config.cold_promote = atoi(value);
+            else if (strcmp(key, "cold_interval") == 0) config.cold_interval = atoi(value);
+            else if (strcmp(key, "cold_archive_size") == 0) config.cold_archive = (long)parse_amount(value);
+            else if (strcmp(key, "cold_compression") == 0) config.cold_level = atoi(value);
+            else if (strcmp(key, "watch_history") == 0) config.watch_history = (int)parse_amount(value);
+            else if (strcmp(key, "upgrade_socket") == 0) snprintf(config.upgrade_socket, sizeof(config.upgrade_socket), "%s", value);
+            else if (strcmp(key, "drain_timeout") == 0) config.drain_timeout = atoi(value);
+            else if (strcmp(key, "io_uring") == 0) config.io_uring = atoi(value);
+            else if (strcmp(key, "cipher_threads") == 0) config.cipher_threads = atoi(value);
+            else if (strcmp(key, "rm_threads") == 0) config.rm_threads = atoi(value);
+            else printf("%s: unknown setting '%s' ignored\n", path, key);
         }
+        fclose(fp);
+    }
+    if (config.listeners < 1) config.listeners = 1;
+    if (config.listeners > MAX_LISTENERS) config.listeners = MAX_LISTENERS;
+    if (config.rm_threads > RM_MAX_THREADS) config.rm_threads = RM_MAX_THREADS;
+    // A packed version is checked and sent as a single chunk
+    if (config.pack_threshold > CRC_CHUNK) config.pack_threshold = CRC_CHUNK;
+    if (config.pack_segment < 1024 * 1024) config.pack_segment = 1024 * 1024;
+    if (config.cold_interval < 1) config.cold_interval = 1;
+    if (config.cold_archive < 1024 * 1024) config.cold_archive = 1024 * 1024;
+    if (config.cold_level < 1 || config.cold_level > 9) config.cold_level = 6;
+    if (config.drain_timeout < 0) config.drain_timeout = 0;
+    ratelimit_configure(&config.rate);
+    trace_configure(config.trace, config.trace_events > 0 ? config.trace_events : 0);
+    // One buffer holds a whole checksum chunk, and so any packed version
+    bufpool_configure(CRC_CHUNK, config.buffer_pool > 0 ? config.buffer_pool : CRC_CHUNK);
+    watch_configure(config.watch_history > 0 ? config.watch_history : 1);
+}
 
-        // Write initial data
-        char *file_start = strchr(buffer, '\n') + 1;
-        long written = received - (file_start - buffer);
-        fwrite(file_start, 1, written, fp);
+// === Draining === //
 
-        // Continue receiving remaining data
-        while (written < filesize) {
-            ssize_t chunk = recv(client_sock, buffer, sizeof(buffer), 0);
-            if (chunk <= 0) break;
-            fwrite(buffer, 1, chunk, fp);
-            written += chunk;
+/*
+ * On SIGINT or SIGTERM, or once a new server has taken the listening
+ * sockets over (see hand_over), the server drains: it stops accepting,
+ * lets the commands in flight finish and closes each connection after
+ * its current command, so clients reconnect to the new server. It exits
+ * when the last connection is gone, or after drain_timeout seconds;
+ * uploads still incomplete by then are removed rather than left behind
+ * truncated. A second signal exits right away.
+ *
+ * While a handover is under way the stores are frozen. A command that
+ * would change them waits to learn whether the new server took over: if
+ * it did, the connection is closed without an answer and the client
+ * sends the command again to the new server.
+ */
+
+static int drain_pipe[2] = { -1, -1 };  // readable once draining has started
+static atomic_int draining;
+static atomic_int stores_frozen;         // a new server owns the pack and cold tier
+static sigset_t stop_signals;
+static pthread_mutex_t conns_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t conns_gone = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t handover_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t handover_done = PTHREAD_COND_INITIALIZER;  // unfrozen, or draining
+static struct conn *conns;
+
+static void handover_changed(void) {
+    pthread_mutex_lock(&handover_lock);
+    pthread_cond_broadcast(&handover_done);
+    pthread_mutex_unlock(&handover_lock);
+}
+
+static void start_drain(const char *why) {
+    if (atomic_exchange(&draining, 1)) return;
+    printf("%s, draining connections...\n", why);
+    if (write(drain_pipe[1], "", 1) < 0) perror("drain");
+    handover_changed();
+}
+
+static void conn_register(struct conn *c) {
+    pthread_mutex_lock(&conns_lock);
+    c->upload = NULL;
+    c->prev = NULL;
+    c->next = conns;
+    if (conns) conns->prev = c;
+    conns = c;
+    pthread_mutex_unlock(&conns_lock);
+}
+
+static void conn_unregister(struct conn *c) {
+    pthread_mutex_lock(&conns_lock);
+    if (c->prev) c->prev->next = c->next;
+    else conns = c->next;
+    if (c->next) c->next->prev = c->prev;
+    if (!conns) pthread_cond_broadcast(&conns_gone);
+    pthread_mutex_unlock(&conns_lock);
+}
+
+static void free_uploads(char **uploads) {
+    for (size_t i = 0; uploads && uploads[i]; i++) free(uploads[i]);
+    free(uploads);
+}
+
+/*
+ * lock_files_uploads - Takes file_mutex like lock_files and copies out the
+ * files of the WRITEs still receiving data; none of them can finish before
+ * file_mutex is released. Returns a NULL-terminated array for free_uploads,
+ * or NULL (with file_mutex held all the same) when out of memory.
+ */
+
+static char **lock_files_uploads(void) {
+    pthread_mutex_lock(&conns_lock);
+    lock_files();
+    size_t n = 0;
+    for (struct conn *c = conns; c; c = c->next) n++;
+    char **uploads = calloc(n + 1, sizeof(*uploads));
+    n = 0;
+    for (struct conn *c = conns; uploads && c; c = c->next) {
+        if (c->upload && !(uploads[n++] = strdup(c->upload))) {
+            free_uploads(uploads);
+            uploads = NULL;
         }
+    }
+    pthread_mutex_unlock(&conns_lock);
+    return uploads;
+}
 
-        fclose(fp);
-        // Set read/write permissions for owner, read for others
-        chmod(final, 0644);
-
-        printf("Saved: %s (%ld bytes)\n", final, written);
-    }
-    
-    // === GET: Retrieve a File === //
-    
-    else if (strncmp(buffer, "GET", 3) == 0) {
-        char path[1024];
-        int version = -1;
-        
-        // Parse the GET command to extract the file path and optional version number
-        sscanf(buffer, "GET %[^:\n]:%d", path, &version);
-        if (version == -1) sscanf(buffer, "GET %s", path);
-        
-        // Separate the filename and extension
-        char *dot = strrchr(path, '.');
-        char filename[512];
-        char ext[32] = "";
-        if (dot) {
-            strncpy(filename, path, dot - path);
-            filename[dot - path] = '\0';
-            strcpy(ext, dot);
-        } else {
-            strcpy(filename, path);
-        }
-        
-        // Determine the latest version if not specified
-        if (version == -1) version = get_latest_version(filename);
-        if (version == 0) {
-            send(client_sock, "SIZE 0\n", 8, 0);
-            close(client_sock);
-            pthread_exit(NULL);
-        }
-        
-        // Construct the full path to the requested file version
-        char final[2048];
-        snprintf(final, sizeof(final), "%s/%s_v%d%s", ROOT_DIR, filename, version, ext);
-        
-        // Open the file for reading
-        pthread_mutex_lock(&file_mutex);
-        FILE *fp = fopen(final, "rb");
-        pthread_mutex_unlock(&file_mutex);
-        if (!fp) {
-            send(client_sock, "SIZE 0\n", 8, 0);
-            close(client_sock);
-            pthread_exit(NULL);
-        }
-        
-        // Determine the file size and send it to the client
-        fseek(fp, 0, SEEK_END);
-        long filesize = ftell(fp);
-        rewind(fp);
-        char msg[64];
-        snprintf(msg, sizeof(msg), "SIZE %ld\n", filesize);
-        send(client_sock, msg, strlen(msg), 0);
-        
-        // Wait for client acknowledgment
-        recv(client_sock, buffer, sizeof(buffer), 0);
-        
-        // Read the file, encrypt it, and send it to the client
-        while (!feof(fp)) {
-            size_t read = fread(buffer, 1, sizeof(buffer), fp);
-            xor_cipher(buffer, read, ENCRYPTION_KEY);
-            send(client_sock, buffer, read, 0);
-        }
-        
-        fclose(fp);
-        printf("Sent: %s (%ld bytes)\n", final, filesize);
-    }
-    
-    // === RM -->  Delete a File ====== //
-    
-    else if (strncmp(buffer, "RM", 2) == 0) {
-        char path[1024];
-        
-        // Parse the RM command to extract the file path
-        sscanf(buffer, "RM %s", path);
-        
-        // Construct the full path to the file
-        char full[2048];
-        snprintf(full, sizeof(full), "%s/%s", ROOT_DIR, path);
-        
-        // Attempt to delete the file
-        pthread_mutex_lock(&file_mutex);
-        int status = remove(full);
+/*
+ * conn_next_command - Reads the next command line like conn_read_line,
+ * but once the server is draining, the connection is treated as closed
+ * rather than start another command.
+ */
+
+static int conn_next_command(struct conn *c, char *line, size_t cap) {
+    if (atomic_load(&draining)) return 0;
+    while (c->off == c->len) {
+        struct pollfd pfd[2] = { { c->sock, POLLIN, 0 }, { drain_pipe[0], POLLIN, 0 } };
+        if (poll(pfd, 2, -1) < 0 && errno != EINTR) return -1;
+        if (pfd[0].revents) break;
+        if (pfd[1].revents) return 0;
+    }
+    return conn_read_line(c, line, cap);
+}
+
+/*
+ * freeze_stores - Stops (on) or resumes all writes to the pack and the
+ * cold tier, waiting for those in progress, so that a new server can load
+ * them. WRITE and RM are refused meanwhile.
+ */
+
+static void freeze_stores(int on) {
+    lock_files();
+    atomic_store(&stores_frozen, on);
+    pthread_mutex_unlock(&file_mutex);
+    pack_freeze(on);
+    cold_freeze(on);
+    if (!on) handover_changed();
+}
+
+/*
+ * wait_unfrozen - Waits out a handover in progress. Returns 0 once the
+ * stores may be written, or -1 if a new server took them over; the
+ * caller then closes its connection without answering.
+ */
+
+static int wait_unfrozen(void) {
+    pthread_mutex_lock(&handover_lock);
+    while (atomic_load(&stores_frozen) && !atomic_load(&draining)) {
+        pthread_cond_wait(&handover_done, &handover_lock);
+    }
+    int frozen = atomic_load(&stores_frozen);
+    pthread_mutex_unlock(&handover_lock);
+    return frozen ? -1 : 0;
+}
+
+// lock_files for a change to the stores: -1, holding nothing, if handed over
+static int lock_files_unfrozen(void) {
+    for (;;) {
+        lock_files();
+        if (!atomic_load(&stores_frozen)) return 0;
         pthread_mutex_unlock(&file_mutex);
-        
-        // Inform the client of the result
-        if (status == 0) {
-            send(client_sock, "File deleted.\n", 15, 0);
-        } else {
-            send(client_sock, "Delete failed.\n", 16, 0);
-        }
-    }
-    
-    // === LS: List Server Files === //
-    
-    else if (strncmp(buffer, "LS", 2) == 0) {
-        char filter[1024] = "";
-        
-        // Parse the LS command to extract an optional filter
-        sscanf(buffer, "LS %s", filter);
-        
-        // List files in the server storage, applying the filter if provided
-        list_files(client_sock, strlen(filter) > 0 ? filter : NULL);
+        if (wait_unfrozen() < 0) return -1;
     }
-    
-    close(client_sock);
-    pthread_exit(NULL);
- }
-    // === Main Function ========== //
+}
 
-    int main() {
-        // Set up the SIGINT handler for graceful shutdown
-        signal(SIGINT, handle_sigint);
+// Removes the uploads still in progress and exits
+static void exit_now(void) {
+    int left = 0;
+    pthread_mutex_lock(&conns_lock);
+    lock_files();
+    for (struct conn *c = conns; c; c = c->next, left++) {
+        if (!c->upload) continue;
+        remove(c->upload);
+        remove_meta(c->upload);
+        printf("Incomplete upload discarded: %s\n", c->upload);
+    }
+    printf("Exiting (%d connection%s cut off)\n", left, left == 1 ? "" : "s");
+    exit(0);
+}
+
+// Waits up to drain_timeout for every connection to close, then exits
+static void finish_drain(void) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += config.drain_timeout;
+    pthread_mutex_lock(&conns_lock);
+    while (conns && pthread_cond_timedwait(&conns_gone, &conns_lock, &deadline) != ETIMEDOUT) {}
+    pthread_mutex_unlock(&conns_lock);
+    exit_now();
+}
 
-        struct sockaddr_in server_addr, client_addr;
-        socklen_t client_size = sizeof(client_addr);
+static void *stop_waiter(void *arg) {
+    int sig, count = 0;
+    while (sigwait(&stop_signals, &sig) == 0) {
+        if (++count > 1) exit_now();
+        start_drain(sig == SIGINT ? "Caught SIGINT" : "Caught SIGTERM");
+    }
+    return NULL;
+}
 
-        // Create the server socket
-        server_sock = socket(AF_INET, SOCK_STREAM, 0);
+// === Socket Tuning === //
 
-        // Configure the server address
-        server_addr.sin_family = AF_INET;
-        server_addr.sin_port = htons(PORT);
-        server_addr.sin_addr.s_addr = INADDR_ANY;
+/*
+ * set_cork - Holds back partial frames while a response is assembled
+ * (header + payload + trailer, or many LS lines) and flushes on release.
+ */
 
-        // Bind the socket to the specified address and port
-        bind(server_sock, (struct sockaddr*)&server_addr, sizeof(server_addr));
+void set_cork(int sock, int on) {
+    setsockopt(sock, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+}
 
-        // Start listening for incoming connections
-        listen(server_sock, 5);
-        printf("Server listening on port %d...\n", PORT);
+/*
+ * tune_socket - Applies the configured options to a socket. Buffer sizes
+ * set on a listening socket are inherited by the connections it accepts.
+ */
 
-        // Main loop to accept and handle client connections
-        while (1) {
-            int *client = malloc(sizeof(int));
-            *client = accept(server_sock, (struct sockaddr*)&client_addr, &client_size);
-            pthread_t tid;
-            pthread_create(&tid, NULL, handle_client, client);
+void tune_socket(int sock) {
+    if (config.tcp_nodelay) {
+        int one = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    if (config.sndbuf > 0) setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &config.sndbuf, sizeof(config.sndbuf));
+    if (config.rcvbuf > 0) setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &config.rcvbuf, sizeof(config.rcvbuf));
+}
+
+// === io_uring Transfers === //
+
+#define TAG_READ 0
+#define TAG_SEND 1
+#define TAG_RECV 2
+#define TAG_WRITE 3
+
+/*
+ * conn_ring - Returns the connection's io_uring for a transfer of size
+ * bytes, setting it up on first use, or NULL to use plain system calls.
+ * The first failed setup turns io_uring off for good.
+ */
+
+static struct uring *conn_ring(struct conn *c, long size) {
+    if (!config.io_uring || size < URING_MIN_SIZE) return NULL;
+    if (!c->ring && !(c->ring = uring_create(c->sock)) && atomic_exchange(&config.io_uring, 0)) {
+        printf("io_uring unavailable, using plain system calls\n");
+    }
+    return c->ring;
+}
+
+/*
+ * ring_attach - Takes a set of pool buffers for one transfer on ring and
+ * registers them, with fd, for the length of it, so a ring holds no
+ * memory between transfers. Returns -1, holding nothing, if the transfer
+ * has to use plain system calls instead.
+ */
+
+static int ring_attach(struct uring *ring, int fd, void **bufs) {
+    if (bufpool_get_many(bufs, URING_BUFFERS) < 0) return -1;
+    if (uring_attach(ring, fd, bufs, bufpool_buffer_size()) < 0) {
+        bufpool_put_many(bufs, URING_BUFFERS);
+        return -1;
+    }
+    return 0;
+}
+
+static void ring_detach(struct uring *ring, void **bufs) {
+    uring_detach(ring);
+    bufpool_put_many(bufs, URING_BUFFERS);
+}
+
+// ===  Command Handlers === //
+
+/*
+ * Each handler processes one command line read from the connection.
+ * They return 0 if the connection can carry another command and -1 if
+ * it has to be closed.
+ */
+
+// === WRITE Operation === //
+
+/*
+ * WRITE path size [mtime] [CRC32C] [NONCE=<hex>]
+ * With the CRC32C flag the payload is followed by a "CRC <hex>" trailer
+ * and the upload is rejected if it does not match what arrived.
+ * NONCE marks the payload as ChaCha20 ciphertext; the nonce is stored
+ * with the version so the client can decrypt it later.
+ */
+
+/*
+ * write_packed - Receives a small version into memory and appends it to
+ * the pack in one write. Replies exactly like a file-backed WRITE.
+ */
+
+static int write_packed(struct conn *c, const char *filename, const char *ext, long filesize, long mtime,
+                        int want_crc, const uint8_t *nonce) {
+    char line[BUFFER_SIZE];
+    char *data = bufpool_get();  // pack_threshold never exceeds the buffer size
+    if (!data) {
+        send_str(c->sock, "ERR out of memory\n");
+        return conn_skip_payload(c, filesize, want_crc);
+    }
+    struct pack_info info = { filesize, mtime > 0 ? mtime : time(NULL), 0, nonce != NULL, { 0 } };
+    if (nonce) memcpy(info.nonce, nonce, CHACHA20_NONCE_SIZE);
+
+    long received = 0;
+    struct transfer xfer;
+    transfer_begin(&xfer, c->limits, filesize);
+    while (received < filesize) {
+        uint64_t t = trace_now();
+        ssize_t chunk = conn_read(c, data + received, filesize - received);
+        trace_add(TRACE_NETWORK, t);
+        if (chunk <= 0) break;
+        received += chunk;
+        transfer_account(&xfer, chunk);
+    }
+    transfer_end(&xfer);
+    if (received < filesize) {
+        bufpool_put(data);
+        return -1;
+    }
+    info.crc = crc32c_update(0, data, filesize);
+
+    if (want_crc) {
+        unsigned int expected;
+        if (conn_read_line(c, line, sizeof(line)) <= 0 || sscanf(line, "CRC %x", &expected) != 1) {
+            bufpool_put(data);
+            return -1;
+        }
+        if (expected != info.crc) {
+            printf("Checksum mismatch, upload discarded: %s%s (got %08x, expected %08x)\n", filename, ext, info.crc, expected);
+            bufpool_put(data);
+            return send_str(c->sock, "ERR checksum mismatch\n");
+        }
+    }
+
+    if (lock_files_unfrozen() < 0) {
+        bufpool_put(data);
+        return -1;
+    }
+    int version = get_latest_version(filename, ext) + 1;
+    uint64_t t = trace_now();
+    int status = pack_append(filename, ext, version, data, &info);
+    trace_span(TRACE_DISK, t);
+    pthread_mutex_unlock(&file_mutex);
+    bufpool_put(data);
+    if (status < 0) return send_str(c->sock, "ERR cannot store file\n");
+
+    printf("Packed: %s_v%d%s (%ld bytes)\n", filename, version, ext, filesize);
+    watch_publish(WATCH_NEW, filename, ext, version, filesize);
+    snprintf(line, sizeof(line), "OK %d\n", version);
+    return send_str(c->sock, line);
+}
+
+/*
+ * receive_file_ring - Receives the rest of a WRITE payload from written on
+ * through the connection's io_uring: each checksum chunk is one receive
+ * linked to the file write that stores it, submitted together. Returns
+ * the new number of bytes received, short of filesize if the client went
+ * away or (setting *store_failed) the file could not be written.
+ */
+
+static long receive_file_ring(struct uring *u, long written, long filesize, struct version_meta *meta,
+                              uint32_t *chunk_crc, struct transfer *xfer, int *store_failed) {
+    long results[URING_TAGS];
+    const char *buffer = uring_buffer(u, 0);
+    while (written < filesize) {
+        long want = filesize - written;
+        long chunk_left = CRC_CHUNK - written % CRC_CHUNK;
+        if (want > chunk_left) want = chunk_left;
+        uring_prep_recv(u, TAG_RECV, 0, want, 1);
+        uring_prep_write(u, TAG_WRITE, 0, 0, want, written);
+        uint64_t t = trace_now();
+        if (uring_run(u, results) < 0) break;
+        trace_add(TRACE_NETWORK, t);
+        long chunk = results[TAG_RECV];
+        if (chunk <= 0) break;
+
+        // Older kernels may end a receive early, cancelling the write, and
+        // a write may complete short; either way the rest is resubmitted
+        long stored = results[TAG_WRITE] > 0 && results[TAG_WRITE] <= chunk ? results[TAG_WRITE] : 0;
+        while (stored < chunk) {
+            uring_prep_write(u, TAG_WRITE, 0, stored, chunk - stored, written + stored);
+            if (uring_run(u, results) < 0 || results[TAG_WRITE] <= 0) break;
+            stored += results[TAG_WRITE];
+        }
+        if (stored < chunk) {
+            *store_failed = 1;
+            return written + chunk;
+        }
+        meta->crc = crc32c_update(meta->crc, buffer, chunk);
+        *chunk_crc = crc32c_update(*chunk_crc, buffer, chunk);
+        written += chunk;
+        if (written % CRC_CHUNK == 0 || written == filesize) {
+            meta->chunks[meta->nchunks++] = *chunk_crc;
+            *chunk_crc = 0;
+        }
+        transfer_account(xfer, chunk);
+    }
+    return written;
+}
+
+/*
+ * discard_upload - Deletes the version a WRITE was creating. c->upload is
+ * cleared in the same file_mutex hold, so once another WRITE can reuse
+ * the name, nothing mistakes its version for this unfinished one.
+ */
+
+static void discard_upload(struct conn *c, const char *final) {
+    lock_files();
+    c->upload = NULL;
+    remove(final);
+    remove_meta(final);
+    atomic_fetch_add(&listing_epoch, 1);
+    pthread_mutex_unlock(&file_mutex);
+}
+
+int handle_write(struct conn *c, const char *line) {
+    uint64_t parse_start = trace_now();
+    char *filepath = arena_alloc(c->arena, 1024);
+    char *filename = arena_alloc(c->arena, 1024);
+    char *final = arena_alloc(c->arena, 2048);
+    char token[64];
+    long filesize = -1;
+    long mtime = 0;
+    int consumed = 0, want_crc = 0, has_nonce = 0;
+    uint8_t nonce[CHACHA20_NONCE_SIZE];
+    if (!filepath || !filename || !final) {
+        send_str(c->sock, "ERR out of memory\n");
+        return -1;
+    }
+    if (sscanf(line, "WRITE %1023s %ld%n", filepath, &filesize, &consumed) < 2 || filesize < 0) {
+        send_str(c->sock, "ERR malformed WRITE\n");
+        return -1;
+    }
+
+    // Optional fields after the size
+    const char *opts = line + consumed;
+    int used;
+    while (sscanf(opts, " %63s%n", token, &used) == 1) {
+        opts += used;
+        if (strcmp(token, "CRC32C") == 0) {
+            want_crc = 1;
+        } else if (strncmp(token, "NONCE=", 6) == 0) {
+            has_nonce = hex_decode(token + 6, nonce, CHACHA20_NONCE_SIZE) == 0;
+        } else if (token[0] >= '0' && token[0] <= '9') {
+            mtime = atol(token);
+        }
+    }
+    if (!valid_path(filepath)) {
+        send_str(c->sock, "ERR invalid path\n");
+        return conn_skip_payload(c, filesize, want_crc);
+    }
+
+    // Split the remote path into name and extension
+    char ext[32];
+    split_path(filepath, filename, 1024, ext, sizeof(ext));
+    trace_span(TRACE_PARSE, parse_start);
+
+    // Small versions go to a pack segment instead of a file of their own
+    if (filesize <= config.pack_threshold) {
+        return write_packed(c, filename, ext, filesize, mtime, want_crc, has_nonce ? nonce : NULL);
+    }
+
+    if (lock_files_unfrozen() < 0) return -1;
+    int version = get_latest_version(filename, ext) + 1;
+
+    // Build the full path to the new versioned file
+    snprintf(final, 2048, "%s/%s_v%d%s", ROOT_DIR, filename, version, ext);
+    make_parent_dirs(final);
+
+    // === Permission Check === //
+    if (access(final, F_OK) == 0) {
+        if (access(final, W_OK) != 0) {
+            pthread_mutex_unlock(&file_mutex);
+            send_str(c->sock, "Permission denied.\n");
+            return conn_skip_payload(c, filesize, want_crc);
+        }
+    }
+
+    FILE *fp = fopen(final, "wb");
+    if (fp) c->upload = final;
+    pthread_mutex_unlock(&file_mutex);
+    if (!fp) {
+        send_str(c->sock, "ERR cannot create file\n");
+        return conn_skip_payload(c, filesize, want_crc);
+    }
+
+    struct version_meta meta = { 0, 0, NULL, has_nonce, { 0 } };
+    if (has_nonce) memcpy(meta.nonce, nonce, sizeof(nonce));
+    size_t nchunks = (filesize + CRC_CHUNK - 1) / CRC_CHUNK;
+    meta.chunks = malloc((nchunks ? nchunks : 1) * sizeof(uint32_t));
+    // With io_uring, the ring's first buffer doubles as the plain one
+    void *ring_bufs[URING_BUFFERS];
+    struct uring *ring = conn_ring(c, filesize);
+    if (ring && ring_attach(ring, fileno(fp), ring_bufs) < 0) ring = NULL;
+    char *buffer = ring ? ring_bufs[0] : bufpool_get();
+    if (!meta.chunks || !buffer) {
+        if (ring) ring_detach(ring, ring_bufs);
+        else bufpool_put(buffer);
+        fclose(fp);
+        discard_upload(c, final);
+        free(meta.chunks);
+        send_str(c->sock, "ERR out of memory\n");
+        return conn_skip_payload(c, filesize, want_crc);
+    }
+
+    // Receive the payload; anything after it belongs to the next command.
+    // Checksums are folded in as the bytes arrive. With io_uring, only
+    // what is already buffered goes through conn_read.
+    long written = 0;
+    uint32_t chunk_crc = 0;
+    int store_failed = 0;
+    struct transfer xfer;
+    transfer_begin(&xfer, c->limits, filesize);
+    while (written < filesize && (!ring || c->off < c->len)) {
+        long want = filesize - written;
+        long chunk_left = CRC_CHUNK - written % CRC_CHUNK;
+        if (want > chunk_left) want = chunk_left;
+        uint64_t t = trace_now();
+        if ((size_t)want > bufpool_buffer_size()) want = bufpool_buffer_size();
+        ssize_t chunk = conn_read(c, buffer, want);
+        trace_add(TRACE_NETWORK, t);
+        if (chunk <= 0) break;
+        t = trace_now();
+        store_failed = fwrite(buffer, 1, chunk, fp) != (size_t)chunk;
+        trace_add(TRACE_DISK, t);
+        if (store_failed) {
+            written += chunk;
+            break;
+        }
+        meta.crc = crc32c_update(meta.crc, buffer, chunk);
+        chunk_crc = crc32c_update(chunk_crc, buffer, chunk);
+        written += chunk;
+        if (written % CRC_CHUNK == 0 || written == filesize) {
+            meta.chunks[meta.nchunks++] = chunk_crc;
+            chunk_crc = 0;
+        }
+        transfer_account(&xfer, chunk);
+    }
+    if (ring && written < filesize && !store_failed) {
+        if (fflush(fp) != 0) store_failed = 1;
+        else written = receive_file_ring(ring, written, filesize, &meta, &chunk_crc, &xfer, &store_failed);
+    }
+    transfer_end(&xfer);
+    if (ring) ring_detach(ring, ring_bufs);
+    else bufpool_put(buffer);
+
+    int failed = fclose(fp) != 0;
+    if (store_failed) {
+        // Out of space or an I/O error: drop the partial version but keep
+        // the connection, discarding the rest of the payload
+        discard_upload(c, final);
+        free(meta.chunks);
+        printf("Write failed, upload discarded: %s\n", final);
+        send_str(c->sock, "ERR cannot store file\n");
+        return conn_skip_payload(c, filesize - written, want_crc);
+    }
+    if (written < filesize) {
+        // The client went away mid-transfer; don't keep a truncated version
+        discard_upload(c, final);
+        free(meta.chunks);
+        printf("Incomplete upload discarded: %s (%ld of %ld bytes)\n", final, written, filesize);
+        return -1;
+    }
+
+    if (want_crc) {
+        char trailer[64];
+        unsigned int expected;
+        if (conn_read_line(c, trailer, sizeof(trailer)) <= 0 || sscanf(trailer, "CRC %x", &expected) != 1) {
+            discard_upload(c, final);
+            free(meta.chunks);
+            return -1;
+        }
+        if (expected != meta.crc) {
+            printf("Checksum mismatch, upload discarded: %s (got %08x, expected %08x)\n", final, meta.crc, expected);
+            discard_upload(c, final);
+            free(meta.chunks);
+            return send_str(c->sock, "ERR checksum mismatch\n");
+        }
+    }
+
+    uint64_t t = trace_now();
+    failed = failed || save_meta(final, &meta) < 0;
+    trace_span(TRACE_DISK, t);
+    free(meta.chunks);
+    if (failed) {
+        discard_upload(c, final);
+        return send_str(c->sock, "ERR cannot store file\n");
+    }
+
+    // Set read/write permissions for owner, read for others
+    chmod(final, 0644);
+    if (mtime > 0) {
+        struct timeval times[2] = { { mtime, 0 }, { mtime, 0 } };
+        utimes(final, times);
+    }
+    lock_files();
+    c->upload = NULL;
+    pthread_mutex_unlock(&file_mutex);
+
+    printf("Saved: %s (%ld bytes)\n", final, written);
+    watch_publish(WATCH_NEW, filename, ext, version, written);
+    char reply[64];
+    snprintf(reply, sizeof(reply), "OK %d\n", version);
+    return send_str(c->sock, reply);
+}
+
+// === GET: Retrieve a File === //
+
+/*
+ * GET path[:version] [CRC32C] [CACHED=<version>:<crc>,...] [SNAP=<id>]
+ * SNAP asks for the version path had in a snapshot instead of the latest.
+ * Chunks are checked against their stored checksums as they are read;
+ * on a mismatch the transfer is aborted rather than sending bad data.
+ * With the CRC32C flag a "CRC <hex>" trailer over the bytes sent follows
+ * the payload. Legacy versions are decrypted before sending; ChaCha20
+ * versions are sent as stored, announced as "SIZE <n> NONCE=<hex>".
+ * The SIZE line ends with "VERSION=<v>" and, for versions with a stored
+ * checksum, "CRC=<crc>", which together identify the content.
+ *
+ * CACHED lists the versions the client already holds. If the version
+ * asked for is among them, with the same stored checksum, the reply is
+ * "NOT_MODIFIED <version> <crc>" instead and nothing else is sent.
+ */
+
+/*
+ * parse_path_version - Splits "path[:version]" in place. Returns the
+ * version, or -1 when none was given.
+ */
+
+int parse_path_version(char *path) {
+    char *colon = strrchr(path, ':');
+    if (!colon || colon[1] == '\0' || strspn(colon + 1, "0123456789") != strlen(colon + 1)) return -1;
+    *colon = '\0';
+    return atoi(colon + 1);
+}
+
+// Whether a CACHED= list names version with the stored checksum crc
+static int in_cached_list(const char *list, int version, uint32_t crc) {
+    while (list && *list) {
+        char *end;
+        long v = strtol(list, &end, 10);
+        if (*end != ':') return 0;
+        unsigned long cached = strtoul(end + 1, &end, 16);
+        if (v == version && cached == crc) return 1;
+        list = *end == ',' ? end + 1 : NULL;
+    }
+    return 0;
+}
+
+static int send_not_modified(int sock, int version, uint32_t crc) {
+    char msg[64];
+    snprintf(msg, sizeof(msg), "NOT_MODIFIED %d %08x\n", version, crc);
+    return send_str(sock, msg);
+}
+
+// Formats GET's "SIZE ..." line; crc is the stored checksum, if known
+static void format_size(char *msg, size_t cap, long size, const uint8_t *nonce, int version, const uint32_t *crc) {
+    char nonce_opt[2 * CHACHA20_NONCE_SIZE + 8] = "", crc_opt[16] = "";
+    if (nonce) {
+        strcpy(nonce_opt, " NONCE=");
+        hex_encode(nonce, CHACHA20_NONCE_SIZE, nonce_opt + 7);
+    }
+    if (crc) snprintf(crc_opt, sizeof(crc_opt), " CRC=%08x", *crc);
+    snprintf(msg, cap, "SIZE %ld%s VERSION=%d%s\n", size, nonce_opt, version, crc_opt);
+}
+
+/*
+ * send_packed - GET for a packed version, already read into data (a pool
+ * buffer, returned here). The version is checked as a whole before anything is
+ * sent; a damaged one is reported as missing.
+ */
+
+static int send_packed(struct conn *c, char *data, const struct pack_info *info, int version, int want_crc,
+                       const char *name) {
+    char msg[160], ack[64];
+    if (crc32c_update(0, data, info->size) != info->crc) {
+        printf("Checksum mismatch in packed %s, transfer refused\n", name);
+        bufpool_put(data);
+        return send_str(c->sock, "SIZE 0\n");
+    }
+    format_size(msg, sizeof(msg), info->size, info->has_nonce ? info->nonce : NULL, version, &info->crc);
+    uint64_t t = trace_now();
+    if (send_str(c->sock, msg) < 0 || conn_read_line(c, ack, sizeof(ack)) <= 0) {
+        bufpool_put(data);
+        return -1;
+    }
+    trace_span(TRACE_NETWORK, t);
+
+    if (!info->has_nonce) xor_cipher(data, info->size, ENCRYPTION_KEY, 0);
+    struct transfer xfer;
+    transfer_begin(&xfer, c->limits, info->size);
+    set_cork(c->sock, 1);
+    t = trace_now();
+    int status = send_all(c->sock, data, info->size);
+    trace_span(TRACE_NETWORK, t);
+    transfer_account(&xfer, info->size);
+    transfer_end(&xfer);
+    if (status == 0 && want_crc) {
+        snprintf(msg, sizeof(msg), "CRC %08x\n", crc32c_update(0, data, info->size));
+        status = send_str(c->sock, msg);
+    }
+    set_cork(c->sock, 0);
+    bufpool_put(data);
+    if (status == 0) printf("Sent: %s (%ld bytes, packed)\n", name, info->size);
+    return status;
+}
+
+struct chunk_check {
+    const struct version_meta *meta;
+    int verify;
+    const char *final;
+};
+
+// Verifies and decrypts one pipe chunk, on a cipher worker
+static int check_chunk(void *arg, char *data, size_t len, long offset) {
+    const struct chunk_check *check = arg;
+    const struct version_meta *meta = check->meta;
+    for (size_t off = 0; check->verify && off < len; off += CRC_CHUNK) {
+        size_t n = len - off < CRC_CHUNK ? len - off : CRC_CHUNK;
+        long index = (offset + off) / CRC_CHUNK;
+        if (index >= (long)meta->nchunks || crc32c_update(0, data + off, n) != meta->chunks[index]) {
+            printf("Checksum mismatch in %s at offset %ld, transfer aborted\n", check->final, offset + (long)off);
+            return -1;
+        }
+    }
+    xor_cipher(data, len, ENCRYPTION_KEY, offset);
+    return 0;
+}
+
+// Cipher pipe slots are pool buffers, counted against the pool's cap
+static const struct cpipe_alloc pipe_alloc = { bufpool_get_many, bufpool_put_many };
+
+/*
+ * send_file_piped - send_file_chunks for a legacy XOR version on cipher
+ * workers: the pipe's reader thread reads ahead, the workers check and
+ * decrypt chunks in parallel, and this thread sends them in order.
+ * Returns the number of bytes sent, or -1 if the connection failed.
+ */
+
+static long send_file_piped(struct conn *c, struct cpipe *pipe, long filesize, uint32_t *crc) {
+    long sent = 0;
+    char *data;
+    size_t len;
+    struct transfer xfer;
+    transfer_begin(&xfer, c->limits, filesize);
+    while ((data = cpipe_take(pipe, &len))) {
+        if (crc) *crc = crc32c_update(*crc, data, len);
+        uint64_t t = trace_now();
+        int failed = send_all(c->sock, data, len) < 0;
+        trace_add(TRACE_NETWORK, t);
+        cpipe_release(pipe);
+        if (failed) {
+            sent = -1;
+            break;
+        }
+        sent += len;
+        transfer_account(&xfer, len);
+    }
+    transfer_end(&xfer);
+    cpipe_finish(pipe, sent != filesize);
+    return sent;
+}
+
+/*
+ * send_file_ring - send_file_chunks through the connection's io_uring.
+ * While one chunk is sent the next is read into the other registered
+ * buffer, both in one submission; a chunk is only sent once it checked
+ * out. Returns the number of bytes sent, or -1 if the connection failed.
+ */
+
+static long send_file_ring(struct conn *c, struct uring *u, long filesize, const struct version_meta *meta,
+                           int verify, const char *final, uint32_t *crc) {
+    long results[URING_TAGS];
+    long sent = 0, offset = 0, sending = 0;
+    long reading = filesize < CRC_CHUNK ? filesize : CRC_CHUNK;
+    long got = 0;  // of the chunk being read
+    int buf = 0;
+    struct transfer xfer;
+    transfer_begin(&xfer, c->limits, filesize);
+    uring_prep_read(u, TAG_READ, buf, 0, reading, 0);
+    for (;;) {
+        uint64_t t = trace_now();
+        if (uring_run(u, results) < 0) {
+            sent = -1;
+            break;
+        }
+        trace_add(sending ? TRACE_NETWORK : TRACE_DISK, t);
+        if (sending) {
+            // A send cut short is finished the plain way
+            const char *data = uring_buffer(u, buf ^ 1);
+            long done = results[TAG_SEND];
+            if (done < 0 || (done < sending && send_all(c->sock, data + done, sending - done) < 0)) {
+                sent = -1;
+                break;
+            }
+            sent += sending;
+            transfer_account(&xfer, sending);
+            sending = 0;
+        }
+        if (reading == 0 || results[TAG_READ] <= 0) break;
+
+        // A read cut short is resubmitted for the rest of its chunk
+        got += results[TAG_READ];
+        if (got < reading) {
+            uring_prep_read(u, TAG_READ, buf, got, reading - got, offset + got);
+            continue;
+        }
+        char *data = uring_buffer(u, buf);
+        long nread = reading;
+        got = 0;
+        if (verify && (offset / CRC_CHUNK >= (long)meta->nchunks ||
+                       crc32c_update(0, data, nread) != meta->chunks[offset / CRC_CHUNK])) {
+            printf("Checksum mismatch in %s at offset %ld, transfer aborted\n", final, offset);
+            break;
+        }
+        if (!meta->has_nonce) xor_cipher(data, nread, ENCRYPTION_KEY, offset);
+        if (crc) *crc = crc32c_update(*crc, data, nread);
+        uring_prep_send(u, TAG_SEND, data, nread);
+        sending = nread;
+        offset += nread;
+        buf ^= 1;
+        reading = filesize - offset < CRC_CHUNK ? filesize - offset : CRC_CHUNK;
+        if (reading > 0) uring_prep_read(u, TAG_READ, buf, 0, reading, offset);
+    }
+    transfer_end(&xfer);
+    return sent;
+}
+
+/*
+ * send_file_chunks - Reads up to filesize bytes of a stored version chunk
+ * by chunk, verifies each chunk (when verify is set), decrypts it (legacy
+ * XOR only) and sends it. Stops early at the first damaged chunk. When crc
+ * is non-NULL it is extended over the bytes sent. Returns the number of
+ * bytes sent, or -1 if the connection failed.
+ */
+
+static long send_file_chunks(struct conn *c, FILE *fp, long filesize, const struct version_meta *meta,
+                             int verify, const char *final, uint32_t *crc) {
+    // Cold versions have no file descriptor to hand to the reader or ring
+    if (!meta->has_nonce && config.cipher_threads > 1 && filesize >= PIPE_MIN_SIZE && fileno(fp) >= 0) {
+        struct chunk_check check = { meta, verify, final };
+        struct cpipe *pipe = cpipe_start(config.cipher_threads, CRC_CHUNK, 0, check_chunk, &check, &pipe_alloc);
+        if (pipe && cpipe_start_reader(pipe, fileno(fp), filesize) == 0) {
+            return send_file_piped(c, pipe, filesize, crc);
+        }
+        if (pipe) cpipe_finish(pipe, 1);
+    }
+    struct uring *ring = fileno(fp) >= 0 ? conn_ring(c, filesize) : NULL;
+    void *ring_bufs[URING_BUFFERS];
+    if (ring && ring_attach(ring, fileno(fp), ring_bufs) == 0) {
+        long sent = send_file_ring(c, ring, filesize, meta, verify, final, crc);
+        ring_detach(ring, ring_bufs);
+        return sent;
+    }
+    char *buffer = bufpool_get();
+    if (!buffer) return -1;
+    long sent = 0;
+    struct transfer xfer;
+    transfer_begin(&xfer, c->limits, filesize);
+    while (sent < filesize) {
+        uint64_t t = trace_now();
+        size_t nread = fread(buffer, 1, CRC_CHUNK, fp);
+        trace_add(TRACE_DISK, t);
+        if (nread == 0) break;
+        if (nread > (size_t)(filesize - sent)) nread = filesize - sent;
+        if (verify && (sent / CRC_CHUNK >= (long)meta->nchunks ||
+                       crc32c_update(0, buffer, nread) != meta->chunks[sent / CRC_CHUNK])) {
+            printf("Checksum mismatch in %s at offset %ld, transfer aborted\n", final, sent);
+            break;
+        }
+        if (!meta->has_nonce) xor_cipher(buffer, nread, ENCRYPTION_KEY, sent);
+        if (crc) *crc = crc32c_update(*crc, buffer, nread);
+        t = trace_now();
+        int failed = send_all(c->sock, buffer, nread) < 0;
+        trace_add(TRACE_NETWORK, t);
+        if (failed) {
+            sent = -1;
+            break;
+        }
+        sent += nread;
+        transfer_account(&xfer, nread);
+    }
+    transfer_end(&xfer);
+    bufpool_put(buffer);
+    return sent;
+}
+
+int handle_get(struct conn *c, const char *line) {
+    uint64_t parse_start = trace_now();
+    char *path = arena_alloc(c->arena, 1024);
+    char *filename = arena_alloc(c->arena, 1024);
+    char *final = arena_alloc(c->arena, 2048);
+    char *options = arena_alloc(c->arena, BUFFER_SIZE);
+    char ack[64];
+    int used = 0;
+
+    // Parse the GET command to extract the file path and optional version number
+    if (!path || !filename || !final || !options || sscanf(line, "GET %1023s%n", path, &used) < 1) {
+        return send_str(c->sock, "SIZE 0\n");
+    }
+    int version = parse_path_version(path);
+    int want_crc = 0;
+    unsigned long snap = 0;
+    const char *cached = NULL;
+    snprintf(options, BUFFER_SIZE, "%s", line + used);
+    char *save, *token;
+    for (token = strtok_r(options, " ", &save); token; token = strtok_r(NULL, " ", &save)) {
+        if (strcmp(token, "CRC32C") == 0) want_crc = 1;
+        else if (strncmp(token, "CACHED=", 7) == 0) cached = token + 7;
+        else if (strncmp(token, "SNAP=", 5) == 0) snap = strtoul(token + 5, NULL, 10);
+    }
+    if (!valid_path(path)) return send_str(c->sock, "SIZE 0\n");
+
+    // Separate the filename and extension
+    char ext[32];
+    split_path(path, filename, 1024, ext, sizeof(ext));
+    trace_span(TRACE_PARSE, parse_start);
+
+    // Determine the snapshot's or the latest version if not specified
+    if (version == -1) version = snap ? snap_version(snap, path) : get_latest_version(filename, ext);
+    if (version <= 0) return send_str(c->sock, "SIZE 0\n");
+
+    // Construct the full path to the requested file version
+    snprintf(final, 2048, "%s/%s_v%d%s", ROOT_DIR, filename, version, ext);
+
+    // Packed versions are fetched with a single pread
+    struct pack_info packed;
+    char *data = bufpool_get();
+    uint64_t t = trace_now();
+    int found = data && pack_read(filename, ext, version, data, bufpool_buffer_size(), &packed) == 0;
+    trace_span(TRACE_DISK, t);
+    if (found && in_cached_list(cached, version, packed.crc)) {
+        bufpool_put(data);
+        return send_not_modified(c->sock, version, packed.crc);
+    }
+    if (found) return send_packed(c, data, &packed, version, want_crc, final);
+    bufpool_put(data);
+
+    // The client's copy is still current: answer from the checksum alone
+    struct version_meta meta;
+    if (cached && load_meta(final, &meta, 0) == 0 && in_cached_list(cached, version, meta.crc)) {
+        return send_not_modified(c->sock, version, meta.crc);
+    }
+
+    // Open the file (or its cold copy) and send its size to the client
+    t = trace_now();
+    long filesize;
+    FILE *fp = open_version(final, &filesize);
+    if (!fp) return send_str(c->sock, "SIZE 0\n");
+    int has_meta = load_meta(final, &meta, 1) == 0;
+    int verify = has_meta && meta.nchunks == (size_t)((filesize + CRC_CHUNK - 1) / CRC_CHUNK);
+    trace_span(TRACE_DISK, t);
+    char msg[160];
+    format_size(msg, sizeof(msg), filesize, meta.has_nonce ? meta.nonce : NULL, version, has_meta ? &meta.crc : NULL);
+    t = trace_now();
+    if (send_str(c->sock, msg) < 0 || conn_read_line(c, ack, sizeof(ack)) <= 0) {
+        // The client went away before acknowledging
+        fclose(fp);
+        free(meta.chunks);
+        return -1;
+    }
+    trace_span(TRACE_NETWORK, t);
+
+    uint32_t sent_crc = 0;
+    set_cork(c->sock, 1);
+    long sent = send_file_chunks(c, fp, filesize, &meta, verify, final, want_crc ? &sent_crc : NULL);
+    fclose(fp);
+    free(meta.chunks);
+    if (sent != filesize) return -1;
+    if (want_crc) {
+        snprintf(msg, sizeof(msg), "CRC %08x\n", sent_crc);
+        if (send_str(c->sock, msg) < 0) return -1;
+    }
+    set_cork(c->sock, 0);
+    printf("Sent: %s (%ld bytes)\n", final, filesize);
+    return 0;
+}
+
+// === RM -->  Delete a File ====== //
+
+/*
+ * remove_version - Removes a stored version from every tier; a version
+ * caught mid-move may briefly be in two. Returns -1 if it was in none, and
+ * -2, leaving it alone, if a snapshot holds it.
+ */
+
+static int remove_version(const char *stored) {
+    char full[2048], filename[1024], ext[32], logical[1056];
+    snprintf(full, sizeof(full), "%s/%s", ROOT_DIR, stored);
+    int version = parse_stored_path(stored, filename, sizeof(filename), ext, sizeof(ext));
+    snprintf(logical, sizeof(logical), "%s%s", filename, ext);
+    pthread_rwlock_rdlock(&snapshot_lock);
+    if (version > 0 && snap_holder(logical, version)) {
+        pthread_rwlock_unlock(&snapshot_lock);
+        return -2;
+    }
+    int status = version > 0 && pack_remove(filename, ext, version) == 0 ? 0 : -1;
+    if (version > 0 && cold_remove(filename, ext, version) == 0) status = 0;
+    if (remove(full) == 0) status = 0;
+    if (status == 0) atomic_fetch_add(&listing_epoch, 1);
+    pthread_rwlock_unlock(&snapshot_lock);
+    if (status == 0) {
+        remove_meta(full);
+        if (version > 0) watch_publish(WATCH_DELETE, filename, ext, version, 0);
+    }
+    return status;
+}
+
+int handle_rm(struct conn *c, const char *line) {
+    char *path = arena_alloc(c->arena, 1024);
+
+    // Parse the RM command to extract the file path
+    if (!path || sscanf(line, "RM %1023s", path) != 1 || !valid_path(path)) {
+        return send_str(c->sock, "Delete failed.\n");
+    }
+
+    if (lock_files_unfrozen() < 0) return -1;
+    uint64_t t = trace_now();
+    int status = remove_version(path);
+    trace_span(TRACE_DISK, t);
+    pthread_mutex_unlock(&file_mutex);
+
+    // Inform the client of the result
+    if (status == 0) {
+        return send_str(c->sock, "File deleted.\n");
+    }
+    if (status == -2) return send_str(c->sock, "ERR version held by a snapshot\n");
+    return send_str(c->sock, "Delete failed.\n");
+}
+
+// === Bulk RM: Delete Many Versions at Once === //
+
+/*
+ * RM -r <pattern>[:<versions>] [KEEP=<n>]
+ * Deletes every version of every path matching pattern (a prefix, or a
+ * glob as in MGET) that is within versions (N, N-M, N- or -M; all if
+ * omitted) and not among the newest n of its path. Versions a snapshot
+ * holds are left alone. Replies "MATCHED <count> <held>", then
+ * "PROGRESS <done> <count>" about once a second, then
+ * "DELETED <deleted> <failed>" and "__END__".
+ *
+ * rm_threads workers do the unlinking while the connection thread reports.
+ * Only the latest version of a path is removed under file_mutex, since a
+ * concurrent WRITE numbers its new version from it; older versions go
+ * without it, so GET and WRITE elsewhere are not held up.
+ */
+
+struct rm_victim {
+    const char *stored;
+    int latest;  // newest version of its path when listed
+};
+
+struct bulk_rm {
+    struct rm_victim *victims;
+    size_t count;
+    atomic_size_t next;
+    atomic_long deleted, failed;
+    int running;  // workers not yet finished, under lock
+    pthread_mutex_t lock;
+    pthread_cond_t finished;
+};
+
+static void *bulk_rm_worker(void *arg) {
+    struct bulk_rm *rm = arg;
+    size_t i;
+    while ((i = atomic_fetch_add(&rm->next, 1)) < rm->count) {
+        const struct rm_victim *v = &rm->victims[i];
+        if (v->latest ? lock_files_unfrozen() < 0 : wait_unfrozen() < 0) break;
+        int status = remove_version(v->stored);
+        if (v->latest) pthread_mutex_unlock(&file_mutex);
+        atomic_fetch_add(status == 0 ? &rm->deleted : &rm->failed, 1);
+    }
+    pthread_mutex_lock(&rm->lock);
+    rm->running--;
+    pthread_cond_signal(&rm->finished);
+    pthread_mutex_unlock(&rm->lock);
+    return NULL;
+}
+
+// Parses N, N-M, N- or -M into *from and *to (0 = open)
+int parse_version_range(const char *text, int *from, int *to) {
+    char *end = (char *)text;
+    *from = *to = 0;
+    if (*text != '-') *from = (int)strtol(text, &end, 10);
+    if (*end == '\0') {
+        *to = *from;
+    } else if (*end != '-') {
+        return -1;
+    } else if (end[1] != '\0') {
+        *to = (int)strtol(end + 1, &end, 10);
+        if (*end != '\0') return -1;
+    }
+    if (*from == 0 && *to == 0) return -1;
+    return *to == 0 || *from <= *to ? 0 : -1;
+}
+
+// Parses KEEP=<n> (n >= 0) into *keep
+int parse_keep(const char *arg, int *keep) {
+    if (strncmp(arg, "KEEP=", 5) != 0) return -1;
+    const char *digits = arg + 5;
+    if (!*digits || strspn(digits, "0123456789") != strlen(digits)) return -1;
+    *keep = (int)strtol(digits, NULL, 10);
+    return 0;
+}
+
+int handle_bulk_rm(struct conn *c, const char *line) {
+    uint64_t parse_start = trace_now();
+    char *pattern = arena_alloc(c->arena, 1024);
+    char *prefix = arena_alloc(c->arena, 1024);
+    char keep_arg[32] = "";
+    int from = 0, to = 0, keep = 0;
+    if (!pattern || !prefix || sscanf(line, "RM -r %1023s %31s", pattern, keep_arg) < 1) {
+        return send_str(c->sock, "ERR bad pattern\n__END__\n");
+    }
+    char *colon = strrchr(pattern, ':');
+    if (colon && colon[1] && strspn(colon + 1, "0123456789-") == strlen(colon + 1)) {
+        *colon = '\0';
+        if (parse_version_range(colon + 1, &from, &to) < 0) {
+            return send_str(c->sock, "ERR bad version range\n__END__\n");
+        }
+    }
+    if (!valid_path(pattern)) return send_str(c->sock, "ERR bad pattern\n__END__\n");
+    if (keep_arg[0] && parse_keep(keep_arg, &keep) < 0) {
+        return send_str(c->sock, "ERR bad KEEP\n__END__\n");
+    }
+    if (wait_unfrozen() < 0) return -1;
+
+    size_t literal = strcspn(pattern, "*?[");
+    int glob = pattern[literal] != '\0';
+    snprintf(prefix, 1024, "%.*s", (int)literal, pattern);
+    trace_span(TRACE_PARSE, parse_start);
+
+    struct detail_ctx ctx = { prefix, NULL, 0, 0 };
+    struct pack_item *packed;
+    size_t npacked;
+    uint64_t t = trace_now();
+    collect_versions(&ctx, &packed, &npacked);
+    trace_span(TRACE_VERSION_LOOKUP, t);
+
+    // Entries come newest first per path, so rank counts the newer ones
+    struct bulk_rm rm = { .victims = malloc((ctx.count ? ctx.count : 1) * sizeof(struct rm_victim)) };
+    if (!rm.victims) {
+        free_versions(&ctx, packed, npacked);
+        return send_str(c->sock, "ERR out of memory\n__END__\n");
+    }
+    int rank = 0;
+    size_t held = 0;
+    for (size_t i = 0; i < ctx.count; i++) {
+        const struct version_entry *e = &ctx.entries[i];
+        rank = i > 0 && strcmp(e->path, ctx.entries[i - 1].path) == 0 ? rank + 1 : 0;
+        if (glob && fnmatch(pattern, e->path, FNM_PATHNAME) != 0) continue;
+        if (rank < keep || (from && e->version < from) || (to && e->version > to)) continue;
+        if (snap_holder(e->path, e->version)) {
+            held++;
+            continue;
+        }
+        rm.victims[rm.count].stored = e->stored;
+        rm.victims[rm.count].latest = rank == 0;
+        rm.count++;
+    }
+
+    char msg[128];
+    snprintf(msg, sizeof(msg), "MATCHED %zu %zu\n", rm.count, held);
+    int status = send_str(c->sock, msg);
+
+    t = trace_now();
+    atomic_init(&rm.next, 0);
+    atomic_init(&rm.deleted, 0);
+    atomic_init(&rm.failed, 0);
+    pthread_mutex_init(&rm.lock, NULL);
+    pthread_cond_init(&rm.finished, NULL);
+    int workers = config.rm_threads > 0 ? config.rm_threads : 1;
+    if ((size_t)workers > rm.count) workers = (int)rm.count;
+    pthread_t threads[RM_MAX_THREADS];
+    int started = 0;
+    for (; started < workers; started++) {
+        rm.running++;
+        if (pthread_create(&threads[started], NULL, bulk_rm_worker, &rm) != 0) {
+            rm.running--;
+            break;
+        }
+    }
+    if (started == 0 && rm.count > 0) {
+        rm.running++;
+        bulk_rm_worker(&rm);
+    }
+
+    // Report progress until the workers are done; a client that went away
+    // does not stop the deletion it asked for
+    long reported = 0;
+    pthread_mutex_lock(&rm.lock);
+    while (rm.running > 0) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += 1;
+        if (pthread_cond_timedwait(&rm.finished, &rm.lock, &deadline) != ETIMEDOUT) continue;
+        long done = atomic_load(&rm.deleted) + atomic_load(&rm.failed);
+        if (done != reported && status == 0) {
+            reported = done;
+            snprintf(msg, sizeof(msg), "PROGRESS %ld %zu\n", done, rm.count);
+            pthread_mutex_unlock(&rm.lock);
+            status = send_str(c->sock, msg);
+            pthread_mutex_lock(&rm.lock);
+        }
+    }
+    pthread_mutex_unlock(&rm.lock);
+    for (int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+    trace_span(TRACE_DISK, t);
+
+    long deleted = atomic_load(&rm.deleted), failed = atomic_load(&rm.failed);
+    printf("Deleted %ld of %zu versions matching %s\n", deleted, rm.count, pattern);
+    // Cut short by a handover: rerun on the new server, it finishes the job
+    if (deleted + failed < (long)rm.count) status = -1;
+    snprintf(msg, sizeof(msg), "DELETED %ld %ld\n__END__\n", deleted, failed);
+    if (status == 0) status = send_str(c->sock, msg);
+    pthread_mutex_destroy(&rm.lock);
+    pthread_cond_destroy(&rm.finished);
+    free(rm.victims);
+    free_versions(&ctx, packed, npacked);
+    return status < 0 ? -1 : 0;
+}
+
+// === LS: List Server Files === //
+
+/*
+ * LS [-l] [filter] [SNAP=<id>]
+ * With SNAP, lists the versions recorded in a snapshot instead of the
+ * current ones.
+ */
+
+int handle_ls(struct conn *c, const char *line) {
+    char arg[1024] = "";
+    char filter[1024] = "";
+    unsigned long snap = 0;
+
+    // Parse the LS command to extract an optional "-l" flag and filter
+    const char *snap_opt = strstr(line, " SNAP=");
+    if (snap_opt) snap = strtoul(snap_opt + 6, NULL, 10);
+    sscanf(line, "LS %1023s %1023s", arg, filter);
+    if (strncmp(arg, "SNAP=", 5) == 0) arg[0] = '\0';
+    if (strncmp(filter, "SNAP=", 5) == 0) filter[0] = '\0';
+    if (snap && snap_version(snap, "") < 0) return send_str(c->sock, "ERR no such snapshot\n__END__\n");
+
+    set_cork(c->sock, 1);
+    if (strcmp(arg, "-l") == 0) {
+        list_latest(c->sock, strlen(filter) > 0 ? filter : NULL, snap);
+    } else if (snap) {
+        list_snapshot_files(c->sock, strlen(arg) > 0 ? arg : NULL, snap);
+    } else {
+        // List files in the server storage, applying the filter if provided
+        list_files(c->sock, strlen(arg) > 0 ? arg : NULL);
+    }
+    set_cork(c->sock, 0);
+    return 0;
+}
+
+// === WATCH: Stream Change Events === //
+
+/*
+ * WATCH [prefix] [FROM=<seq>]
+ * Replies "WATCHING <seq>" with the latest sequence number, then sends an
+ * "EVENT" line (see watch.c) for every version written or deleted below
+ * prefix, starting after FROM if given and after <seq> otherwise.
+ * "RESYNC <seq>" means events were missed (the history moved on, or the
+ * server restarted) and the subscriber should list again; the stream
+ * carries on after <seq>. While nothing happens, "PING <seq>" goes out
+ * every WATCH_PING seconds. Any line from the client ends the watch with
+ * "__END__" and the connection takes commands again.
+ */
+
+int handle_watch(struct conn *c, const char *line) {
+    const size_t cap = 8192;
+    char *prefix = arena_alloc(c->arena, 1024);
+    char *args = arena_alloc(c->arena, BUFFER_SIZE);
+    char *events = arena_alloc(c->arena, cap);
+    if (!prefix || !args || !events) return send_str(c->sock, "ERR out of memory\n");
+
+    prefix[0] = '\0';
+    snprintf(args, BUFFER_SIZE, "%s", line + 5);
+    uint64_t cursor = watch_head();
+    char *save, *token;
+    for (token = strtok_r(args, " ", &save); token; token = strtok_r(NULL, " ", &save)) {
+        if (strncmp(token, "FROM=", 5) == 0) cursor = strtoull(token + 5, NULL, 10);
+        else snprintf(prefix, 1024, "%s", token);
+    }
+
+    char msg[64];
+    snprintf(msg, sizeof(msg), "WATCHING %llu\n", (unsigned long long)watch_head());
+    if (send_str(c->sock, msg) < 0) return -1;
+    time_t last_sent = time(NULL);
+    for (;;) {
+        int n = watch_next(&cursor, prefix, events, cap, 1000);
+        size_t len = n > 0 ? (size_t)n : 0;
+        if (n < 0) {
+            len = snprintf(events, cap, "RESYNC %llu\n", (unsigned long long)cursor);
+        } else if (n == 0 && time(NULL) - last_sent >= WATCH_PING) {
+            len = snprintf(events, cap, "PING %llu\n", (unsigned long long)cursor);
+        }
+        if (len > 0) {
+            if (send_all(c->sock, events, len) < 0) return -1;
+            last_sent = time(NULL);
+        }
+
+        // A draining server hands subscribers to its successor: they
+        // reconnect and resume from their last sequence number
+        if (atomic_load(&draining)) return -1;
+
+        // Stop once the client says something (or hangs up)
+        struct pollfd pfd = { c->sock, POLLIN, 0 };
+        if (c->off < c->len || poll(&pfd, 1, 0) > 0) break;
+    }
+    if (conn_read_line(c, args, BUFFER_SIZE) <= 0) return -1;
+    return send_str(c->sock, "__END__\n");
+}
+
+// === MGET: Stream Many Versions as One Archive === //
+
+/*
+ * MGET pattern [v<version>|t<unix time>|s<snapshot>]
+ * Sends every path matching pattern (a path prefix, or a glob when it
+ * contains *, ? or [, where * stops at '/' as in the shell) back to back,
+ * without waiting for acknowledgements:
+ *     FILE <path> <version> <size> <mtime> <nonce|->
+ *     <size bytes, as GET would send them>
+ *     CRC <hex>
+ * followed by "__END__". Paths are sent at their latest version, or as of
+ * version N (their newest version <= N), as they stood at a given time, or
+ * as recorded in a snapshot.
+ * A version that cannot be read is announced as "SKIP <path> <reason>"
+ * instead; one found damaged halfway is padded out to its announced size
+ * and followed by "ERR <reason>" in place of the CRC, so the stream goes on.
+ */
+
+static int send_zeros(int sock, long len) {
+    static const char zeros[BUFFER_SIZE];
+    while (len > 0) {
+        size_t n = len < (long)sizeof(zeros) ? (size_t)len : sizeof(zeros);
+        if (send_all(sock, zeros, n) < 0) return -1;
+        len -= n;
+    }
+    return 0;
+}
+
+static int send_skip(int sock, const char *path, const char *reason) {
+    char msg[1200];
+    snprintf(msg, sizeof(msg), "SKIP %s %s\n", path, reason);
+    return send_str(sock, msg);
+}
+
+static int send_archive_packed(struct conn *c, const struct version_entry *e, char *filename) {
+    char msg[1200], ext[32], nonce[2 * CHACHA20_NONCE_SIZE + 1] = "-";
+    char *data = bufpool_get();
+    struct pack_info info;
+    if (!data) return send_skip(c->sock, e->path, "out-of-memory");
+    parse_stored_path(e->stored, filename, 1024, ext, sizeof(ext));
+    uint64_t t = trace_now();
+    int found = pack_read(filename, ext, e->version, data, bufpool_buffer_size(), &info) == 0;
+    trace_add(TRACE_DISK, t);
+    if (!found || crc32c_update(0, data, info.size) != info.crc) {
+        if (found) printf("Checksum mismatch in packed %s, skipped\n", e->stored);
+        bufpool_put(data);
+        return send_skip(c->sock, e->path, found ? "damaged" : "removed");
+    }
+    if (info.has_nonce) hex_encode(info.nonce, CHACHA20_NONCE_SIZE, nonce);
+    else xor_cipher(data, info.size, ENCRYPTION_KEY, 0);
+
+    snprintf(msg, sizeof(msg), "FILE %s %d %ld %ld %s\n", e->path, e->version, info.size, (long)info.mtime, nonce);
+    struct transfer xfer;
+    transfer_begin(&xfer, c->limits, info.size);
+    t = trace_now();
+    int status = send_str(c->sock, msg) < 0 || send_all(c->sock, data, info.size) < 0 ? -1 : 0;
+    trace_add(TRACE_NETWORK, t);
+    transfer_account(&xfer, info.size);
+    transfer_end(&xfer);
+    if (status == 0) {
+        snprintf(msg, sizeof(msg), "CRC %08x\n", crc32c_update(0, data, info.size));
+        status = send_str(c->sock, msg);
+    }
+    bufpool_put(data);
+    return status;
+}
+
+static int send_archive_file(struct conn *c, const struct version_entry *e, char *final) {
+    char msg[1200], nonce[2 * CHACHA20_NONCE_SIZE + 1] = "-";
+    snprintf(final, 2048, "%s/%s", ROOT_DIR, e->stored);
+    uint64_t t = trace_now();
+    long filesize;
+    FILE *fp = open_version(final, &filesize);
+    if (!fp) return send_skip(c->sock, e->path, "removed");
+    struct version_meta meta;
+    int verify = load_meta(final, &meta, 1) == 0 &&
+                 meta.nchunks == (size_t)((filesize + CRC_CHUNK - 1) / CRC_CHUNK);
+    trace_add(TRACE_DISK, t);
+    if (meta.has_nonce) hex_encode(meta.nonce, CHACHA20_NONCE_SIZE, nonce);
+
+    snprintf(msg, sizeof(msg), "FILE %s %d %ld %ld %s\n", e->path, e->version, filesize, (long)e->mtime, nonce);
+    uint32_t crc = 0;
+    long sent = send_str(c->sock, msg) < 0 ? -1 : send_file_chunks(c, fp, filesize, &meta, verify, final, &crc);
+    fclose(fp);
+    free(meta.chunks);
+    if (sent < 0) return -1;
+    if (sent < filesize) {
+        if (send_zeros(c->sock, filesize - sent) < 0) return -1;
+        return send_str(c->sock, "ERR checksum mismatch\n");
+    }
+    snprintf(msg, sizeof(msg), "CRC %08x\n", crc);
+    return send_str(c->sock, msg);
+}
+
+/*
+ * pick_version - Whether e is the version of its path that MGET sends:
+ * the newest one at or below max_version / at or before as_of (0 = any),
+ * or the one snapshot snap recorded. Entries come newest first, so that
+ * is the first one accepted per path.
+ */
+
+static int pick_version(const struct version_entry *e, int max_version, time_t as_of, unsigned long snap) {
+    if (snap) return e->version == snap_version(snap, e->path);
+    return (max_version == 0 || e->version <= max_version) && (as_of == 0 || e->mtime <= as_of);
+}
+
+int handle_mget(struct conn *c, const char *line) {
+    uint64_t parse_start = trace_now();
+    char *pattern = arena_alloc(c->arena, 1024);
+    char *prefix = arena_alloc(c->arena, 1024);
+    char *scratch = arena_alloc(c->arena, 2048);  // stored path of the version being sent
+    char when[32] = "";
+    if (!pattern || !prefix || !scratch || sscanf(line, "MGET %1023s %31s", pattern, when) < 1 || !valid_path(pattern)) {
+        return send_str(c->sock, "ERR bad pattern\n__END__\n");
+    }
+    int max_version = 0;
+    long as_of = 0;
+    unsigned long snap = 0;
+    if (when[0] && !(sscanf(when, "v%d", &max_version) == 1 && max_version > 0) &&
+        !(sscanf(when, "t%ld", &as_of) == 1 && as_of > 0) && !(sscanf(when, "s%lu", &snap) == 1 && snap > 0)) {
+        return send_str(c->sock, "ERR bad version or time\n__END__\n");
+    }
+    if (snap && snap_version(snap, "") < 0) return send_str(c->sock, "ERR no such snapshot\n__END__\n");
+
+    // Everything before the first wildcard narrows the walk like an LS prefix
+    size_t literal = strcspn(pattern, "*?[");
+    int glob = pattern[literal] != '\0';
+    snprintf(prefix, 1024, "%.*s", (int)literal, pattern);
+    trace_span(TRACE_PARSE, parse_start);
+
+    struct detail_ctx ctx = { prefix, NULL, 0, 0 };
+    struct pack_item *packed;
+    size_t npacked;
+    uint64_t t = trace_now();
+    collect_versions(&ctx, &packed, &npacked);
+    trace_span(TRACE_VERSION_LOOKUP, t);
+
+    int status = 0, files = 0;
+    const char *done = NULL;  // path already sent (or skipped)
+    set_cork(c->sock, 1);
+    for (size_t i = 0; i < ctx.count && status == 0; i++) {
+        struct version_entry *e = &ctx.entries[i];
+        if (done && strcmp(e->path, done) == 0) continue;
+        if (glob && fnmatch(pattern, e->path, FNM_PATHNAME) != 0) continue;
+        if (!pick_version(e, max_version, as_of, snap)) continue;
+        done = e->path;
+        status = e->packed ? send_archive_packed(c, e, scratch) : send_archive_file(c, e, scratch);
+        files++;
+    }
+    free_versions(&ctx, packed, npacked);
+    if (status == 0) status = send_str(c->sock, "__END__\n");
+    set_cork(c->sock, 0);
+    if (status == 0) printf("Sent archive of %d files for %s\n", files, pattern);
+    return status;
+}
+
+// === SNAPSHOT: Point-in-Time Views === //
+
+/*
+ * SNAPSHOT          records the latest version of every path; replies
+ *                   "SNAPSHOT <id> <paths>"
+ * SNAPSHOT -l       lists "<id> <created> <paths>", newest first
+ * SNAPSHOT -d <id>  drops a snapshot, letting its versions be deleted
+ * Every reply ends with "__END__". GET and LS take "SNAP=<id>", and MGET
+ * "s<id>", to read paths as they were in the snapshot.
+ *
+ * The versions are listed without file_mutex, which is then taken only
+ * to copy the uploads still in flight, which are left out; what remains
+ * was complete at that point. snapshot_lock is taken along with it, so no
+ * RM gets in between and the snapshot is in place to protect what it
+ * lists (see remove_version). Should a version have been removed or
+ * promoted while the listing ran (listing_epoch), it is redone, the last
+ * time under file_mutex.
+ */
+
+#define SNAPSHOT_ATTEMPTS 3
+
+static int take_snapshot(struct conn *c) {
+    char final[2048], msg[128];
+    struct detail_ctx ctx = { NULL, NULL, 0, 0 };
+    struct pack_item *packed = NULL;
+    size_t npacked = 0;
+    uint64_t t = trace_now();
+    char **uploads;
+    for (int attempt = 1;; attempt++) {
+        int locked_walk = attempt >= SNAPSHOT_ATTEMPTS;
+        unsigned long epoch = atomic_load(&listing_epoch);
+        if (!locked_walk) collect_versions(&ctx, &packed, &npacked);
+        uploads = lock_files_uploads();
+        pthread_rwlock_wrlock(&snapshot_lock);
+        int frozen = atomic_load(&stores_frozen);
+        if (!frozen && locked_walk && uploads) collect_versions(&ctx, &packed, &npacked);
+        pthread_mutex_unlock(&file_mutex);
+        if (!frozen && (locked_walk || !uploads || atomic_load(&listing_epoch) == epoch)) break;
+
+        pthread_rwlock_unlock(&snapshot_lock);
+        free_uploads(uploads);
+        free_versions(&ctx, packed, npacked);
+        ctx = (struct detail_ctx){ NULL, NULL, 0, 0 };
+        packed = NULL;
+        npacked = 0;
+        if (frozen && wait_unfrozen() < 0) return -1;
+    }
+    trace_span(TRACE_VERSION_LOOKUP, t);
+
+    // The newest version of each path that is not still being received
+    struct snap_entry *entries = malloc((ctx.count ? ctx.count : 1) * sizeof(*entries));
+    size_t n = 0;
+    for (size_t i = 0; entries && uploads && i < ctx.count; i++) {
+        const struct version_entry *e = &ctx.entries[i];
+        if (n > 0 && strcmp(entries[n - 1].path, e->path) == 0) continue;
+        snprintf(final, sizeof(final), "%s/%s", ROOT_DIR, e->stored);
+        int in_flight = 0;
+        for (size_t j = 0; !e->packed && !e->cold && uploads[j]; j++) in_flight |= strcmp(uploads[j], final) == 0;
+        if (in_flight) continue;
+        entries[n].path = e->path;
+        entries[n].version = e->version;
+        n++;
+    }
+    t = trace_now();
+    unsigned long id = uploads && entries ? snap_create(entries, n) : 0;
+    trace_span(TRACE_DISK, t);
+    pthread_rwlock_unlock(&snapshot_lock);
+    free(entries);
+    free_versions(&ctx, packed, npacked);
+    free_uploads(uploads);
+
+    if (id == 0) return send_str(c->sock, "ERR cannot save snapshot\n__END__\n");
+    printf("Snapshot %lu taken (%zu paths)\n", id, n);
+    snprintf(msg, sizeof(msg), "SNAPSHOT %lu %zu\n__END__\n", id, n);
+    return send_str(c->sock, msg);
+}
+
+int handle_snapshot(struct conn *c, const char *line) {
+    char msg[128];
+    unsigned long id;
+    if (strcmp(line, "SNAPSHOT") == 0) return take_snapshot(c);
+
+    if (sscanf(line, "SNAPSHOT -d %lu", &id) == 1) {
+        if (wait_unfrozen() < 0) return -1;
+        if (snap_drop(id) < 0) return send_str(c->sock, "ERR no such snapshot\n__END__\n");
+        printf("Snapshot %lu dropped\n", id);
+        return send_str(c->sock, "OK\n__END__\n");
+    }
+    if (strcmp(line, "SNAPSHOT -l") != 0) return send_str(c->sock, "ERR malformed SNAPSHOT\n__END__\n");
+
+    size_t count;
+    struct snap_info *list = snap_list(&count);
+    int status = 0;
+    set_cork(c->sock, 1);
+    for (size_t i = 0; i < count && status == 0; i++) {
+        snprintf(msg, sizeof(msg), "%lu %ld %zu\n", list[i].id, (long)list[i].created, list[i].paths);
+        status = send_str(c->sock, msg);
+    }
+    free(list);
+    if (status == 0) status = send_str(c->sock, "__END__\n");
+    set_cork(c->sock, 0);
+    return status < 0 ? -1 : 0;
+}
+
+// === STATS: Memory Pool Usage === //
+
+/*
+ * handle_stats - Sends "name value" lines describing the transfer buffer
+ * pool and the request arenas, followed by "__END__".
+ */
+
+int handle_stats(struct conn *c) {
+    struct pool_stats st;
+    char msg[1024];
+    pool_stats(&st);
+    snprintf(msg, sizeof(msg),
+             "pool_buffer_size %zu\npool_buffers %zu\npool_buffers_max %zu\npool_in_use %zu\n"
+             "pool_peak_in_use %zu\npool_gets %lu\npool_waits %lu\narenas %zu\narena_bytes %zu\n"
+             "arena_peak_bytes %zu\narena_reserved_bytes %zu\n__END__\n",
+             st.buffer_size, st.buffers, st.max_buffers, st.in_use, st.peak_in_use, st.gets, st.waits,
+             st.arenas, st.arena_bytes, st.arena_peak, st.arena_reserved);
+    return send_str(c->sock, msg);
+}
+
+// === TRACE: Dump Phase Timings === //
+
+/*
+ * handle_trace - Sends the trace rings as Chrome trace JSON, one event
+ * per line, followed by "__END__" like LS.
+ */
+
+int handle_trace(struct conn *c) {
+    char *json = NULL;
+    size_t len = 0;
+    FILE *out = open_memstream(&json, &len);
+    if (!out) return send_str(c->sock, "__END__\n");
+    trace_dump(out);
+    fclose(out);
+    int status = send_all(c->sock, json, len);
+    free(json);
+    return status < 0 ? -1 : send_str(c->sock, "__END__\n");
+}
+
+// === Tiering: Cold Versions === //
+
+/*
+ * Every cold_interval seconds a background pass moves file-backed versions
+ * beyond the newest cold_keep_versions of their path, or not read for
+ * cold_after_days, into the cold tier, and brings back cold versions read
+ * at least cold_promote_reads times since the previous pass. A version
+ * read within the last READ_GUARD seconds is never moved. Packed versions
+ * stay in their segments; they are small and already share files.
+ *
+ * Copies are made without file_mutex held; only the final switch (drop
+ * the source, or back out if an RM got there first) takes it.
+ */
+
+static int move_to_cold(const struct version_entry *e) {
+    char final[2048], filename[1024], ext[32];
+    snprintf(final, sizeof(final), "%s/%s", ROOT_DIR, e->stored);
+    int version = parse_stored_path(e->stored, filename, sizeof(filename), ext, sizeof(ext));
+    FILE *fp = version > 0 ? fopen(final, "rb") : NULL;
+    if (!fp) return -1;
+    int status = cold_store(filename, ext, version, e->mtime, fp);
+    fclose(fp);
+    if (status < 0) return -1;
+
+    lock_files();
+    if (remove(final) != 0) {
+        cold_remove(filename, ext, version);
+        status = -1;
+    }
+    pthread_mutex_unlock(&file_mutex);
+    return status;
+}
+
+static int promote(const struct cold_item *item) {
+    char final[2048], temp[2064], filename[1024], ext[32];
+    snprintf(final, sizeof(final), "%s/%s", ROOT_DIR, item->stored);
+    snprintf(temp, sizeof(temp), "%s.promote", final);
+    parse_stored_path(item->stored, filename, sizeof(filename), ext, sizeof(ext));
+    long size;
+    FILE *in = cold_fopen(filename, ext, item->version, &size);
+    if (!in) return -1;
+    make_parent_dirs(final);
+    FILE *out = fopen(temp, "wb");
+    char *buf = bufpool_get();
+    long copied = 0;
+    size_t n;
+    while (out && buf && (n = fread(buf, 1, bufpool_buffer_size(), in)) > 0 && fwrite(buf, 1, n, out) == n) {
+        copied += n;
+    }
+    bufpool_put(buf);
+    fclose(in);
+    if (!out || fclose(out) != 0 || copied != size) {
+        unlink(temp);
+        return -1;
+    }
+    struct timespec times[2] = { { time(NULL), 0 }, { item->mtime, 0 } };
+    utimensat(AT_FDCWD, temp, times, 0);
+
+    lock_files();
+    int status = atomic_load(&stores_frozen) ? -1 : rename(temp, final);
+    if (status != 0) {
+        unlink(temp);
+    } else if (cold_remove(filename, ext, item->version) != 0) {
+        // Deleted while it was being copied
+        remove(final);
+        status = -1;
+    } else {
+        atomic_fetch_add(&listing_epoch, 1);
+    }
+    pthread_mutex_unlock(&file_mutex);
+    return status;
+}
+
+static void tier_pass(void) {
+    if (atomic_load(&stores_frozen)) return;
+    if (config.cold_promote > 0) {
+        size_t ncold;
+        struct cold_item *cold = cold_list(&ncold);
+        cold_reset_reads();
+        for (size_t i = 0; i < ncold; i++) {
+            if (cold[i].reads >= (unsigned)config.cold_promote && promote(&cold[i]) == 0) {
+                printf("Promoted %s from the cold tier\n", cold[i].stored);
+            }
+        }
+        cold_free_list(cold, ncold);
+    }
+
+    struct detail_ctx ctx = { NULL, NULL, 0, 0 };
+    struct pack_item *packed;
+    size_t npacked;
+    collect_versions(&ctx, &packed, &npacked);
+    time_t now = time(NULL);
+    int rank = 0;
+    for (size_t i = 0; i < ctx.count; i++) {
+        struct version_entry *e = &ctx.entries[i];
+        rank = i > 0 && strcmp(e->path, ctx.entries[i - 1].path) == 0 ? rank + 1 : 0;
+        if (e->packed || e->cold || e->atime > now - READ_GUARD) continue;
+        int superseded = config.cold_keep > 0 && rank >= config.cold_keep;
+        int idle = config.cold_after_days > 0 && e->atime < now - config.cold_after_days * 86400L;
+        if ((superseded || idle) && move_to_cold(e) == 0) printf("Moved %s to the cold tier\n", e->stored);
+    }
+    free_versions(&ctx, packed, npacked);
+}
+
+static void *tier_loop(void *arg) {
+    for (;;) {
+        sleep(config.cold_interval);
+        tier_pass();
+    }
+    return NULL;
+}
+
+// ===  Client Handler Thread === //
+
+/*
+ * handle_client - Handles client requests in a separate thread.
+ * Commands are served in order until the client closes the connection,
+ * or the server drains.
+ */
+
+void *handle_client(void *arg) {
+    struct conn *c = arg;
+
+    char line[BUFFER_SIZE];
+    int status = 0;
+    trace_span(TRACE_ACCEPT, c->accepted);
+    while (status == 0 && conn_next_command(c, line, sizeof(line)) > 0) {
+        if (line[0] == '\0') continue;
+
+        trace_request_begin(line);
+        if (strncmp(line, "WRITE", 5) == 0) {
+            ratelimit_request(c->limits, OP_WRITE);
+            status = handle_write(c, line);
+        } else if (strncmp(line, "MGET", 4) == 0) {
+            ratelimit_request(c->limits, OP_GET);
+            status = handle_mget(c, line);
+        } else if (strncmp(line, "GET", 3) == 0) {
+            ratelimit_request(c->limits, OP_GET);
+            status = handle_get(c, line);
+        } else if (strncmp(line, "RM -r ", 6) == 0) {
+            ratelimit_request(c->limits, OP_RM);
+            status = handle_bulk_rm(c, line);
+        } else if (strncmp(line, "RM", 2) == 0) {
+            ratelimit_request(c->limits, OP_RM);
+            status = handle_rm(c, line);
+        } else if (strncmp(line, "LS", 2) == 0) {
+            ratelimit_request(c->limits, OP_LS);
+            status = handle_ls(c, line);
+        } else if (strncmp(line, "SNAPSHOT", 8) == 0) {
+            ratelimit_request(c->limits, OP_LS);
+            status = handle_snapshot(c, line);
+        } else if (strncmp(line, "WATCH", 5) == 0) {
+            ratelimit_request(c->limits, OP_LS);
+            status = handle_watch(c, line);
+        } else if (strcmp(line, "STATS") == 0) {
+            ratelimit_request(c->limits, OP_OTHER);
+            status = handle_stats(c);
+        } else if (strcmp(line, "TRACE") == 0) {
+            ratelimit_request(c->limits, OP_OTHER);
+            status = handle_trace(c);
+        } else {
+            ratelimit_request(c->limits, OP_OTHER);
+            status = send_str(c->sock, "ERR unknown command\n");
+        }
+        trace_request_end();
+        if (c->upload) {
+            // A failed WRITE has already removed its file
+            lock_files();
+            c->upload = NULL;
+            pthread_mutex_unlock(&file_mutex);
+        }
+        arena_reset(c->arena);
+    }
+
+    conn_unregister(c);
+    uring_destroy(c->ring);
+    close(c->sock);
+    ratelimit_release(c->limits);
+    arena_destroy(c->arena);
+    free(c);
+    pthread_exit(NULL);
+ }
+    // === Listeners ========== //
+
+    /*
+     * open_listener - Creates one listening socket. With several listeners
+     * each gets its own SO_REUSEPORT socket and the kernel spreads incoming
+     * connections across them.
+     */
+
+    int open_listener(int port) {
+        struct sockaddr_in server_addr;
+        int sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (sock < 0) return -1;
+        int one = 1;
+        setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (config.listeners > 1) setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+        tune_socket(sock);
+        // Shared with the next server after a restart: whoever loses the
+        // race for a connection goes back to waiting instead of blocking
+        fcntl(sock, F_SETFL, O_NONBLOCK);
+
+        // Configure the server address
+        memset(&server_addr, 0, sizeof(server_addr));
+        server_addr.sin_family = AF_INET;
+        server_addr.sin_port = htons(port);
+        server_addr.sin_addr.s_addr = INADDR_ANY;
+
+        // Bind the socket to the specified address and port, then listen
+        if (bind(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0 || listen(sock, SOMAXCONN) < 0) {
+            close(sock);
+            return -1;
+        }
+        return sock;
+    }
+
+    /*
+     * accept_loop - Accepts connections on one listening socket until the
+     * server drains. When CPU pinning is on, the listener and every
+     * connection thread it starts run on the same CPU, so a connection
+     * stays where it was accepted.
+     */
+
+    void *accept_loop(void *arg) {
+        int index = (int)(long)arg;
+        int sock = listen_socks[index];
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (config.pin_cpus) {
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(index % sysconf(_SC_NPROCESSORS_ONLN), &cpus);
+            pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+            pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+        }
+
+        while (!atomic_load(&draining)) {
+            struct pollfd pfd[2] = { { sock, POLLIN, 0 }, { drain_pipe[0], POLLIN, 0 } };
+            if (poll(pfd, 2, -1) <= 0 || !(pfd[0].revents & POLLIN)) continue;
+            struct sockaddr_in client_addr;
+            socklen_t client_size = sizeof(client_addr);
+            int client_sock = accept(sock, (struct sockaddr*)&client_addr, &client_size);
+            if (client_sock < 0) continue;
+            uint64_t accepted = trace_now();
+            tune_socket(client_sock);
+            struct conn *client = malloc(sizeof(*client));
+            if (!client || !(client->arena = arena_create())) {
+                close(client_sock);
+                free(client);
+                continue;
+            }
+            client->sock = client_sock;
+            client->off = client->len = 0;
+            client->accepted = accepted;
+            client->ring = NULL;
+            client->limits = ratelimit_client(client_addr.sin_addr.s_addr);
+            conn_register(client);
+            pthread_t tid;
+            if (pthread_create(&tid, &attr, handle_client, client) != 0) {
+                conn_unregister(client);
+                close(client_sock);
+                ratelimit_release(client->limits);
+                arena_destroy(client->arena);
+                free(client);
+            }
+        }
+        // Connections still queued are left to the next server, if any
+        close(sock);
+        pthread_attr_destroy(&attr);
+        return NULL;
+    }
+
+    // === Restart Handoff ========== //
+
+    /*
+     * A new server asks the running one for its listening sockets over
+     * upgrade_socket, so the ports never close:
+     *   1. the old server freezes its stores and sends the sockets with
+     *      SCM_RIGHTS ("LISTENERS <n>");
+     *   2. the new server loads the pack and the cold tier and replies
+     *      "READY";
+     *   3. the old server stops accepting and drains, while the new one
+     *      starts accepting on the same sockets.
+     * Connections arriving in between wait in the sockets' backlog. If the
+     * new server goes away before READY, the old one carries on.
+     */
+
+    static int hand_over(int peer) {
+        if (atomic_load(&draining)) return -1;
+        printf("New server starting, handing the listeners over...\n");
+        freeze_stores(1);
+
+        char msg[32];
+        union {
+            struct cmsghdr header;
+            char buf[CMSG_SPACE(sizeof(int) * MAX_LISTENERS)];
+        } control;
+        struct iovec iov = { msg, snprintf(msg, sizeof(msg), "LISTENERS %d\n", nlisteners) };
+        struct msghdr mh = { 0 };
+        mh.msg_iov = &iov;
+        mh.msg_iovlen = 1;
+        mh.msg_control = control.buf;
+        mh.msg_controllen = CMSG_SPACE(sizeof(int) * nlisteners);
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(sizeof(int) * nlisteners);
+        memcpy(CMSG_DATA(cm), listen_socks, sizeof(int) * nlisteners);
+
+        char reply[16];
+        ssize_t n = sendmsg(peer, &mh, 0) == (ssize_t)iov.iov_len ? recv(peer, reply, sizeof(reply) - 1, 0) : -1;
+        if (n > 0 && strncmp(reply, "READY", 5) == 0) {
+            start_drain("Listeners handed over");
+            return 0;
+        }
+        freeze_stores(0);
+        printf("New server went away, still serving\n");
+        return -1;
+    }
+
+    static void *upgrade_loop(void *arg) {
+        int sock = (int)(long)arg;
+        while (!atomic_load(&draining)) {
+            int peer = accept(sock, NULL, NULL);
+            if (peer < 0) continue;
+            int done = hand_over(peer) == 0;
+            close(peer);
+            if (done) break;
+        }
+        close(sock);
+        return NULL;
+    }
+
+    /*
+     * open_upgrade_socket - Listens on the UNIX socket at path, replacing
+     * the one of the server this one took over from.
+     */
+
+    int open_upgrade_socket(const char *path) {
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+        if (strlen(path) >= sizeof(addr.sun_path)) return -1;
+        strcpy(addr.sun_path, path);
+        int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (sock < 0) return -1;
+        unlink(path);
+        if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 || chmod(path, 0600) < 0 || listen(sock, 1) < 0) {
+            close(sock);
+            return -1;
+        }
+        return sock;
+    }
+
+    /*
+     * take_over - Asks a server running on path for its listening sockets.
+     * Returns the connection to reply READY on once the stores are loaded,
+     * or -1 (with nothing taken) if no server answered.
+     */
+
+    int take_over(const char *path) {
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+        if (strlen(path) >= sizeof(addr.sun_path)) return -1;
+        strcpy(addr.sun_path, path);
+        int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (sock < 0) return -1;
+
+        char msg[32];
+        union {
+            struct cmsghdr header;
+            char buf[CMSG_SPACE(sizeof(int) * MAX_LISTENERS)];
+        } control;
+        struct iovec iov = { msg, sizeof(msg) };
+        struct msghdr mh = { 0 };
+        mh.msg_iov = &iov;
+        mh.msg_iovlen = 1;
+        mh.msg_control = control.buf;
+        mh.msg_controllen = sizeof(control.buf);
+        struct cmsghdr *cm = NULL;
+        if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0 && recvmsg(sock, &mh, 0) > 0) {
+            cm = CMSG_FIRSTHDR(&mh);
+        }
+        if (!cm || cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS || cm->cmsg_len <= CMSG_LEN(0)) {
+            close(sock);
+            return -1;
+        }
+        nlisteners = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(listen_socks, CMSG_DATA(cm), sizeof(int) * nlisteners);
+        return sock;
+    }
+
+    // === Main Function ========== //
+
+    int main() {
+        // A client closing early must not kill the whole server
+        signal(SIGPIPE, SIG_IGN);
+
+        mkdir(ROOT_DIR, 0755);
+        load_config();
+        if (pipe(drain_pipe) < 0) {
+            perror("pipe");
+            return 1;
+        }
+        // Before any other thread exists, so SIGINT and SIGTERM reach only
+        // stop_waiter and SIGUSR1 only the trace dumper
+        sigemptyset(&stop_signals);
+        sigaddset(&stop_signals, SIGINT);
+        sigaddset(&stop_signals, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &stop_signals, NULL);
+        trace_start_signal_dumper();
+        pthread_t waiter;
+        if (pthread_create(&waiter, NULL, stop_waiter, NULL) == 0) pthread_detach(waiter);
+
+        // Take the listeners over from a server already running here, if
+        // any; it stops writing to the stores before handing them out
+        int upgrading = strcmp(config.upgrade_socket, "none") != 0;
+        int handoff = upgrading ? take_over(config.upgrade_socket) : -1;
+
+        // Packed versions stay readable even with packing turned off
+        if (pack_open(PACK_DIR, config.pack_segment) < 0) {
+            perror("Cannot open " PACK_DIR);
+            return 1;
+        }
+        if (config.cold_dir[0] && cold_open(config.cold_dir, config.cold_archive, config.cold_level) < 0) {
+            perror(config.cold_dir);
+            return 1;
+        }
+        if (snap_open(SNAP_DIR) < 0) {
+            perror("Cannot open " SNAP_DIR);
+            return 1;
+        }
+
+        const char *port_env = getenv("FS_PORT");
+        int port = port_env ? atoi(port_env) : PORT;
+
+        if (handoff >= 0) {
+            struct sockaddr_in addr;
+            socklen_t len = sizeof(addr);
+            if (getsockname(listen_socks[0], (struct sockaddr *)&addr, &len) == 0) port = ntohs(addr.sin_port);
+            send_str(handoff, "READY\n");
+            close(handoff);
+            printf("Took over %d listener%s from the running server\n", nlisteners, nlisteners > 1 ? "s" : "");
+        } else {
+            // Create the listening sockets
+            for (nlisteners = 0; nlisteners < config.listeners; nlisteners++) {
+                listen_socks[nlisteners] = open_listener(port);
+                if (listen_socks[nlisteners] < 0) {
+                    perror("Bind failed");
+                    return 1;
+                }
+            }
+        }
+        printf("Server listening on port %d (%d listener%s)...\n", port, nlisteners, nlisteners > 1 ? "s" : "");
+
+        pack_start_compactor(config.pack_compact);
+        if (config.cold_dir[0]) {
+            pthread_t tier;
+            if (pthread_create(&tier, NULL, tier_loop, NULL) == 0) pthread_detach(tier);
+        }
+        if (upgrading) {
+            pthread_t upgrader;
+            int sock = open_upgrade_socket(config.upgrade_socket);
+            if (sock < 0) {
+                perror(config.upgrade_socket);
+            } else if (pthread_create(&upgrader, NULL, upgrade_loop, (void *)(long)sock) == 0) {
+                pthread_detach(upgrader);
+            }
+        }
+
+        // Every listener but the first gets its own thread; main runs the first
+        for (int i = 1; i < nlisteners; i++) {
+            pthread_t tid;
+            if (pthread_create(&tid, NULL, accept_loop, (void *)(long)i) != 0) {
+                perror("Listener thread failed");
+                return 1;
+            }
             pthread_detach(tid);
         }
+        accept_loop((void *)0);
+        finish_drain();
+        return 0;
  }
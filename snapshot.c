@@ -0,0 +1,281 @@
+/*
+ * snapshot.c - Point-in-time views of the namespace.
+ *
+ * Snapshots live in a list, newest first, guarded by one rwlock; lookups
+ * share it and only linking in or dropping a snapshot takes it alone.
+ * Snapshot files are written in full under a temporary name and renamed
+ * into place, so a crash leaves either the whole snapshot or none of it.
+ * The next id is saved before a snapshot is, so ids are not handed out
+ * twice even if a dropped snapshot was the newest.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "snapshot.h"
+
+#define NEXT_ID_FILE "next_id"
+
+struct snapshot {
+    unsigned long id;
+    time_t created;
+    struct snap_entry *entries;
+    size_t count;
+    struct snapshot *next;
+};
+
+static pthread_rwlock_t snap_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t create_lock = PTHREAD_MUTEX_INITIALIZER;  // one snapshot saved at a time
+static struct snapshot *snapshots;
+static unsigned long next_id = 1;
+static char snap_dir[1024];
+
+static int compare_entries(const void *a, const void *b) {
+    return strcmp(((const struct snap_entry *)a)->path, ((const struct snap_entry *)b)->path);
+}
+
+static void snapshot_path(char *out, size_t cap, unsigned long id) {
+    snprintf(out, cap, "%s/%lu.snap", snap_dir, id);
+}
+
+static void free_snapshot(struct snapshot *s) {
+    if (!s) return;
+    snap_free_entries(s->entries, s->count);
+    free(s);
+}
+
+static struct snapshot *find_snapshot(unsigned long id) {
+    struct snapshot *s = snapshots;
+    while (s && s->id != id) s = s->next;
+    return s;
+}
+
+static const struct snap_entry *find_entry(const struct snapshot *s, const char *path) {
+    struct snap_entry key = { (char *)path, 0 };
+    return bsearch(&key, s->entries, s->count, sizeof(key), compare_entries);
+}
+
+// Writes path through a temporary file, so it appears complete or not at all
+static FILE *begin_file(const char *path, char *temp, size_t cap) {
+    snprintf(temp, cap, "%s.tmp", path);
+    return fopen(temp, "w");
+}
+
+static int end_file(FILE *fp, const char *temp, const char *path) {
+    int ok = fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+    if (fclose(fp) != 0 || !ok || rename(temp, path) != 0) {
+        unlink(temp);
+        return -1;
+    }
+    return 0;
+}
+
+static int save_next_id(unsigned long id) {
+    char path[1100], temp[1120];
+    snprintf(path, sizeof(path), "%s/%s", snap_dir, NEXT_ID_FILE);
+    FILE *fp = begin_file(path, temp, sizeof(temp));
+    if (!fp) return -1;
+    fprintf(fp, "%lu\n", id);
+    return end_file(fp, temp, path);
+}
+
+static int save_snapshot(const struct snapshot *s) {
+    char path[1100], temp[1120];
+    snapshot_path(path, sizeof(path), s->id);
+    FILE *fp = begin_file(path, temp, sizeof(temp));
+    if (!fp) return -1;
+    fprintf(fp, "SNAPSHOT %lu %ld %zu\n", s->id, (long)s->created, s->count);
+    for (size_t i = 0; i < s->count; i++) fprintf(fp, "%d %s\n", s->entries[i].version, s->entries[i].path);
+    return end_file(fp, temp, path);
+}
+
+// Reads one snapshot file; NULL if it is unreadable or cut short
+static struct snapshot *load_snapshot(const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) return NULL;
+    struct snapshot *s = calloc(1, sizeof(*s));
+    long created;
+    size_t count;
+    char line[1100];
+    if (!s || !fgets(line, sizeof(line), fp) || sscanf(line, "SNAPSHOT %lu %ld %zu", &s->id, &created, &count) != 3 ||
+        !(s->entries = calloc(count ? count : 1, sizeof(*s->entries)))) {
+        fclose(fp);
+        free_snapshot(s);
+        return NULL;
+    }
+    s->created = created;
+    int used;
+    while (s->count < count && fgets(line, sizeof(line), fp)) {
+        struct snap_entry *e = &s->entries[s->count];
+        line[strcspn(line, "\n")] = '\0';
+        if (sscanf(line, "%d %n", &e->version, &used) != 1 || !(e->path = strdup(line + used))) break;
+        s->count++;
+    }
+    fclose(fp);
+    if (s->count != count) {
+        free_snapshot(s);
+        return NULL;
+    }
+    qsort(s->entries, s->count, sizeof(*s->entries), compare_entries);
+    return s;
+}
+
+/*
+ * snap_open - Loads every snapshot saved in dir, creating the directory if
+ * needed. Snapshot files that cannot be read are reported and skipped.
+ */
+
+int snap_open(const char *dir) {
+    snprintf(snap_dir, sizeof(snap_dir), "%s", dir);
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) return -1;
+
+    char path[1100];
+    snprintf(path, sizeof(path), "%s/%s", dir, NEXT_ID_FILE);
+    FILE *fp = fopen(path, "r");
+    if (fp) {
+        if (fscanf(fp, "%lu", &next_id) != 1 || next_id == 0) next_id = 1;
+        fclose(fp);
+    }
+
+    DIR *d = opendir(dir);
+    if (!d) return -1;
+    struct dirent *entry;
+    unsigned long id;
+    char tail[8];
+    while ((entry = readdir(d)) != NULL) {
+        if (sscanf(entry->d_name, "%lu.%7s", &id, tail) != 2 || strcmp(tail, "snap") != 0) continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+        struct snapshot *s = load_snapshot(path);
+        if (!s) {
+            fprintf(stderr, "Skipping damaged snapshot %s\n", path);
+            continue;
+        }
+        struct snapshot **link = &snapshots;
+        while (*link && (*link)->id > s->id) link = &(*link)->next;
+        s->next = *link;
+        *link = s;
+        if (s->id >= next_id) next_id = s->id + 1;
+    }
+    closedir(d);
+    return 0;
+}
+
+/*
+ * snap_create - Saves entries (sorted by path) as a new snapshot and makes
+ * it live. Returns its id, or 0 if it could not be saved.
+ */
+
+unsigned long snap_create(const struct snap_entry *entries, size_t count) {
+    struct snapshot *s = calloc(1, sizeof(*s));
+    if (!s || !(s->entries = calloc(count ? count : 1, sizeof(*s->entries)))) {
+        free_snapshot(s);
+        return 0;
+    }
+    for (; s->count < count; s->count++) {
+        s->entries[s->count].version = entries[s->count].version;
+        if (!(s->entries[s->count].path = strdup(entries[s->count].path))) {
+            free_snapshot(s);
+            return 0;
+        }
+    }
+    s->created = time(NULL);
+
+    pthread_mutex_lock(&create_lock);
+    s->id = next_id;
+    if (save_next_id(s->id + 1) < 0 || save_snapshot(s) < 0) {
+        pthread_mutex_unlock(&create_lock);
+        free_snapshot(s);
+        return 0;
+    }
+    next_id = s->id + 1;
+    pthread_rwlock_wrlock(&snap_lock);
+    s->next = snapshots;
+    snapshots = s;
+    pthread_rwlock_unlock(&snap_lock);
+    pthread_mutex_unlock(&create_lock);
+    return s->id;
+}
+
+// Removes a snapshot, releasing its versions; returns -1 if there is none
+int snap_drop(unsigned long id) {
+    pthread_rwlock_wrlock(&snap_lock);
+    struct snapshot **link = &snapshots;
+    while (*link && (*link)->id != id) link = &(*link)->next;
+    struct snapshot *s = *link;
+    if (s) *link = s->next;
+    pthread_rwlock_unlock(&snap_lock);
+    if (!s) return -1;
+
+    char path[1100];
+    snapshot_path(path, sizeof(path), id);
+    unlink(path);
+    free_snapshot(s);
+    return 0;
+}
+
+int snap_version(unsigned long id, const char *path) {
+    pthread_rwlock_rdlock(&snap_lock);
+    const struct snapshot *s = find_snapshot(id);
+    const struct snap_entry *e = s ? find_entry(s, path) : NULL;
+    int version = !s ? -1 : e ? e->version : 0;
+    pthread_rwlock_unlock(&snap_lock);
+    return version;
+}
+
+unsigned long snap_holder(const char *path, int version) {
+    unsigned long holder = 0;
+    pthread_rwlock_rdlock(&snap_lock);
+    for (const struct snapshot *s = snapshots; s && !holder; s = s->next) {
+        const struct snap_entry *e = find_entry(s, path);
+        if (e && e->version == version) holder = s->id;
+    }
+    pthread_rwlock_unlock(&snap_lock);
+    return holder;
+}
+
+// A copy of the entries of snapshot id, NULL if there is no such snapshot
+struct snap_entry *snap_entries(unsigned long id, size_t *count) {
+    *count = 0;
+    pthread_rwlock_rdlock(&snap_lock);
+    const struct snapshot *s = find_snapshot(id);
+    struct snap_entry *copy = s ? calloc(s->count ? s->count : 1, sizeof(*copy)) : NULL;
+    for (size_t i = 0; copy && i < s->count; i++) {
+        copy[i].version = s->entries[i].version;
+        if (!(copy[i].path = strdup(s->entries[i].path))) {
+            snap_free_entries(copy, *count);
+            copy = NULL;
+            *count = 0;
+            break;
+        }
+        (*count)++;
+    }
+    pthread_rwlock_unlock(&snap_lock);
+    return copy;
+}
+
+void snap_free_entries(struct snap_entry *entries, size_t count) {
+    for (size_t i = 0; entries && i < count; i++) free(entries[i].path);
+    free(entries);
+}
+
+// Every live snapshot, newest first; free the result with free()
+struct snap_info *snap_list(size_t *count) {
+    *count = 0;
+    pthread_rwlock_rdlock(&snap_lock);
+    size_t n = 0;
+    for (const struct snapshot *s = snapshots; s; s = s->next) n++;
+    struct snap_info *list = malloc((n ? n : 1) * sizeof(*list));
+    for (const struct snapshot *s = snapshots; list && s; s = s->next) {
+        list[*count].id = s->id;
+        list[*count].created = s->created;
+        list[*count].paths = s->count;
+        (*count)++;
+    }
+    pthread_rwlock_unlock(&snap_lock);
+    return list;
+}
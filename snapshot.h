@@ -0,0 +1,52 @@
+/*
+ * snapshot.h - Point-in-time views of the namespace.
+ *
+ * A snapshot records, for every path, the version that was its latest
+ * when the snapshot was taken. Versions never change once written, so
+ * that map is the whole snapshot: taking one is a pass over the version
+ * metadata and copies no data. Keeping the versions a snapshot holds from
+ * being deleted is up to the caller (see snap_holder).
+ *
+ * Each snapshot is saved as one file of "version path" lines, sorted by
+ * path, in the snapshot directory, and kept in memory for lookups by
+ * binary search. Ids are never reused, not even across restarts, so a
+ * snapshot id always means the same set of versions.
+ */
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stddef.h>
+#include <time.h>
+
+// One path of a snapshot; arrays of them are sorted by path
+struct snap_entry {
+    char *path;   // "docs/a.txt"
+    int version;
+};
+
+// One live snapshot, as returned by snap_list()
+struct snap_info {
+    unsigned long id;
+    time_t created;
+    size_t paths;
+};
+
+int snap_open(const char *dir);
+
+// Copies entries (sorted by path) into a new snapshot; returns its id, 0 on failure
+unsigned long snap_create(const struct snap_entry *entries, size_t count);
+int snap_drop(unsigned long id);
+
+// Version of path in snapshot id: 0 if the path is not in it, -1 if there
+// is no such snapshot
+int snap_version(unsigned long id, const char *path);
+
+// Id of a snapshot holding that version of path, 0 if none does
+unsigned long snap_holder(const char *path, int version);
+
+struct snap_entry *snap_entries(unsigned long id, size_t *count);
+void snap_free_entries(struct snap_entry *entries, size_t count);
+struct snap_info *snap_list(size_t *count);
+
+#endif
@@ -0,0 +1,99 @@
+/*
+ * test.h - What the unit tests share.
+ *
+ * Every test_*.c is a program of its own, linked against server.c (with
+ * its main() renamed) like the microbenchmarks, so what is tested is what
+ * the server runs. CHECK counts a check and prints it if it fails.
+ * test_begin moves into a scratch directory below /tmp; test_end removes
+ * it again, prints a summary and returns the exit status.
+ *
+ * The stores keep their state in globals, so a step that stands for a
+ * server (re)start runs in a child process of its own (run_restart).
+ */
+
+#ifndef TEST_H
+#define TEST_H
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+static int checks, failures;
+static char test_scratch[] = "/tmp/fstests.XXXXXX";
+static char test_cwd[4096];
+
+#define CHECK(cond)                                                              \
+    do {                                                                         \
+        checks++;                                                                \
+        if (!(cond)) {                                                           \
+            failures++;                                                          \
+            printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond);               \
+        }                                                                        \
+    } while (0)
+
+/*
+ * run_restart - Runs step in a child process and adds its checks to ours.
+ * Returns -1 if the child did not finish.
+ */
+
+static inline int run_restart(void (*step)(void)) {
+    int fds[2], counts[2];
+    fflush(stdout);
+    if (pipe(fds) != 0) return -1;
+    pid_t pid = fork();
+    if (pid == 0) {
+        checks = failures = 0;
+        step();
+        fflush(stdout);
+        counts[0] = checks;
+        counts[1] = failures;
+        _exit(write(fds[1], counts, sizeof(counts)) == sizeof(counts) ? 0 : 1);
+    }
+    close(fds[1]);
+    int status, got = read(fds[0], counts, sizeof(counts)) == sizeof(counts);
+    close(fds[0]);
+    if (pid < 0 || waitpid(pid, &status, 0) != pid || !got || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        return -1;
+    }
+    checks += counts[0];
+    failures += counts[1];
+    return 0;
+}
+
+static inline int file_exists(const char *path) {
+    struct stat st;
+    return stat(path, &st) == 0;
+}
+
+static inline long file_size(const char *path) {
+    struct stat st;
+    return stat(path, &st) == 0 ? (long)st.st_size : -1;
+}
+
+static inline int test_begin(void) {
+    if (!getcwd(test_cwd, sizeof(test_cwd)) || !mkdtemp(test_scratch) || chdir(test_scratch) != 0) {
+        perror("test scratch directory");
+        return -1;
+    }
+    return 0;
+}
+
+static inline int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    return remove(path);
+}
+
+static inline int test_end(const char *name) {
+    if (test_cwd[0]) {
+        if (chdir(test_cwd) != 0) perror(test_cwd);
+        nftw(test_scratch, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    }
+    printf("%-16s %d checks, %d failed\n", name, checks, failures);
+    return failures > 0;
+}
+
+#endif
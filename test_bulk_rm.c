@@ -0,0 +1,49 @@
+/*
+ * test_bulk_rm.c - Parsing the arguments of RM -r: version ranges and
+ * KEEP=<n>.
+ */
+
+#include "test.h"
+
+// From server.c
+int parse_version_range(const char *text, int *from, int *to);
+int parse_keep(const char *arg, int *keep);
+
+static int range_is(const char *text, int from, int to) {
+    int f = -1, t = -1;
+    return parse_version_range(text, &f, &t) == 0 && f == from && t == to;
+}
+
+static int keep_is(const char *arg, int keep) {
+    int k = -1;
+    return parse_keep(arg, &k) == 0 && k == keep;
+}
+
+static void bulk_rm_tests(void) {
+    int from, to, keep;
+    CHECK(range_is("3", 3, 3));
+    CHECK(range_is("2-5", 2, 5));
+    CHECK(range_is("4-", 4, 0));
+    CHECK(range_is("-7", 0, 7));
+    CHECK(range_is("5-5", 5, 5));
+    CHECK(parse_version_range("5-2", &from, &to) < 0);
+    CHECK(parse_version_range("0", &from, &to) < 0);
+    CHECK(parse_version_range("-", &from, &to) < 0);
+    CHECK(parse_version_range("", &from, &to) < 0);
+    CHECK(parse_version_range("1-2-3", &from, &to) < 0);
+    CHECK(parse_version_range("2x", &from, &to) < 0);
+
+    CHECK(keep_is("KEEP=0", 0));
+    CHECK(keep_is("KEEP=2", 2));
+    CHECK(keep_is("KEEP=15", 15));
+    CHECK(parse_keep("KEEP=", &keep) < 0);
+    CHECK(parse_keep("KEEP=-1", &keep) < 0);
+    CHECK(parse_keep("KEEP=3x", &keep) < 0);
+    CHECK(parse_keep("keep=3", &keep) < 0);
+    CHECK(parse_keep("KEEP", &keep) < 0);
+}
+
+int main(void) {
+    bulk_rm_tests();
+    return test_end("bulk rm");
+}
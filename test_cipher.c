@@ -0,0 +1,115 @@
+/*
+ * test_cipher.c - ChaCha20 against RFC 8439.
+ *
+ * Runs on every implementation the CPU has (see chacha20_use_impl): the
+ * RFC vectors, once on their own and once inside a call long enough for
+ * the widest vector code, and stretches of a long stream cut at awkward
+ * offsets, which must match the scalar code byte for byte.
+ */
+
+#include "test.h"
+#include "cipher.h"
+
+// RFC 8439 A.1, test vectors #1 and #2: keystream blocks 0 and 1 for an all-zero key and nonce
+static const uint8_t zero_keystream[128] = {
+    0x76, 0xb8, 0xe0, 0xad, 0xa0, 0xf1, 0x3d, 0x90, 0x40, 0x5d, 0x6a, 0xe5, 0x53, 0x86, 0xbd, 0x28,
+    0xbd, 0xd2, 0x19, 0xb8, 0xa0, 0x8d, 0xed, 0x1a, 0xa8, 0x36, 0xef, 0xcc, 0x8b, 0x77, 0x0d, 0xc7,
+    0xda, 0x41, 0x59, 0x7c, 0x51, 0x57, 0x48, 0x8d, 0x77, 0x24, 0xe0, 0x3f, 0xb8, 0xd8, 0x4a, 0x37,
+    0x6a, 0x43, 0xb8, 0xf4, 0x15, 0x18, 0xa1, 0x1c, 0xc3, 0x87, 0xb6, 0x69, 0xb2, 0xee, 0x65, 0x86,
+    0x9f, 0x07, 0xe7, 0xbe, 0x55, 0x51, 0x38, 0x7a, 0x98, 0xba, 0x97, 0x7c, 0x73, 0x2d, 0x08, 0x0d,
+    0xcb, 0x0f, 0x29, 0xa0, 0x48, 0xe3, 0x65, 0x69, 0x12, 0xc6, 0x53, 0x3e, 0x32, 0xee, 0x7a, 0xed,
+    0x29, 0xb7, 0x21, 0x76, 0x9c, 0xe6, 0x4e, 0x43, 0xd5, 0x71, 0x33, 0xb0, 0x74, 0xd8, 0x39, 0xd5,
+    0x31, 0xed, 0x1f, 0x28, 0x51, 0x0a, 0xfb, 0x45, 0xac, 0xe1, 0x0a, 0x1f, 0x4b, 0x79, 0x4d, 0x6f,
+};
+
+// RFC 8439 2.4.2: key 00..1f, this nonce, block counter 1
+static const uint8_t sunscreen_nonce[CHACHA20_NONCE_SIZE] = { 0, 0, 0, 0, 0, 0, 0, 0x4a, 0, 0, 0, 0 };
+static const char sunscreen_plain[] =
+    "Ladies and Gentlemen of the class of '99: If I could offer you only one tip for the future, "
+    "sunscreen would be it.";
+static const uint8_t sunscreen_cipher[114] = {
+    0x6e, 0x2e, 0x35, 0x9a, 0x25, 0x68, 0xf9, 0x80, 0x41, 0xba, 0x07, 0x28, 0xdd, 0x0d, 0x69, 0x81,
+    0xe9, 0x7e, 0x7a, 0xec, 0x1d, 0x43, 0x60, 0xc2, 0x0a, 0x27, 0xaf, 0xcc, 0xfd, 0x9f, 0xae, 0x0b,
+    0xf9, 0x1b, 0x65, 0xc5, 0x52, 0x47, 0x33, 0xab, 0x8f, 0x59, 0x3d, 0xab, 0xcd, 0x62, 0xb3, 0x57,
+    0x16, 0x39, 0xd6, 0x24, 0xe6, 0x51, 0x52, 0xab, 0x8f, 0x53, 0x0c, 0x35, 0x9f, 0x08, 0x61, 0xd8,
+    0x07, 0xca, 0x0d, 0xbf, 0x50, 0x0d, 0x6a, 0x61, 0x56, 0xa3, 0x8e, 0x08, 0x8a, 0x22, 0xb6, 0x5e,
+    0x52, 0xbc, 0x51, 0x4d, 0x16, 0xcc, 0xf8, 0x06, 0x81, 0x8c, 0xe9, 0x1a, 0xb7, 0x79, 0x37, 0x36,
+    0x5a, 0xf9, 0x0b, 0xbf, 0x74, 0xa3, 0x5b, 0xe6, 0xb4, 0x0b, 0x8e, 0xed, 0xf2, 0x78, 0x5e, 0x42,
+    0x87, 0x4d,
+};
+
+#define STREAM_LEN 4096     // long enough for every implementation's widest step
+#define SPANS 6
+
+// Pieces of the stream cut at awkward places, checked against the scalar code
+static const size_t span_off[SPANS] = { 0, 1, 63, 64, 1000, 2047 };
+static const size_t span_len[SPANS] = { STREAM_LEN, 4000, 1025, 1024, 3000, 2049 };
+
+static void stream(uint8_t *out, size_t off, size_t len) {
+    uint8_t key[CHACHA20_KEY_SIZE], nonce[CHACHA20_NONCE_SIZE];
+    for (int i = 0; i < CHACHA20_KEY_SIZE; i++) key[i] = 0xa0 + i;
+    for (int i = 0; i < CHACHA20_NONCE_SIZE; i++) nonce[i] = 0x30 + i;
+    for (size_t i = 0; i < len; i++) out[i] = (uint8_t)((off + i) * 7);
+    chacha20_xor(key, nonce, off, out, len);
+}
+
+static void chacha20_impl_tests(const char *impl, uint8_t *const reference[SPANS]) {
+    static uint8_t buf[STREAM_LEN];
+    uint8_t key[CHACHA20_KEY_SIZE] = { 0 }, nonce[CHACHA20_NONCE_SIZE] = { 0 };
+
+    // A.1: the keystream is what encrypting zeros gives, here in one long call
+    memset(buf, 0, sizeof(buf));
+    chacha20_xor(key, nonce, 0, buf, sizeof(buf));
+    CHECK(memcmp(buf, zero_keystream, sizeof(zero_keystream)) == 0);
+
+    // 2.4.2 at block 1, both on its own and inside a long call
+    for (int i = 0; i < CHACHA20_KEY_SIZE; i++) key[i] = i;
+    size_t len = sizeof(sunscreen_cipher);
+    memcpy(buf, sunscreen_plain, len);
+    chacha20_xor(key, sunscreen_nonce, 64, buf, len);
+    CHECK(memcmp(buf, sunscreen_cipher, len) == 0);
+    memset(buf, 0, sizeof(buf));
+    memcpy(buf + 64, sunscreen_plain, len);
+    chacha20_xor(key, sunscreen_nonce, 0, buf, sizeof(buf));
+    CHECK(memcmp(buf + 64, sunscreen_cipher, len) == 0);
+
+    for (int i = 0; i < SPANS; i++) {
+        stream(buf, span_off[i], span_len[i]);
+        if (memcmp(buf, reference[i], span_len[i]) != 0) {
+            printf("FAIL chacha20 %s: %zu bytes at offset %zu differ from scalar\n", impl, span_len[i],
+                   span_off[i]);
+            failures++;
+        }
+        checks++;
+    }
+}
+
+static void chacha20_tests(void) {
+    static const char *const impls[] = { "scalar", "sse2", "avx2", "avx512" };
+    const char *picked = chacha20_impl_name();
+    uint8_t *reference[SPANS];
+    chacha20_use_impl("scalar");
+    for (int i = 0; i < SPANS; i++) {
+        reference[i] = malloc(span_len[i]);
+        if (!reference[i]) {
+            while (i-- > 0) free(reference[i]);
+            CHECK(!"out of memory");
+            return;
+        }
+        stream(reference[i], span_off[i], span_len[i]);
+    }
+    for (size_t i = 0; i < sizeof(impls) / sizeof(*impls); i++) {
+        if (chacha20_use_impl(impls[i]) < 0) {
+            printf("chacha20: %s not supported here, skipped\n", impls[i]);
+            continue;
+        }
+        chacha20_impl_tests(impls[i], reference);
+    }
+    chacha20_use_impl(picked);
+    for (int i = 0; i < SPANS; i++) free(reference[i]);
+}
+
+int main(void) {
+    chacha20_tests();
+    return test_end("cipher");
+}
@@ -0,0 +1,98 @@
+/*
+ * test_coldstore.c - Replaying the cold tier, and its tombstone log
+ * shrinking as archives are unlinked.
+ */
+
+#include "test.h"
+#include <stdint.h>
+#include "coldstore.h"
+
+#define COLD_DIR "cold"
+
+/*
+ * Archives are 1 MiB and every version is incompressible, so each archive
+ * takes a few. Removing the first half of the versions empties the older
+ * archives, which must go together with their tombstones.
+ */
+
+#define COLD_VERSIONS 12
+#define COLD_SIZE (300 * 1024)
+
+static void cold_fill(unsigned char *data, int n) {
+    uint32_t x = 0x9e3779b9u * (n + 1);
+    for (size_t i = 0; i < COLD_SIZE; i++) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        data[i] = x;
+    }
+}
+
+// Whether version n reads back intact (1), is gone (0) or is damaged (-1)
+static int cold_check(int n) {
+    static unsigned char data[COLD_SIZE], expect[COLD_SIZE];
+    char name[16];
+    long size;
+    snprintf(name, sizeof(name), "v%d", n);
+    FILE *fp = cold_fopen(name, ".dat", 1, &size);
+    if (!fp) return 0;
+    size_t got = fread(data, 1, sizeof(data), fp);
+    int more = fgetc(fp) != EOF;
+    fclose(fp);
+    cold_fill(expect, n);
+    return size == COLD_SIZE && got == COLD_SIZE && !more && memcmp(data, expect, COLD_SIZE) == 0 ? 1 : -1;
+}
+
+static void cold_verify(void) {
+    int ok = 1;
+    for (int i = 0; i < COLD_VERSIONS; i++) ok &= cold_check(i) == (i < COLD_VERSIONS / 2 ? 0 : 1);
+    CHECK(ok);
+    size_t count;
+    struct cold_item *items = cold_list(&count);
+    CHECK(count == COLD_VERSIONS / 2);
+    cold_free_list(items, count);
+}
+
+static void cold_write_step(void) {
+    static unsigned char data[COLD_SIZE];
+    CHECK(cold_open(COLD_DIR, 1 << 20, 1) == 0);
+    int ok = 1;
+    for (int i = 0; i < COLD_VERSIONS; i++) {
+        char name[16];
+        snprintf(name, sizeof(name), "v%d", i);
+        cold_fill(data, i);
+        FILE *fp = fmemopen(data, COLD_SIZE, "r");
+        ok &= fp && cold_store(name, ".dat", 1, 1000 + i, fp) == 0;
+        if (fp) fclose(fp);
+    }
+    CHECK(ok);
+    CHECK(file_exists(COLD_DIR "/archive_000001.cold"));
+
+    for (int i = 0; i < COLD_VERSIONS / 2; i++) {
+        char name[16];
+        snprintf(name, sizeof(name), "v%d", i);
+        ok &= cold_remove(name, ".dat", 1) == 0;
+    }
+    CHECK(ok);
+    CHECK(!file_exists(COLD_DIR "/archive_000001.cold"));
+    // Only tombstones of archives still there are kept, at most one archive's worth
+    long log = file_size(COLD_DIR "/tombstones.log");
+    CHECK(log >= 0 && log < COLD_VERSIONS / 2 * 24);
+    cold_verify();
+}
+
+static void cold_replay_step(void) {
+    CHECK(cold_open(COLD_DIR, 1 << 20, 1) == 0);
+    cold_verify();
+}
+
+static void cold_tests(void) {
+    CHECK(run_restart(cold_write_step) == 0);
+    CHECK(run_restart(cold_replay_step) == 0);
+}
+
+int main(void) {
+    if (test_begin() < 0) return 1;
+    cold_tests();
+    return test_end("coldstore");
+}
@@ -0,0 +1,44 @@
+/*
+ * test_crc32c.c - CRC32C known answers.
+ *
+ * The check value of "123456789" and the RFC 3720 (iSCSI) vectors, and a
+ * stream checksummed in chunks of odd sizes at odd alignments, which must
+ * match the one-shot checksum.
+ */
+
+#include "test.h"
+#include "crc32c.h"
+
+static void crc32c_tests(void) {
+    CHECK(crc32c_update(0, "123456789", 9) == 0xE3069283u);
+
+    unsigned char buf[32];
+    memset(buf, 0, sizeof(buf));
+    CHECK(crc32c_update(0, buf, sizeof(buf)) == 0x8A9136AAu);
+    memset(buf, 0xff, sizeof(buf));
+    CHECK(crc32c_update(0, buf, sizeof(buf)) == 0x62A8AB43u);
+    for (int i = 0; i < 32; i++) buf[i] = i;
+    CHECK(crc32c_update(0, buf, sizeof(buf)) == 0x46DD794Eu);
+    for (int i = 0; i < 32; i++) buf[i] = 31 - i;
+    CHECK(crc32c_update(0, buf, sizeof(buf)) == 0x113FDB5Cu);
+
+    // Chunks of odd sizes at odd alignments give the one-shot checksum
+    size_t len = 100000;
+    unsigned char *data = malloc(len + 1);
+    CHECK(data != NULL);
+    if (!data) return;
+    srandom(1);
+    for (size_t i = 0; i <= len; i++) data[i] = random();
+    uint32_t whole = crc32c_update(0, data + 1, len);
+    uint32_t crc = 0;
+    for (size_t off = 0, step = 1; off < len; off += step, step = step * 3 % 4099 + 1) {
+        crc = crc32c_update(crc, data + 1 + off, off + step <= len ? step : len - off);
+    }
+    CHECK(crc == whole);
+    free(data);
+}
+
+int main(void) {
+    crc32c_tests();
+    return test_end("crc32c");
+}
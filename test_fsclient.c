@@ -0,0 +1,204 @@
+/*
+ * test_fsclient.c - libfsclient against a server running in a child
+ * process: ChaCha20 transfers large enough to go through the cipher
+ * workers, written from and read back into files and memory, and the
+ * streamed commands (MGET, RM -r, SNAPSHOT).
+ */
+
+#include "test.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "fsclient.h"
+
+// From server.c
+int server_main(void);
+
+#define BIG_SIZE (5 * 1024 * 1024 + 123) // crosses many 256 KiB pipe chunks, unaligned
+
+static int port;
+static pid_t server_pid;
+
+static int start_server(void) {
+    port = 20000 + getpid() % 20000;
+    fflush(stdout);
+    server_pid = fork();
+    if (server_pid == 0) {
+        char value[16];
+        snprintf(value, sizeof(value), "%d", port);
+        setenv("FS_PORT", value, 1);
+        if (!freopen("/dev/null", "w", stdout)) _exit(1);
+        _exit(server_main());
+    }
+    if (server_pid < 0) return -1;
+
+    // Wait for the listener
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port) };
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    for (int tries = 0; tries < 500; tries++) {
+        int sock = socket(AF_INET, SOCK_STREAM, 0);
+        int rc = connect(sock, (struct sockaddr *)&addr, sizeof(addr));
+        close(sock);
+        if (rc == 0) return 0;
+        usleep(10000);
+    }
+    return -1;
+}
+
+static void stop_server(void) {
+    if (server_pid <= 0) return;
+    kill(server_pid, SIGTERM);
+    waitpid(server_pid, NULL, 0);
+}
+
+static void note_result(struct fsc_client *cl, struct fsc_result *res, void *arg) {
+    struct fsc_result *out = arg;
+    out->status = res->status;
+    out->version = res->version;
+    out->size = res->size;
+    out->data = res->data;
+    res->data = NULL;
+}
+
+struct progress {
+    int reports;     // callbacks with more set
+    int failed;      // of which with an error
+    int status;      // of the final callback
+    unsigned long snapshot;
+    size_t size;
+};
+
+static void note_progress(struct fsc_client *cl, struct fsc_result *res, void *arg) {
+    struct progress *p = arg;
+    if (res->more) {
+        p->reports++;
+        p->failed += res->status != FSC_OK;
+        return;
+    }
+    p->status = res->status;
+    p->snapshot = res->snapshot;
+    p->size = res->size;
+}
+
+static int write_file(const char *path, const char *data, size_t size) {
+    FILE *fp = fopen(path, "wb");
+    if (!fp) return -1;
+    size_t n = fwrite(data, 1, size, fp);
+    return fclose(fp) == 0 && n == size ? 0 : -1;
+}
+
+static char *read_file(const char *path, size_t size) {
+    char *data = malloc(size + 1);
+    FILE *fp = fopen(path, "rb");
+    size_t n = fp && data ? fread(data, 1, size + 1, fp) : 0;
+    if (fp) fclose(fp);
+    if (n != size) {
+        free(data);
+        return NULL;
+    }
+    return data;
+}
+
+static void pipe_tests(void) {
+    uint8_t key[CHACHA20_KEY_SIZE];
+    for (int i = 0; i < CHACHA20_KEY_SIZE; i++) key[i] = i * 7 + 1;
+    struct fsc_options opts = { .port = port, .cipher = CIPHER_CHACHA20, .key = key, .cipher_threads = 4 };
+    struct fsc_client *cl = fsc_open(&opts);
+    CHECK(cl != NULL);
+    if (!cl) return;
+
+    char *data = malloc(BIG_SIZE);
+    for (size_t i = 0; i < BIG_SIZE; i++) data[i] = (char)(i * 2654435761u >> 13);
+    CHECK(write_file("big.in", data, BIG_SIZE) == 0);
+
+    struct fsc_result res = { .status = 1 };
+    int fd = open("big.in", O_RDONLY);
+    CHECK(fsc_write_fd(cl, "big.bin", fd, BIG_SIZE, 0, note_result, &res) == 0);
+    fsc_run(cl);
+    close(fd);
+    CHECK(res.status == FSC_OK && res.version == 1);
+
+    // Into a file, through the cipher workers
+    res = (struct fsc_result){ .status = 1 };
+    fd = open("big.out", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    CHECK(fsc_get_fd(cl, "big.bin", 0, fd, note_result, &res) == 0);
+    fsc_run(cl);
+    close(fd);
+    CHECK(res.status == FSC_OK && res.size == BIG_SIZE);
+    char *back = read_file("big.out", BIG_SIZE);
+    CHECK(back && memcmp(back, data, BIG_SIZE) == 0);
+    free(back);
+
+    // Into memory
+    res = (struct fsc_result){ .status = 1 };
+    CHECK(fsc_get(cl, "big.bin", 1, note_result, &res) == 0);
+    fsc_run(cl);
+    CHECK(res.status == FSC_OK && res.size == BIG_SIZE && res.data);
+    CHECK(res.data && memcmp(res.data, data, BIG_SIZE) == 0);
+    free(res.data);
+
+    // Restored by MGET below the directory part of the pattern
+    struct progress mget = { .status = 1 };
+    CHECK(fsc_mget(cl, "big*", NULL, "restore", note_progress, &mget) == 0);
+    fsc_run(cl);
+    CHECK(mget.status == FSC_OK && mget.reports == 1 && mget.failed == 0);
+    back = read_file("restore/big.bin", BIG_SIZE);
+    CHECK(back && memcmp(back, data, BIG_SIZE) == 0);
+    free(back);
+    CHECK(!file_exists("restore/big.bin.part"));
+
+    free(data);
+    fsc_close(cl);
+}
+
+static void stream_tests(void) {
+    struct fsc_options opts = { .port = port };
+    struct fsc_client *cl = fsc_open(&opts);
+    CHECK(cl != NULL);
+    if (!cl) return;
+
+    struct fsc_result res = { .status = 1 };
+    for (int i = 0; i < 3; i++) {
+        CHECK(fsc_write(cl, "s/a.txt", "abc", 3, 0, note_result, &res) == 0);
+        fsc_run(cl);
+    }
+    CHECK(res.status == FSC_OK && res.version == 3);
+
+    struct progress snap = { .status = 1 };
+    CHECK(fsc_snapshot(cl, note_progress, &snap) == 0);
+    fsc_run(cl);
+    CHECK(snap.status == FSC_OK && snap.snapshot > 0 && snap.size >= 1);
+
+    // Version 3 is held by the snapshot, 1 and 2 go
+    struct progress rm = { .status = 1 };
+    CHECK(fsc_rm_bulk(cl, "s/a.txt", 0, note_progress, &rm) == 0);
+    fsc_run(cl);
+    CHECK(rm.status == FSC_OK && rm.reports >= 2);
+    CHECK(fsc_rm_bulk(cl, "s/a.txt:3-1", 0, note_progress, &rm) == 0);
+    fsc_run(cl);
+    CHECK(rm.status == FSC_ERR_SERVER);
+
+    struct progress drop = { .status = 1 };
+    CHECK(fsc_snapshot_drop(cl, snap.snapshot, note_progress, &drop) == 0);
+    fsc_run(cl);
+    CHECK(drop.status == FSC_OK);
+    CHECK(fsc_snapshot_drop(cl, snap.snapshot, note_progress, &drop) == 0);
+    fsc_run(cl);
+    CHECK(drop.status == FSC_ERR_SERVER);
+    fsc_close(cl);
+}
+
+int main(void) {
+    if (test_begin() < 0) return 1;
+    if (start_server() == 0) {
+        pipe_tests();
+        stream_tests();
+    } else {
+        CHECK(!"server did not start");
+    }
+    stop_server();
+    return test_end("fsclient");
+}
@@ -0,0 +1,114 @@
+/*
+ * test_packstore.c - Replaying the pack after tombstones and compaction.
+ *
+ * Built with a one-second compactor interval, so a compaction happens
+ * while the test waits.
+ */
+
+#include "test.h"
+#include "crc32c.h"
+#include "packstore.h"
+
+#define PACK_DIR "pack"
+#define RECORD_SIZE 64000   // 16 records fill a 1 MiB segment, a 17th does not fit
+
+/*
+ * Segments are 1 MiB: a0..a15 fill segment 1, b0..b15 segment 2, the
+ * tombstones of every b and of a0 follow them there and c0 starts
+ * segment 3. Segment 2 is then all dead and the compactor's pick; the a0
+ * tombstone in it must be carried over, since segment 1 stays.
+ */
+
+static void pack_fill(struct pack_info *info, char *data, char series, int n, int version) {
+    memset(data, series + n + version, RECORD_SIZE);
+    memset(info, 0, sizeof(*info));
+    info->size = RECORD_SIZE;
+    info->mtime = 1000 + n;
+    info->crc = crc32c_update(0, data, RECORD_SIZE);
+}
+
+static int pack_put(char series, int n) {
+    static char data[RECORD_SIZE];
+    char name[16];
+    struct pack_info info;
+    snprintf(name, sizeof(name), "%c%d", series, n);
+    pack_fill(&info, data, series, n, 1);
+    return pack_append(name, ".bin", 1, data, &info);
+}
+
+// Whether series n reads back intact (1), is gone (0) or is damaged (-1)
+static int pack_check(char series, int n) {
+    static char data[RECORD_SIZE + 1], expect[RECORD_SIZE];
+    char name[16];
+    struct pack_info info, want;
+    snprintf(name, sizeof(name), "%c%d", series, n);
+    if (pack_read(name, ".bin", 1, data, sizeof(data), &info) < 0) return 0;
+    pack_fill(&want, expect, series, n, 1);
+    if (info.size != want.size || info.mtime != want.mtime || info.crc != want.crc) return -1;
+    return memcmp(data, expect, RECORD_SIZE) == 0 ? 1 : -1;
+}
+
+static void pack_verify(void) {
+    int intact = 1;
+    for (int i = 1; i < 16; i++) intact &= pack_check('a', i) == 1;
+    CHECK(intact);
+    CHECK(pack_check('a', 0) == 0);
+    int gone = 1;
+    for (int i = 0; i < 16; i++) gone &= pack_check('b', i) == 0;
+    CHECK(gone);
+    CHECK(pack_check('c', 0) == 1);
+    CHECK(pack_latest_version("a5", ".bin") == 1);
+    CHECK(pack_latest_version("a0", ".bin") == 0);
+
+    size_t count;
+    struct pack_item *items = pack_list(&count);
+    CHECK(count == 16);
+    pack_free_list(items, count);
+}
+
+static int pack_drop(char series, int n) {
+    char name[16];
+    snprintf(name, sizeof(name), "%c%d", series, n);
+    return pack_remove(name, ".bin", 1);
+}
+
+static void pack_write_step(void) {
+    CHECK(pack_open(PACK_DIR, 1 << 20) == 0);
+    int ok = 1;
+    for (int i = 0; i < 16; i++) ok &= pack_put('a', i) == 0;
+    for (int i = 0; i < 16; i++) ok &= pack_put('b', i) == 0;
+    for (int i = 0; i < 16; i++) ok &= pack_drop('b', i) == 0;
+    ok &= pack_drop('a', 0) == 0;
+    ok &= pack_put('c', 0) == 0;
+    CHECK(ok);
+    CHECK(pack_drop('a', 0) < 0);
+    CHECK(file_exists(PACK_DIR "/segment_000003.pack"));
+    pack_verify();
+}
+
+static void pack_replay_step(void) {
+    CHECK(pack_open(PACK_DIR, 1 << 20) == 0);
+    pack_verify();
+}
+
+static void pack_compact_step(void) {
+    CHECK(pack_open(PACK_DIR, 1 << 20) == 0);
+    pack_start_compactor(0.5);
+    for (int i = 0; i < 100 && file_exists(PACK_DIR "/segment_000002.pack"); i++) usleep(100 * 1000);
+    CHECK(!file_exists(PACK_DIR "/segment_000002.pack"));
+    CHECK(file_exists(PACK_DIR "/segment_000001.pack"));
+    pack_verify();
+}
+
+static void pack_tests(void) {
+    CHECK(run_restart(pack_write_step) == 0);
+    CHECK(run_restart(pack_replay_step) == 0);
+    CHECK(run_restart(pack_compact_step) == 0);
+    CHECK(run_restart(pack_replay_step) == 0);
+}
+
+int main(void) {
+    if (test_begin() < 0) return 1;
+    pack_tests();
+    return test_end("packstore");
+}
@@ -0,0 +1,65 @@
+/*
+ * test_snapshot.c - Creating, looking up, dropping and reloading
+ * snapshots.
+ */
+
+#include "test.h"
+#include "snapshot.h"
+
+#define SNAP_DIR "snaps"
+
+static unsigned long first_snapshot;
+
+static void snap_create_step(void) {
+    CHECK(snap_open(SNAP_DIR) == 0);
+    struct snap_entry entries[] = { { "a.txt", 1 }, { "b/c.txt", 3 }, { "b/d", 2 } };
+    unsigned long id = snap_create(entries, 3);
+    CHECK(id == first_snapshot);
+    unsigned long empty = snap_create(NULL, 0);
+    CHECK(empty == id + 1);
+
+    CHECK(snap_version(id, "a.txt") == 1);
+    CHECK(snap_version(id, "b/c.txt") == 3);
+    CHECK(snap_version(id, "b/c") == 0);
+    CHECK(snap_version(id + 2, "a.txt") == -1);
+    CHECK(snap_holder("b/d", 2) == id);
+    CHECK(snap_holder("b/d", 1) == 0);
+
+    CHECK(snap_drop(empty) == 0);
+    CHECK(snap_drop(empty) == -1);
+    CHECK(snap_version(empty, "a.txt") == -1);
+}
+
+static void snap_reload_step(void) {
+    CHECK(snap_open(SNAP_DIR) == 0);
+    size_t count;
+    struct snap_info *list = snap_list(&count);
+    CHECK(count == 1 && list && list[0].id == first_snapshot && list[0].paths == 3);
+    free(list);
+
+    struct snap_entry *entries = snap_entries(first_snapshot, &count);
+    CHECK(entries && count == 3);
+    if (entries && count == 3) {
+        CHECK(strcmp(entries[0].path, "a.txt") == 0 && entries[0].version == 1);
+        CHECK(strcmp(entries[1].path, "b/c.txt") == 0 && entries[1].version == 3);
+        CHECK(strcmp(entries[2].path, "b/d") == 0 && entries[2].version == 2);
+    }
+    snap_free_entries(entries, count);
+    CHECK(snap_holder("b/c.txt", 3) == first_snapshot);
+
+    // The dropped snapshot was the newest; its id is still not handed out again
+    struct snap_entry one = { "x", 1 };
+    CHECK(snap_create(&one, 1) == first_snapshot + 2);
+}
+
+static void snapshot_tests(void) {
+    first_snapshot = 1;
+    CHECK(run_restart(snap_create_step) == 0);
+    CHECK(run_restart(snap_reload_step) == 0);
+}
+
+int main(void) {
+    if (test_begin() < 0) return 1;
+    snapshot_tests();
+    return test_end("snapshot");
+}
@@ -0,0 +1,238 @@
+/*
+ * trace.c - Per-thread ring buffers of phase timings.
+ *
+ * A ring has a single writer, the thread that owns it: it fills slot
+ * head % size and then publishes head + 1 with a release store. Readers
+ * load head, copy the slots, load head again and drop the slots the
+ * writer may have lapped in between. No locks on the recording path.
+ *
+ * Connection threads come and go, so rings are pooled: a thread takes a
+ * free ring the first time it records something and gives it back when
+ * it exits. Rings are never freed, which keeps readers safe.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "trace.h"
+
+#define MAX_RINGS 1024
+#define DEFAULT_EVENTS 2048
+
+struct trace_event {
+    uint64_t start;
+    uint64_t dur;
+    uint64_t request;
+    uint32_t phase;
+    uint64_t totals[TRACE_PHASES];   // request events: time summed with trace_add
+    char label[64];                  // request events: the command line
+};
+
+struct trace_ring {
+    _Atomic uint64_t head;           // events ever written
+    int in_use;
+    unsigned index;
+    struct trace_event *events;
+};
+
+int trace_enabled;
+static unsigned ring_size = DEFAULT_EVENTS;
+static struct trace_ring *rings[MAX_RINGS];
+static _Atomic unsigned nrings;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t ring_key;
+static _Atomic uint64_t next_request = 1;
+
+static __thread struct trace_ring *my_ring;
+static __thread struct trace_event current;  // the request being served
+
+static const char *phase_names[TRACE_PHASES] = {
+    "request", "accept", "parse", "lock_wait", "version_lookup", "disk_io", "network",
+};
+
+uint64_t trace_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static void release_ring(void *arg) {
+    struct trace_ring *ring = arg;
+    pthread_mutex_lock(&rings_lock);
+    ring->in_use = 0;
+    pthread_mutex_unlock(&rings_lock);
+}
+
+void trace_configure(int enabled, unsigned events_per_thread) {
+    if (events_per_thread > 0) ring_size = events_per_thread;
+    pthread_key_create(&ring_key, release_ring);
+    trace_enabled = enabled;
+}
+
+/*
+ * acquire_ring - Gives the calling thread a ring, reusing one left by an
+ * exited thread when possible. Returns NULL once MAX_RINGS are in use.
+ */
+
+static struct trace_ring *acquire_ring(void) {
+    struct trace_ring *ring = NULL;
+    pthread_mutex_lock(&rings_lock);
+    unsigned n = atomic_load(&nrings);
+    for (unsigned i = 0; i < n && !ring; i++) {
+        if (!rings[i]->in_use) ring = rings[i];
+    }
+    if (!ring && n < MAX_RINGS && (ring = calloc(1, sizeof(*ring)))) {
+        ring->events = calloc(ring_size, sizeof(*ring->events));
+        if (!ring->events) {
+            free(ring);
+            ring = NULL;
+        } else {
+            ring->index = n;
+            rings[n] = ring;
+            atomic_store_explicit(&nrings, n + 1, memory_order_release);
+        }
+    }
+    if (ring) ring->in_use = 1;
+    pthread_mutex_unlock(&rings_lock);
+    if (ring) pthread_setspecific(ring_key, ring);
+    return ring;
+}
+
+static void record(const struct trace_event *ev) {
+    if (!my_ring && !(my_ring = acquire_ring())) return;
+    uint64_t head = atomic_load_explicit(&my_ring->head, memory_order_relaxed);
+    my_ring->events[head % ring_size] = *ev;
+    atomic_store_explicit(&my_ring->head, head + 1, memory_order_release);
+}
+
+// === Recording === //
+
+void trace_request_begin(const char *command) {
+    if (!trace_enabled) return;
+    memset(&current, 0, sizeof(current));
+    current.phase = TRACE_REQUEST;
+    current.request = atomic_fetch_add(&next_request, 1);
+    snprintf(current.label, sizeof(current.label), "%s", command);
+    current.start = trace_clock();
+}
+
+void trace_request_end(void) {
+    if (!trace_enabled || current.request == 0) return;
+    current.dur = trace_clock() - current.start;
+    record(&current);
+    current.request = 0;
+}
+
+void trace_span(enum trace_phase phase, uint64_t start) {
+    if (start == 0) return;
+    struct trace_event ev = { .start = start, .request = current.request, .phase = phase };
+    ev.dur = trace_clock() - start;
+    record(&ev);
+}
+
+void trace_add(enum trace_phase phase, uint64_t start) {
+    if (start == 0) return;
+    current.totals[phase] += trace_clock() - start;
+}
+
+// === Dumping === //
+
+static void write_json_string(FILE *out, const char *s) {
+    fputc('"', out);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') fprintf(out, "\\%c", *s);
+        else if ((unsigned char)*s < 0x20) fprintf(out, "\\u%04x", *s);
+        else fputc(*s, out);
+    }
+    fputc('"', out);
+}
+
+static void write_event(FILE *out, const struct trace_event *ev, unsigned tid, int first) {
+    char name[16] = "";
+    const char *cat = ev->phase == TRACE_REQUEST ? "request" : "phase";
+    if (ev->phase == TRACE_REQUEST) {
+        // Named after the command word, e.g. "GET"
+        sscanf(ev->label, "%15s", name);
+    } else {
+        snprintf(name, sizeof(name), "%s", phase_names[ev->phase]);
+    }
+    fprintf(out, "%s{\"name\":", first ? "" : ",");
+    write_json_string(out, name);
+    fprintf(out, ",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%u,\"args\":{",
+            cat, ev->start / 1000.0, ev->dur / 1000.0, (int)getpid(), tid);
+    fprintf(out, "\"req\":%lu", (unsigned long)ev->request);
+    if (ev->phase == TRACE_REQUEST) {
+        fprintf(out, ",\"cmd\":");
+        write_json_string(out, ev->label);
+        for (int p = 0; p < TRACE_PHASES; p++) {
+            if (ev->totals[p]) fprintf(out, ",\"%s_us\":%.3f", phase_names[p], ev->totals[p] / 1000.0);
+        }
+    }
+    fprintf(out, "}}\n");
+}
+
+/*
+ * trace_dump - Copies each ring and writes the events that were not
+ * overwritten during the copy. tid is the ring number, which stays the
+ * same while one connection thread owns it.
+ */
+
+void trace_dump(FILE *out) {
+    struct trace_event *copy = malloc((size_t)ring_size * sizeof(*copy));
+    int first = 1;
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    unsigned n = atomic_load_explicit(&nrings, memory_order_acquire);
+    for (unsigned r = 0; copy && r < n; r++) {
+        struct trace_ring *ring = rings[r];
+        uint64_t end = atomic_load_explicit(&ring->head, memory_order_acquire);
+        uint64_t begin = end > ring_size ? end - ring_size : 0;
+        for (uint64_t i = begin; i < end; i++) copy[i - begin] = ring->events[i % ring_size];
+        uint64_t now = atomic_load_explicit(&ring->head, memory_order_acquire);
+        // The writer may already be overwriting slot now, which held event
+        // now - ring_size, so only events after that one are intact
+        uint64_t valid = now + 1 > ring_size ? now + 1 - ring_size : 0;
+        for (uint64_t i = begin > valid ? begin : valid; i < end; i++) {
+            write_event(out, &copy[i - begin], ring->index + 1, first);
+            first = 0;
+        }
+    }
+    fprintf(out, "]}\n");
+    free(copy);
+}
+
+static void *signal_dumper(void *arg) {
+    sigset_t *set = arg;
+    int sig, count = 0;
+    while (sigwait(set, &sig) == 0) {
+        char path[64];
+        snprintf(path, sizeof(path), "trace_%d_%d.json", (int)getpid(), ++count);
+        FILE *fp = fopen(path, "w");
+        if (!fp) {
+            perror("trace dump");
+            continue;
+        }
+        trace_dump(fp);
+        fclose(fp);
+        printf("Trace written to %s\n", path);
+    }
+    return NULL;
+}
+
+/*
+ * trace_start_signal_dumper - Dumps to trace_<pid>_<n>.json on SIGUSR1.
+ * Must run before any other thread is started, so that every thread
+ * inherits the blocked signal and only the dumper receives it.
+ */
+
+void trace_start_signal_dumper(void) {
+    static sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, signal_dumper, &set) == 0) pthread_detach(tid);
+}
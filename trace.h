@@ -0,0 +1,60 @@
+/*
+ * trace.h - Per-request phase tracing into per-thread ring buffers.
+ *
+ * Every command a connection thread serves becomes a "request" span,
+ * with child spans for the phases it went through (lock wait, version
+ * lookup, disk I/O, network, ...). Phases hit once per chunk inside a
+ * transfer loop are summed up instead of being recorded one by one, so a
+ * large GET costs two clock reads per chunk and no ring slots.
+ *
+ * Each thread writes only to its own ring, so recording takes no locks;
+ * dumps read the rings concurrently and skip slots that were overwritten
+ * while they were being copied. With tracing off every call returns
+ * after a single branch.
+ *
+ * Dumps are Chrome trace JSON (chrome://tracing, ui.perfetto.dev).
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+enum trace_phase {
+    TRACE_REQUEST,
+    TRACE_ACCEPT,          // accept() returned -> connection thread running
+    TRACE_PARSE,
+    TRACE_LOCK_WAIT,       // waiting for file_mutex
+    TRACE_VERSION_LOOKUP,
+    TRACE_DISK,
+    TRACE_NETWORK,
+    TRACE_PHASES
+};
+
+extern int trace_enabled;
+
+uint64_t trace_clock(void);
+
+// Current time in ns, or 0 when tracing is off (which the calls below ignore)
+static inline uint64_t trace_now(void) {
+    return trace_enabled ? trace_clock() : 0;
+}
+
+void trace_configure(int enabled, unsigned events_per_thread);
+
+void trace_request_begin(const char *command);
+void trace_request_end(void);
+
+// Records a span from start until now
+void trace_span(enum trace_phase phase, uint64_t start);
+
+// Adds the time since start to the current request's total for phase
+void trace_add(enum trace_phase phase, uint64_t start);
+
+// Writes every event still in the rings, one JSON object per line
+void trace_dump(FILE *out);
+
+void trace_start_signal_dumper(void);
+
+#endif
@@ -0,0 +1,250 @@
+/*
+ * uring.c - Minimal io_uring backend for bulk transfers.
+ *
+ * The submission and completion rings are mapped the way the kernel
+ * describes them in io_uring_params; the ring is only ever used by the
+ * thread of its connection, so the one thing to get right is the memory
+ * ordering of the shared head and tail indexes. Fixed file slot 0 holds
+ * the socket, slot 1 the file of the transfer in progress.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+#include "uring.h"
+
+#define RING_ENTRIES 8
+#define SLOT_SOCK 0
+#define SLOT_FILE 1
+
+struct uring {
+    int fd;
+    void *sq_map;
+    size_t sq_map_len;
+    void *cq_map;         // same as sq_map with IORING_FEAT_SINGLE_MMAP
+    size_t cq_map_len;
+    struct io_uring_sqe *sqes;
+    size_t sqes_len;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned queued;      // prepared since the last uring_run
+    void *bufs[URING_BUFFERS];  // registered by uring_attach, not owned
+};
+
+static int sys_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned submit, unsigned wait) {
+    return (int)syscall(__NR_io_uring_enter, fd, submit, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+static int sys_register(int fd, unsigned op, const void *arg, unsigned n) {
+    return (int)syscall(__NR_io_uring_register, fd, op, arg, n);
+}
+
+// Checks that the kernel knows every operation used here
+static int supports_ops(int fd) {
+    static const int needed[] = { IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED, IORING_OP_RECV, IORING_OP_SEND };
+    size_t len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, len);
+    int ok = probe && sys_register(fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+    for (size_t i = 0; ok && i < sizeof(needed) / sizeof(needed[0]); i++) {
+        ok = needed[i] <= probe->last_op && (probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    return ok;
+}
+
+static int map_rings(struct uring *u, const struct io_uring_params *p) {
+    u->sq_map_len = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+    u->cq_map_len = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+    int single = p->features & IORING_FEAT_SINGLE_MMAP;
+    if (single && u->cq_map_len > u->sq_map_len) u->sq_map_len = u->cq_map_len;
+
+    u->sq_map = mmap(NULL, u->sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (u->sq_map == MAP_FAILED) return -1;
+    if (single) {
+        u->cq_map = u->sq_map;
+    } else {
+        u->cq_map = mmap(NULL, u->cq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+        if (u->cq_map == MAP_FAILED) return -1;
+    }
+    u->sqes_len = p->sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) return -1;
+
+    char *sq = u->sq_map, *cq = u->cq_map;
+    u->sq_head = (unsigned *)(sq + p->sq_off.head);
+    u->sq_tail = (unsigned *)(sq + p->sq_off.tail);
+    u->sq_mask = (unsigned *)(sq + p->sq_off.ring_mask);
+    u->sq_array = (unsigned *)(sq + p->sq_off.array);
+    u->cq_head = (unsigned *)(cq + p->cq_off.head);
+    u->cq_tail = (unsigned *)(cq + p->cq_off.tail);
+    u->cq_mask = (unsigned *)(cq + p->cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(cq + p->cq_off.cqes);
+    return 0;
+}
+
+/*
+ * uring_create - Sets up a ring for the connection on sock. Returns NULL
+ * if io_uring is unavailable or any step fails.
+ */
+
+struct uring *uring_create(int sock) {
+    struct uring *u = calloc(1, sizeof(*u));
+    if (!u) return NULL;
+    u->sq_map = u->cq_map = u->sqes = MAP_FAILED;
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    u->fd = sys_setup(RING_ENTRIES, &p);
+    if (u->fd < 0 || !supports_ops(u->fd) || map_rings(u, &p) < 0) goto fail;
+
+    int files[2] = { sock, -1 };
+    if (sys_register(u->fd, IORING_REGISTER_FILES, files, 2) < 0) goto fail;
+    return u;
+
+fail:
+    uring_destroy(u);
+    return NULL;
+}
+
+void uring_destroy(struct uring *u) {
+    if (!u) return;
+    if (u->sqes != MAP_FAILED) munmap(u->sqes, u->sqes_len);
+    if (u->cq_map != MAP_FAILED && u->cq_map != u->sq_map) munmap(u->cq_map, u->cq_map_len);
+    if (u->sq_map != MAP_FAILED) munmap(u->sq_map, u->sq_map_len);
+    if (u->fd >= 0) close(u->fd);  // drops the registrations with it
+    free(u);
+}
+
+void *uring_buffer(struct uring *u, int index) {
+    return u->bufs[index];
+}
+
+static int set_file(struct uring *u, int fd) {
+    struct io_uring_files_update update;
+    memset(&update, 0, sizeof(update));
+    update.offset = SLOT_FILE;
+    update.fds = (unsigned long)&fd;
+    return sys_register(u->fd, IORING_REGISTER_FILES_UPDATE, &update, 1) == 1 ? 0 : -1;
+}
+
+/*
+ * uring_attach - Registers the URING_BUFFERS buffers in bufs, each of
+ * buffer_size bytes, and puts fd in the file slot for the reads and
+ * writes that follow. The buffers stay the caller's; they must outlive
+ * the matching uring_detach.
+ */
+
+int uring_attach(struct uring *u, int fd, void **bufs, size_t buffer_size) {
+    struct iovec iov[URING_BUFFERS];
+    for (int i = 0; i < URING_BUFFERS; i++) {
+        iov[i].iov_base = bufs[i];
+        iov[i].iov_len = buffer_size;
+    }
+    if (sys_register(u->fd, IORING_REGISTER_BUFFERS, iov, URING_BUFFERS) < 0) return -1;
+    if (set_file(u, fd) < 0) {
+        sys_register(u->fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+        return -1;
+    }
+    memcpy(u->bufs, bufs, sizeof(u->bufs));
+    return 0;
+}
+
+// Empties the file slot and drops the buffers, so the ring keeps neither
+void uring_detach(struct uring *u) {
+    set_file(u, -1);
+    sys_register(u->fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+    memset(u->bufs, 0, sizeof(u->bufs));
+}
+
+// === Submission === //
+
+static struct io_uring_sqe *next_sqe(struct uring *u, int tag, int op, int slot) {
+    unsigned tail = *u->sq_tail + u->queued;
+    unsigned index = tail & *u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op;
+    sqe->fd = slot;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->user_data = tag;
+    u->sq_array[index] = index;
+    u->queued++;
+    return sqe;
+}
+
+void uring_prep_read(struct uring *u, int tag, int buf, size_t at, size_t len, off_t off) {
+    struct io_uring_sqe *sqe = next_sqe(u, tag, IORING_OP_READ_FIXED, SLOT_FILE);
+    sqe->addr = (unsigned long)((char *)u->bufs[buf] + at);
+    sqe->len = len;
+    sqe->off = off;
+    sqe->buf_index = buf;
+}
+
+void uring_prep_write(struct uring *u, int tag, int buf, size_t at, size_t len, off_t off) {
+    struct io_uring_sqe *sqe = next_sqe(u, tag, IORING_OP_WRITE_FIXED, SLOT_FILE);
+    sqe->addr = (unsigned long)((char *)u->bufs[buf] + at);
+    sqe->len = len;
+    sqe->off = off;
+    sqe->buf_index = buf;
+}
+
+/*
+ * uring_prep_recv - Queues a receive of exactly len bytes into buffer buf.
+ * With link set, the next operation queued only runs if all of them
+ * arrived; a short receive (end of stream) cancels it.
+ */
+
+void uring_prep_recv(struct uring *u, int tag, int buf, size_t len, int link) {
+    struct io_uring_sqe *sqe = next_sqe(u, tag, IORING_OP_RECV, SLOT_SOCK);
+    sqe->addr = (unsigned long)u->bufs[buf];
+    sqe->len = len;
+    sqe->msg_flags = MSG_WAITALL;
+    if (link) sqe->flags |= IOSQE_IO_LINK;
+}
+
+void uring_prep_send(struct uring *u, int tag, const void *data, size_t len) {
+    struct io_uring_sqe *sqe = next_sqe(u, tag, IORING_OP_SEND, SLOT_SOCK);
+    sqe->addr = (unsigned long)data;
+    sqe->len = len;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+}
+
+/*
+ * uring_run - Submits everything queued in one system call and waits for
+ * all of it to complete, storing each result (bytes, or -errno) at its
+ * tag in results. Returns -1 if the kernel refused the submission.
+ */
+
+int uring_run(struct uring *u, long *results) {
+    unsigned pending = u->queued;
+    __atomic_store_n(u->sq_tail, *u->sq_tail + u->queued, __ATOMIC_RELEASE);
+    u->queued = 0;
+
+    unsigned submit = pending;
+    while (pending > 0) {
+        int rc = sys_enter(u->fd, submit, pending);
+        if (rc < 0 && errno != EINTR) return -1;
+        if (rc > 0) submit -= rc < (int)submit ? (unsigned)rc : submit;
+
+        unsigned head = *u->cq_head;
+        unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail && pending > 0; head++, pending--) {
+            const struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+            if (cqe->user_data < URING_TAGS) results[cqe->user_data] = cqe->res;
+        }
+        __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
@@ -0,0 +1,44 @@
+/*
+ * uring.h - Minimal io_uring backend for bulk transfers.
+ *
+ * A ring belongs to one connection. It is set up with raw system calls
+ * (no liburing). Each transfer lends it two buffers, registered for the
+ * length of the transfer, so reads and writes of the stored file use the
+ * fixed-buffer operations; the connection's socket plus the file of the
+ * current transfer sit in the ring's fixed file table. Operations are queued with the uring_prep_* calls and
+ * submitted together, and optionally linked so that one only starts once
+ * the previous one has fully succeeded.
+ *
+ * uring_create() returns NULL on kernels without io_uring (or without the
+ * operations used here); callers then keep to plain read/write calls.
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define URING_BUFFERS 2
+#define URING_TAGS 8
+
+struct uring;
+
+struct uring *uring_create(int sock);
+void uring_destroy(struct uring *u);
+void *uring_buffer(struct uring *u, int index);
+
+int uring_attach(struct uring *u, int fd, void **bufs, size_t buffer_size);
+void uring_detach(struct uring *u);
+
+// Queue one operation; tag (0 to URING_TAGS - 1) names its result. Reads
+// and writes use len bytes of buffer buf starting at byte at, and may
+// complete short like read(2) and write(2)
+void uring_prep_read(struct uring *u, int tag, int buf, size_t at, size_t len, off_t off);
+void uring_prep_write(struct uring *u, int tag, int buf, size_t at, size_t len, off_t off);
+void uring_prep_recv(struct uring *u, int tag, int buf, size_t len, int link);
+void uring_prep_send(struct uring *u, int tag, const void *data, size_t len);
+
+int uring_run(struct uring *u, long *results);
+
+#endif
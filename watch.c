@@ -0,0 +1,140 @@
+/*
+ * watch.c - Change notifications for WATCH subscribers.
+ *
+ * The history is a ring indexed by sequence number. One mutex guards it
+ * and one condition variable wakes the subscribers. Publishers only copy
+ * a pointer while holding the mutex; subscribers format their events into
+ * their own buffer while holding it and send them after letting go.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include "watch.h"
+
+#define DEFAULT_HISTORY 4096
+
+struct watch_event {
+    enum watch_type type;
+    char *path;       // NULL if it could not be copied
+    int version;
+    long size;
+};
+
+static pthread_mutex_t watch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t watch_published = PTHREAD_COND_INITIALIZER;
+static struct watch_event *events;
+static size_t nslots;
+static uint64_t next_seq = 1;
+
+/*
+ * watch_configure - Sets how many events are kept for resuming subscribers
+ * (at least one) and starts the sequence at the current time. Call once,
+ * before anything is published.
+ */
+
+void watch_configure(size_t history) {
+    if (history == 0) history = DEFAULT_HISTORY;
+    pthread_mutex_lock(&watch_lock);
+    if ((events = calloc(history, sizeof(*events)))) nslots = history;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    next_seq = (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000 + 1;
+    pthread_mutex_unlock(&watch_lock);
+}
+
+// Publishes a change to version of the path written as filename + ext
+void watch_publish(enum watch_type type, const char *filename, const char *ext, int version, long size) {
+    size_t name_len = strlen(filename), ext_len = strlen(ext);
+    char *path = malloc(name_len + ext_len + 1);
+    if (path) {
+        memcpy(path, filename, name_len);
+        memcpy(path + name_len, ext, ext_len + 1);
+    }
+    pthread_mutex_lock(&watch_lock);
+    if (nslots) {
+        struct watch_event *e = &events[next_seq % nslots];
+        free(e->path);
+        e->type = type;
+        e->path = path;
+        path = NULL;
+        e->version = version;
+        e->size = size;
+    }
+    next_seq++;
+    pthread_cond_broadcast(&watch_published);
+    pthread_mutex_unlock(&watch_lock);
+    free(path);
+}
+
+uint64_t watch_head(void) {
+    pthread_mutex_lock(&watch_lock);
+    uint64_t head = next_seq - 1;
+    pthread_mutex_unlock(&watch_lock);
+    return head;
+}
+
+/*
+ * watch_next - Waits up to timeout_ms for events after *cursor and formats
+ * those whose path starts with prefix into out, one line each:
+ *   EVENT <seq> NEW <path> <version> <size>
+ *   EVENT <seq> DELETE <path> <version>
+ * as many as fit (cap must hold at least one). *cursor advances past
+ * every event looked at, matching or not. Returns the number of bytes
+ * written, or -1 if some event after *cursor is no longer in the history;
+ * *cursor then points past what was lost.
+ */
+
+int watch_next(uint64_t *cursor, const char *prefix, char *out, size_t cap, int timeout_ms) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&watch_lock);
+    while (*cursor == next_seq - 1) {
+        if (pthread_cond_timedwait(&watch_published, &watch_lock, &deadline) == ETIMEDOUT) break;
+    }
+    uint64_t head = next_seq - 1;
+    uint64_t oldest = next_seq > nslots ? next_seq - nslots : 0;
+    if (*cursor > head || *cursor + 1 < oldest || (nslots == 0 && *cursor < head)) {
+        *cursor = head;
+        pthread_mutex_unlock(&watch_lock);
+        return -1;
+    }
+
+    size_t len = 0, prefix_len = strlen(prefix);
+    int status = 0;
+    while (*cursor < head) {
+        const struct watch_event *e = &events[(*cursor + 1) % nslots];
+        unsigned long long seq = *cursor + 1;
+        if (!e->path) {
+            // Report the gap on its own, after what came before it
+            if (len == 0) {
+                (*cursor)++;
+                status = -1;
+            }
+            break;
+        }
+        if (strncmp(e->path, prefix, prefix_len) == 0) {
+            int n;
+            if (e->type == WATCH_NEW) {
+                n = snprintf(out + len, cap - len, "EVENT %llu NEW %s %d %ld\n", seq, e->path, e->version, e->size);
+            } else {
+                n = snprintf(out + len, cap - len, "EVENT %llu DELETE %s %d\n", seq, e->path, e->version);
+            }
+            if (n < 0 || (size_t)n >= cap - len) break;  // picked up by the next call
+            len += n;
+        }
+        (*cursor)++;
+    }
+    pthread_mutex_unlock(&watch_lock);
+    return status < 0 ? -1 : (int)len;
+}
@@ -0,0 +1,36 @@
+/*
+ * watch.h - Change notifications for WATCH subscribers.
+ *
+ * WRITE and RM publish an event for every version they add or delete.
+ * Events get consecutive sequence numbers and are kept in a fixed-size
+ * in-memory history, so a subscriber that reconnects can resume right
+ * after the last event it saw. Publishing wakes every waiting subscriber
+ * at once; nobody has to poll the storage directory.
+ *
+ * Sequence numbers start at the server's start time in microseconds, so
+ * they keep increasing across restarts, and a subscriber resuming from
+ * before a restart (or from an event that has left the history) is told
+ * that it missed events instead of silently missing them.
+ */
+
+#ifndef WATCH_H
+#define WATCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum watch_type {
+    WATCH_NEW,
+    WATCH_DELETE
+};
+
+void watch_configure(size_t history);
+
+void watch_publish(enum watch_type type, const char *filename, const char *ext, int version, long size);
+
+// Sequence number of the latest event
+uint64_t watch_head(void);
+
+int watch_next(uint64_t *cursor, const char *prefix, char *out, size_t cap, int timeout_ms);
+
+#endif